@@ -7,12 +7,13 @@
     register() must return an instance of a class suitable to execute
     the "python part" of the other callbacks.
     
+    register() may also return a list of such instances; their methods
+    are called in the order of the list. See README.txt for details.
+    
     NOTE: While Python allows to dynamically add or delete class methods at
-    runtime, adding such a method after the call to register() will not
-    have any effect, because the corresponding httrack callback is not
-    registered and will never be registered. Deleting a method will
-    simply lead to a "trivial" execution of the corresponding httrack
-    callback.
+    runtime, adding or deleting such a method after the call to register() 
+    will not have any effect, because the methods are looked up only once,
+    when the mirror starts.
 """
 
 import os, stat, sys
@@ -0,0 +1,746 @@
+""" helpers for programs that work together with the httrack-py glue.
+
+    FeedReader: subscriber for the page feed (see "Page feed" in
+    README.txt). Example:
+
+        reader = FeedReader("/dev/shm/httrack-feed")
+        while 1:
+            for rec in reader.poll():
+                result = analyze(rec.url, rec.headers, rec.body)
+                if rec.valid():
+                    store(result)
+            if reader.closed():
+                break
+            time.sleep(0.1)
+        reader.close()
+
+    EventLogReader: reader for the event log (see "Event log" in
+    README.txt). Example:
+
+        for ev in EventLogReader("crawl.evl"):
+            if ev.type == EV_TRANSFER and ev.statuscode >= 400:
+                print ev.url, ev.statuscode
+
+    PackReader: reader for the pack files (see "Pack files" in
+    README.txt). Example:
+
+        pack = PackReader("mirror")
+        html = pack.get("example.com/index.html")
+        pack.extract("/tmp/mirror")
+
+    iter_tags: the tags of a HTML text, tokenized by
+    httracklib.scan_tags (only in callbacks). Example:
+
+        for tag in iter_tags(page.html, ("a", "link")):
+            href = tag.attrs.get("href")
+
+    replay: call the methods of a handler with the arguments recorded
+    with record_path (see "Recording" in README.txt), and compare the
+    results. Example:
+
+        report = replay("crawl.rec", MyHandler())
+        print report
+        for d in report.diffs:
+            print d.callback, d.url, d.recorded, d.replayed
+
+    Used as a script, this module extracts pack files, or replays a
+    recording with the handlers returned by register() of a module:
+
+        python httracktools.py extract <pack_path> <directory>
+        python httracktools.py replay <recording> <module>
+"""
+
+import marshal, mmap, os, struct, sys, time, zlib
+
+FEED_MAGIC = "HTSFEED1"
+FEED_PAD = -1
+
+# struct feed_header in httrack-py.c
+_HEADER = struct.Struct("=8sqqqqqqii")
+_SUBSCRIBER = struct.Struct("=qqqii")
+_RECORD = struct.Struct("=IiIIIIq")
+_HEAD = 24
+_OLDEST = 32
+_RECORDS = 40
+_CLOSED = 56
+_NSUBSCRIBERS = 60
+_SUBSCRIBERS = 64
+
+
+class FeedRecord:
+    """ a page of the feed. url is a string; headers and body are
+        buffer objects pointing into the shared memory; they are not
+        copied. They become invalid, when the producer overwrites the
+        record; call valid() after you read them.
+    """
+
+    def __init__(self, reader, pos, status, seq, url, headers, body):
+        self._reader = reader
+        self.pos = pos
+        self.status = status
+        self.seq = seq
+        self.url = url
+        self.headers = headers
+        self.body = body
+
+    def valid(self):
+        """ return true, if the record was not overwritten yet """
+        return self._reader._get(_OLDEST) <= self.pos
+
+
+class FeedReader:
+    """ subscriber of the page feed written by httrack-py into the
+        file path. Only records written after the subscription are read.
+    """
+
+    def __init__(self, path, timeout=10.0):
+        fd = os.open(path, os.O_RDWR)
+        try:
+            deadline = time.time() + timeout
+            while 1:
+                size = os.fstat(fd).st_size
+                if size > _HEADER.size:
+                    self._mm = mmap.mmap(fd, size)
+                    if self._mm[:8] == FEED_MAGIC:
+                        break
+                    self._mm.close()
+                if time.time() > deadline:
+                    raise IOError("%s is not a httrack-py feed" % path)
+                time.sleep(0.05)
+        finally:
+            os.close(fd)
+        (magic, self.size, self.data_offset, head, oldest, records,
+         too_large, closed, nsubscribers) = _HEADER.unpack_from(self._mm, 0)
+        self._slot = self._attach(nsubscribers)
+
+    def _get(self, offset):
+        return struct.unpack_from("=q", self._mm, offset)[0]
+
+    def _set(self, offset, value):
+        # xxx not atomic in a strict sense, but an aligned 8 byte write
+        struct.pack_into("=q", self._mm, offset, value)
+
+    def _attach(self, nsubscribers):
+        pid = os.getpid()
+        for i in range(nsubscribers):
+            offset = _SUBSCRIBERS + i * _SUBSCRIBER.size
+            old = _SUBSCRIBER.unpack_from(self._mm, offset)[3]
+            if old:
+                try:
+                    os.kill(old, 0)
+                    continue
+                except OSError:
+                    pass
+            records = self._get(_RECORDS)
+            _SUBSCRIBER.pack_into(self._mm, offset, self._get(_HEAD),
+                                  records, 0, pid, 0)
+            # xxx two subscribers can race for the same slot; the loser
+            # sees another pid here and tries the next slot
+            time.sleep(0.001)
+            if _SUBSCRIBER.unpack_from(self._mm, offset)[3] == pid:
+                return offset
+        raise IOError("no free subscriber slot in the feed")
+
+    def closed(self):
+        """ return true, if the mirror is finished and all records
+            were read
+        """
+        return (struct.unpack_from("=i", self._mm, _CLOSED)[0]
+                and self._get(self._slot) >= self._get(_HEAD))
+
+    def lag(self):
+        """ return the number of bytes not yet read """
+        return self._get(_HEAD) - self._get(self._slot)
+
+    def drops(self):
+        """ return the number of records overwritten before they were
+            read
+        """
+        return self._get(self._slot + 16)
+
+    def poll(self):
+        """ yield the records written since the last call """
+        mm = self._mm
+        tail = self._get(self._slot)
+        consumed = self._get(self._slot + 8)
+        head = self._get(_HEAD)
+        while tail < head:
+            oldest = self._get(_OLDEST)
+            if tail < oldest:
+                # we were too slow; the producer counted the drops
+                tail = oldest
+                continue
+            offset = tail % self.size
+            if self.size - offset < _RECORD.size:
+                tail += self.size - offset
+                continue
+            start = self.data_offset + offset
+            (length, status, url_len, headers_len, body_len, reserved,
+             seq) = _RECORD.unpack_from(mm, start)
+            if status == FEED_PAD:
+                tail += length
+                continue
+            start += _RECORD.size
+            url = mm[start:start + url_len]
+            start += url_len
+            headers = buffer(mm, start, headers_len)
+            start += headers_len
+            body = buffer(mm, start, body_len)
+            rec = FeedRecord(self, tail, status, seq, url, headers, body)
+            if not rec.valid():
+                continue
+            tail += length
+            consumed += 1
+            self._set(self._slot, tail)
+            self._set(self._slot + 8, consumed)
+            yield rec
+        self._set(self._slot, tail)
+
+    def close(self):
+        """ release the subscriber slot """
+        if self._mm is not None:
+            struct.pack_into("=i", self._mm, self._slot + 24, 0)
+            self._mm.close()
+            self._mm = None
+
+
+EV_MAGIC = "HTSEVLG1"
+EV_BLOCK_MAGIC = "HEVB"
+EV_CHECK_LINK = 1
+EV_TRANSFER = 2
+EV_SAVE_NAME = 3
+
+# struct ev_header in httrack-py.c
+_EV_BLOCK = struct.Struct("=4sII")
+_EV_HEADER = struct.Struct("=IBBHdqq")
+_EV_LEN = struct.Struct("=I")
+
+
+class Event(object):
+    """ a record of the event log. Attributes: type (EV_*), time, url,
+        and depending on the type:
+
+        EV_CHECK_LINK: status, result (argument and return value of
+                       check_link)
+        EV_TRANSFER:   statuscode, size, contenttype
+        EV_SAVE_NAME:  filename
+    """
+
+    __slots__ = ('type', 'time', 'url', 'a', 'b', 'extra')
+
+    def __init__(self, type, time, url, a, b, extra):
+        self.type = type
+        self.time = time
+        self.url = url
+        self.a = a
+        self.b = b
+        self.extra = extra
+
+    status = statuscode = property(lambda self: self.a)
+    result = size = property(lambda self: self.b)
+    contenttype = filename = property(lambda self: self.extra)
+
+    def __repr__(self):
+        return "<Event %i %s %r %i %i %r>" % (self.type, self.time, self.url,
+                                            self.a, self.b, self.extra)
+
+
+class EventLogReader:
+    """ iterate over the records of the event log path. Blocks are read
+        and decompressed one at a time.
+    """
+
+    magic = EV_MAGIC
+    kind = "event log"
+
+    def __init__(self, path):
+        self._f = open(path, "rb")
+        if self._f.read(len(self.magic)) != self.magic:
+            self._f.close()
+            raise IOError("%s is not a httrack-py %s" % (path, self.kind))
+
+    def blocks(self):
+        """ yield the decompressed blocks """
+        read = self._f.read
+        while 1:
+            head = read(_EV_BLOCK.size)
+            if len(head) < _EV_BLOCK.size:
+                # end of the file, or a block not yet written completely
+                return
+            magic, clen, rawlen = _EV_BLOCK.unpack(head)
+            if magic != EV_BLOCK_MAGIC:
+                raise IOError("invalid block in the %s" % self.kind)
+            data = read(clen)
+            if len(data) < clen:
+                return
+            yield zlib.decompress(data)
+
+    def __iter__(self):
+        unpack_header = _EV_HEADER.unpack_from
+        unpack_len = _EV_LEN.unpack_from
+        for block in self.blocks():
+            pos = 0
+            end = len(block)
+            while pos < end:
+                (length, type, nstrings, reserved, t, a,
+                 b) = unpack_header(block, pos)
+                p = pos + _EV_HEADER.size
+                slen = unpack_len(block, p)[0]
+                url = block[p + 4:p + 4 + slen]
+                extra = None
+                if nstrings > 1:
+                    p += 4 + slen
+                    slen = unpack_len(block, p)[0]
+                    extra = block[p + 4:p + 4 + slen]
+                yield Event(type, t, url, a, b, extra)
+                pos += length
+
+    def close(self):
+        self._f.close()
+
+
+REC_MAGIC = "HTSREC01"
+REC_ERROR = 1
+REC_REPR = 2
+
+# struct rec_header in httrack-py.c
+_REC_HEADER = struct.Struct("=IBBHddII")
+
+# cb_names in httrack-py.c
+CALLBACKS = ("start", "end", "change_options", "check_html",
+             "preprocess_html", "postprocess_html", "query2", "query3",
+             "loop", "check_link", "pause", "save_file", "link_detected",
+             "link_detected2", "transfer_status", "save_name", "send_header",
+             "receive_header", "process_page")
+
+
+class RecordedCall(object):
+    """ a call recorded with record_path. callback is the name of the
+        method, handler the index of the handler; args is the tuple of
+        arguments, result the return value, or with flags & REC_ERROR,
+        the name of the exception class.
+    """
+
+    __slots__ = ('callback', 'handler', 'flags', 'start', 'seconds',
+                 'args', 'result')
+
+    def __init__(self, callback, handler, flags, start, seconds, args,
+                 result):
+        self.callback = callback
+        self.handler = handler
+        self.flags = flags
+        self.start = start
+        self.seconds = seconds
+        self.args = args
+        self.result = result
+
+    def url(self):
+        """ the URL of the call, or None """
+        args = self.args
+        if self.callback == "process_page":
+            args = args[0][1:]
+        elif self.callback in ("check_html", "preprocess_html",
+                               "postprocess_html"):
+            args = args[1:]
+        elif self.callback != "check_link":
+            return None
+        return args[0] + args[1]
+
+    def __repr__(self):
+        return "<RecordedCall %s %i %r>" % (self.callback, self.handler,
+                                            self.url())
+
+
+class RecordingReader(EventLogReader):
+    """ iterate over the calls (RecordedCall) of the recording path """
+
+    magic = REC_MAGIC
+    kind = "recording"
+
+    def __iter__(self):
+        unpack_header = _REC_HEADER.unpack_from
+        loads = marshal.loads
+        for block in self.blocks():
+            pos = 0
+            end = len(block)
+            while pos < end:
+                (length, cb, handler, flags, start, seconds, args_len,
+                 reserved) = unpack_header(block, pos)
+                p = pos + _REC_HEADER.size
+                yield RecordedCall(CALLBACKS[cb], handler, flags, start,
+                                   seconds, loads(block[p:p + args_len]),
+                                   loads(block[p + args_len:pos + length]))
+                pos += length
+
+
+class ReplayPage(object):
+    """ stand-in for httracklib.Page, built from a recorded
+        process_page call
+    """
+
+    def __init__(self, html, url_adresse, url_fichier, content_type,
+                 charset, headers):
+        self.html = html
+        self.url_adresse = url_adresse
+        self.url_fichier = url_fichier
+        self.content_type = content_type
+        self.charset = charset
+        self.raw_headers = headers
+        self.near_duplicate = None
+        self.edits = []
+        self._text = None
+
+    def headers(self):
+        d = {}
+        for line in self.raw_headers.split("\n"):
+            name, colon, value = line.partition(":")
+            if not colon or not name:
+                continue
+            name = name.lower()
+            value = value.strip()
+            d[name] = name in d and "%s, %s" % (d[name], value) or value
+        return d
+    headers = property(headers)
+
+    def encoding(self):
+        """ as page_find_charset in httrack-py.c """
+        charset = self.charset
+        if not charset:
+            head = self.html[:1024].lower()
+            i = head.find("charset=")
+            if i >= 0:
+                charset = head[i + 8:].lstrip("\"'").split(None, 1)[0]
+                charset = charset.split("\"")[0].split("'")[0]
+                charset = charset.split(";")[0].split(">")[0]
+        return charset.lower()
+    encoding = property(encoding)
+
+    def text(self):
+        if self._text is None:
+            try:
+                self._text = self.html.decode(self.encoding or "utf-8",
+                                              self.encoding and "replace"
+                                              or "strict")
+            except (LookupError, UnicodeError):
+                try:
+                    self._text = self.html.decode("utf-8")
+                except UnicodeError:
+                    self._text = self.html.decode("latin-1")
+        return self._text
+
+    def set_text(self, text):
+        self.html = text.encode(self.encoding or "utf-8",
+                                "xmlcharrefreplace")
+        self._text = text
+    text = property(text, set_text)
+
+    def simhash(self):
+        import httracklib
+        return httracklib.simhash(self.html)
+    simhash = property(simhash)
+
+    def replace(self, old, new):
+        if not old:
+            raise ValueError("replace: empty search string")
+        self.edits.append((old, new))
+
+
+def _decision(callback, result):
+    """ the result of a method as the glue uses it """
+    if callback in ("check_html", "loop", "send_header", "receive_header",
+                    "start", "change_options"):
+        return bool(result)
+    if callback == "process_page":
+        return result is None or bool(result)
+    if callback == "check_link":
+        if isinstance(result, int) and result in (0, 1):
+            return int(result)
+        return -1
+    if callback in ("preprocess_html", "postprocess_html"):
+        # other results leave the text unchanged
+        return isinstance(result, str) and result or None
+    return result
+
+
+class ReplayDiff(object):
+    """ a call whose replayed result differs from the recorded one """
+
+    __slots__ = ('callback', 'handler', 'url', 'recorded', 'replayed')
+
+    def __init__(self, callback, handler, url, recorded, replayed):
+        self.callback = callback
+        self.handler = handler
+        self.url = url
+        self.recorded = recorded
+        self.replayed = replayed
+
+    def __repr__(self):
+        return "<ReplayDiff %s %r: %r -> %r>" % (self.callback, self.url,
+                                                 self.recorded, self.replayed)
+
+
+class ReplayReport(object):
+    """ result of replay(). stats maps the callback names to
+        [calls, recorded seconds, replayed seconds, differences];
+        diffs holds the first max_diffs differences.
+    """
+
+    def __init__(self):
+        self.stats = {}
+        self.diffs = []
+        self.ndiffs = 0
+
+    def __str__(self):
+        lines = ["%-18s %8s %12s %12s %8s" % ("callback", "calls",
+                                              "recorded s", "replayed s",
+                                              "diffs")]
+        for name in CALLBACKS:
+            if name in self.stats:
+                lines.append("%-18s %8i %12.6f %12.6f %8i"
+                             % ((name,) + tuple(self.stats[name])))
+        return "\n".join(lines)
+
+
+def replay(path, handlers, max_diffs=100):
+    """ call the methods of handlers (an instance, or a list of
+        instances like the first parameter of httracklib.httrack) with
+        the arguments recorded in path. Calls recorded for a handler
+        index that handlers don't have, or for a method they don't
+        define, are skipped.
+        return: a ReplayReport
+    """
+    if not isinstance(handlers, (list, tuple)):
+        handlers = [handlers]
+    report = ReplayReport()
+    timer = time.time
+    reader = RecordingReader(path)
+    try:
+        for call in reader:
+            if call.handler >= len(handlers):
+                continue
+            meth = getattr(handlers[call.handler], call.callback, None)
+            if meth is None:
+                continue
+            args = call.args
+            if call.callback == "process_page":
+                args = (ReplayPage(*args[0]),)
+            start = timer()
+            try:
+                res = meth(*args)
+                flags = 0
+            except Exception, e:
+                res = e.__class__.__name__
+                flags = REC_ERROR
+            seconds = timer() - start
+            if flags == 0 and call.flags & REC_REPR:
+                res = repr(res)
+            stat = report.stats.setdefault(call.callback, [0, 0.0, 0.0, 0])
+            stat[0] += 1
+            stat[1] += call.seconds
+            stat[2] += seconds
+            if flags & REC_ERROR:
+                new = ("exception", res)
+            else:
+                new = _decision(call.callback, res)
+            if call.flags & REC_ERROR:
+                old = ("exception", call.result)
+            else:
+                old = _decision(call.callback, call.result)
+            if old != new:
+                stat[3] += 1
+                report.ndiffs += 1
+                if len(report.diffs) < max_diffs:
+                    report.diffs.append(ReplayDiff(call.callback,
+                                                   call.handler, call.url(),
+                                                   old, new))
+    finally:
+        reader.close()
+    return report
+
+
+PACK_MAGIC = "HPK1"
+PACK_INDEX_MAGIC = "HTSPKIX1"
+PACK_NONE = 0
+PACK_ZLIB = 1
+PACK_ZSTD = 2
+
+# pack_entry, pack_index_header, pack_slot in httrack-py.c
+_PACK_ENTRY = struct.Struct("=4sHBBQQ")
+_PACK_INDEX = struct.Struct("=8sQQII")
+_PACK_SLOT = struct.Struct("=QIIQ")
+
+
+def _pack_hash(path):
+    """ 64 bit FNV-1a hash, as pack_hash() in httrack-py.c """
+    h = 14695981039346656037L
+    for c in path:
+        h = ((h ^ ord(c)) * 1099511628211L) & 0xffffffffffffffffL
+    return h or 1
+
+
+class PackReader:
+    """ reader for the pack files written with the prefix path """
+
+    def __init__(self, path):
+        self.path = path
+        f = open(path + ".idx", "rb")
+        try:
+            self._index = mmap.mmap(f.fileno(), 0, access=mmap.ACCESS_READ)
+        finally:
+            f.close()
+        (magic, self.nslots, self.count, self.npacks,
+         reserved) = _PACK_INDEX.unpack_from(self._index, 0)
+        if magic != PACK_INDEX_MAGIC:
+            raise IOError("%s.idx is not a pack index" % path)
+        self._packs = {}
+
+    def _pack(self, number):
+        f = self._packs.get(number)
+        if f is None:
+            f = self._packs[number] = open("%s-%05i.pack" % (self.path,
+                                                             number), "rb")
+        return f
+
+    def _entry(self, number, offset, read_data=True):
+        f = self._pack(number)
+        f.seek(offset)
+        (magic, path_len, compression, reserved, raw_len,
+         stored_len) = _PACK_ENTRY.unpack(f.read(_PACK_ENTRY.size))
+        if magic != PACK_MAGIC:
+            raise IOError("invalid entry in pack %i at %i" % (number, offset))
+        path = f.read(path_len)
+        if not read_data:
+            return path, None
+        data = f.read(stored_len)
+        if compression == PACK_ZLIB:
+            data = zlib.decompress(data)
+        elif compression == PACK_ZSTD:
+            import zstandard
+            data = zstandard.ZstdDecompressor().decompress(
+                data, max_output_size=raw_len)
+        return path, data
+
+    def _slots(self):
+        offset = _PACK_INDEX.size
+        for i in xrange(self.nslots):
+            slot = _PACK_SLOT.unpack_from(self._index, offset)
+            offset += _PACK_SLOT.size
+            if slot[0]:
+                yield slot
+
+    def get(self, path):
+        """ return the content of the file path; raise KeyError, if
+            it is not in the packs
+        """
+        h = _pack_hash(path)
+        i = h & (self.nslots - 1)
+        while 1:
+            slot = _PACK_SLOT.unpack_from(self._index,
+                                          _PACK_INDEX.size
+                                          + i * _PACK_SLOT.size)
+            if not slot[0]:
+                raise KeyError(path)
+            if slot[0] == h:
+                entry_path, data = self._entry(slot[1], slot[3])
+                if entry_path == path:
+                    return data
+            i = (i + 1) & (self.nslots - 1)
+
+    def __contains__(self, path):
+        try:
+            self.get(path)
+            return True
+        except KeyError:
+            return False
+
+    def paths(self):
+        """ yield the paths of all files in the packs """
+        for slot in self._slots():
+            yield self._entry(slot[1], slot[3], False)[0]
+
+    def items(self):
+        """ yield (path, content) of all files in the packs """
+        for slot in self._slots():
+            yield self._entry(slot[1], slot[3])
+
+    def extract(self, directory):
+        """ write all files into directory; return their number """
+        n = 0
+        for path, data in self.items():
+            target = os.path.join(directory, path.lstrip("/"))
+            target = os.path.normpath(target)
+            if not target.startswith(os.path.normpath(directory) + os.sep):
+                # xxx a path with ".." leaving the directory
+                continue
+            parent = os.path.dirname(target)
+            if not os.path.isdir(parent):
+                os.makedirs(parent)
+            f = open(target, "wb")
+            f.write(data)
+            f.close()
+            n += 1
+        return n
+
+    def close(self):
+        for f in self._packs.values():
+            f.close()
+        self._packs = {}
+        self._index.close()
+
+
+class Tag(object):
+    """ a tag returned by iter_tags. name and the attribute names are
+        in lower case; the attribute values are not decoded. start and
+        end are the offsets of the tag in the text.
+    """
+    __slots__ = ("kind", "name", "attrs", "start", "end")
+
+    def __init__(self, kind, name, attrs, start, end):
+        self.kind = kind
+        self.name = name
+        self.attrs = attrs
+        self.start = start
+        self.end = end
+
+    def __repr__(self):
+        return "<Tag %s %r>" % (self.name, self.attrs)
+
+
+def iter_tags(html, names=None):
+    """ yield a Tag for each tag of html (a string or a
+        httracklib.Page); see httracklib.scan_tags for names
+    """
+    import httracklib
+    if isinstance(html, httracklib.Page):
+        html = html.html
+    rec = httracklib.scan_tags(html, names)
+    size = httracklib.SCAN_RECORD
+    i = 0
+    while i < len(rec):
+        kind, start, end, name_start, name_end, nattrs = rec[i:i + size]
+        i += size
+        attrs = {}
+        for j in xrange(nattrs):
+            a, an_start, an_end, vs, ve, quote = rec[i:i + size]
+            i += size
+            attrs[html[an_start:an_end].lower()] = html[vs:ve] if vs >= 0 \
+                                                   else None
+        yield Tag(kind, html[name_start:name_end].lower(), attrs, start, end)
+
+
+if __name__ == "__main__":
+    if len(sys.argv) != 4 or sys.argv[1] not in ("extract", "replay"):
+        sys.stderr.write("usage: %s extract <pack_path> <directory>\n"
+                         "       %s replay <recording> <module>\n"
+                         % (sys.argv[0], sys.argv[0]))
+        sys.exit(2)
+    if sys.argv[1] == "replay":
+        sys.path.insert(0, ".")
+        report = replay(sys.argv[2], __import__(sys.argv[3]).register())
+        print report
+        for d in report.diffs:
+            print d
+        sys.exit(0)
+    reader = PackReader(sys.argv[2])
+    print "%i files extracted" % reader.extract(sys.argv[3])
+    reader.close()
@@ -37,15 +37,17 @@ setup(name="httrack-py",
       url="http://code.google.com/p/httrack-py",
       license = "http://www.fsf.org/licensing/licenses/lgpl.txt",
       platforms = ["unix","win32"],
-      py_modules = ['httrack'],
+      py_modules = ['httrack', 'httracktools'],
       description = doclines[0],
       classifiers = filter(None, classifiers.split("\n")),
       long_description = "\n".join(doclines[2:]),
       ext_modules=[Extension(
          "httracklib",
          [os.path.join("src","httrack-py.c")],
+         depends=[os.path.join("src","httrack-py.h")],
          include_dirs=[HTTRACK_SRC_DIR, os.sep.join((HTTRACK_SRC_DIR, "src"))] + PLATFORM_INCLUDES,
-         libraries=['httrack']
+         define_macros=[('HTS_PY_SQLITE', None)],
+         libraries=['httrack', 'sqlite3', 'z']
       )],
 
 )
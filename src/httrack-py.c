@@ -40,7 +40,26 @@ xxx (possible) Problems:
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-/* #include <pthread.h> */
+#include <limits.h>
+#include <ctype.h>
+#include <strings.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fnmatch.h>
+#include <netdb.h>
+#include <poll.h>
+#include <time.h>
+#include <sys/time.h>
+#include <sys/types.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <pthread.h>
 
 #include "httrack-library.h"
 /* needed for lien_back definition: */
@@ -48,7 +67,20 @@ xxx (possible) Problems:
 #ifdef HTS_INTERNAL_BYTECODE
   #include "htsbauth.h"
 #endif
+#include <zlib.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include <Python.h>
+#include <frameobject.h>
+#include <marshal.h>
+#ifdef HTS_PY_SQLITE
+#include <sqlite3.h>
+#endif
+#ifdef HTS_PY_ZSTD
+#include <zstd.h>
+#endif
+#include "httrack-py.h"
 
 /* "External" */
 #ifdef _WIN32
@@ -128,12 +160,47 @@ EXTERNAL_FUNCTION int hts_py_receive_header(char *buf,
                                          char *referer_adr,
                                          char *referer_fil,
                                          htsblk *incoming);
-static PyObject *pCallbackClass = 0, *pAnswerQuery2 = 0, *pAnswerQuery3 = 0,
-                *httrackError;
 static int stop_on_next_callback = 0;
 
+static PyObject *create_lib_module(void);
+static int start_workers(void);
+static void stop_workers(void);
+static int start_feed(void);
+static void stop_feed(void);
+static int start_validators(void);
+static void stop_validators(void);
+static int start_host_limits(void);
+static int start_controller(void);
+static void stop_controller(void);
+static void controller_attach(httrackp *opt);
+static int start_breakers(void);
+static int mapping_double(PyObject *d, char *key, double *v);
+static int start_decision_cache(void);
+static int start_metrics(void);
+static void stop_metrics(void);
+static void metrics_enter(int cb);
+static void metrics_leave(void);
+static int start_event_log(void);
+static void stop_event_log(void);
+static int start_warc(void);
+static void stop_warc(void);
+static int start_pack(void);
+static void stop_pack(void);
+static void pack_attach(httrackp *opt);
+static int start_pages(void);
+static void stop_pages(void);
+static int start_extract(void);
+static void stop_extract(void);
+static int start_near_duplicates(void);
+static void stop_near_duplicates(void);
+static int start_record(void);
+static void stop_record(void);
+static int start_audit(void);
+static void stop_audit(void);
+static PyGILState_STATE enter_python(int cb);
+static void leave_python(PyGILState_STATE gil);
+
 #ifdef PLUGIN
-  static PyObject *pHttrackModule, *pSysModule;
   static char *default_py_name = "httrack";
 #endif
 
@@ -145,653 +212,2815 @@ static int is_initialized = 0, abort_in_start_callback = 0;
 #define REGULAR_STOP 0
 #define IGNORE_EXCEPTION 1
 
-/* return: 1 on success; 0 if an error occured */
-#ifdef PLUGIN
-static int initialize(int called_from_plugin_init) {
-  /* init the Python interpreter
+/* Callback pipelines.
+
+   The callback "object" can be a single instance of a callback class,
+   or a list or tuple of such instances ("handlers"). For each httrack
+   callback, the bound methods of all handlers defining a method of
+   that name are looked up once in initialize() and stored in a
+   pipeline, in the order of the handlers. The hts_py_* functions
+   marshal their arguments once and run the stages of the pipeline.
+   How the results of the stages are combined, depends on the callback;
+   see the comments of the hts_py_* functions.
+
+   process_page is no httrack callback; it is called by check_html
+   (see "Page objects" below).
+
+   The order of the CB_* constants must match cb_names.
+*/
+enum {
+  CB_START, CB_END, CB_CHANGE_OPTIONS, CB_CHECK_HTML, CB_PREPROCESS_HTML,
+  CB_POSTPROCESS_HTML, CB_QUERY2, CB_QUERY3, CB_LOOP, CB_CHECK_LINK,
+  CB_PAUSE, CB_SAVE_FILE, CB_LINK_DETECTED, CB_LINK_DETECTED2,
+  CB_TRANSFER_STATUS, CB_SAVE_NAME, CB_SEND_HEADER, CB_RECEIVE_HEADER,
+  CB_PROCESS_PAGE, CB_COUNT
+};
+
+static char *cb_names[CB_COUNT] = {
+  "start", "end", "change_options", "check_html", "preprocess_html",
+  "postprocess_html", "query2", "query3", "loop", "check_link",
+  "pause", "save_file", "link_detected", "link_detected2",
+  "transfer_status", "save_name", "send_header", "receive_header",
+  "process_page"
+};
+
+/* native predicate of a stage; see "Filters" below */
+typedef struct {
+  char **hosts;        /* 0 terminated lists of fnmatch patterns, */
+  char **paths;        /* or 0 for "any" */
+  char **types;
+  LLint min_size, max_size;   /* -1: no limit */
+} cb_filter;
+
+typedef struct {
+  PyObject *handler;   /* borrowed; pHandlers holds the reference */
+  PyObject *meth;      /* the bound method */
+  int index;           /* position of the handler in pHandlers */
+  int cb;              /* CB_* constant of the pipeline */
+  cb_filter *filter;   /* 0: the method is called for all URLs */
+  long calls;
+  double seconds;      /* total time spent in the method */
+} cb_stage;
+
+/* C function from a capsule; see "Native callbacks" below */
+typedef struct {
+  void *fn;            /* hts_py_*_fn from httrack-py.h */
+  void *data;          /* context of the capsule */
+  PyObject *capsule;
+} native_stage;
+
+typedef struct {
+  int nstages;
+  int nfilters;        /* number of stages with a filter */
+  cb_stage *stages;
+  int nnatives;
+  native_stage *natives;
+} cb_pipeline;
+
+/* The Python objects used by the callbacks. There is one instance for
+   the main interpreter, and one for each subinterpreter (see
+   enter_python()). interp points to the instance used by the current
+   thread.
+*/
+typedef struct py_interp {
+  PyThreadState *tstate;          /* only used for subinterpreters */
+  cb_pipeline pipelines[CB_COUNT];
+  /* tuple of all handlers; pCallbackClass is the first of them */
+  PyObject *pHandlers;
+  PyObject *pCallbackClass;
+  /* the handler of the stage that raised the last exception; used by
+     process_error to find error_handler and error_policy
   */
-    PyObject *pString, *dict, *syspath, *reg, *v;
-    char *modname, *cc = 0;
+  PyObject *pCurrentHandler;
+  PyObject *pAnswerQuery2, *pAnswerQuery3;
+  PyObject *httrackError;
+  PyObject *pTimeoutError;        /* httracklib.CallbackTimeout */
+  /* thread state of the watchdog thread; only used for
+     subinterpreters
+  */
+  PyThreadState *wd_tstate;
+  struct py_interp *next;         /* list of subinterpreters */
+} py_interp;
+
+#ifdef _WIN32
+#define THREAD_LOCAL __declspec(thread)
 #else
-static int initialize(PyObject* cbInst) {
+#define THREAD_LOCAL __thread
 #endif
-  int res = 1;
-  stop_on_next_callback = 0;
-  #ifdef PLUGIN
-    if (is_initialized) {
-      return 1;
-    }
-    is_initialized = 1;
-    Py_Initialize();
-    abort_in_start_callback = 1;
-    /* sys.path contains only the "system library" paths, but not 
-       the current directory, which we need
-    */
-    pString = PyString_FromString("sys");
-    if (!pString) {
-      PyErr_Print();
-      return 0;
-    }
-    pSysModule = PyImport_Import(pString);
-    Py_DECREF(pString);
-    if (!pSysModule) {
-      PyErr_Print();
-      return 0;
-    }
-    
-    dict = PyModule_GetDict(pSysModule);
-    syspath = PyDict_GetItemString(dict, "path");
-    
-    modname = getenv("HTTRACK_PYTHON");
-    /* if the module name contains at least one '/', we assume that
-       a complete path is specified
-    */
-    if (modname) {
-      cc = rindex(modname, '/');
-      if (cc) {
-        *cc = 0;
-        pString = PyString_FromString(modname);
-        *cc = '/';
-      }
-    }
-    if (!cc) {
-      /* default path for the httrack module is the current directory */
-      pString = PyString_FromString(".");
-    }
-    if (!pString) {
-      PyErr_Print();
-      Py_DECREF(pSysModule);
-      return 0;
-    }
 
-    PyList_Append(syspath, pString);
-    Py_DECREF(pString);
+static py_interp main_interp;
+static THREAD_LOCAL py_interp *interp = &main_interp;
 
-    if (!modname) {
-      modname = default_py_name;
-    }
-    else if (cc) {
-      modname = cc+1;
-    }
-    
-    /* a possible '.py' suffix should be removed */
-    cc = rindex(modname, '.');
-    if (cc) {
-      if (0 == strcmp(cc, ".py")) {
-        *cc = 0;
-      }
-    }
-    pString = PyString_FromString(modname);
-    if (!pString) {
-      PyErr_Print();
-      Py_DECREF(pSysModule);
-      return 0;
-    }
+#ifdef PLUGIN
+/* see enter_python() */
+static int use_subinterpreters = 0;
+static pthread_t main_thread;
+/* set for a thread, if its subinterpreter could not be created */
+static THREAD_LOCAL int no_subinterpreter = 0;
+/* list of all subinterpreters; protected by the GIL */
+static py_interp *subinterpreters = 0;
+#endif
 
-    pHttrackModule = PyImport_Import(pString);
-    Py_DECREF(pString);
-    if (!pHttrackModule) {
-      int import_error = PyErr_ExceptionMatches(PyExc_ImportError);
-      PyErr_Print();
-      Py_DECREF(pSysModule);
-      /* check the error. If no module is found, we'll get
-         'ImportError: No module named httrack'
-         This is NOT a reason to abort the mirror, if all of the following
-         conditions are met:
-         1. this library is httrack's default plugin
-         2. the environment variable HTTRACK_PYTHON is not set
-         3. this function is called from plugin_init
+/* statistics of the last mirror, see cleanup() */
+static PyObject *pLastStageStats = 0;
 
-         All other conditions and all other errors should cause an abortion
-         of the mirror. 
-      */
-      if (   import_error
-          && !getenv("HTTRACK_PYTHON")
-          && called_from_plugin_init) {
-        abort_in_start_callback = 0;
-      }
-      return 0;
-    }
-    
-    /* now get the Python "callback class" instance */
-    dict = PyModule_GetDict(pHttrackModule);
-    v = PyInt_FromLong(IMMEDIATE_STOP);
-    PyDict_SetItemString(dict, "IMMEDIATE_STOP", v);
-    Py_DECREF(v);
-    
-    v = PyInt_FromLong(REGULAR_STOP);
-    PyDict_SetItemString(dict, "REGULAR_STOP", v);
-    Py_DECREF(v);
-    
-    v = PyInt_FromLong(IGNORE_EXCEPTION);
-    PyDict_SetItemString(dict, "IGNORE_EXCEPTION", v);
-    Py_DECREF(v);
-    fprintf(stderr, "initialzes xxxx\n");
+static double now_seconds(void) {
+  struct timeval tv;
+  gettimeofday(&tv, 0);
+  return tv.tv_sec + tv.tv_usec * 1e-6;
+}
 
-    reg = PyDict_GetItemString(dict, "register");
-    if (!reg) {
-      fprintf(stderr, 
-        "htrack-py error: Python module %s does not have a function\n"
-        "named register\n", modname);
-        Py_DECREF(pSysModule);
-        Py_DECREF(pHttrackModule);
-        return 0;
-    }
-    if (!PyCallable_Check(reg)) {
-      fprintf(stderr, 
-        "httrack-py error: %s.register is not callable\n", modname);
-      Py_DECREF(pSysModule);
-      Py_DECREF(pHttrackModule);
-      return 0;
-    }
-    pCallbackClass = PyObject_CallObject(reg, 0);
+/* Filters.
 
-    if (!pCallbackClass) {
-      PyErr_Print();
-      Py_DECREF(pSysModule);
-      Py_DECREF(pHttrackModule);
-      return 0;
-    }
-    htswrap_add("end", hts_py_end);
+   A handler can restrict its URL based callbacks with the attribute
+   filters, a mapping from the callback name to a mapping with the
+   optional keys
+     host          pattern or list of patterns for url_adresse
+     path          pattern or list of patterns for url_fichier
+     content_type  pattern or list of patterns for the MIME type
+     min_size, max_size   limits of the size in bytes
+   Patterns are shell wildcards (fnmatch); hosts and content types
+   are compared without regard to case. A method is called only for URLs matching all keys
+   of its filter (and one of the patterns of each key).
 
-  #else
-    pCallbackClass = cbInst;
-    Py_INCREF(pCallbackClass);
-    HOOK(hts_py_start, start, start);
-  #endif
-  httrackError = PyErr_NewException("httrack.error", 0, 0);
-  Py_INCREF(httrackError);
-  // xxx set pCallbackClass from function param, if this is an exenstion class
+   Filters are supported by check_html, preprocess_html,
+   postprocess_html and process_page, where the size is the length of
+   the HTML text,
+   and by transfer_status, where content type and size are taken from
+   the htsblk. The HTML callbacks know no content type, so their
+   content_type patterns are not checked.
 
-  HOOK(hts_py_end, end, end);
-  HOOK(hts_py_change_options, change-options, change_options);
-  HOOK(hts_py_check_html, check-html, check_html);
-  HOOK(hts_py_preprocess_html, preprocess-html, preprocess_html);
-  HOOK(hts_py_postprocess_html, postprocess-html, postprocess_html);
-  /* xxx not yet implemented HOOK(hts_py_query, query, query); */
-  HOOK(hts_py_query2, query2, query2);
-  HOOK(hts_py_query3, query3, query3);
-  HOOK(hts_py_loop, loop, loop);
-  HOOK(hts_py_checklink, check-link, check_link);
-  HOOK(hts_py_pause, pause, pause)
-  HOOK(hts_py_save_file, save-file, save_file);
-  HOOK(hts_py_link_detected, link-detected, link_detected);
-  HOOK(hts_py_link_detected2, link-detected2, link_detected2);
-  HOOK(hts_py_transfer_status, transfer-status, transfer_status);
-  HOOK(hts_py_save_name, save-name, save_name);
-  HOOK(hts_py_send_header, send-header, send_header);
-  HOOK(hts_py_receive_header, receive-header, receive_header);
+   The filters are checked before any Python object is built; if no
+   stage of a callback wants a page, the GIL is not even acquired.
+   The filters of the main interpreter are used for this check, since
+   it happens before the subinterpreter of the thread is known.
+*/
 
-  #ifdef PLUGIN
-    Py_DECREF(pSysModule);
-    Py_DECREF(pHttrackModule);
-    abort_in_start_callback = 0;
-  #endif
+typedef struct {
+  char *adr, *fil;
+  char *content_type;  /* 0: unknown */
+  LLint size;          /* -1: unknown */
+} url_info;
 
-  return res;
+static void free_patterns(char **patterns) {
+  char **pp;
+  if (!patterns)
+    return;
+  for (pp = patterns; *pp; pp++) {
+    free(*pp);
+  }
+  free(patterns);
 }
 
-#ifdef PLUGIN
-void plugin_init() {
-  int res;
-  res = initialize(1);
-  /* we need the start callback in any case, because plugin_init
-     can't bort the mirror
-  */
-  htswrap_add("start", hts_py_start);
+static void free_filter(cb_filter *f) {
+  if (!f)
+    return;
+  free_patterns(f->hosts);
+  free_patterns(f->paths);
+  free_patterns(f->types);
+  free(f);
 }
-#endif
 
-/* error handler. This handler is called, either if a callback
-   class method raises an exception, or if an error occurs in this
-   library. 
-   
-   If the callback class defines a method error_handler
-   (def error_handler(self, callback_name, error_object, error_val)), 
-   delegate the decision to continue or abort to this method. 
-   
-   Otherwise:
-   
-   call PyErr_Print() to provide some information to the user.
- 
-   If the callback class has an attribute error_policy (must be a 
-   dictionary), decide what to do according to that policy
-   
-   Otherwise:
-   check the value of the environment variable HTTRACK_PY_NO_STOP_ON_ERROR. 
-   If it is defined, continue the mirror process, else abort.
-   
-   (Many program check first for an environment variable, and then look
-   for some other definitions, e.g. in a config file. If you prefer
-   this behaviour, check for an environment variable in the error
-   handler of the cllback class.)
-   
-   Some callbacks do not allow to abort the mirror. If an error occured
-   in such a callback, the error handler of the callback class
-   can be used to record the occurence of the error in an attribute,
-   and the next callback allowing to abort the mirror can decide, what
-   to do. This library does not attempt to abort the mirror later.
-   
+/* get d[key], a string or a sequence of strings, as a list of patterns.
+   The patterns are converted to lower case, if nocase is set.
+   return: 1 on success; 0 if an error occured (Python error set)
 */
+static int filter_patterns(PyObject *d, char *key, int nocase,
+                           char ***res) {
+  PyObject *o, *item;
+  char *cc;
+  int i, n, ok = 0;
 
-static int process_error(char *cbname) {
-  PyObject *pType, *pValue, *pTraceback, *meth, *args, *pCbname, *pRes, *dict;
-  int res;
-  char *cc, *cc1;
-
-  /* save the error data first; it will be cleared by the 
-     PyObject_HasAttrString call below
-  */
-  PyErr_Fetch(&pType, &pValue, &pTraceback);
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "error_handler")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "error_handler");
-    if (meth) {
-      pCbname = PyString_FromString(cbname);
-      if (pCbname) {
-        args = PyTuple_New(4);
-        if (args) {
-          PyTuple_SetItem(args, 0, pCbname);
-          PyTuple_SetItem(args, 1, pType);
-          if (pValue) {
-            PyTuple_SetItem(args, 2, pValue);
-          }
-          else {
-            PyTuple_SetItem(args, 2, Py_None);
-            Py_INCREF(Py_None);
-          }
-          if (pTraceback) {
-            PyTuple_SetItem(args, 3, pTraceback);
-          }
-          else {
-            PyTuple_SetItem(args, 3, Py_None);
-            Py_INCREF(Py_None);
-          }
-          pRes = PyObject_CallObject(meth, args);
-          if (pRes) {
-            if (!PyInt_Check(pRes)) {
-              /* consider this a serious error -- an error handler
-                 should not produce its own error
-              */
-              return IMMEDIATE_STOP;
-            }
-            res = PyInt_AsLong(pRes);
-            if (res < IMMEDIATE_STOP || res > IGNORE_EXCEPTION)
-              return IMMEDIATE_STOP;
-            return res;
-          }
-        }
-      }
+  if (!PyMapping_HasKeyString(d, key))
+    return 1;
+  o = PyMapping_GetItemString(d, key);
+  if (!o)
+    return 0;
+  n = PyString_Check(o) ? 1 : PySequence_Size(o);
+  if (n < 0) {
+    PyErr_Clear();
+    goto done;
+  }
+  *res = calloc(n + 1, sizeof(char*));
+  if (!*res) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  for (i = 0; i < n; i++) {
+    item = PyString_Check(o) ? o : PySequence_GetItem(o, i);
+    if (!item)
+      goto done;
+    if (PyString_Check(item))
+      (*res)[i] = strdup(PyString_AsString(item));
+    if (item != o)
+      Py_DECREF(item);
+    if (!(*res)[i])
+      goto done;
+    for (cc = (*res)[i]; nocase && *cc; cc++) {
+      *cc = tolower((unsigned char)*cc);
     }
-    /* if we arrive here, an error occured during error handling.
-       Let's stop immediately
-    */
-    PyErr_Print();
-    fprintf(stderr, "this error occurred during error handling. trying to abort\n");
-    return IMMEDIATE_STOP;
   }
+  ok = 1;
 
-  PyErr_Restore(pType, pValue, pTraceback);
-  PyErr_Print();
-  res = REGULAR_STOP;
-  cc = getenv("HTTRACK_PY_ERROR_POLICY");
-  if (cc) {
-    res = strtol(cc, &cc1, 10);
-    if (cc == cc1 || -1 > res || res > 1 ) {
-      fprintf(stderr, "invalid value for HTTRACK_PY_ERROR_POLICY.\n");
-      res = IMMEDIATE_STOP;
-    }
+done:
+  if (!ok && !PyErr_Occurred())
+    PyErr_Format(PyExc_TypeError,
+                 "filter %s must be a string or a list of strings", key);
+  Py_DECREF(o);
+  return ok;
+}
+
+static int filter_size(PyObject *d, char *key, LLint *size) {
+  double v = -1.0;
+  if (!mapping_double(d, key, &v))
+    return 0;
+  *size = v < 0.0 ? -1 : (LLint)v;
+  return 1;
+}
+
+/* parse the filter of the callback cb of a handler.
+   return: 1 on success (*res is 0, if the handler has no filter for
+           cb); 0 if an error occured (Python error set)
+*/
+static int parse_filter(PyObject *handler, int cb, cb_filter **res) {
+  PyObject *filters, *d = 0, *keys = 0;
+  char *key;
+  int i, ok = 0;
+
+  *res = 0;
+  if (!PyObject_HasAttrString(handler, "filters"))
+    return 1;
+  filters = PyObject_GetAttrString(handler, "filters");
+  if (!filters)
+    return 0;
+  if (filters == Py_None) {
+    Py_DECREF(filters);
+    return 1;
   }
-  
-  /* try to use the error_policy attribute in the callback class */
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "error_policy")) {
-    dict = PyObject_GetAttrString(pCallbackClass, "error_policy");
-    if (dict) {
-      if (!PyMapping_Check(dict)) {
-        fprintf(stderr, "error_policy attribute must be a mapping object\n");
-        return IMMEDIATE_STOP;
-      }
-      if (PyMapping_HasKeyString(dict, "__default__")) {
-        pRes = PyMapping_GetItemString(dict, "__default__");
-        if (pRes) {
-          res = PyInt_AsLong(pRes);
-          if (-1 > res || res > 1) {
-            fprintf(stderr, "invalid value for error_policy['__default__']. ");
-            res = IMMEDIATE_STOP;
-          }
-        }
-        else {
-          PyErr_Print();
-          fprintf(stderr, "this error occurred during error handling. Will probably abort\n");
-          res = IMMEDIATE_STOP;
-        }
-      }
-      if (PyMapping_HasKeyString(dict, cbname)) {
-        pRes = PyMapping_GetItemString(dict, cbname);
-        if (pRes) {
-          res = PyInt_AsLong(pRes);
-          if (-1 > res || res > 1) {
-            fprintf(stderr, "invalid value for error_policy['%s']. ", cbname);
-            res = IMMEDIATE_STOP;
-          }
-        }
-        else {
-          PyErr_Print();
-          fprintf(stderr, "this error occurred during error handling. Will probably abort\n");
-          res = IMMEDIATE_STOP;
-        }
-      }
-      return res;
+  if (!PyMapping_Check(filters)) {
+    PyErr_SetString(PyExc_TypeError,
+                    "filters attribute must be a mapping object");
+    goto done;
+  }
+  if (!PyMapping_HasKeyString(filters, cb_names[cb])) {
+    ok = 1;
+    goto done;
+  }
+  if (   cb != CB_CHECK_HTML && cb != CB_PREPROCESS_HTML
+      && cb != CB_POSTPROCESS_HTML && cb != CB_TRANSFER_STATUS
+      && cb != CB_PROCESS_PAGE) {
+    PyErr_Format(PyExc_ValueError, "no filters for callback %s",
+                 cb_names[cb]);
+    goto done;
+  }
+  d = PyMapping_GetItemString(filters, cb_names[cb]);
+  if (!d)
+    goto done;
+  if (!PyMapping_Check(d) || !(keys = PyMapping_Keys(d))) {
+    PyErr_Clear();
+    PyErr_Format(PyExc_TypeError, "filter of %s must be a mapping object",
+                 cb_names[cb]);
+    goto done;
+  }
+  /* a misspelt key would silently disable a part of the filter */
+  for (i = 0; i < PyList_Size(keys); i++) {
+    key = PyString_Check(PyList_GetItem(keys, i))
+            ? PyString_AsString(PyList_GetItem(keys, i)) : "";
+    if (   strcmp(key, "host") && strcmp(key, "path")
+        && strcmp(key, "content_type") && strcmp(key, "min_size")
+        && strcmp(key, "max_size")) {
+      PyErr_Format(PyExc_ValueError, "unknown key in the filter of %s",
+                   cb_names[cb]);
+      goto done;
     }
-    /* if we arrive here, an error occured during error handling.
-       Let's stop immediately
-    */
-    PyErr_Print();
-    fprintf(stderr, "this error occurrd during error handling. Trying to abort\n");
-    return IMMEDIATE_STOP;
   }
-  return res;
+  *res = calloc(1, sizeof(cb_filter));
+  if (!*res) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  ok =    filter_patterns(d, "host", 1, &(*res)->hosts)
+       && filter_patterns(d, "path", 0, &(*res)->paths)
+       && filter_patterns(d, "content_type", 1, &(*res)->types)
+       && filter_size(d, "min_size", &(*res)->min_size)
+       && filter_size(d, "max_size", &(*res)->max_size);
+  if (!ok) {
+    free_filter(*res);
+    *res = 0;
+  }
+
+done:
+  Py_XDECREF(keys);
+  Py_XDECREF(d);
+  Py_DECREF(filters);
+  return ok;
 }
 
-/* for callbacks that return 0 for "stop mirror" and 1 for "continue"
-*/
-static int process_error_direct(char *cbname) {
-  int res = process_error(cbname);
-  if (res == IMMEDIATE_STOP) 
-    return REGULAR_STOP;
-  return res;
+static int match_patterns(char **patterns, char *s) {
+  if (!patterns)
+    return 1;
+  if (!s)
+    return 0;
+  for (; *patterns; patterns++) {
+    if (!fnmatch(*patterns, s, 0))
+      return 1;
+  }
+  return 0;
 }
 
-/* for callbacks  that have other return value
+/* like match_patterns, for patterns in lower case (see parse_filter).
+   FNM_CASEFOLD is not POSIX, so s is converted; long strings in an
+   allocated buffer.
 */
-static void process_error_indirect(char *cbname) {
-  int res = process_error(cbname);
-  if (res == IMMEDIATE_STOP) 
-    exit(-1);
-  if (res == REGULAR_STOP)
-    stop_on_next_callback = 1;
+static int match_patterns_nocase(char **patterns, char *s) {
+  char buf[256], *low = buf;
+  size_t i, len;
+  int res;
+  if (!patterns || !s)
+    return match_patterns(patterns, s);
+  len = strlen(s);
+  if (len >= sizeof(buf) && !(low = malloc(len + 1)))
+    return match_patterns(patterns, s);
+  for (i = 0; i <= len; i++) {
+    low[i] = tolower((unsigned char)s[i]);
+  }
+  res = match_patterns(patterns, low);
+  if (low != buf)
+    free(low);
+  return res;
 }
 
-// xxxxxxxxxxxxxx change error behaviour: raise an exception,
-// if the variable type is wrong
-
-#define setAnyItem(pydict, field)   if (!tmp) return 0; \
-                        if (PyDict_SetItemString(pydict, #field, tmp) == -1) { \
-                          Py_DECREF(tmp); \
-                          return 0; \
-                        } \
-                        Py_DECREF(tmp); 
+/* return: 1 if the stage wants to see the URL u */
+static int stage_wanted(cb_stage *stage, url_info *u) {
+  cb_filter *f = stage->filter;
+  if (!f)
+    return 1;
+  if (u->size >= 0 && (   (f->min_size >= 0 && u->size < f->min_size)
+                       || (f->max_size >= 0 && u->size > f->max_size)))
+    return 0;
+  return    match_patterns_nocase(f->hosts, u->adr)
+         && match_patterns(f->paths, u->fil)
+         && (!u->content_type
+             || match_patterns_nocase(f->types, u->content_type));
+}
 
-#define setIntItem(pydict, cstruct, field) { PyObject *tmp; \
-                        tmp = PyInt_FromLong(cstruct->field); \
-                        setAnyItem(pydict, field) \
-                      }
+/* return: 1 if any stage of the pipeline wants to see the URL u */
+static int pipeline_wanted(cb_pipeline *p, url_info *u) {
+  int i;
+  if (!p->nfilters)
+    return 1;
+  for (i = 0; i < p->nstages; i++) {
+    if (stage_wanted(&p->stages[i], u))
+      return 1;
+  }
+  return 0;
+}
 
-#define setIntItem2(pydict, intname, field) { PyObject *tmp; \
-                        tmp = PyInt_FromLong(intname); \
-                        setAnyItem(pydict, field) \
-                      }
+/* like pipeline_wanted, for the hts_py_* functions: may be called
+   without the GIL. The pipelines don't change while the mirror runs.
+*/
+static int cb_wanted(int cb, char *adr, char *fil, LLint size) {
+  url_info u;
+  if (!main_interp.pipelines[cb].nfilters)
+    return 1;
+  u.adr = adr;
+  u.fil = fil;
+  u.content_type = 0;
+  u.size = size;
+  return pipeline_wanted(&main_interp.pipelines[cb], &u);
+}
 
-/* xxx LLint may be defined as 'long long int', and for this
-   type we don't have a proper conversion function in the Python/C API
-   
-   We ignore this problem, and use simply PyLong_FromLong
+/* like cb_wanted, for the HTML callbacks: Python is also needed, if
+   process_page wants the page
 */
-#define setLLIntItem(pydict, cstruct, field) { PyObject *tmp; \
-                          tmp = PyLong_FromLong(cstruct->field); \
-                          setAnyItem(pydict, field) \
-                        }
+static int html_wanted(int cb, char *adr, char *fil, LLint size) {
+  return    cb_wanted(cb, adr, fil, size)
+         || (   main_interp.pipelines[CB_PROCESS_PAGE].nstages
+             && cb_wanted(CB_PROCESS_PAGE, adr, fil, size));
+}
 
-#define setFloatItem(pydict, cstruct, field) { PyObject *tmp; \
-                          tmp = PyFloat_FromDouble(cstruct->field); \
-                          setAnyItem(pydict, field) \
-                        }
+static void free_pipelines(void) {
+  int cb, i;
+  for (cb = 0; cb < CB_COUNT; cb++) {
+    for (i = 0; i < interp->pipelines[cb].nstages; i++) {
+      Py_DECREF(interp->pipelines[cb].stages[i].meth);
+      free_filter(interp->pipelines[cb].stages[i].filter);
+    }
+    free(interp->pipelines[cb].stages);
+    interp->pipelines[cb].stages = 0;
+    interp->pipelines[cb].nstages = 0;
+    interp->pipelines[cb].nfilters = 0;
+    for (i = 0; i < interp->pipelines[cb].nnatives; i++) {
+      Py_DECREF(interp->pipelines[cb].natives[i].capsule);
+    }
+    free(interp->pipelines[cb].natives);
+    interp->pipelines[cb].natives = 0;
+    interp->pipelines[cb].nnatives = 0;
+  }
+  interp->pCurrentHandler = 0;
+}
 
-#define setStringItem(pydict, cstruct, field) { PyObject *tmp; \
-                           tmp = PyString_FromString(cstruct->field); \
-                           setAnyItem(pydict, field) \
-                         }
+/* Native callbacks.
 
-#define getIntItem(pydict, cstruct, field) { PyObject *tmp; \
-                        tmp = PyDict_GetItemString(pydict, #field); \
-                        if (tmp && PyInt_Check(tmp)) { \
-                          cstruct->field = PyInt_AsLong(tmp); \
-                        } \
-                        else { \
-                          if (tmp) { \
-                            PyErr_SetString(httrackError, \
-                              "wrong type for option dict entry " #field); \
-                          } \
-                          else { \
-                            PyErr_SetString(httrackError, \
-                              "value for key " #field " is missing"); \
-                          } \
-                        } \
-                      }
+   For the callbacks check_html, preprocess_html, postprocess_html,
+   check_link, link_detected and link_detected2, a handler can provide
+   a C function in a PyCapsule (see httrack-py.h): the attribute of the
+   callback itself is a capsule, or the attribute <callback>_native,
+   if the handler also has a Python method.
 
-#define getLLIntItem(pydict, cstruct, field) { PyObject *tmp; \
-                          tmp = PyDict_GetItemString(pydict, #field); \
-                          if (tmp && PyLong_Check(tmp)) { \
-                            cstruct->field = PyLong_AsLong(tmp); \
-                          } \
-                          else { \
-                            if (tmp) { \
-                              PyErr_SetString(httrackError, \
-                                "wrong type for option dict entry " #field); \
-                            } \
-                            else { \
-                              PyErr_SetString(httrackError, \
-                                "value for key " #field " is missing"); \
-                            } \
-                          } \
-                        } 
+   The hts_py_* functions call the native functions of all handlers
+   first, without the GIL, in the order of the handlers; the first
+   result other than HTS_PY_CONTINUE is the result of the callback, and
+   no Python method is called. The filters apply only to the Python
+   methods. The native functions of the first interpreter are used for
+   all threads.
 
-#define getFloatItem(pydict, cstruct, field) { PyObject *tmp; \
-                          tmp = PyDict_GetItemString(pydict, #field); \
-                          if (tmp && PyFloat_Check(tmp)) { \
-                            cstruct->field = PyFloat_AsDouble(tmp); \
-                          } \
-                          else { \
-                            if (tmp) { \
-                              PyErr_SetString(httrackError, \
-                                "wrong type for option dict entry " #field); \
-                            } \
-                            else { \
-                              PyErr_SetString(httrackError, \
-                                "value for key " #field " is missing"); \
-                            } \
-                          } \
-                        }
+   If the glue needs the GIL for the call anyway (WARC output, edits
+   from process_page, page feed), preprocess_html and postprocess_html
+   call the native functions after the glue's own work, with the GIL
+   held, so they see the same text as the Python methods.
+*/
 
-#define getStringItem(pydict, cstruct, field, maxsize) { PyObject *tmp; \
-                      tmp = PyDict_GetItemString(pydict, #field); \
-                      if (tmp && PyString_Check(tmp)) { \
-                        int size, psize = PyString_Size(tmp); \
-                        size = (psize < maxsize) ? psize : maxsize; \
-                        strncpy(cstruct->field, PyString_AsString(tmp), size); \
-                      } \
-                          else { \
-                            if (tmp) { \
-                              PyErr_SetString(httrackError, \
-                                "wrong type for option dict entry " #field); \
-                            } \
-                            else { \
-                              PyErr_SetString(httrackError, \
-                                "value for key " #field " is missing"); \
-                            } \
-                          } \
-                    }
+static int native_allowed(int cb) {
+  return    cb == CB_CHECK_HTML || cb == CB_PREPROCESS_HTML
+         || cb == CB_POSTPROCESS_HTML || cb == CB_CHECK_LINK
+         || cb == CB_LINK_DETECTED || cb == CB_LINK_DETECTED2;
+}
 
-#ifdef HTS_INTERNAL_BYTECODE
-static PyObject *set_cookies(t_cookie *cookies) {
-  /* return: (cookies, auth_data) or a null pointer, if an error occurs
-     where: cookies is a list of singlecookies,
-              and each cookie is a list of strings
-            auth_data is a list of 2-tuples, containing the "prefix" and user:ass
-            (see htsbauth.[ch] for details
-  */
-  PyObject *res, *pAllCookies, *pAuth, *pCookie, *s, *s2, *t;
-  char *c1, *c2;
-  bauth_chain *auth;
-  int i;
-  
-  pAllCookies = PyList_New(0);
-  if (!pAllCookies) {
+/* add the native function of handler for cb to its pipeline, if the
+   handler has one.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int add_native(PyObject *handler, int cb, int index) {
+  cb_pipeline *p = &interp->pipelines[cb];
+  PyObject *capsule;
+  char name[64];
+  void *fn;
+
+  snprintf(name, sizeof(name), "%s_native", cb_names[cb]);
+  if (PyObject_HasAttrString(handler, name)) {
+    capsule = PyObject_GetAttrString(handler, name);
+  }
+  else {
+    capsule = PyObject_GetAttrString(handler, cb_names[cb]);
+    if (capsule && !PyCapsule_CheckExact(capsule)) {
+      Py_DECREF(capsule);
+      return 1;
+    }
+  }
+  if (!capsule) {
+    PyErr_Clear();
+    return 1;
+  }
+  if (!native_allowed(cb)) {
+    Py_DECREF(capsule);
+    PyErr_Format(PyExc_TypeError,
+                 "callback %s of handler %i can't be native",
+                 cb_names[cb], index);
     return 0;
   }
-  
-  pAuth = PyList_New(0);
-  if (!pAuth) {
-    Py_DECREF(pAllCookies);
+  snprintf(name, sizeof(name), "httrack_py.%s", cb_names[cb]);
+  fn = PyCapsule_CheckExact(capsule) ? PyCapsule_GetPointer(capsule, name)
+                                     : 0;
+  if (!fn) {
+    Py_DECREF(capsule);
+    PyErr_Clear();
+    PyErr_Format(PyExc_TypeError,
+                 "native callback %s of handler %i must be a capsule "
+                 "named \"%s\"", cb_names[cb], index, name);
     return 0;
   }
+  p->natives[p->nnatives].fn = fn;
+  p->natives[p->nnatives].data = PyCapsule_GetContext(capsule);
+  p->natives[p->nnatives].capsule = capsule;
+  p->nnatives++;
+  return 1;
+}
 
-  res = PyTuple_New(2);
-  if (!res) {
-    Py_DECREF(pAllCookies);
-    Py_DECREF(pAuth);
-    return 0;
+/* run the native functions of the callback cb, casting them to type
+   and calling them with args (the arguments of the hts_py_* function
+   and native->data). res is set to the first result other than
+   HTS_PY_CONTINUE, or to HTS_PY_CONTINUE.
+*/
+#define RUN_NATIVE(res, cb, type, args) { \
+    cb_pipeline *np_ = &main_interp.pipelines[cb]; \
+    native_stage *native; \
+    int ni_; \
+    res = HTS_PY_CONTINUE; \
+    for (ni_ = 0; res == HTS_PY_CONTINUE && ni_ < np_->nnatives; ni_++) { \
+      native = &np_->natives[ni_]; \
+      res = ((type) native->fn) args; \
+    } \
   }
-  
-  PyTuple_SetItem(res, 0, pAllCookies);
-  PyTuple_SetItem(res, 1, pAuth);
-  
-  c1 = cookies->data;
-  while (*c1) {
-    i = 0;
-    pCookie = PyList_New(0);
-    if (!pCookie) {
-      Py_DECREF(res);
+
+/* set pHandlers from the object returned by register() or passed to
+   httracklib.httrack(), and resolve the methods of all handlers.
+   Steals the reference to obj.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int setup_pipelines(PyObject *obj) {
+  PyObject *handler, *meth;
+  int cb, i, n;
+  cb_stage *stage;
+
+  if (PyList_Check(obj) || PyTuple_Check(obj)) {
+    interp->pHandlers = PySequence_Tuple(obj);
+    Py_DECREF(obj);
+    if (!interp->pHandlers)
       return 0;
-    }
-    if (PyList_Append(pAllCookies, pCookie)) {
-      Py_DECREF(res);
-      Py_DECREF(pCookie);
+  }
+  else {
+    interp->pHandlers = PyTuple_New(1);
+    if (!interp->pHandlers) {
+      Py_DECREF(obj);
       return 0;
     }
-    Py_DECREF(pCookie);
+    PyTuple_SetItem(interp->pHandlers, 0, obj);
+  }
+  n = PyTuple_Size(interp->pHandlers);
+  if (!n) {
+    PyErr_SetString(PyExc_ValueError, "the list of callback handlers is empty");
+    return 0;
+  }
+  interp->pCallbackClass = PyTuple_GetItem(interp->pHandlers, 0);
 
-    while (strcmp(c2=cookie_get(c1, i++), "")) {
-      s = PyString_FromString(c2);
-      if (!s) {
-        Py_DECREF(res);
+  for (cb = 0; cb < CB_COUNT; cb++) {
+    interp->pipelines[cb].nstages = 0;
+    interp->pipelines[cb].nfilters = 0;
+    interp->pipelines[cb].nnatives = 0;
+    interp->pipelines[cb].stages = malloc(n * sizeof(cb_stage));
+    interp->pipelines[cb].natives = malloc(n * sizeof(native_stage));
+    if (!interp->pipelines[cb].stages || !interp->pipelines[cb].natives) {
+      PyErr_NoMemory();
+      return 0;
+    }
+    for (i = 0; i < n; i++) {
+      handler = PyTuple_GetItem(interp->pHandlers, i);
+      if (!add_native(handler, cb, i))
+        return 0;
+      if (!PyObject_HasAttrString(handler, cb_names[cb]))
+        continue;
+      meth = PyObject_GetAttrString(handler, cb_names[cb]);
+      if (!meth)
         return 0;
+      if (PyCapsule_CheckExact(meth)) {
+        /* a native callback without a Python method */
+        Py_DECREF(meth);
+        continue;
       }
-      if (PyList_Append(pCookie, s)) {
-        Py_DECREF(res);
-        Py_DECREF(s);
+      if (!PyCallable_Check(meth)) {
+        Py_DECREF(meth);
+        PyErr_Format(PyExc_TypeError,
+                     "attribute %s of callback handler %i is not callable",
+                     cb_names[cb], i);
         return 0;
       }
-      Py_DECREF(s);
+      stage = &interp->pipelines[cb].stages[interp->pipelines[cb].nstages++];
+      stage->handler = handler;
+      stage->meth = meth;
+      stage->index = i;
+      stage->cb = cb;
+      stage->calls = 0;
+      stage->seconds = 0.0;
+      if (!parse_filter(handler, cb, &stage->filter)) {
+        stage->filter = 0;
+        return 0;
+      }
+      if (stage->filter)
+        interp->pipelines[cb].nfilters++;
     }
-    
-    c1 = cookie_nextfield(c1);
   }
-  
-  auth = &cookies->auth;
-  while (auth) {
-    s = PyString_FromString(auth->prefix);
-    if (!s) {
-      Py_DECREF(res);
-      return 0;
+  return 1;
+}
+
+/* read an integer setting: the attribute attr of the first handler,
+   if it exists, else the environment variable env, else deflt
+*/
+static long get_setting_long(char *attr, char *env, long deflt) {
+  PyObject *v;
+  char *cc, *cc1;
+  long res = deflt;
+
+  if (   interp->pCallbackClass
+      && PyObject_HasAttrString(interp->pCallbackClass, attr)) {
+    v = PyObject_GetAttrString(interp->pCallbackClass, attr);
+    if (v) {
+      res = PyInt_AsLong(v);
+      Py_DECREF(v);
     }
-    
-    s2 = PyString_FromString(auth->auth);
-    if (!s2) {
-      Py_DECREF(res);
-      Py_DECREF(s);
-      return 0;
+    if (!v || (res == -1 && PyErr_Occurred())) {
+      PyErr_Print();
+      fprintf(stderr, "httrack-py: invalid value for attribute %s\n", attr);
+      res = deflt;
     }
-    
-    t = PyTuple_New(2);
-    if (!t) {
+    return res;
+  }
+  cc = env ? getenv(env) : 0;
+  if (cc) {
+    res = strtol(cc, &cc1, 10);
+    if (cc == cc1) {
+      fprintf(stderr, "invalid value for %s.\n", env);
+      res = deflt;
+    }
+  }
+  return res;
+}
+
+/* read a string setting like get_setting_long.
+   return: a copy of the value (to be freed by the caller), or 0, if
+           the setting does not exist
+*/
+static char *get_setting_string(char *attr, char *env) {
+  PyObject *v;
+  char *cc = 0;
+
+  if (   interp->pCallbackClass
+      && PyObject_HasAttrString(interp->pCallbackClass, attr)) {
+    v = PyObject_GetAttrString(interp->pCallbackClass, attr);
+    if (v && PyString_Check(v)) {
+      cc = strdup(PyString_AsString(v));
+    }
+    else if (v != Py_None) {
+      if (PyErr_Occurred())
+        PyErr_Print();
+      fprintf(stderr, "httrack-py: invalid value for attribute %s\n", attr);
+    }
+    Py_XDECREF(v);
+    return cc;
+  }
+  cc = env ? getenv(env) : 0;
+  return cc && *cc ? strdup(cc) : 0;
+}
+
+/* A simple hash map with string keys, for the native tables of this
+   module (per URL, per host, ...). The keys are copied. The values
+   are freed with free_value, if it is not 0, when they are replaced
+   or when the map is cleared. The entries are also kept in the order
+   in which they were put, so that a bounded table can drop its oldest
+   entry. The maps are not thread safe; the callers protect them with
+   the GIL or with their own lock.
+*/
+typedef struct str_entry {
+  struct str_entry *next;
+  struct str_entry *older, *newer;
+  unsigned long hash;
+  char *key;
+  void *value;
+} str_entry;
+
+typedef struct {
+  str_entry **buckets;
+  unsigned long nbuckets;
+  unsigned long count;
+  str_entry *oldest, *newest;
+  void (*free_value)(void *value);
+} str_map;
+
+static unsigned long str_hash(const char *s) {
+  /* FNV-1a */
+  unsigned long h = 2166136261UL;
+  while (*s) {
+    h = (h ^ (unsigned char) *s++) * 16777619UL;
+  }
+  return h;
+}
+
+/* return: 1 on success; 0 if no memory is available */
+static int str_map_init(str_map *m, void (*free_value)(void *value)) {
+  m->nbuckets = 64;
+  m->count = 0;
+  m->oldest = m->newest = 0;
+  m->free_value = free_value;
+  m->buckets = calloc(m->nbuckets, sizeof(str_entry*));
+  return m->buckets != 0;
+}
+
+static str_entry **str_map_find(str_map *m, const char *key,
+                                unsigned long hash) {
+  str_entry **e = &m->buckets[hash % m->nbuckets];
+  while (*e && ((*e)->hash != hash || strcmp((*e)->key, key)))
+    e = &(*e)->next;
+  return e;
+}
+
+static void str_map_grow(str_map *m) {
+  str_entry **buckets, *e, *next;
+  unsigned long i, n = m->nbuckets * 4;
+
+  buckets = calloc(n, sizeof(str_entry*));
+  if (!buckets)
+    return;             /* we can live with long chains */
+  for (i = 0; i < m->nbuckets; i++) {
+    for (e = m->buckets[i]; e; e = next) {
+      next = e->next;
+      e->next = buckets[e->hash % n];
+      buckets[e->hash % n] = e;
+    }
+  }
+  free(m->buckets);
+  m->buckets = buckets;
+  m->nbuckets = n;
+}
+
+static void str_map_unlink(str_map *m, str_entry *e) {
+  if (e->older)
+    e->older->newer = e->newer;
+  else
+    m->oldest = e->newer;
+  if (e->newer)
+    e->newer->older = e->older;
+  else
+    m->newest = e->older;
+}
+
+static void str_map_link(str_map *m, str_entry *e) {
+  e->older = m->newest;
+  e->newer = 0;
+  if (m->newest)
+    m->newest->newer = e;
+  else
+    m->oldest = e;
+  m->newest = e;
+}
+
+/* add or replace the value for key; the entry becomes the newest.
+   return: 1 on success; 0 if no memory is available
+*/
+static int str_map_put(str_map *m, const char *key, void *value) {
+  unsigned long hash = str_hash(key);
+  str_entry **pe, *e;
+
+  if (!m->buckets)
+    return 0;
+  pe = str_map_find(m, key, hash);
+  e = *pe;
+  if (e) {
+    if (m->free_value && e->value != value)
+      m->free_value(e->value);
+    e->value = value;
+    str_map_unlink(m, e);
+    str_map_link(m, e);
+    return 1;
+  }
+  e = malloc(sizeof(str_entry));
+  if (!e)
+    return 0;
+  e->key = strdup(key);
+  if (!e->key) {
+    free(e);
+    return 0;
+  }
+  e->hash = hash;
+  e->value = value;
+  e->next = 0;
+  *pe = e;
+  str_map_link(m, e);
+  if (++m->count > m->nbuckets)
+    str_map_grow(m);
+  return 1;
+}
+
+/* return: the value of key, or 0 */
+static void *str_map_get(str_map *m, const char *key) {
+  str_entry *e;
+  if (!m->buckets)
+    return 0;
+  e = *str_map_find(m, key, str_hash(key));
+  return e ? e->value : 0;
+}
+
+/* iterate over the entries of the map. Start with *bucket == 0 and
+   e == 0; returns 0 after the last entry.
+*/
+static str_entry *str_map_next(str_map *m, unsigned long *bucket,
+                               str_entry *e) {
+  if (e && e->next)
+    return e->next;
+  if (e)
+    (*bucket)++;
+  for (; m->buckets && *bucket < m->nbuckets; (*bucket)++) {
+    if (m->buckets[*bucket])
+      return m->buckets[*bucket];
+  }
+  return 0;
+}
+
+/* remove key from the map.
+   return: its value, which is not freed, or 0
+*/
+static void *str_map_take(str_map *m, const char *key) {
+  str_entry **pe, *e;
+  void *value;
+
+  if (!m->buckets)
+    return 0;
+  pe = str_map_find(m, key, str_hash(key));
+  e = *pe;
+  if (!e)
+    return 0;
+  *pe = e->next;
+  str_map_unlink(m, e);
+  value = e->value;
+  free(e->key);
+  free(e);
+  m->count--;
+  return value;
+}
+
+/* remove the oldest entry of the map, and free its value */
+static void str_map_drop_oldest(str_map *m) {
+  void *value;
+
+  if (!m->oldest)
+    return;
+  value = str_map_take(m, m->oldest->key);
+  if (m->free_value)
+    m->free_value(value);
+}
+
+static void str_map_clear(str_map *m) {
+  str_entry *e, *next;
+  unsigned long i;
+
+  for (i = 0; m->buckets && i < m->nbuckets; i++) {
+    for (e = m->buckets[i]; e; e = next) {
+      next = e->next;
+      if (m->free_value)
+        m->free_value(e->value);
+      free(e->key);
+      free(e);
+    }
+    m->buckets[i] = 0;
+  }
+  m->count = 0;
+  m->oldest = m->newest = 0;
+}
+
+static void str_map_free(str_map *m) {
+  str_map_clear(m);
+  free(m->buckets);
+  m->buckets = 0;
+  m->nbuckets = 0;
+}
+
+/* return: the key of a URL for the native tables (to be freed by the
+           caller), or 0 if no memory is available
+*/
+static char *url_key(char *adr, char *fil) {
+  char *key = malloc(strlen(adr) + strlen(fil) + 1);
+  if (key) {
+    strcpy(key, adr);
+    strcat(key, fil);
+  }
+  return key;
+}
+
+/* return: the prefix which makes adr+fil a full URL; the address of
+           a non-http URL already begins with its scheme
+*/
+static const char *url_scheme(char *adr) {
+  return strstr(adr, "://") ? "" : "http://";
+}
+
+/* Circuit breakers and error table.
+
+   If the setting breaker_threshold (attribute of the first handler,
+   or environment variable HTTRACK_PY_BREAKER_THRESHOLD) is greater
+   than 0, each callback has a circuit breaker: if the methods of a
+   callback raise that many exceptions within breaker_window seconds
+   (HTTRACK_PY_BREAKER_WINDOW, default 60), the breaker "opens", and
+   the callback is not executed for breaker_cooldown seconds
+   (HTTRACK_PY_BREAKER_COOLDOWN, default 30); httrack gets the same
+   answer as without a Python method. Afterwards, the next call is
+   tried: if it succeeds, the breaker is closed again, otherwise it
+   stays open for another cooldown period.
+
+   All exceptions are counted in a table, per callback and exception
+   type. The traceback of an exception is printed only for the first
+   exception of a kind, and then at most once in error_print_interval
+   seconds (HTTRACK_PY_ERROR_PRINT_INTERVAL, default 60; 0 prints all
+   tracebacks). httracklib.error_summary() returns the table.
+
+   The breakers and the table are protected by the GIL.
+*/
+
+enum { BREAKER_CLOSED, BREAKER_OPEN, BREAKER_HALF_OPEN };
+static char *breaker_states[] = {"closed", "open", "half_open"};
+
+typedef struct {
+  int state;
+  long failures;        /* in the current window */
+  double window_start;
+  double opened;
+  long trips;           /* how often the breaker was opened */
+  long skipped;         /* calls skipped while the breaker was open */
+} cb_breaker;
+
+typedef struct {
+  char cbname[32];
+  char type[96];
+  long count;
+  long suppressed;      /* not printed since the last printed one */
+  double first, last, last_print;
+  char message[256];
+} error_entry;
+
+static cb_breaker breakers[CB_COUNT];
+static long breaker_threshold = 0, breaker_window, breaker_cooldown;
+static long error_print_interval;
+/* "cbname\ttype" -> error_entry */
+static str_map error_table;
+
+/* read the settings and reset the breakers and the error table.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int start_breakers(void) {
+  memset(breakers, 0, sizeof(breakers));
+  breaker_threshold = get_setting_long("breaker_threshold",
+                                       "HTTRACK_PY_BREAKER_THRESHOLD", 0);
+  breaker_window = get_setting_long("breaker_window",
+                                    "HTTRACK_PY_BREAKER_WINDOW", 60);
+  breaker_cooldown = get_setting_long("breaker_cooldown",
+                                      "HTTRACK_PY_BREAKER_COOLDOWN", 30);
+  error_print_interval = get_setting_long("error_print_interval",
+                                          "HTTRACK_PY_ERROR_PRINT_INTERVAL",
+                                          60);
+  str_map_free(&error_table);
+  if (!str_map_init(&error_table, free)) {
+    PyErr_NoMemory();
+    return 0;
+  }
+  return 1;
+}
+
+/* return: 1, if the callback must not be executed now */
+static int breaker_open(int cb) {
+  cb_breaker *b = &breakers[cb];
+
+  if (b->state != BREAKER_OPEN)
+    return 0;
+  if (now_seconds() - b->opened >= breaker_cooldown) {
+    b->state = BREAKER_HALF_OPEN;
+    return 0;
+  }
+  b->skipped++;
+  return 1;
+}
+
+/* return: 1, if the callback has methods, which may be called now */
+static int cb_active(int cb) {
+  return interp->pipelines[cb].nstages && !breaker_open(cb);
+}
+
+static void breaker_failure(int cb) {
+  cb_breaker *b = &breakers[cb];
+  double now;
+
+  if (breaker_threshold <= 0)
+    return;
+  now = now_seconds();
+  if (b->state == BREAKER_CLOSED) {
+    if (now - b->window_start > breaker_window) {
+      b->window_start = now;
+      b->failures = 0;
+    }
+    if (++b->failures < breaker_threshold)
+      return;
+  }
+  if (b->state != BREAKER_OPEN) {
+    b->state = BREAKER_OPEN;
+    b->trips++;
+    fprintf(stderr, "httrack-py: too many errors in %s; callback disabled "
+                    "for %li seconds\n", cb_names[cb], breaker_cooldown);
+  }
+  b->opened = now;
+}
+
+static void breaker_success(int cb) {
+  cb_breaker *b = &breakers[cb];
+  if (b->state == BREAKER_HALF_OPEN) {
+    b->state = BREAKER_CLOSED;
+    b->failures = 0;
+    b->window_start = now_seconds();
+  }
+}
+
+/* count the exception (type, value) raised in the callback cbname.
+   return: 1, if its traceback should be printed
+*/
+static int record_error(char *cbname, PyObject *type, PyObject *value) {
+  error_entry *e;
+  PyObject *s;
+  char key[160], *tname;
+  double now = now_seconds();
+
+  tname = type && PyExceptionClass_Check(type) ? PyExceptionClass_Name(type)
+                                               : "?";
+  snprintf(key, sizeof(key), "%s\t%s", cbname, tname);
+  e = str_map_get(&error_table, key);
+  if (!e) {
+    e = calloc(1, sizeof(error_entry));
+    if (!e || !str_map_put(&error_table, key, e)) {
+      free(e);
+      return 1;
+    }
+    snprintf(e->cbname, sizeof(e->cbname), "%s", cbname);
+    snprintf(e->type, sizeof(e->type), "%s", tname);
+    e->first = now;
+    e->last_print = now - error_print_interval - 1;
+  }
+  e->count++;
+  e->last = now;
+  s = value ? PyObject_Str(value) : 0;
+  if (s) {
+    snprintf(e->message, sizeof(e->message), "%s", PyString_AsString(s));
+    Py_DECREF(s);
+  }
+  else {
+    PyErr_Clear();
+  }
+
+  if (error_print_interval <= 0)
+    return 1;
+  if (now - e->last_print < error_print_interval) {
+    e->suppressed++;
+    return 0;
+  }
+  if (e->suppressed)
+    fprintf(stderr, "httrack-py: %li similar errors (%s in %s) were not "
+                    "printed\n", e->suppressed, e->type, e->cbname);
+  e->suppressed = 0;
+  e->last_print = now;
+  return 1;
+}
+
+/* return: [{'callback', 'type', 'count', 'suppressed', 'first',
+           'last', 'message'}] */
+static PyObject *build_error_summary(void) {
+  PyObject *res, *d;
+  str_entry *se = 0;
+  unsigned long i = 0;
+  error_entry *e;
+
+  res = PyList_New(0);
+  if (!res)
+    return 0;
+  while ((se = str_map_next(&error_table, &i, se))) {
+    e = se->value;
+    d = Py_BuildValue("{s:s,s:s,s:l,s:l,s:d,s:d,s:s}",
+                      "callback", e->cbname, "type", e->type,
+                      "count", e->count, "suppressed", e->suppressed,
+                      "first", e->first, "last", e->last,
+                      "message", e->message);
+    if (!d || PyList_Append(res, d)) {
+      Py_XDECREF(d);
       Py_DECREF(res);
-      Py_DECREF(s);
-      Py_DECREF(s2);
       return 0;
     }
-    
-    PyTuple_SetItem(t, 0, s);
-    PyTuple_SetItem(t, 1, s2);
-    
-    if (PyList_Append(pAuth, t)) {
+    Py_DECREF(d);
+  }
+  return res;
+}
+
+/* return: {callback_name: {'state', 'trips', 'skipped'}} */
+static PyObject *build_breaker_stats(void) {
+  PyObject *res, *d;
+  int cb;
+
+  res = PyDict_New();
+  if (!res)
+    return 0;
+  for (cb = 0; cb < CB_COUNT; cb++) {
+    if (!breakers[cb].trips)
+      continue;
+    d = Py_BuildValue("{s:s,s:l,s:l}",
+                      "state", breaker_states[breakers[cb].state],
+                      "trips", breakers[cb].trips,
+                      "skipped", breakers[cb].skipped);
+    if (!d || PyDict_SetItemString(res, cb_names[cb], d)) {
+      Py_XDECREF(d);
       Py_DECREF(res);
-      Py_DECREF(t);
       return 0;
     }
-    auth = auth->next;
+    Py_DECREF(d);
   }
-  
   return res;
 }
-#endif
 
-static int set_option_dict(httrackp* opt, PyObject* dict) {
-  setIntItem(dict, opt, wizard);
-  setIntItem(dict, opt, flush);
-  setIntItem(dict, opt, travel);
-  setIntItem(dict, opt, seeker);
-  setIntItem(dict, opt, depth);
-  setIntItem(dict, opt, extdepth);
-  setIntItem(dict, opt, urlmode);
-  setIntItem(dict, opt, debug);
-  setIntItem(dict, opt, getmode);
-  /* xxx FILE *log, *errlog are missing. Not sure, if and how to map these 
-     to Python types
-  */
-  setLLIntItem(dict, opt, maxsite);
-  setLLIntItem(dict, opt, maxfile_nonhtml);
-  setLLIntItem(dict, opt, maxfile_html);
-  setIntItem(dict, opt, maxsoc);
-  setLLIntItem(dict, opt, fragment);
-  setIntItem(dict, opt, nearlink);
-  setIntItem(dict, opt, makeindex);
-  setIntItem(dict, opt, kindex);
-  setIntItem(dict, opt, delete_old);
-  setIntItem(dict, opt, timeout);
-  setIntItem(dict, opt, rateout);
-  setIntItem(dict, opt, maxtime);
-  setIntItem(dict, opt, maxrate);
-  setFloatItem(dict, opt, maxconn);
-  setIntItem(dict, opt, waittime);
-  setIntItem(dict, opt, cache);
-  setIntItem(dict, opt, shell);
-  setIntItem(dict, opt, savename_83);
-  setStringItem(dict, opt, savename_userdef);
-  setIntItem(dict, opt, mimehtml);
-  setIntItem(dict, opt, user_agent_send);
-  setStringItem(dict, opt, user_agent);
-  setStringItem(dict, opt, referer);
-  setStringItem(dict, opt, from);
-  setStringItem(dict, opt, path_log);
-  setStringItem(dict, opt, path_html);
-  setStringItem(dict, opt, path_bin);
-  setIntItem(dict, opt, retry);
-  setIntItem(dict, opt, makestat);
-  setIntItem(dict, opt, maketrack);
-  setIntItem(dict, opt, parsejava);
-  setIntItem(dict, opt, hostcontrol);
-  setIntItem(dict, opt, errpage);
-  setIntItem(dict, opt, check_type);
-  setIntItem(dict, opt, all_in_cache);
-  setIntItem(dict, opt, robots);
-  setIntItem(dict, opt, external);
-  setIntItem(dict, opt, passprivacy);
-  setIntItem(dict, opt, includequery);
-  setIntItem(dict, opt, mirror_first_page);
-  setStringItem(dict, opt, sys_com);
-  setIntItem(dict, opt, sys_com_exec);
-  setIntItem(dict, opt, accept_cookie);
+static void print_error_summary(void) {
+  str_entry *se = 0;
+  unsigned long i = 0;
+  error_entry *e;
 
-#ifdef HTS_INTERNAL_BYTECODE
-  if (opt->cookie) {
-    PyObject *tmp = set_cookies(opt->cookie);
-    if (!tmp) return 0;
-    setAnyItem(dict, cookie);
+  if (!error_table.count)
+    return;
+  fprintf(stderr, "httrack-py error summary:\n");
+  while ((se = str_map_next(&error_table, &i, se))) {
+    e = se->value;
+    fprintf(stderr, "  %-18s %-24s %8li  %s\n",
+            e->cbname, e->type, e->count, e->message);
   }
-#endif
+}
 
-  setIntItem(dict, opt, http10);
-  setIntItem(dict, opt, nokeepalive);
+/* Time budgets and watchdog.
+
+   If the first handler has an attribute time_budgets, a mapping
+   {callback_name: seconds} (the key '__default__' applies to all
+   other callbacks), a watchdog thread checks the running callback
+   methods. A method running longer than the budget of its callback
+   is recorded as an overrun, with the URL being processed;
+   httracklib.overruns() returns the records.
+
+   If the setting interrupt_overruns (attribute of the first handler,
+   or environment variable HTTRACK_PY_INTERRUPT_OVERRUNS) is greater
+   than 0, the watchdog also raises the exception
+   httracklib.CallbackTimeout in the thread running the method. It is
+   handled like any other exception raised by the method: the error
+   policy is applied, and httrack gets the default answer of the
+   callback. The exception is only raised while Python byte code is
+   executed; a long running C function (a regular expression, a
+   blocking read) is not interrupted.
+
+   Callbacks executed by worker processes are not watched.
+*/
+
+#define WD_SLOTS 64
+#define WD_OVERRUNS_MAX 10000
+
+typedef struct {
+  int active;             /* a method is running */
+  long seq;               /* number of the call */
+  int cb;
+  double start;
+  long thread_id;
+  PyThreadState *tstate;
+  PyFrameObject *base;    /* frame of the caller of the method */
+  py_interp *interp;
+  char *adr, *fil;        /* URL of the call, if known */
+  int overrun;            /* index in wd_overruns, or -1 */
+  int interrupted;
+} wd_slot;
+
+typedef struct {
+  int cb;
+  char url[256];
+  double seconds;
+  int interrupted;
+} wd_overrun;
+
+static double cb_budgets[CB_COUNT];
+static int wd_enabled = 0, wd_interrupt, wd_stop;
+static pthread_t wd_thread;
+static pthread_mutex_t wd_lock = PTHREAD_MUTEX_INITIALIZER;
+/* one slot for each running method; protected by wd_lock */
+static wd_slot wd_slots[WD_SLOTS];
+/* URL of the callback running in this thread; see watch_url() */
+static THREAD_LOCAL char *wd_adr = 0, *wd_fil = 0;
+static wd_overrun *wd_overruns = 0;
+static int wd_noverruns = 0;
+
+/* tell the watchdog the URL of the callback of this thread. Reset by
+   leave_python()
+*/
+static void watch_url(char *adr, char *fil) {
+  wd_adr = adr;
+  wd_fil = fil;
+}
+
+/* called with the GIL held */
+static void wd_interrupt_call(wd_slot *slot, long seq) {
+  PyGILState_STATE gil = PyGILState_UNLOCKED;
+  py_interp *target = slot->interp;
+
+  /* no thread state for the watchdog: the call can't be interrupted */
+  if (target != &main_interp && !target->wd_tstate)
+    return;
+  if (target == &main_interp)
+    gil = PyGILState_Ensure();
+  else
+    PyEval_AcquireThread(target->wd_tstate);
+  /* the call may have finished while we waited for the GIL */
+  pthread_mutex_lock(&wd_lock);
+  if (slot->active && slot->seq == seq) {
+    PyThreadState_SetAsyncExc(slot->thread_id, target->pTimeoutError);
+    slot->interrupted = 1;
+    if (slot->overrun >= 0)
+      wd_overruns[slot->overrun].interrupted = 1;
+  }
+  pthread_mutex_unlock(&wd_lock);
+  if (target == &main_interp)
+    PyGILState_Release(gil);
+  else
+    PyEval_ReleaseThread(target->wd_tstate);
+}
+
+static void *wd_main(void *arg) {
+  struct timespec ts;
+  double now, min_budget = 1e9;
+  wd_slot *slot, *victim;
+  wd_overrun *o;
+  long seq = 0;
+  int cb, i;
+
+  for (cb = 0; cb < CB_COUNT; cb++) {
+    if (cb_budgets[cb] > 0.0 && cb_budgets[cb] < min_budget)
+      min_budget = cb_budgets[cb];
+  }
+  /* check four times per budget, but not too often */
+  min_budget /= 4;
+  if (min_budget < 0.001) min_budget = 0.001;
+  if (min_budget > 0.1) min_budget = 0.1;
+  ts.tv_sec = 0;
+  ts.tv_nsec = (long) (min_budget * 1e9);
+
+  while (!wd_stop) {
+    nanosleep(&ts, 0);
+    victim = 0;
+    now = now_seconds();
+    pthread_mutex_lock(&wd_lock);
+    for (i = 0; i < WD_SLOTS; i++) {
+      slot = &wd_slots[i];
+      if (   !slot->active || cb_budgets[slot->cb] <= 0.0
+          || now - slot->start < cb_budgets[slot->cb])
+        continue;
+      if (slot->overrun < 0 && wd_noverruns < WD_OVERRUNS_MAX) {
+        o = &wd_overruns[wd_noverruns];
+        o->cb = slot->cb;
+        snprintf(o->url, sizeof(o->url), "%s%s",
+                 slot->adr ? slot->adr : "", slot->fil ? slot->fil : "");
+        o->seconds = now - slot->start;
+        o->interrupted = 0;
+        slot->overrun = wd_noverruns++;
+      }
+      if (wd_interrupt && !slot->interrupted && !victim) {
+        victim = slot;
+        seq = slot->seq;
+      }
+    }
+    pthread_mutex_unlock(&wd_lock);
+    if (victim)
+      wd_interrupt_call(victim, seq);
+  }
+  return 0;
+}
+
+/* read the settings and start the watchdog.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int start_watchdog(void) {
+  PyObject *d;
+  double deflt = 0.0;
+  int cb, ok = 0;
+
+  memset(cb_budgets, 0, sizeof(cb_budgets));
+  wd_noverruns = 0;
+  if (   !interp->pCallbackClass
+      || !PyObject_HasAttrString(interp->pCallbackClass, "time_budgets"))
+    return 1;
+  d = PyObject_GetAttrString(interp->pCallbackClass, "time_budgets");
+  if (!d)
+    return 0;
+  if (!PyMapping_Check(d)) {
+    PyErr_SetString(PyExc_TypeError,
+                    "time_budgets attribute must be a mapping object");
+    goto done;
+  }
+  if (!mapping_double(d, "__default__", &deflt))
+    goto done;
+  for (cb = 0; cb < CB_COUNT; cb++) {
+    cb_budgets[cb] = deflt;
+    if (!mapping_double(d, cb_names[cb], &cb_budgets[cb]))
+      goto done;
+  }
+  wd_interrupt = get_setting_long("interrupt_overruns",
+                                  "HTTRACK_PY_INTERRUPT_OVERRUNS", 0) > 0;
+  if (!wd_overruns)
+    wd_overruns = malloc(WD_OVERRUNS_MAX * sizeof(wd_overrun));
+  if (!wd_overruns) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  wd_stop = 0;
+  if (pthread_create(&wd_thread, 0, wd_main, 0)) {
+    PyErr_SetString(PyExc_RuntimeError, "can't start the watchdog thread");
+    goto done;
+  }
+  wd_enabled = 1;
+  ok = 1;
+
+done:
+  Py_DECREF(d);
+  return ok;
+}
+
+/* stop the watchdog thread. Called with the GIL held. */
+static void stop_watchdog(void) {
+  if (!wd_enabled)
+    return;
+  wd_stop = 1;
+  /* the watchdog may wait for the GIL */
+  Py_BEGIN_ALLOW_THREADS
+  pthread_join(wd_thread, 0);
+  Py_END_ALLOW_THREADS
+  wd_enabled = 0;
+}
+
+/* a method of the callback cb starts in this thread.
+   return: the slot of the call, or 0, if all slots are used
+*/
+static wd_slot *wd_begin(int cb) {
+  wd_slot *slot = 0;
+  int i;
+
+  pthread_mutex_lock(&wd_lock);
+  for (i = 0; i < WD_SLOTS; i++) {
+    if (!wd_slots[i].active) {
+      slot = &wd_slots[i];
+      break;
+    }
+  }
+  if (slot) {
+    slot->active = 1;
+    slot->seq++;
+    slot->cb = cb;
+    slot->tstate = PyThreadState_Get();
+    slot->thread_id = slot->tstate->thread_id;
+    slot->base = slot->tstate->frame;
+    slot->start = now_seconds();
+    slot->interp = interp;
+    slot->adr = wd_adr;
+    slot->fil = wd_fil;
+    slot->overrun = -1;
+    slot->interrupted = 0;
+  }
+  pthread_mutex_unlock(&wd_lock);
+  return slot;
+}
+
+/* the method has returned */
+static void wd_end(wd_slot *slot) {
+  int interrupted = 0;
+
+  pthread_mutex_lock(&wd_lock);
+  slot->active = 0;
+  if (slot->overrun >= 0)
+    wd_overruns[slot->overrun].seconds = now_seconds() - slot->start;
+  interrupted = slot->interrupted;
+  pthread_mutex_unlock(&wd_lock);
+  if (interrupted) {
+    /* the exception may still be pending, if the method returned
+       before it was raised
+    */
+    PyThreadState_SetAsyncExc(slot->thread_id, 0);
+  }
+}
+
+/* return: [{'callback', 'url', 'seconds', 'interrupted'}] */
+static PyObject *build_overruns(void) {
+  PyObject *res, *d;
+  int i;
+
+  res = PyList_New(0);
+  if (!res)
+    return 0;
+  pthread_mutex_lock(&wd_lock);
+  for (i = 0; i < wd_noverruns; i++) {
+    d = Py_BuildValue("{s:s,s:s,s:d,s:i}",
+                      "callback", cb_names[wd_overruns[i].cb],
+                      "url", wd_overruns[i].url,
+                      "seconds", wd_overruns[i].seconds,
+                      "interrupted", wd_overruns[i].interrupted);
+    if (!d || PyList_Append(res, d)) {
+      Py_XDECREF(d);
+      Py_DECREF(res);
+      res = 0;
+      break;
+    }
+    Py_DECREF(d);
+  }
+  pthread_mutex_unlock(&wd_lock);
+  return res;
+}
+
+/* Sampling profiler.
+
+   If the setting profile_rate (attribute of the first handler, or
+   environment variable HTTRACK_PY_PROFILE_RATE) is greater than 0, or
+   if profile_path (HTTRACK_PY_PROFILE) is set, a thread samples the
+   Python stacks of the running callback methods profile_rate times
+   per second (default: 100). The call slots of the watchdog tell
+   which threads run a method, and where its stack begins.
+
+   Each sample is counted in the "collapsed stack" format used by
+   flame graph tools:
+
+     check_html;check_html (handlers.py:12);parse (util.py:40) 17
+
+   The first element is the callback. When the mirror ends, the counts
+   are written into the file profile_path; httracklib.profile_samples()
+   returns them as a dictionary.
+*/
+
+#define PROF_STACK_SIZE 4096
+
+static int prof_enabled = 0, prof_stop;
+static long prof_rate;
+static char *prof_path = 0;
+static pthread_t prof_thread;
+/* stack -> long *count; protected by the GIL */
+static str_map prof_samples = { 0 };
+
+/* append the stack of the method running in slot to buf */
+static void prof_stack(wd_slot *slot, char *buf, int size) {
+  PyFrameObject *frames[128], *f;
+  PyCodeObject *code;
+  char *file, *sep;
+  int n = 0, len;
+
+  for (f = slot->tstate->frame; f && f != slot->base && n < 128;
+       f = f->f_back)
+    frames[n++] = f;
+  len = snprintf(buf, size, "%s", cb_names[slot->cb]);
+  while (n-- > 0 && len < size) {
+    code = frames[n]->f_code;
+    file = PyString_AsString(code->co_filename);
+    sep = strrchr(file, '/');
+    len += snprintf(buf + len, size - len, ";%s (%s:%i)",
+                    PyString_AsString(code->co_name),
+                    sep ? sep + 1 : file, code->co_firstlineno);
+  }
+}
+
+/* count one sample of each running method. Called with the GIL held */
+static void prof_sample(void) {
+  char stack[PROF_STACK_SIZE];
+  long *count;
+  int i;
+
+  pthread_mutex_lock(&wd_lock);
+  for (i = 0; i < WD_SLOTS; i++) {
+    if (!wd_slots[i].active)
+      continue;
+    prof_stack(&wd_slots[i], stack, sizeof(stack));
+    count = str_map_get(&prof_samples, stack);
+    if (!count) {
+      count = calloc(1, sizeof(long));
+      if (!count || !str_map_put(&prof_samples, stack, count)) {
+        free(count);
+        continue;
+      }
+    }
+    (*count)++;
+  }
+  pthread_mutex_unlock(&wd_lock);
+}
+
+static void *prof_main(void *arg) {
+  PyGILState_STATE gil;
+  struct timespec ts;
+
+  ts.tv_sec = prof_rate == 1;
+  ts.tv_nsec = prof_rate == 1 ? 0 : 1000000000L / prof_rate;
+  while (!prof_stop) {
+    nanosleep(&ts, 0);
+    /* the methods don't run while we hold the GIL; their frames are
+       stable
+    */
+    gil = PyGILState_Ensure();
+    if (!prof_stop)
+      prof_sample();
+    PyGILState_Release(gil);
+  }
+  return 0;
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_profiler(void) {
+  free(prof_path);
+  prof_path = get_setting_string("profile_path", "HTTRACK_PY_PROFILE");
+  prof_rate = get_setting_long("profile_rate", "HTTRACK_PY_PROFILE_RATE",
+                               prof_path ? 100 : 0);
+  if (prof_rate <= 0)
+    return 1;
+  if (prof_rate > 10000)
+    prof_rate = 10000;
+  str_map_free(&prof_samples);
+  if (!str_map_init(&prof_samples, free)) {
+    PyErr_NoMemory();
+    return 0;
+  }
+  prof_stop = 0;
+  if (pthread_create(&prof_thread, 0, prof_main, 0)) {
+    PyErr_SetString(PyExc_RuntimeError, "can't start the profiler thread");
+    return 0;
+  }
+  prof_enabled = 1;
+  return 1;
+}
+
+/* stop the sampling thread, and write the samples into profile_path.
+   Called with the GIL held. The samples are kept for
+   httracklib.profile_samples().
+*/
+static void stop_profiler(void) {
+  unsigned long bucket = 0;
+  str_entry *e = 0;
+  FILE *fp;
+
+  if (!prof_enabled)
+    return;
+  prof_stop = 1;
+  Py_BEGIN_ALLOW_THREADS
+  pthread_join(prof_thread, 0);
+  Py_END_ALLOW_THREADS
+  prof_enabled = 0;
+  if (!prof_path)
+    return;
+  fp = fopen(prof_path, "w");
+  if (!fp) {
+    fprintf(stderr, "httrack-py: can't write the profile %s: %s\n",
+            prof_path, strerror(errno));
+    return;
+  }
+  while ((e = str_map_next(&prof_samples, &bucket, e)))
+    fprintf(fp, "%s %li\n", e->key, *(long *) e->value);
+  fclose(fp);
+}
+
+/* return: {stack: count}, or None, if the profiler was not used */
+static PyObject *build_profile_samples(void) {
+  unsigned long bucket = 0;
+  str_entry *e = 0;
+  PyObject *res, *v;
+
+  if (!prof_samples.buckets) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  res = PyDict_New();
+  if (!res)
+    return 0;
+  while ((e = str_map_next(&prof_samples, &bucket, e))) {
+    v = PyInt_FromLong(*(long *) e->value);
+    if (!v || PyDict_SetItemString(res, e->key, v)) {
+      Py_XDECREF(v);
+      Py_DECREF(res);
+      return 0;
+    }
+    Py_DECREF(v);
+  }
+  return res;
+}
+
+/* Trace of the callbacks and transfers.
+
+   If the first handler has an attribute trace_path, or if the
+   environment variable HTTRACK_PY_TRACE is set, the glue records the
+   timeline of each hts_py_* call: the wait for the GIL, the whole
+   call, and in it the marshalling of the arguments (until the first
+   Python method is called), each Python method, and the unmarshalling
+   of the results (after the last method returned). send_header and
+   transfer_status also record the begin and the end of each transfer.
+   When the mirror ends, the events are written into trace_path in the
+   JSON format of chrome://tracing and Perfetto.
+
+   Each thread records into its own buffer, without locking; at most
+   trace_max_events (HTTRACK_PY_TRACE_MAX_EVENTS; default: 1000000)
+   events per thread are kept.
+*/
+
+enum {
+  TR_GIL, TR_CALLBACK, TR_MARSHAL, TR_PYTHON, TR_UNMARSHAL,
+  TR_TRANSFER_BEGIN, TR_TRANSFER_END
+};
+
+typedef struct {
+  int kind;             /* TR_* constant */
+  int cb;
+  int value;            /* handler index, or HTTP status code */
+  double start, end;
+  char *url;            /* 0, if unknown */
+} trace_event;
+
+typedef struct trace_buffer {
+  trace_event *events;
+  int n, size;
+  int tid;
+  long dropped;
+  struct trace_buffer *next;
+} trace_buffer;
+
+static int trace_enabled = 0;
+static char *trace_path = 0;
+static long trace_max_events;
+static double trace_t0;
+/* all buffers of the current mirror; protected by trace_lock */
+static trace_buffer *trace_buffers = 0;
+static int trace_generation = 0, trace_ntids = 0;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static THREAD_LOCAL trace_buffer *tr_buf = 0;
+static THREAD_LOCAL int tr_generation = 0;
+/* the hts_py_* call running in this thread */
+static THREAD_LOCAL int tr_cb = -1;
+static THREAD_LOCAL double tr_wait, tr_start, tr_first_call, tr_last_end;
+
+static void trace_event_add(int kind, int cb, int value,
+                            double start, double end,
+                            char *adr, char *fil) {
+  trace_buffer *b = tr_buf;
+  trace_event *e;
+  int size;
+
+  if (!b || tr_generation != trace_generation) {
+    b = calloc(1, sizeof(trace_buffer));
+    if (!b)
+      return;
+    pthread_mutex_lock(&trace_lock);
+    b->tid = ++trace_ntids;
+    b->next = trace_buffers;
+    trace_buffers = b;
+    pthread_mutex_unlock(&trace_lock);
+    tr_buf = b;
+    tr_generation = trace_generation;
+  }
+  if (b->n == b->size) {
+    size = b->size ? 2 * b->size : 1024;
+    if (size > trace_max_events)
+      size = trace_max_events;
+    e = b->n < size ? realloc(b->events, size * sizeof(trace_event)) : 0;
+    if (!e) {
+      b->dropped++;
+      return;
+    }
+    b->events = e;
+    b->size = size;
+  }
+  e = &b->events[b->n++];
+  e->kind = kind;
+  e->cb = cb;
+  e->value = value;
+  e->start = start;
+  e->end = end;
+  e->url = adr ? url_key(adr, fil ? fil : "") : 0;
+}
+
+/* an hts_py_* call for the callback cb starts; wait is the time when
+   it started to wait for the GIL
+*/
+static void trace_enter(int cb, double wait) {
+  tr_cb = cb;
+  tr_wait = wait;
+  tr_start = now_seconds();
+  tr_first_call = tr_last_end = 0.0;
+}
+
+/* a Python method of the current call ran from start to end */
+static void trace_method(cb_stage *stage, double start, double end) {
+  if (tr_cb < 0)
+    return;
+  trace_event_add(TR_PYTHON, stage->cb, stage->index, start, end, 0, 0);
+  if (tr_first_call == 0.0)
+    tr_first_call = start;
+  tr_last_end = end;
+}
+
+/* the current hts_py_* call ends; adr and fil are its URL, if known */
+static void trace_leave(char *adr, char *fil) {
+  double end = now_seconds();
+
+  if (tr_cb < 0 || !trace_enabled) {
+    tr_cb = -1;
+    return;
+  }
+  if (tr_start > tr_wait)
+    trace_event_add(TR_GIL, tr_cb, 0, tr_wait, tr_start, 0, 0);
+  trace_event_add(TR_CALLBACK, tr_cb, 0, tr_start, end, adr, fil);
+  if (tr_first_call > 0.0) {
+    trace_event_add(TR_MARSHAL, tr_cb, 0, tr_start, tr_first_call, 0, 0);
+    trace_event_add(TR_UNMARSHAL, tr_cb, 0, tr_last_end, end, 0, 0);
+  }
+  tr_cb = -1;
+}
+
+static void trace_transfer(int kind, char *adr, char *fil, int status) {
+  double now = now_seconds();
+  trace_event_add(kind, CB_TRANSFER_STATUS, status, now, now, adr, fil);
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_trace(void) {
+  free(trace_path);
+  trace_path = get_setting_string("trace_path", "HTTRACK_PY_TRACE");
+  if (!trace_path)
+    return 1;
+  trace_max_events = get_setting_long("trace_max_events",
+                                      "HTTRACK_PY_TRACE_MAX_EVENTS",
+                                      1000000);
+  trace_t0 = now_seconds();
+  trace_enabled = 1;
+  return 1;
+}
+
+static void trace_write_string(FILE *fp, char *s) {
+  fputc('"', fp);
+  for (; *s; s++) {
+    if (*s == '"' || *s == '\\')
+      fprintf(fp, "\\%c", *s);
+    else if ((unsigned char) *s < 0x20)
+      fprintf(fp, "\\u%04x", (unsigned char) *s);
+    else
+      fputc(*s, fp);
+  }
+  fputc('"', fp);
+}
+
+static void trace_write_event(FILE *fp, trace_event *e, int pid, int tid) {
+  static char *names[] = {
+    "gil", 0, "marshal", "python", "unmarshal", "transfer", "transfer"
+  };
+  double ts = (e->start - trace_t0) * 1e6;
+
+  fprintf(fp, "{\"name\":\"%s\",\"pid\":%i,\"tid\":%i,\"ts\":%.3f,",
+          e->kind == TR_CALLBACK ? cb_names[e->cb] : names[e->kind],
+          pid, tid, ts);
+  switch (e->kind) {
+  case TR_TRANSFER_BEGIN:
+  case TR_TRANSFER_END:
+    fprintf(fp, "\"cat\":\"transfer\",\"ph\":\"%s\",\"id\":\"0x%lx\","
+                "\"args\":{",
+            e->kind == TR_TRANSFER_BEGIN ? "b" : "e",
+            e->url ? str_hash(e->url) : 0UL);
+    if (e->kind == TR_TRANSFER_END)
+      fprintf(fp, "\"statuscode\":%i,", e->value);
+    fprintf(fp, "\"url\":");
+    trace_write_string(fp, e->url ? e->url : "");
+    fprintf(fp, "}}");
+    break;
+  default:
+    fprintf(fp, "\"cat\":\"%s\",\"ph\":\"X\",\"dur\":%.3f,\"args\":{",
+            e->kind == TR_CALLBACK ? "callback" : "glue",
+            (e->end - e->start) * 1e6);
+    if (e->kind == TR_PYTHON)
+      fprintf(fp, "\"handler\":%i", e->value);
+    if (e->url) {
+      fprintf(fp, "\"url\":");
+      trace_write_string(fp, e->url);
+    }
+    fprintf(fp, "}}");
+  }
+}
+
+/* write the trace into trace_path, and free the buffers. Called, when
+   no callback runs anymore.
+*/
+static void stop_trace(void) {
+  trace_buffer *b, *next;
+  FILE *fp;
+  int i, pid = getpid(), first = 1;
+  long dropped = 0;
+
+  if (!trace_enabled)
+    return;
+  trace_enabled = 0;
+  fp = fopen(trace_path, "w");
+  if (!fp)
+    fprintf(stderr, "httrack-py: can't write the trace %s: %s\n",
+            trace_path, strerror(errno));
+  else
+    fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  for (b = trace_buffers; b; b = next) {
+    next = b->next;
+    if (fp) {
+      fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%i,"
+                  "\"tid\":%i,\"args\":{\"name\":\"httrack thread %i\"}}",
+              first ? "" : ",\n", pid, b->tid, b->tid);
+      first = 0;
+    }
+    for (i = 0; i < b->n; i++) {
+      if (fp) {
+        fprintf(fp, ",\n");
+        trace_write_event(fp, &b->events[i], pid, b->tid);
+      }
+      free(b->events[i].url);
+    }
+    dropped += b->dropped;
+    free(b->events);
+    free(b);
+  }
+  trace_buffers = 0;
+  trace_ntids = 0;
+  trace_generation++;
+  if (fp) {
+    fprintf(fp, "\n]}\n");
+    fclose(fp);
+  }
+  if (dropped)
+    fprintf(stderr, "httrack-py: %li trace events dropped "
+                    "(trace_max_events)\n", dropped);
+}
+
+static PyObject *record_begin(PyObject *args);
+static void record_stage(cb_stage *stage, PyObject *pArgs, PyObject *pRes,
+                         double start, double end);
+
+/* call the method of one stage. args may be 0 for methods without
+   parameters.
+   return: new reference to the result, or 0, if the method raised
+           an exception
+*/
+static PyObject *call_stage(cb_stage *stage, PyObject *args) {
+  PyObject *pRes;
+  wd_slot *slot = 0;
+  /* the arguments are recorded before the method can change them */
+  PyObject *pRecArgs = record_begin(args);
+  double start = now_seconds(), end;
+
+  if ((wd_enabled && cb_budgets[stage->cb] > 0.0) || prof_enabled)
+    slot = wd_begin(stage->cb);
+  pRes = PyObject_CallObject(stage->meth, args);
+  if (slot)
+    wd_end(slot);
+  end = now_seconds();
+  stage->seconds += end - start;
+  if (trace_enabled)
+    trace_method(stage, start, end);
+  if (pRecArgs)
+    record_stage(stage, pRecArgs, pRes, start, end);
+  stage->calls++;
+  interp->pCurrentHandler = pRes ? 0 : stage->handler;
+  if (pRes)
+    breaker_success(stage->cb);
+  else
+    breaker_failure(stage->cb);
+  return pRes;
+}
+
+#ifdef PLUGIN
+/* import the Python module with the callback classes into the current
+   interpreter, and call its function register().
+   return: new reference to the result of register(), or 0, if an error
+           occured. Python errors are already printed.
+*/
+static PyObject *load_handlers(int called_from_plugin_init) {
+    PyObject *pString, *dict, *syspath, *reg, *v;
+    PyObject *pHttrackModule, *pSysModule;
+    char *modname, *cc = 0;
+
+    /* sys.path contains only the "system library" paths, but not 
+       the current directory, which we need
+    */
+    pString = PyString_FromString("sys");
+    if (!pString) {
+      PyErr_Print();
+      return 0;
+    }
+    pSysModule = PyImport_Import(pString);
+    Py_DECREF(pString);
+    if (!pSysModule) {
+      PyErr_Print();
+      return 0;
+    }
+    
+    dict = PyModule_GetDict(pSysModule);
+    syspath = PyDict_GetItemString(dict, "path");
+    
+    modname = getenv("HTTRACK_PYTHON");
+    /* if the module name contains at least one '/', we assume that
+       a complete path is specified
+    */
+    if (modname) {
+      cc = rindex(modname, '/');
+      if (cc) {
+        *cc = 0;
+        pString = PyString_FromString(modname);
+        *cc = '/';
+      }
+    }
+    if (!cc) {
+      /* default path for the httrack module is the current directory */
+      pString = PyString_FromString(".");
+    }
+    if (!pString) {
+      PyErr_Print();
+      Py_DECREF(pSysModule);
+      return 0;
+    }
+
+    PyList_Append(syspath, pString);
+    Py_DECREF(pString);
+
+    if (!modname) {
+      modname = default_py_name;
+    }
+    else if (cc) {
+      modname = cc+1;
+    }
+    
+    /* a possible '.py' suffix should be removed */
+    cc = rindex(modname, '.');
+    if (cc) {
+      if (0 == strcmp(cc, ".py")) {
+        *cc = 0;
+      }
+    }
+    pString = PyString_FromString(modname);
+    if (!pString) {
+      PyErr_Print();
+      Py_DECREF(pSysModule);
+      return 0;
+    }
+
+    pHttrackModule = PyImport_Import(pString);
+    Py_DECREF(pString);
+    if (!pHttrackModule) {
+      int import_error = PyErr_ExceptionMatches(PyExc_ImportError);
+      PyErr_Print();
+      Py_DECREF(pSysModule);
+      /* check the error. If no module is found, we'll get
+         'ImportError: No module named httrack'
+         This is NOT a reason to abort the mirror, if all of the following
+         conditions are met:
+         1. this library is httrack's default plugin
+         2. the environment variable HTTRACK_PYTHON is not set
+         3. this function is called from plugin_init
+
+         All other conditions and all other errors should cause an abortion
+         of the mirror. 
+      */
+      if (   import_error
+          && !getenv("HTTRACK_PYTHON")
+          && called_from_plugin_init) {
+        abort_in_start_callback = 0;
+      }
+      return 0;
+    }
+    
+    /* now get the Python "callback class" instance */
+    dict = PyModule_GetDict(pHttrackModule);
+    v = PyInt_FromLong(IMMEDIATE_STOP);
+    PyDict_SetItemString(dict, "IMMEDIATE_STOP", v);
+    Py_DECREF(v);
+    
+    v = PyInt_FromLong(REGULAR_STOP);
+    PyDict_SetItemString(dict, "REGULAR_STOP", v);
+    Py_DECREF(v);
+    
+    v = PyInt_FromLong(IGNORE_EXCEPTION);
+    PyDict_SetItemString(dict, "IGNORE_EXCEPTION", v);
+    Py_DECREF(v);
+    fprintf(stderr, "initialzes xxxx\n");
+
+    reg = PyDict_GetItemString(dict, "register");
+    if (!reg) {
+      fprintf(stderr, 
+        "htrack-py error: Python module %s does not have a function\n"
+        "named register\n", modname);
+        Py_DECREF(pSysModule);
+        Py_DECREF(pHttrackModule);
+        return 0;
+    }
+    if (!PyCallable_Check(reg)) {
+      fprintf(stderr, 
+        "httrack-py error: %s.register is not callable\n", modname);
+      Py_DECREF(pSysModule);
+      Py_DECREF(pHttrackModule);
+      return 0;
+    }
+    v = PyObject_CallObject(reg, 0);
+    if (!v) {
+      PyErr_Print();
+    }
+    Py_DECREF(pSysModule);
+    Py_DECREF(pHttrackModule);
+    return v;
+}
+#endif
+
+/* return: 1 on success; 0 if an error occured */
+#ifdef PLUGIN
+static int initialize(int called_from_plugin_init) {
+  /* init the Python interpreter
+  */
+    PyObject *v;
+#else
+static int initialize(PyObject* cbInst) {
+#endif
+  int res = 1;
+  stop_on_next_callback = 0;
+  #ifdef PLUGIN
+    if (is_initialized) {
+      return 1;
+    }
+    is_initialized = 1;
+    Py_Initialize();
+    PyEval_InitThreads();
+    main_thread = pthread_self();
+    abort_in_start_callback = 1;
+    if (!create_lib_module()) {
+      PyErr_Print();
+      return 0;
+    }
+    v = load_handlers(called_from_plugin_init);
+    if (!v) {
+      return 0;
+    }
+    if (!setup_pipelines(v)) {
+      PyErr_Print();
+      free_pipelines();
+      Py_XDECREF(interp->pHandlers);
+      interp->pHandlers = interp->pCallbackClass = 0;
+      return 0;
+    }
+    htswrap_add("end", hts_py_end);
+    use_subinterpreters = get_setting_long("subinterpreters",
+                                           "HTTRACK_PY_SUBINTERPRETERS", 0) > 0;
+
+  #else
+    Py_INCREF(cbInst);
+    if (!setup_pipelines(cbInst)) {
+      free_pipelines();
+      Py_XDECREF(interp->pHandlers);
+      interp->pHandlers = interp->pCallbackClass = 0;
+      return 0;
+    }
+    HOOK(hts_py_start, start, start);
+  #endif
+  interp->httrackError = PyErr_NewException("httrack.error", 0, 0);
+  Py_INCREF(interp->httrackError);
+  // xxx set pCallbackClass from function param, if this is an exenstion class
+
+  HOOK(hts_py_end, end, end);
+  HOOK(hts_py_change_options, change-options, change_options);
+  HOOK(hts_py_check_html, check-html, check_html);
+  HOOK(hts_py_preprocess_html, preprocess-html, preprocess_html);
+  HOOK(hts_py_postprocess_html, postprocess-html, postprocess_html);
+  /* xxx not yet implemented HOOK(hts_py_query, query, query); */
+  HOOK(hts_py_query2, query2, query2);
+  HOOK(hts_py_query3, query3, query3);
+  HOOK(hts_py_loop, loop, loop);
+  HOOK(hts_py_checklink, check-link, check_link);
+  HOOK(hts_py_pause, pause, pause)
+  HOOK(hts_py_save_file, save-file, save_file);
+  HOOK(hts_py_link_detected, link-detected, link_detected);
+  HOOK(hts_py_link_detected2, link-detected2, link_detected2);
+  HOOK(hts_py_transfer_status, transfer-status, transfer_status);
+  HOOK(hts_py_save_name, save-name, save_name);
+  HOOK(hts_py_send_header, send-header, send_header);
+  HOOK(hts_py_receive_header, receive-header, receive_header);
+
+  if (   !start_workers() || !start_feed() || !start_validators()
+      || !start_host_limits() || !start_controller()
+      || !start_decision_cache() || !start_breakers()
+      || !start_watchdog() || !start_profiler() || !start_trace()
+      || !start_metrics() || !start_event_log() || !start_warc()
+      || !start_pack() || !start_pages() || !start_extract()
+      || !start_near_duplicates() || !start_record() || !start_audit()) {
+  #ifdef PLUGIN
+    PyErr_Print();
+  #endif
+    res = 0;
+  }
+
+  #ifdef PLUGIN
+    abort_in_start_callback = 0;
+  #endif
+
+  return res;
+}
+
+#ifdef PLUGIN
+/* initialize the plugin. Afterwards, the GIL is released; the
+   hts_py_* functions acquire it when needed.
+*/
+static int initialize_plugin(int called_from_plugin_init) {
+  int res;
+  if (is_initialized)
+    return 1;
+  res = initialize(called_from_plugin_init);
+  PyEval_SaveThread();
+  return res;
+}
+
+void plugin_init() {
+  int res;
+  res = initialize_plugin(1);
+  /* we need the start callback in any case, because plugin_init
+     can't bort the mirror
+  */
+  htswrap_add("start", hts_py_start);
+}
+#endif
+
+/* Memory audit.
+
+   If the setting audit_interval (attribute of the first handler, or
+   environment variable HTTRACK_PY_AUDIT) is greater than 0, every
+   audit_interval-th call of each callback is audited: the number of
+   objects tracked by Python's garbage collector and the resident set
+   size of the process are taken after the hts_py_* function acquired
+   the GIL, and again before it releases it. The differences are
+   summed per callback, so a callback which leaves objects behind
+   shows a steady growth in httracklib.audit_stats(). When the mirror
+   ends, the callbacks with a growth are reported on stderr.
+
+   Python 2 has no tracemalloc; the RSS is the nearest measure of the
+   memory not held by Python objects. Counting the objects walks all
+   of them, so choose audit_interval according to the size of the
+   heap.
+*/
+
+typedef struct {
+  long calls, audited;
+  LLint objects, rss;   /* sums of the differences */
+} audit_counter;
+
+static long audit_interval = 0;
+static audit_counter audit_counters[CB_COUNT];
+
+/* the audited call of this thread; protected by the GIL */
+static THREAD_LOCAL int au_cb = -1;
+static THREAD_LOCAL Py_ssize_t au_objects;
+static THREAD_LOCAL long au_rss;
+
+/* return: the number of objects tracked by the garbage collector, or
+           -1. Called with the GIL held; a pending Python error is
+           kept.
+*/
+static Py_ssize_t audit_count_objects(void) {
+  PyObject *type, *value, *tb, *gc, *list;
+  Py_ssize_t n = -1;
+
+  PyErr_Fetch(&type, &value, &tb);
+  gc = PyImport_ImportModule("gc");
+  list = gc ? PyObject_CallMethod(gc, "get_objects", 0) : 0;
+  if (list && PyList_Check(list))
+    n = PyList_GET_SIZE(list);
+  Py_XDECREF(list);
+  Py_XDECREF(gc);
+  PyErr_Clear();
+  PyErr_Restore(type, value, tb);
+  return n;
+}
+
+/* return: the resident set size in bytes, or 0, if it is not known */
+static long audit_rss(void) {
+  FILE *f = fopen("/proc/self/statm", "r");
+  long pages = 0;
+
+  if (!f)
+    return 0;
+  if (fscanf(f, "%*s %ld", &pages) != 1)
+    pages = 0;
+  fclose(f);
+  return pages * sysconf(_SC_PAGESIZE);
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_audit(void) {
+  audit_interval = get_setting_long("audit_interval", "HTTRACK_PY_AUDIT", 0);
+  if (audit_interval < 0)
+    audit_interval = 0;
+  memset(audit_counters, 0, sizeof(audit_counters));
+  return 1;
+}
+
+static void stop_audit(void) {
+  audit_counter *c;
+  int cb;
+
+  for (cb = 0; audit_interval && cb < CB_COUNT; cb++) {
+    c = &audit_counters[cb];
+    /* the RSS grows in pages, so small differences are noise */
+    if (c->audited && (c->objects > 0 || c->rss >= 1024 * 1024))
+      fprintf(stderr, "httrack-py audit: %s: %.2f objects, %.0f bytes RSS "
+                      "per call (%li of %li calls audited)\n", cb_names[cb],
+              (double) c->objects / c->audited,
+              (double) c->rss / c->audited, c->audited, c->calls);
+  }
+  audit_interval = 0;
+}
+
+/* called by enter_python, with the GIL held */
+static void audit_enter(int cb) {
+  if (!audit_interval || au_cb >= 0)
+    return;
+  if (audit_counters[cb].calls++ % audit_interval)
+    return;
+  au_cb = cb;
+  au_objects = audit_count_objects();
+  au_rss = audit_rss();
+}
+
+/* called by leave_python, with the GIL held */
+static void audit_leave(void) {
+  audit_counter *c;
+  Py_ssize_t n;
+
+  if (au_cb < 0)
+    return;
+  c = &audit_counters[au_cb];
+  au_cb = -1;
+  n = audit_count_objects();
+  if (n < 0 || au_objects < 0)
+    return;
+  c->audited++;
+  c->objects += n - au_objects;
+  c->rss += audit_rss() - au_rss;
+}
+
+/* return: None, if audit_interval was not used, else a dictionary
+           callback name -> {'calls', 'audited', 'objects', 'rss'},
+           where objects and rss are the summed growth
+*/
+static PyObject *build_audit_stats(void) {
+  PyObject *res, *v;
+  audit_counter *c;
+  int cb;
+
+  for (cb = 0; cb < CB_COUNT && !audit_counters[cb].calls; cb++) ;
+  if (cb == CB_COUNT) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  res = PyDict_New();
+  for (cb = 0; res && cb < CB_COUNT; cb++) {
+    c = &audit_counters[cb];
+    if (!c->calls)
+      continue;
+    v = Py_BuildValue("{s:l,s:l,s:L,s:L}", "calls", c->calls,
+                      "audited", c->audited, "objects", c->objects,
+                      "rss", c->rss);
+    if (!v || PyDict_SetItemString(res, cb_names[cb], v)) {
+      Py_XDECREF(v);
+      Py_DECREF(res);
+      return 0;
+    }
+    Py_DECREF(v);
+  }
+  return res;
+}
+
+/* GIL handling and subinterpreters.
+
+   The hts_py_* functions may be called by any httrack thread. They
+   acquire the GIL with enter_python() and release it with
+   leave_python(). In the plugin, the GIL is released after the
+   initialization; in the extension module, httracklib.httrack()
+   releases it while the httrack engine runs.
+
+   In the plugin, the setting subinterpreters (attribute of the first
+   handler or environment variable HTTRACK_PY_SUBINTERPRETERS) allows
+   to run the callbacks of each httrack thread, except the thread that
+   initialized the plugin, in a separate subinterpreter. The
+   subinterpreter is created, when the thread calls one of the hts_py_*
+   functions for the first time; it imports the callback module and
+   calls register(), exactly like the main interpreter.
+
+   NOTE: The subinterpreters of Python 2 share the GIL, so they isolate
+   the callback handlers of the threads, but the callbacks still run
+   one at a time.
+*/
+
+#ifdef PLUGIN
+/* create a subinterpreter for the current thread.
+   return: the subinterpreter, with the GIL held, or 0, if an error
+           occured (the GIL is not held)
+*/
+static py_interp *new_subinterpreter(void) {
+  py_interp *sub;
+  PyObject *v = 0;
+
+  sub = calloc(1, sizeof(py_interp));
+  if (!sub)
+    return 0;
+  PyEval_AcquireLock();
+  sub->tstate = Py_NewInterpreter();
+  if (!sub->tstate) {
+    PyEval_ReleaseLock();
+    free(sub);
+    return 0;
+  }
+  interp = sub;
+  if (create_lib_module()) {
+    v = load_handlers(0);
+  }
+  if (   !v || !setup_pipelines(v)
+      || !(sub->httrackError = PyErr_NewException("httrack.error", 0, 0))) {
+    if (PyErr_Occurred())
+      PyErr_Print();
+    free_pipelines();
+    Py_XDECREF(sub->pHandlers);
+    Py_EndInterpreter(sub->tstate);
+    PyEval_ReleaseLock();
+    interp = &main_interp;
+    free(sub);
+    return 0;
+  }
+  /* if this fails, overruns in this interpreter are not interrupted;
+     see wd_interrupt_call()
+  */
+  sub->wd_tstate = PyThreadState_New(sub->tstate->interp);
+  sub->next = subinterpreters;
+  subinterpreters = sub;
+  return sub;
+}
+#endif
+
+static PyGILState_STATE acquire_python(void) {
+#ifdef PLUGIN
+  if (use_subinterpreters && !pthread_equal(pthread_self(), main_thread)) {
+    if (interp != &main_interp) {
+      PyEval_RestoreThread(interp->tstate);
+      return PyGILState_UNLOCKED;
+    }
+    if (!no_subinterpreter) {
+      if (new_subinterpreter())
+        return PyGILState_UNLOCKED;
+      no_subinterpreter = 1;
+      fprintf(stderr, "httrack-py: can't create a subinterpreter. "
+                      "Using the main interpreter\n");
+    }
+  }
+#endif
+  return PyGILState_Ensure();
+}
+
+/* acquire the GIL for the hts_py_* function of the callback cb */
+static PyGILState_STATE enter_python(int cb) {
+  double wait = trace_enabled ? now_seconds() : 0.0;
+  PyGILState_STATE gil;
+
+  metrics_enter(cb);
+  gil = acquire_python();
+
+  if (trace_enabled)
+    trace_enter(cb, wait);
+  audit_enter(cb);
+  return gil;
+}
+
+static void leave_python(PyGILState_STATE gil) {
+  audit_leave();
+  trace_leave(wd_adr, wd_fil);
+  metrics_leave();
+  watch_url(0, 0);
+  if (interp != &main_interp) {
+    interp->tstate = PyEval_SaveThread();
+    return;
+  }
+  PyGILState_Release(gil);
+}
+
+/* error handler. This handler is called, either if a callback
+   class method raises an exception, or if an error occurs in this
+   library. 
+   
+   If the callback class defines a method error_handler
+   (def error_handler(self, callback_name, error_object, error_val)), 
+   delegate the decision to continue or abort to this method. 
+   
+   Otherwise:
+   
+   call PyErr_Print() to provide some information to the user.
+ 
+   If the callback class has an attribute error_policy (must be a 
+   dictionary), decide what to do according to that policy
+   
+   Otherwise:
+   check the value of the environment variable HTTRACK_PY_NO_STOP_ON_ERROR. 
+   If it is defined, continue the mirror process, else abort.
+   
+   (Many program check first for an environment variable, and then look
+   for some other definitions, e.g. in a config file. If you prefer
+   this behaviour, check for an environment variable in the error
+   handler of the cllback class.)
+   
+   Some callbacks do not allow to abort the mirror. If an error occured
+   in such a callback, the error handler of the callback class
+   can be used to record the occurence of the error in an attribute,
+   and the next callback allowing to abort the mirror can decide, what
+   to do. This library does not attempt to abort the mirror later.
+   
+*/
+
+static int process_error(char *cbname) {
+  PyObject *pType, *pValue, *pTraceback, *meth, *args, *pRes, *dict;
+  /* errors raised by a stage are handled by its own handler; errors
+     raised by this library by the first handler
+  */
+  PyObject *pHandler = interp->pCurrentHandler ? interp->pCurrentHandler
+                                                : interp->pCallbackClass;
+  int res, print;
+  char *cc, *cc1;
+
+  interp->pCurrentHandler = 0;
+  /* save the error data first; it will be cleared by the 
+     PyObject_HasAttrString call below
+  */
+  PyErr_Fetch(&pType, &pValue, &pTraceback);
+  PyErr_NormalizeException(&pType, &pValue, &pTraceback);
+  print = record_error(cbname, pType, pValue);
+  if (pHandler && PyObject_HasAttrString(pHandler, "error_handler")) {
+    meth = PyObject_GetAttrString(pHandler, "error_handler");
+    args = meth ? Py_BuildValue("(sOOO)", cbname,
+                                pType ? pType : Py_None,
+                                pValue ? pValue : Py_None,
+                                pTraceback ? pTraceback : Py_None)
+                : 0;
+    Py_XDECREF(pType);
+    Py_XDECREF(pValue);
+    Py_XDECREF(pTraceback);
+    pRes = args ? PyObject_CallObject(meth, args) : 0;
+    Py_XDECREF(meth);
+    Py_XDECREF(args);
+    if (pRes) {
+      /* a result other than a valid int is considered a serious
+         error -- an error handler should not produce its own error
+      */
+      res = PyInt_Check(pRes) ? PyInt_AsLong(pRes) : IMMEDIATE_STOP;
+      Py_DECREF(pRes);
+      if (res < IMMEDIATE_STOP || res > IGNORE_EXCEPTION)
+        return IMMEDIATE_STOP;
+      return res;
+    }
+    /* if we arrive here, an error occured during error handling.
+       Let's stop immediately
+    */
+    PyErr_Print();
+    fprintf(stderr, "this error occurred during error handling. trying to abort\n");
+    return IMMEDIATE_STOP;
+  }
+
+  PyErr_Restore(pType, pValue, pTraceback);
+  if (print)
+    PyErr_Print();
+  else
+    PyErr_Clear();
+  res = REGULAR_STOP;
+  cc = getenv("HTTRACK_PY_ERROR_POLICY");
+  if (cc) {
+    res = strtol(cc, &cc1, 10);
+    if (cc == cc1 || -1 > res || res > 1 ) {
+      fprintf(stderr, "invalid value for HTTRACK_PY_ERROR_POLICY.\n");
+      res = IMMEDIATE_STOP;
+    }
+  }
+  
+  /* try to use the error_policy attribute in the callback class */
+  if (pHandler && PyObject_HasAttrString(pHandler, "error_policy")) {
+    dict = PyObject_GetAttrString(pHandler, "error_policy");
+    if (dict) {
+      if (!PyMapping_Check(dict)) {
+        fprintf(stderr, "error_policy attribute must be a mapping object\n");
+        Py_DECREF(dict);
+        return IMMEDIATE_STOP;
+      }
+      if (PyMapping_HasKeyString(dict, "__default__")) {
+        pRes = PyMapping_GetItemString(dict, "__default__");
+        if (pRes) {
+          res = PyInt_AsLong(pRes);
+          Py_DECREF(pRes);
+          if (-1 > res || res > 1) {
+            fprintf(stderr, "invalid value for error_policy['__default__']. ");
+            res = IMMEDIATE_STOP;
+          }
+        }
+        else {
+          PyErr_Print();
+          fprintf(stderr, "this error occurred during error handling. Will probably abort\n");
+          res = IMMEDIATE_STOP;
+        }
+      }
+      if (PyMapping_HasKeyString(dict, cbname)) {
+        pRes = PyMapping_GetItemString(dict, cbname);
+        if (pRes) {
+          res = PyInt_AsLong(pRes);
+          Py_DECREF(pRes);
+          if (-1 > res || res > 1) {
+            fprintf(stderr, "invalid value for error_policy['%s']. ", cbname);
+            res = IMMEDIATE_STOP;
+          }
+        }
+        else {
+          PyErr_Print();
+          fprintf(stderr, "this error occurred during error handling. Will probably abort\n");
+          res = IMMEDIATE_STOP;
+        }
+      }
+      Py_DECREF(dict);
+      return res;
+    }
+    /* if we arrive here, an error occured during error handling.
+       Let's stop immediately
+    */
+    PyErr_Print();
+    fprintf(stderr, "this error occurrd during error handling. Trying to abort\n");
+    return IMMEDIATE_STOP;
+  }
+  return res;
+}
+
+/* for callbacks that return 0 for "stop mirror" and 1 for "continue"
+*/
+static int process_error_direct(char *cbname) {
+  int res = process_error(cbname);
+  if (res == IMMEDIATE_STOP) 
+    return REGULAR_STOP;
+  return res;
+}
+
+/* for callbacks  that have other return value
+*/
+static void process_error_indirect(char *cbname) {
+  int res = process_error(cbname);
+  if (res == IMMEDIATE_STOP) 
+    exit(-1);
+  if (res == REGULAR_STOP)
+    stop_on_next_callback = 1;
+}
+
+// xxxxxxxxxxxxxx change error behaviour: raise an exception,
+// if the variable type is wrong
+
+#define setAnyItem(pydict, field)   if (!tmp) return 0; \
+                        if (PyDict_SetItemString(pydict, #field, tmp) == -1) { \
+                          Py_DECREF(tmp); \
+                          return 0; \
+                        } \
+                        Py_DECREF(tmp); 
+
+#define setIntItem(pydict, cstruct, field) { PyObject *tmp; \
+                        tmp = PyInt_FromLong(cstruct->field); \
+                        setAnyItem(pydict, field) \
+                      }
+
+#define setIntItem2(pydict, intname, field) { PyObject *tmp; \
+                        tmp = PyInt_FromLong(intname); \
+                        setAnyItem(pydict, field) \
+                      }
+
+/* xxx LLint may be defined as 'long long int', and for this
+   type we don't have a proper conversion function in the Python/C API
+   
+   We ignore this problem, and use simply PyLong_FromLong
+*/
+#define setLLIntItem(pydict, cstruct, field) { PyObject *tmp; \
+                          tmp = PyLong_FromLong(cstruct->field); \
+                          setAnyItem(pydict, field) \
+                        }
+
+#define setFloatItem(pydict, cstruct, field) { PyObject *tmp; \
+                          tmp = PyFloat_FromDouble(cstruct->field); \
+                          setAnyItem(pydict, field) \
+                        }
+
+#define setStringItem(pydict, cstruct, field) { PyObject *tmp; \
+                           tmp = PyString_FromString(cstruct->field); \
+                           setAnyItem(pydict, field) \
+                         }
+
+#define getIntItem(pydict, cstruct, field) { PyObject *tmp; \
+                        tmp = PyDict_GetItemString(pydict, #field); \
+                        if (tmp && PyInt_Check(tmp)) { \
+                          cstruct->field = PyInt_AsLong(tmp); \
+                        } \
+                        else { \
+                          if (tmp) { \
+                            PyErr_SetString(interp->httrackError, \
+                              "wrong type for option dict entry " #field); \
+                          } \
+                          else { \
+                            PyErr_SetString(interp->httrackError, \
+                              "value for key " #field " is missing"); \
+                          } \
+                        } \
+                      }
+
+#define getLLIntItem(pydict, cstruct, field) { PyObject *tmp; \
+                          tmp = PyDict_GetItemString(pydict, #field); \
+                          if (tmp && PyLong_Check(tmp)) { \
+                            cstruct->field = PyLong_AsLong(tmp); \
+                          } \
+                          else { \
+                            if (tmp) { \
+                              PyErr_SetString(interp->httrackError, \
+                                "wrong type for option dict entry " #field); \
+                            } \
+                            else { \
+                              PyErr_SetString(interp->httrackError, \
+                                "value for key " #field " is missing"); \
+                            } \
+                          } \
+                        } 
+
+#define getFloatItem(pydict, cstruct, field) { PyObject *tmp; \
+                          tmp = PyDict_GetItemString(pydict, #field); \
+                          if (tmp && PyFloat_Check(tmp)) { \
+                            cstruct->field = PyFloat_AsDouble(tmp); \
+                          } \
+                          else { \
+                            if (tmp) { \
+                              PyErr_SetString(interp->httrackError, \
+                                "wrong type for option dict entry " #field); \
+                            } \
+                            else { \
+                              PyErr_SetString(interp->httrackError, \
+                                "value for key " #field " is missing"); \
+                            } \
+                          } \
+                        }
+
+#define getStringItem(pydict, cstruct, field, maxsize) { PyObject *tmp; \
+                      tmp = PyDict_GetItemString(pydict, #field); \
+                      if (tmp && PyString_Check(tmp)) { \
+                        int size, psize = PyString_Size(tmp); \
+                        size = (psize < maxsize) ? psize : maxsize; \
+                        strncpy(cstruct->field, PyString_AsString(tmp), size); \
+                      } \
+                          else { \
+                            if (tmp) { \
+                              PyErr_SetString(interp->httrackError, \
+                                "wrong type for option dict entry " #field); \
+                            } \
+                            else { \
+                              PyErr_SetString(interp->httrackError, \
+                                "value for key " #field " is missing"); \
+                            } \
+                          } \
+                    }
+
+#ifdef HTS_INTERNAL_BYTECODE
+static PyObject *set_cookies(t_cookie *cookies) {
+  /* return: (cookies, auth_data) or a null pointer, if an error occurs
+     where: cookies is a list of singlecookies,
+              and each cookie is a list of strings
+            auth_data is a list of 2-tuples, containing the "prefix" and user:ass
+            (see htsbauth.[ch] for details
+  */
+  PyObject *res, *pAllCookies, *pAuth, *pCookie, *s, *s2, *t;
+  char *c1, *c2;
+  bauth_chain *auth;
+  int i;
+  
+  pAllCookies = PyList_New(0);
+  if (!pAllCookies) {
+    return 0;
+  }
+  
+  pAuth = PyList_New(0);
+  if (!pAuth) {
+    Py_DECREF(pAllCookies);
+    return 0;
+  }
+
+  res = PyTuple_New(2);
+  if (!res) {
+    Py_DECREF(pAllCookies);
+    Py_DECREF(pAuth);
+    return 0;
+  }
+  
+  PyTuple_SetItem(res, 0, pAllCookies);
+  PyTuple_SetItem(res, 1, pAuth);
+  
+  c1 = cookies->data;
+  while (*c1) {
+    i = 0;
+    pCookie = PyList_New(0);
+    if (!pCookie) {
+      Py_DECREF(res);
+      return 0;
+    }
+    if (PyList_Append(pAllCookies, pCookie)) {
+      Py_DECREF(res);
+      Py_DECREF(pCookie);
+      return 0;
+    }
+    Py_DECREF(pCookie);
+
+    while (strcmp(c2=cookie_get(c1, i++), "")) {
+      s = PyString_FromString(c2);
+      if (!s) {
+        Py_DECREF(res);
+        return 0;
+      }
+      if (PyList_Append(pCookie, s)) {
+        Py_DECREF(res);
+        Py_DECREF(s);
+        return 0;
+      }
+      Py_DECREF(s);
+    }
+    
+    c1 = cookie_nextfield(c1);
+  }
+  
+  auth = &cookies->auth;
+  while (auth) {
+    s = PyString_FromString(auth->prefix);
+    if (!s) {
+      Py_DECREF(res);
+      return 0;
+    }
+    
+    s2 = PyString_FromString(auth->auth);
+    if (!s2) {
+      Py_DECREF(res);
+      Py_DECREF(s);
+      return 0;
+    }
+    
+    t = PyTuple_New(2);
+    if (!t) {
+      Py_DECREF(res);
+      Py_DECREF(s);
+      Py_DECREF(s2);
+      return 0;
+    }
+    
+    PyTuple_SetItem(t, 0, s);
+    PyTuple_SetItem(t, 1, s2);
+    
+    if (PyList_Append(pAuth, t)) {
+      Py_DECREF(res);
+      Py_DECREF(t);
+      return 0;
+    }
+    auth = auth->next;
+  }
+  
+  return res;
+}
+#endif
+
+static int set_option_dict(httrackp* opt, PyObject* dict) {
+  setIntItem(dict, opt, wizard);
+  setIntItem(dict, opt, flush);
+  setIntItem(dict, opt, travel);
+  setIntItem(dict, opt, seeker);
+  setIntItem(dict, opt, depth);
+  setIntItem(dict, opt, extdepth);
+  setIntItem(dict, opt, urlmode);
+  setIntItem(dict, opt, debug);
+  setIntItem(dict, opt, getmode);
+  /* xxx FILE *log, *errlog are missing. Not sure, if and how to map these 
+     to Python types
+  */
+  setLLIntItem(dict, opt, maxsite);
+  setLLIntItem(dict, opt, maxfile_nonhtml);
+  setLLIntItem(dict, opt, maxfile_html);
+  setIntItem(dict, opt, maxsoc);
+  setLLIntItem(dict, opt, fragment);
+  setIntItem(dict, opt, nearlink);
+  setIntItem(dict, opt, makeindex);
+  setIntItem(dict, opt, kindex);
+  setIntItem(dict, opt, delete_old);
+  setIntItem(dict, opt, timeout);
+  setIntItem(dict, opt, rateout);
+  setIntItem(dict, opt, maxtime);
+  setIntItem(dict, opt, maxrate);
+  setFloatItem(dict, opt, maxconn);
+  setIntItem(dict, opt, waittime);
+  setIntItem(dict, opt, cache);
+  setIntItem(dict, opt, shell);
+  setIntItem(dict, opt, savename_83);
+  setStringItem(dict, opt, savename_userdef);
+  setIntItem(dict, opt, mimehtml);
+  setIntItem(dict, opt, user_agent_send);
+  setStringItem(dict, opt, user_agent);
+  setStringItem(dict, opt, referer);
+  setStringItem(dict, opt, from);
+  setStringItem(dict, opt, path_log);
+  setStringItem(dict, opt, path_html);
+  setStringItem(dict, opt, path_bin);
+  setIntItem(dict, opt, retry);
+  setIntItem(dict, opt, makestat);
+  setIntItem(dict, opt, maketrack);
+  setIntItem(dict, opt, parsejava);
+  setIntItem(dict, opt, hostcontrol);
+  setIntItem(dict, opt, errpage);
+  setIntItem(dict, opt, check_type);
+  setIntItem(dict, opt, all_in_cache);
+  setIntItem(dict, opt, robots);
+  setIntItem(dict, opt, external);
+  setIntItem(dict, opt, passprivacy);
+  setIntItem(dict, opt, includequery);
+  setIntItem(dict, opt, mirror_first_page);
+  setStringItem(dict, opt, sys_com);
+  setIntItem(dict, opt, sys_com_exec);
+  setIntItem(dict, opt, accept_cookie);
+
+#ifdef HTS_INTERNAL_BYTECODE
+  if (opt->cookie) {
+    PyObject *tmp = set_cookies(opt->cookie);
+    if (!tmp) return 0;
+    setAnyItem(dict, cookie);
+  }
+#endif
+
+  setIntItem(dict, opt, http10);
+  setIntItem(dict, opt, nokeepalive);
   setIntItem(dict, opt, nocompression);
   setIntItem(dict, opt, sizehack);
   setIntItem(dict, opt, urlhack);
@@ -807,362 +3036,5904 @@ static int set_option_dict(httrackp* opt, PyObject* dict) {
   setStringItem(dict, opt, urllist);
   /* xxx htsfilters filters, void *hash, void *robotsptr missing 
   */
-  setStringItem(dict, opt, lang_iso);
-  setStringItem(dict, opt, mimedefs);
-  setIntItem(dict, opt, maxlink);
-  setIntItem(dict, opt, maxfilter);
-  setStringItem(dict, opt, exec);
-  setIntItem(dict, opt, quiet);
-  setIntItem(dict, opt, keyboard);
-  setIntItem(dict, opt, is_update);
-  setIntItem(dict, opt, dir_topindex);
-  /* xxx htsoptstate stats missing */
+  setStringItem(dict, opt, lang_iso);
+  setStringItem(dict, opt, mimedefs);
+  setIntItem(dict, opt, maxlink);
+  setIntItem(dict, opt, maxfilter);
+  setStringItem(dict, opt, exec);
+  setIntItem(dict, opt, quiet);
+  setIntItem(dict, opt, keyboard);
+  setIntItem(dict, opt, is_update);
+  setIntItem(dict, opt, dir_topindex);
+  /* xxx htsoptstate stats missing */
+  return 1;
+}
+
+static int get_option_dict(httrackp* opt, PyObject* dict) {
+  getIntItem(dict, opt, wizard);
+  getIntItem(dict, opt, flush);
+  getIntItem(dict, opt, travel);
+  getIntItem(dict, opt, seeker);
+  getIntItem(dict, opt, depth);
+  getIntItem(dict, opt, extdepth);
+  getIntItem(dict, opt, urlmode);
+  getIntItem(dict, opt, debug);
+  getIntItem(dict, opt, getmode);
+  /* xxx FILE* are missing. Not sure, if and how to map these 
+     to Python types
+  */
+  getLLIntItem(dict, opt, maxsite);
+  getLLIntItem(dict, opt, maxfile_nonhtml);
+  getLLIntItem(dict, opt, maxfile_html);
+  getIntItem(dict, opt, maxsoc);
+  getLLIntItem(dict, opt, fragment);
+  getIntItem(dict, opt, nearlink);
+  getIntItem(dict, opt, makeindex);
+  getIntItem(dict, opt, kindex);
+  getIntItem(dict, opt, delete_old);
+  getIntItem(dict, opt, timeout);
+  getIntItem(dict, opt, rateout);
+  getIntItem(dict, opt, maxtime);
+  getIntItem(dict, opt, maxrate);
+  getFloatItem(dict, opt, maxconn);
+  getIntItem(dict, opt, waittime);
+  getIntItem(dict, opt, cache);
+  getIntItem(dict, opt, shell);
+  getIntItem(dict, opt, savename_83);
+  getStringItem(dict, opt, savename_userdef, 256);
+  getIntItem(dict, opt, mimehtml);
+  getIntItem(dict, opt, user_agent_send);
+  getStringItem(dict, opt, user_agent, 128);
+  getStringItem(dict, opt, referer, 256);
+  getStringItem(dict, opt, from, 256);
+  getStringItem(dict, opt, path_log, 1024);
+  getStringItem(dict, opt, path_html, 1024);
+  getStringItem(dict, opt, path_bin, 1024);
+  getIntItem(dict, opt, retry);
+  getIntItem(dict, opt, makestat);
+  getIntItem(dict, opt, maketrack);
+  getIntItem(dict, opt, parsejava);
+  getIntItem(dict, opt, hostcontrol);
+  getIntItem(dict, opt, errpage);
+  getIntItem(dict, opt, check_type);
+  getIntItem(dict, opt, all_in_cache);
+  getIntItem(dict, opt, robots);
+  getIntItem(dict, opt, external);
+  getIntItem(dict, opt, passprivacy);
+  getIntItem(dict, opt, includequery);
+  getIntItem(dict, opt, mirror_first_page);
+  getStringItem(dict, opt, sys_com, 2048);
+  getIntItem(dict, opt, sys_com_exec);
+  getIntItem(dict, opt, accept_cookie);
+  /* xxx  t_cookie is missing */
+  getIntItem(dict, opt, http10);
+  getIntItem(dict, opt, nokeepalive);
+  getIntItem(dict, opt, nocompression);
+  getIntItem(dict, opt, sizehack);
+  getIntItem(dict, opt, urlhack);
+  getIntItem(dict, opt, tolerant);
+  getIntItem(dict, opt, parseall);
+  getIntItem(dict, opt, parsedebug);
+  getIntItem(dict, opt, norecatch);
+  getIntItem(dict, opt, verbosedisplay);
+  getStringItem(dict, opt, footer, 256);
+  getIntItem(dict, opt, maxcache);
+  getIntItem(dict, opt, ftp_proxy);
+  getStringItem(dict, opt, filelist, 1024);
+  getStringItem(dict, opt, urllist, 1024);
+  /* xxx htsfilters, hash, robotsptr missing 
+  */
+  getStringItem(dict, opt, lang_iso, 64);
+  getStringItem(dict, opt, mimedefs, 2048);
+  getIntItem(dict, opt, maxlink);
+  getIntItem(dict, opt, maxfilter);
+  /* xxx hrmm. No size defined for char* exec
+     getStringItem(dict, opt, exec);
+  */
+  getIntItem(dict, opt, quiet);
+  getIntItem(dict, opt, keyboard);
+  getIntItem(dict, opt, is_update);
+  getIntItem(dict, opt, dir_topindex);
+  /* xxx htsoptstate stats missing */
+  return 1;
+}
+/* the callbacks start and change_options: all stages see the same
+   option dictionary, so a stage can see the changes made by the
+   stages before it. The values are copied back into opt only if
+   every stage returned a 'true' value.
+*/
+static int process_options(httrackp* opt, int cb) {
+  PyObject *args, *dict, *pres;
+  cb_pipeline *p = &interp->pipelines[cb];
+  int i, res = 1;
+
+  if (stop_on_next_callback)
+    return 0;
+  if (!cb_active(cb))
+    return 1;
+
+  dict = PyDict_New();
+  if (!dict) {
+    return process_error_direct(cb_names[cb]);
+  }
+  if (   !set_option_dict(opt, dict)
+      || !(args = PyTuple_New(1))) {
+    Py_DECREF(dict);
+    return process_error_direct(cb_names[cb]);
+  }
+  PyTuple_SetItem(args, 0, dict);
+
+  for (i = 0; res && i < p->nstages; i++) {
+    pres = call_stage(&p->stages[i], args);
+    if (pres) {
+      res = PyObject_IsTrue(pres);
+      Py_DECREF(pres);
+    }
+    else {
+      res = process_error_direct(cb_names[cb]);
+    }
+  }
+  if (res) {
+    get_option_dict(opt, dict);
+    /* the get*Item macros only set an error for wrong or missing
+       entries; report it, instead of leaving it pending
+    */
+    if (PyErr_Occurred())
+      PyErr_Print();
+  }
+  Py_DECREF(args);
+  return res;
+}
+
+
+EXTERNAL_FUNCTION int hts_py_start(httrackp* opt) {
+  /* call the method 'start' of the Python class; pass (almost) all
+     option values in a dictionary
+  */
+
+  /* "delayed error signal" from plugin_init set?
+  */
+  PyGILState_STATE gil;
+  int res = 1;
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_start %li\n", pthread_self());
+#endif
+#ifdef PLUGIN
+  if (abort_in_start_callback) return 0;
+  res = initialize_plugin(0);
+#endif
+  gil = enter_python(CB_START);
+  res = res && process_options(opt, CB_START);
+  if (res) {
+    controller_attach(opt);
+    pack_attach(opt);
+  }
+  leave_python(gil);
+  return res;
+}
+
+/* return: {callback_name: [(handler_index, calls, seconds), ...]} for
+   all callbacks with at least one stage
+*/
+static PyObject *build_stage_stats(void) {
+  PyObject *res, *l, *t;
+  cb_stage *stage;
+  int cb, i;
+
+  res = PyDict_New();
+  if (!res)
+    return 0;
+  for (cb = 0; cb < CB_COUNT; cb++) {
+    if (!interp->pipelines[cb].nstages)
+      continue;
+    l = PyList_New(0);
+    if (!l || PyDict_SetItemString(res, cb_names[cb], l)) {
+      Py_XDECREF(l);
+      Py_DECREF(res);
+      return 0;
+    }
+    Py_DECREF(l);
+    for (i = 0; i < interp->pipelines[cb].nstages; i++) {
+      stage = &interp->pipelines[cb].stages[i];
+      t = Py_BuildValue("(ild)", stage->index, stage->calls, stage->seconds);
+      if (!t || PyList_Append(l, t)) {
+        Py_XDECREF(t);
+        Py_DECREF(res);
+        return 0;
+      }
+      Py_DECREF(t);
+    }
+  }
+  return res;
+}
+
+static void print_stage_stats(void) {
+  int cb, i;
+  cb_stage *stage;
+
+  fprintf(stderr, "httrack-py stage statistics:\n");
+  for (cb = 0; cb < CB_COUNT; cb++) {
+    for (i = 0; i < interp->pipelines[cb].nstages; i++) {
+      stage = &interp->pipelines[cb].stages[i];
+      fprintf(stderr, "  %-18s handler %d: %10li calls %12.6f s\n",
+              cb_names[cb], stage->index, stage->calls, stage->seconds);
+    }
+  }
+}
+
+/* release the Python objects of the current interpreter */
+static void free_interp(void) {
+  if (interp->pAnswerQuery2) { Py_DECREF(interp->pAnswerQuery2); }
+  if (interp->pAnswerQuery3) { Py_DECREF(interp->pAnswerQuery3); }
+  interp->pAnswerQuery2 = interp->pAnswerQuery3 = 0;
+
+  free_pipelines();
+
+  /* explicitly delete the callback class instances in order to
+    allow a possible class destructor to be executed
+  */
+  if (interp->pHandlers) {
+    Py_DECREF(interp->pHandlers);
+  }
+
+  interp->pHandlers = 0;
+  interp->pCallbackClass = 0;
+}
+
+static void cleanup() {
+  if (getenv("HTTRACK_PY_STAGE_STATS")) {
+    print_stage_stats();
+  }
+  print_error_summary();
+  stop_watchdog();
+  stop_profiler();
+  stop_trace();
+  stop_metrics();
+  stop_event_log();
+  stop_warc();
+  stop_pack();
+  stop_pages();
+  stop_extract();
+  stop_near_duplicates();
+  stop_record();
+  stop_audit();
+  stop_workers();
+  stop_feed();
+  stop_validators();
+  stop_controller();
+
+  /* keep the statistics available for httracklib.stage_stats() */
+  Py_XDECREF(pLastStageStats);
+  pLastStageStats = build_stage_stats();
+  if (!pLastStageStats)
+    PyErr_Clear();
+  free_interp();
+}
+
+/* run the end callback of the current interpreter */
+static int py_end(void) {
+  cb_pipeline *p = &interp->pipelines[CB_END];
+  PyObject *pRes;
+  int i;
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_end %li\n", pthread_self());
+#endif
+  if (stop_on_next_callback)
+    return 0;
+  for (i = 0; i < p->nstages; i++) {
+    pRes = call_stage(&p->stages[i], 0);
+    if (!pRes) {
+      /* this is the last of all callbacks, and we can't return
+         anything, so let's just see, what the user wants to do
+      */
+      process_error_direct("end");
+    }
+    else {
+      Py_DECREF(pRes);
+    }
+  }
+  return 1;
+}
+
+#ifdef PLUGIN
+/* the mirror is finished: run the end callbacks of the interpreters
+   that did not yet see it, delete the subinterpreters, and finalize
+   Python. done is the interpreter whose end callback was already
+   executed.
+*/
+static void finalize_python(py_interp *done) {
+  PyThreadState *tstate;
+  py_interp *sub, *next;
+
+  PyGILState_Ensure();
+  /* the watchdog and the profiler use the thread states of the
+     subinterpreters
+  */
+  stop_watchdog();
+  stop_profiler();
+  tstate = PyThreadState_Get();
+  for (sub = subinterpreters; sub; sub = next) {
+    next = sub->next;
+    PyThreadState_Swap(sub->tstate);
+    interp = sub;
+    if (sub != done)
+      py_end();
+    free_interp();
+    if (sub->wd_tstate) {
+      PyThreadState_Clear(sub->wd_tstate);
+      PyThreadState_Delete(sub->wd_tstate);
+    }
+    Py_EndInterpreter(sub->tstate);
+    free(sub);
+  }
+  subinterpreters = 0;
+  PyThreadState_Swap(tstate);
+  interp = &main_interp;
+  if (done != &main_interp)
+    py_end();
+  cleanup();
+  Py_Finalize();
+}
+#endif
+
+EXTERNAL_FUNCTION int hts_py_end(void) {
+  PyGILState_STATE gil;
+#ifdef PLUGIN
+  py_interp *current;
+  int res;
+
+  gil = enter_python(CB_END);
+  current = interp;
+  res = py_end();
+  leave_python(gil);
+  if (res)
+    finalize_python(current);
+#else
+  int res;
+
+  gil = enter_python(CB_END);
+  res = py_end();
+  leave_python(gil);
+#endif
+  return res;
+}
+
+static int py_change_options(httrackp* opt) {
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_change_options %li\n", pthread_self());
+#endif
+  return process_options(opt, CB_CHANGE_OPTIONS);
+}
+
+
+/* Worker processes.
+
+   If the setting worker_processes (attribute of the first handler, or
+   environment variable HTTRACK_PY_WORKERS) is greater than 0, the
+   callbacks check_html, preprocess_html and postprocess_html are not
+   executed in this process, but in a pool of worker processes, which
+   are forked when the mirror starts. The workers inherit the Python
+   interpreter and the callback handlers, and run the same pipelines
+   as this process would do.
+
+   Each worker has a shared memory segment (size: worker_shm_size or
+   HTTRACK_PY_WORKER_SHM, default 4 MB) for the HTML text, and a socket
+   pair for the requests and replies. HTML texts larger than the
+   segment are sent over the socket. While waiting for a worker, the
+   GIL is released, so callbacks from several httrack threads run in
+   parallel.
+
+   Changes made by the callback methods to the handler instances of a
+   worker are not visible in this process.
+*/
+
+#define WORKER_FAILED -2
+
+typedef struct {
+  int cb;           /* CB_* constant */
+  int len;          /* length of the HTML text */
+  int in_shm;       /* 1: the HTML text is in the shared segment,
+                       0: it follows the request on the socket */
+  int adr_len, fil_len;
+} worker_request;
+
+typedef struct {
+  int res;          /* return value of the callback */
+  int len;          /* length of the (possibly changed) HTML text */
+  int in_shm;
+  int stop;         /* stop_on_next_callback was set in the worker */
+} worker_reply;
+
+typedef struct {
+  pid_t pid;
+  int fd;           /* our end of the socket pair */
+  char *shm;
+  int busy;
+} py_worker;
+
+static py_worker *workers = 0;
+static int nworkers = 0;
+/* workers whose process is alive; protected by worker_lock */
+static int live_workers = 0;
+static size_t worker_shm_size = 0;
+static pthread_mutex_t worker_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t worker_cond = PTHREAD_COND_INITIALIZER;
+
+static int py_check_html(char* html, int len,
+                         char* url_adresse, char* url_fichier);
+static int can_change_html(char** html, int* len,
+                           char* url_adresse, char* url_fichier, int cb);
+
+static int read_all(int fd, void *buf, size_t size) {
+  char *p = buf;
+  ssize_t n;
+  while (size) {
+    n = read(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+static int write_all(int fd, const void *buf, size_t size) {
+  const char *p = buf;
+  ssize_t n;
+  while (size) {
+    n = write(fd, p, size);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    p += n;
+    size -= n;
+  }
+  return 1;
+}
+
+/* main loop of a worker process. Never returns. */
+static void worker_main(py_worker *w) {
+  worker_request rq;
+  worker_reply rp;
+  char *adr, *fil, *html;
+  int len;
+
+  for (;;) {
+    if (!read_all(w->fd, &rq, sizeof(rq)))
+      _exit(0);
+    adr = malloc(rq.adr_len + 1);
+    fil = malloc(rq.fil_len + 1);
+    html = malloc(rq.len + 1);
+    /* not 255: the parent takes that for IMMEDIATE_STOP */
+    if (!adr || !fil || !html)
+      _exit(1);
+    if (   !read_all(w->fd, adr, rq.adr_len)
+        || !read_all(w->fd, fil, rq.fil_len))
+      _exit(0);
+    adr[rq.adr_len] = 0;
+    fil[rq.fil_len] = 0;
+    if (rq.in_shm) {
+      memcpy(html, w->shm, rq.len);
+    }
+    else if (!read_all(w->fd, html, rq.len)) {
+      _exit(0);
+    }
+    html[rq.len] = 0;
+    len = rq.len;
+
+    /* rp.len == -1: the HTML text is unchanged */
+    rp.len = -1;
+    if (rq.cb == CB_CHECK_HTML) {
+      rp.res = py_check_html(html, len, adr, fil);
+    }
+    else {
+      rp.res = can_change_html(&html, &len, adr, fil, rq.cb);
+      if (   len != rq.len || !rq.in_shm
+          || memcmp(html, w->shm, len)) {
+        rp.len = len;
+      }
+    }
+    rp.in_shm = rp.len >= 0 && rp.len <= worker_shm_size;
+    rp.stop = stop_on_next_callback;
+    if (rp.in_shm) {
+      memcpy(w->shm, html, rp.len);
+    }
+    if (   !write_all(w->fd, &rp, sizeof(rp))
+        || (rp.len >= 0 && !rp.in_shm && !write_all(w->fd, html, rp.len)))
+      _exit(0);
+    free(adr);
+    free(fil);
+    free(html);
+  }
+}
+
+static void stop_workers(void) {
+  int i, status;
+  for (i = 0; i < nworkers; i++) {
+    if (workers[i].fd >= 0) {
+      close(workers[i].fd);
+    }
+    if (workers[i].pid > 0) {
+      waitpid(workers[i].pid, &status, 0);
+    }
+    munmap(workers[i].shm, worker_shm_size);
+  }
+  free(workers);
+  workers = 0;
+  nworkers = 0;
+  live_workers = 0;
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_workers(void) {
+  int i, j, n, fds[2];
+  pid_t pid;
+
+  n = get_setting_long("worker_processes", "HTTRACK_PY_WORKERS", 0);
+  if (n <= 0 || (   !interp->pipelines[CB_CHECK_HTML].nstages
+                 && !interp->pipelines[CB_PREPROCESS_HTML].nstages
+                 && !interp->pipelines[CB_POSTPROCESS_HTML].nstages))
+    return 1;
+  worker_shm_size = get_setting_long("worker_shm_size", "HTTRACK_PY_WORKER_SHM",
+                                     4 * 1024 * 1024);
+  workers = calloc(n, sizeof(py_worker));
+  if (!workers) {
+    PyErr_NoMemory();
+    return 0;
+  }
+
+  fflush(0);
+  for (i = 0; i < n; i++) {
+    workers[i].fd = -1;
+    workers[i].shm = mmap(0, worker_shm_size, PROT_READ | PROT_WRITE,
+                          MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+    if (workers[i].shm == MAP_FAILED) {
+      nworkers = i;
+      stop_workers();
+      PyErr_SetFromErrno(PyExc_OSError);
+      return 0;
+    }
+    nworkers = i + 1;
+    if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds)) {
+      stop_workers();
+      PyErr_SetFromErrno(PyExc_OSError);
+      return 0;
+    }
+    pid = fork();
+    if (pid < 0) {
+      close(fds[0]);
+      close(fds[1]);
+      stop_workers();
+      PyErr_SetFromErrno(PyExc_OSError);
+      return 0;
+    }
+    if (pid == 0) {
+      /* worker: forget the pool, and run the callbacks locally */
+      PyOS_AfterFork();
+      close(fds[0]);
+      for (j = 0; j < i; j++) {
+        close(workers[j].fd);
+      }
+      workers[i].fd = fds[1];
+      nworkers = 0;
+      worker_main(&workers[i]);
+    }
+    close(fds[1]);
+    workers[i].pid = pid;
+    workers[i].fd = fds[0];
+    live_workers = i + 1;
+  }
+  return 1;
+}
+
+/* run a HTML callback in a worker process. Called with the GIL held;
+   the GIL is released while the worker is busy.
+   return: the return value of the callback, or WORKER_FAILED, if the
+           worker could not be used. In this case, the caller should
+           run the callback locally.
+*/
+static int worker_call(int cb, char **html, int *len,
+                       char *adr, char *fil) {
+  py_worker *w = 0;
+  worker_request rq;
+  worker_reply rp;
+  int i, ok = 0, status;
+  char *tmp;
+
+
+  rq.cb = cb;
+  rq.len = *len;
+  rq.in_shm = *len <= worker_shm_size;
+  rq.adr_len = strlen(adr);
+  rq.fil_len = strlen(fil);
+
+  Py_BEGIN_ALLOW_THREADS
+  pthread_mutex_lock(&worker_lock);
+  /* if all workers died, the caller runs the callback locally */
+  while (!w && live_workers) {
+    for (i = 0; i < nworkers; i++) {
+      if (!workers[i].busy && workers[i].fd >= 0) {
+        w = &workers[i];
+        break;
+      }
+    }
+    if (!w)
+      pthread_cond_wait(&worker_cond, &worker_lock);
+  }
+  if (w)
+    w->busy = 1;
+  pthread_mutex_unlock(&worker_lock);
+
+  if (w) {
+    if (rq.in_shm) {
+      memcpy(w->shm, *html, *len);
+    }
+    ok =    write_all(w->fd, &rq, sizeof(rq))
+         && write_all(w->fd, adr, rq.adr_len)
+         && write_all(w->fd, fil, rq.fil_len)
+         && (rq.in_shm || write_all(w->fd, *html, *len))
+         && read_all(w->fd, &rp, sizeof(rp));
+    if (ok && rp.len >= 0) {
+      if (rp.len > *len) {
+        tmp = realloc(*html, rp.len + 1);
+        if (tmp) {
+          *html = tmp;
+        }
+        else {
+          /* we can't read the rest of the reply; drop the worker */
+          ok = 0;
+        }
+      }
+      if (ok) {
+        if (rp.in_shm) {
+          memcpy(*html, w->shm, rp.len);
+        }
+        else {
+          ok = read_all(w->fd, *html, rp.len);
+        }
+      }
+      if (ok) {
+        (*html)[rp.len] = 0;
+        *len = rp.len;
+      }
+    }
+    if (!ok) {
+      /* the worker died. If it died because of IMMEDIATE_STOP, we
+         stop too
+      */
+      close(w->fd);
+      w->fd = -1;
+      if (waitpid(w->pid, &status, 0) == w->pid) {
+        w->pid = 0;
+        if (WIFEXITED(status) && WEXITSTATUS(status) == 255)
+          exit(-1);
+      }
+    }
+    pthread_mutex_lock(&worker_lock);
+    w->busy = 0;
+    if (!ok) {
+      /* wake all waiters: they must not wait for a dead worker */
+      live_workers--;
+      pthread_cond_broadcast(&worker_cond);
+    }
+    else {
+      pthread_cond_signal(&worker_cond);
+    }
+    pthread_mutex_unlock(&worker_lock);
+  }
+  Py_END_ALLOW_THREADS
+
+  if (!ok)
+    return WORKER_FAILED;
+  if (rp.stop)
+    stop_on_next_callback = 1;
+  return rp.res;
+}
+
+/* Page feed.
+
+   If the setting feed_path (attribute of the first handler, or
+   environment variable HTTRACK_PY_FEED) is set, each HTML page is
+   published after the postprocess_html callback into a ring buffer,
+   which is stored in the file feed_path and mapped into memory with
+   MAP_SHARED. Other processes (indexers, classifiers, ...) can map the
+   same file and read the pages directly from the ring, instead of
+   reading the saved files again. httracktools.FeedReader is such a
+   subscriber, written in Python.
+
+   A record contains the URL, the HTTP headers of the page (htsblk
+   headers, or the header buffer of the receive_header callback) and
+   the HTML text as returned by the last stage of postprocess_html.
+   The producer never waits for the subscribers: records not yet read
+   by a slow subscriber are overwritten and counted in the drops field
+   of that subscriber.
+
+   Layout of the file (native byte order): a feed_header, followed, at
+   data_offset, by the data area of size bytes (setting feed_size or
+   HTTRACK_PY_FEED_SIZE, default 16 MB). Positions are byte counts
+   since the start of the feed; a position is stored at the offset
+   position % size of the data area. A record starts with a feed_record
+   and is padded to a multiple of 8 bytes; it never wraps around the
+   end of the data area. The rest of the data area is filled with a
+   padding record (status FEED_PAD), or simply skipped, if it is too
+   small for a feed_record.
+
+   The producer first advances oldest past the records it is going to
+   overwrite, then writes the new record, then advances head. Hence a
+   subscriber that read the record at position pos must check, that
+   oldest <= pos is still true; otherwise, the record was overwritten
+   while it was read.
+*/
+
+#define FEED_MAGIC "HTSFEED1"
+#define FEED_SUBSCRIBERS 16
+#define FEED_DATA_OFFSET 4096
+#define FEED_PAD -1
+/* headers of pages received but not yet published */
+#define FEED_PENDING_MAX 1024
+
+typedef struct {
+  volatile int64_t tail;      /* position of the next record to read */
+  volatile int64_t consumed;  /* number of records read */
+  volatile int64_t drops;     /* records overwritten before being read */
+  volatile int32_t pid;       /* 0: the slot is free */
+  int32_t reserved;
+} feed_subscriber;
+
+typedef struct {
+  char magic[8];
+  int64_t size;               /* size of the data area */
+  int64_t data_offset;
+  volatile int64_t head;      /* end of the last record */
+  volatile int64_t oldest;    /* position of the oldest valid record */
+  volatile int64_t records;   /* number of records written */
+  volatile int64_t too_large; /* pages not published: larger than size/4 */
+  volatile int32_t closed;    /* 1: the mirror is finished */
+  int32_t nsubscribers;
+  feed_subscriber subscribers[FEED_SUBSCRIBERS];
+} feed_header;
+
+typedef struct {
+  uint32_t len;               /* length of the record, with padding */
+  int32_t status;             /* HTTP status code, or FEED_PAD */
+  uint32_t url_len, headers_len, body_len;
+  uint32_t reserved;
+  int64_t seq;                /* number of the record */
+} feed_record;
+
+typedef struct {
+  int status;
+  char headers[1];
+} feed_pending;
+
+static feed_header *feed = 0;
+static char *feed_data;
+/* adr+fil -> feed_pending; protected by the GIL */
+static str_map feed_headers;
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_feed(void) {
+  char *path;
+  long size;
+  int fd;
+
+  path = get_setting_string("feed_path", "HTTRACK_PY_FEED");
+  if (!path)
+    return 1;
+  size = get_setting_long("feed_size", "HTTRACK_PY_FEED_SIZE",
+                          16 * 1024 * 1024);
+  size = (size + 7) & ~7L;
+  if (size < 65536)
+    size = 65536;
+
+  fd = open(path, O_RDWR | O_CREAT, 0644);
+  if (fd < 0 || ftruncate(fd, 0) || ftruncate(fd, FEED_DATA_OFFSET + size)) {
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    if (fd >= 0)
+      close(fd);
+    free(path);
+    return 0;
+  }
+  feed = mmap(0, FEED_DATA_OFFSET + size, PROT_READ | PROT_WRITE,
+              MAP_SHARED, fd, 0);
+  close(fd);
+  if (feed == MAP_FAILED) {
+    feed = 0;
+    PyErr_SetFromErrnoWithFilename(PyExc_OSError, path);
+    free(path);
+    return 0;
+  }
+  free(path);
+  if (!str_map_init(&feed_headers, free)) {
+    munmap(feed, FEED_DATA_OFFSET + size);
+    feed = 0;
+    PyErr_NoMemory();
+    return 0;
+  }
+  feed_data = (char*) feed + FEED_DATA_OFFSET;
+  feed->size = size;
+  feed->data_offset = FEED_DATA_OFFSET;
+  feed->nsubscribers = FEED_SUBSCRIBERS;
+  /* the magic number is written last: subscribers wait for it */
+  __sync_synchronize();
+  memcpy(feed->magic, FEED_MAGIC, 8);
+  return 1;
+}
+
+static void stop_feed(void) {
+  if (!feed)
+    return;
+  feed->closed = 1;
+  str_map_free(&feed_headers);
+  munmap(feed, FEED_DATA_OFFSET + feed->size);
+  feed = 0;
+}
+
+/* remember the headers of a HTML page until it is published */
+static void feed_receive_header(char *buf, char *adr, char *fil,
+                                htsblk *incoming) {
+  feed_pending *pending;
+  char *headers, *key;
+  int len;
+
+  if (!strstr(incoming->contenttype, "html"))
+    return;
+  headers = incoming->headers ? incoming->headers : buf;
+  len = strlen(headers);
+  key = url_key(adr, fil);
+  pending = malloc(sizeof(feed_pending) + len);
+  if (!key || !pending) {
+    free(key);
+    free(pending);
+    return;
+  }
+  /* pages that are never postprocessed (errors, not modified, ...)
+     stay in the table, until they are the oldest entry of a full table
+  */
+  if (feed_headers.count >= FEED_PENDING_MAX)
+    str_map_drop_oldest(&feed_headers);
+  pending->status = incoming->statuscode;
+  memcpy(pending->headers, headers, len + 1);
+  if (!str_map_put(&feed_headers, key, pending))
+    free(pending);
+  free(key);
+}
+
+static void feed_publish(char *html, int len, char *adr, char *fil) {
+  feed_pending *pending;
+  feed_record *rec;
+  feed_subscriber *sub;
+  char *key, *headers = "", *p;
+  int64_t head, end, rem, pos;
+  uint32_t total, rlen;
+  int i, adr_len = strlen(adr), fil_len = strlen(fil), hdr_len;
+
+  key = url_key(adr, fil);
+  if (!key)
+    return;
+  pending = str_map_take(&feed_headers, key);
+  if (pending)
+    headers = pending->headers;
+  hdr_len = strlen(headers);
+
+  total = (sizeof(feed_record) + adr_len + fil_len + hdr_len + len + 7) & ~7;
+  if (total > feed->size / 4) {
+    feed->too_large++;
+    free(key);
+    free(pending);
+    return;
+  }
+  head = feed->head;
+  rem = feed->size - head % feed->size;
+  end = head + total + (rem < total ? rem : 0);
+
+  /* forget the records that will be overwritten */
+  pos = feed->oldest;
+  while (pos < head && pos < end - feed->size) {
+    rem = feed->size - pos % feed->size;
+    if (rem < sizeof(feed_record)) {
+      pos += rem;
+      continue;
+    }
+    rec = (feed_record*) (feed_data + pos % feed->size);
+    if (rec->status != FEED_PAD) {
+      for (i = 0; i < FEED_SUBSCRIBERS; i++) {
+        sub = &feed->subscribers[i];
+        if (sub->pid && sub->tail <= pos)
+          sub->drops++;
+      }
+    }
+    pos += rec->len;
+  }
+  feed->oldest = pos;
+  __sync_synchronize();
+
+  rem = feed->size - head % feed->size;
+  if (rem < total) {
+    if (rem >= sizeof(feed_record)) {
+      rec = (feed_record*) (feed_data + head % feed->size);
+      memset(rec, 0, sizeof(feed_record));
+      rec->len = rem;
+      rec->status = FEED_PAD;
+    }
+    head += rem;
+  }
+  rec = (feed_record*) (feed_data + head % feed->size);
+  rlen = total;
+  rec->len = rlen;
+  rec->status = pending ? pending->status : 0;
+  rec->url_len = adr_len + fil_len;
+  rec->headers_len = hdr_len;
+  rec->body_len = len;
+  rec->reserved = 0;
+  rec->seq = feed->records;
+  p = (char*) (rec + 1);
+  memcpy(p, key, adr_len + fil_len);
+  p += adr_len + fil_len;
+  memcpy(p, headers, hdr_len);
+  p += hdr_len;
+  memcpy(p, html, len);
+  if (feed->oldest == feed->head)
+    feed->oldest = head;
+  __sync_synchronize();
+  feed->head = head + total;
+  feed->records++;
+
+  free(key);
+  free(pending);
+}
+
+/* return: a dictionary with the statistics of the feed, or None */
+static PyObject *build_feed_stats(void) {
+  PyObject *res, *l, *t;
+  feed_subscriber *sub;
+  int i;
+
+  if (!feed) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  l = PyList_New(0);
+  if (!l)
+    return 0;
+  for (i = 0; i < FEED_SUBSCRIBERS; i++) {
+    sub = &feed->subscribers[i];
+    if (!sub->pid)
+      continue;
+    t = Py_BuildValue("{s:i,s:L,s:L,s:L}",
+                      "pid", (int) sub->pid,
+                      "lag_records", (PY_LONG_LONG)
+                        (feed->records - sub->consumed - sub->drops),
+                      "lag_bytes", (PY_LONG_LONG) (feed->head - sub->tail),
+                      "drops", (PY_LONG_LONG) sub->drops);
+    if (!t || PyList_Append(l, t)) {
+      Py_XDECREF(t);
+      Py_DECREF(l);
+      return 0;
+    }
+    Py_DECREF(t);
+  }
+  res = Py_BuildValue("{s:L,s:L,s:L,s:L,s:N}",
+                      "size", (PY_LONG_LONG) feed->size,
+                      "records", (PY_LONG_LONG) feed->records,
+                      "bytes", (PY_LONG_LONG) feed->head,
+                      "too_large", (PY_LONG_LONG) feed->too_large,
+                      "subscribers", l);
+  return res;
+}
+
+/* Validator cache.
+
+   If the setting validator_cache (attribute of the first handler, or
+   environment variable HTTRACK_PY_VALIDATORS) is set, it is the file
+   name of a SQLite database, where transfer_status stores the ETag and
+   Last-Modified values of the pages, and the names of the saved files.
+   When a URL is requested again, usually in the next update of the
+   mirror, send_header adds the headers If-None-Match and
+   If-Modified-Since to the request (unless httrack already sent them),
+   so that the server can answer "304 Not Modified" instead of sending
+   the page again. httrack needs its copy of the page to handle such an
+   answer: if the saved file no longer exists, no headers are added,
+   and the entry is dropped.
+
+   The database is only available, if this file is compiled with
+   HTS_PY_SQLITE defined (setup.py does this) and linked with sqlite3.
+*/
+
+/* size of the request buffer passed to the send_header callback
+   (see http_sendhead() in htslib.c)
+*/
+#define SEND_HEADER_BUFSIZE 8192
+/* commit the stored validators after that many changes */
+#define VALIDATOR_COMMIT_INTERVAL 256
+
+static int validators_enabled = 0;
+static long validator_hits, validator_misses, validator_not_modified,
+            validator_stored, validator_dropped;
+#ifdef HTS_PY_SQLITE
+static sqlite3 *validator_db = 0;
+static sqlite3_stmt *validator_select = 0, *validator_store = 0,
+                    *validator_drop = 0;
+static int validator_changes;
+#endif
+
+static void stop_validators(void);
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_validators(void) {
+  char *path;
+
+  validators_enabled = 0;
+  path = get_setting_string("validator_cache", "HTTRACK_PY_VALIDATORS");
+  if (!path)
+    return 1;
+  validator_hits = validator_misses = 0;
+  validator_not_modified = validator_stored = validator_dropped = 0;
+#ifdef HTS_PY_SQLITE
+  if (   sqlite3_open(path, &validator_db) != SQLITE_OK
+      || sqlite3_exec(validator_db,
+                      "CREATE TABLE IF NOT EXISTS validators ("
+                      "url TEXT PRIMARY KEY, etag TEXT, lastmodified TEXT, "
+                      "path TEXT)", 0, 0, 0) != SQLITE_OK
+      || sqlite3_prepare_v2(validator_db,
+                            "SELECT etag, lastmodified, path FROM validators "
+                            "WHERE url = ?", -1, &validator_select, 0)
+           != SQLITE_OK
+      || sqlite3_prepare_v2(validator_db,
+                            "INSERT OR REPLACE INTO validators "
+                            "VALUES (?, ?, ?, ?)", -1, &validator_store, 0)
+           != SQLITE_OK
+      || sqlite3_prepare_v2(validator_db,
+                            "DELETE FROM validators WHERE url = ?", -1,
+                            &validator_drop, 0) != SQLITE_OK
+      || sqlite3_exec(validator_db, "BEGIN", 0, 0, 0) != SQLITE_OK) {
+    PyErr_Format(PyExc_IOError, "validator cache %s: %s", path,
+                 validator_db ? sqlite3_errmsg(validator_db)
+                              : "out of memory");
+    stop_validators();
+    free(path);
+    return 0;
+  }
+  validator_changes = 0;
+  validators_enabled = 1;
+#else
+  fprintf(stderr, "httrack-py: compiled without SQLite; "
+                  "validator cache %s not used\n", path);
+#endif
+  free(path);
+  return 1;
+}
+
+static void stop_validators(void) {
+#ifdef HTS_PY_SQLITE
+  if (!validator_db)
+    return;
+  if (validators_enabled)
+    sqlite3_exec(validator_db, "COMMIT", 0, 0, 0);
+  sqlite3_finalize(validator_select);
+  sqlite3_finalize(validator_store);
+  sqlite3_finalize(validator_drop);
+  sqlite3_close(validator_db);
+  validator_db = 0;
+  validator_select = validator_store = validator_drop = 0;
+#endif
+}
+
+#ifdef HTS_PY_SQLITE
+/* return: 1, if the request in buf has a header line "name: ..." */
+static int has_header(char *buf, char *name) {
+  int len = strlen(name);
+  char *cc = strchr(buf, '\n');
+
+  while (cc) {
+    cc++;
+    if (!strncasecmp(cc, name, len) && cc[len] == ':')
+      return 1;
+    cc = strchr(cc, '\n');
+  }
+  return 0;
+}
+
+static void validator_error(void) {
+  fprintf(stderr, "httrack-py: validator cache: %s\n",
+          sqlite3_errmsg(validator_db));
+}
+
+/* forget the validators of the URL key */
+static void validator_forget(char *key) {
+  sqlite3_bind_text(validator_drop, 1, key, -1, SQLITE_TRANSIENT);
+  if (sqlite3_step(validator_drop) == SQLITE_DONE)
+    validator_dropped++;
+  else
+    validator_error();
+  sqlite3_reset(validator_drop);
+}
+
+/* add the stored validators of the URL to the request in buf, if the
+   file saved for it still exists
+*/
+static void validator_send_header(char *buf, char *adr, char *fil) {
+  char *key, *end, add[1024];
+  const char *etag, *lastmodified, *path;
+  int n = 0, len;
+
+  key = url_key(adr, fil);
+  if (!key)
+    return;
+  sqlite3_bind_text(validator_select, 1, key, -1, SQLITE_TRANSIENT);
+  switch (sqlite3_step(validator_select)) {
+  case SQLITE_ROW:
+    path = (const char*) sqlite3_column_text(validator_select, 2);
+    if (!path || !*path || !fexist((char*) path)) {
+      /* a 304 answer would leave httrack without the page */
+      sqlite3_reset(validator_select);
+      validator_forget(key);
+      validator_misses++;
+      break;
+    }
+    etag = (const char*) sqlite3_column_text(validator_select, 0);
+    lastmodified = (const char*) sqlite3_column_text(validator_select, 1);
+    add[0] = 0;
+    if (etag && *etag && !has_header(buf, "If-None-Match"))
+      n += snprintf(add + n, sizeof(add) - n, "If-None-Match: %s\r\n", etag);
+    if (   n < sizeof(add) && lastmodified && *lastmodified
+        && !has_header(buf, "If-Modified-Since"))
+      n += snprintf(add + n, sizeof(add) - n, "If-Modified-Since: %s\r\n",
+                    lastmodified);
+    end = strstr(buf, "\r\n\r\n");
+    len = strlen(buf);
+    if (n && n < sizeof(add) && end && len + n < SEND_HEADER_BUFSIZE) {
+      end += 2;
+      memmove(end + n, end, len - (end - buf) + 1);
+      memcpy(end, add, n);
+      validator_hits++;
+    }
+    break;
+  case SQLITE_DONE:
+    validator_misses++;
+    break;
+  default:
+    validator_error();
+  }
+  sqlite3_reset(validator_select);
+  free(key);
+}
+
+static void validator_receive_header(htsblk *incoming) {
+  if (incoming->statuscode == 304)
+    validator_not_modified++;
+}
+
+/* store the validators of a page, with the name of the saved file */
+static void validator_transfer_status(lien_back *back) {
+  char *key;
+
+  if (   back->r.statuscode != 200 || back->r.notmodified || !*back->url_sav
+      || (!*back->r.etag && !*back->r.lastmodified))
+    return;
+  key = url_key(back->url_adr, back->url_fil);
+  if (!key)
+    return;
+  sqlite3_bind_text(validator_store, 1, key, -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(validator_store, 2, back->r.etag, -1,
+                    SQLITE_TRANSIENT);
+  sqlite3_bind_text(validator_store, 3, back->r.lastmodified, -1,
+                    SQLITE_TRANSIENT);
+  sqlite3_bind_text(validator_store, 4, back->url_sav, -1,
+                    SQLITE_TRANSIENT);
+  free(key);
+  if (sqlite3_step(validator_store) == SQLITE_DONE) {
+    validator_stored++;
+    if (++validator_changes >= VALIDATOR_COMMIT_INTERVAL) {
+      if (   sqlite3_exec(validator_db, "COMMIT", 0, 0, 0) != SQLITE_OK
+          || sqlite3_exec(validator_db, "BEGIN", 0, 0, 0) != SQLITE_OK)
+        validator_error();
+      validator_changes = 0;
+    }
+  }
+  else {
+    validator_error();
+  }
+  sqlite3_reset(validator_store);
+}
+#endif
+
+/* return: a dictionary with the statistics of the validator cache of
+           the current or last mirror, or None
+*/
+static PyObject *build_validator_stats(void) {
+  if (!validators_enabled) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  return Py_BuildValue("{s:l,s:l,s:l,s:l,s:l}",
+                       "hits", validator_hits,
+                       "misses", validator_misses,
+                       "not_modified", validator_not_modified,
+                       "stored", validator_stored,
+                       "dropped", validator_dropped);
+}
+
+/* Per-host rate limits.
+
+   If the first handler has an attribute host_limits, it must be a
+   mapping {host: limit}, where limit is either a number of requests
+   per second, or a tuple (requests_per_second, burst). The key
+   '__default__' gives the limit of the hosts not mentioned explicitly;
+   without it, these hosts are not limited, but their requests are
+   counted too.
+
+   Each host has a token bucket, which holds up to burst tokens and is
+   refilled with requests_per_second tokens per second. httrack sends
+   the requests from its main loop, so the glue never waits for a
+   token there: when check_link accepts a link whose host has no
+   token, the link is refused for now, and kept in the queue of the
+   host. The loop callback takes the queued URLs whose host has a
+   token again, and gives them to httrack with hts_addurl(); the
+   transfers of the other hosts go on in the meantime. Only if httrack
+   has nothing else to do, the loop callback waits for the next token,
+   because httrack would end the mirror before the queued URLs are
+   added. send_header counts the requests of each host.
+*/
+
+typedef struct host_url {
+  struct host_url *next;
+  char *url;
+} host_url;
+
+typedef struct {
+  double rate;          /* tokens per second; <= 0: not limited */
+  double burst;
+  double tokens;
+  double last;          /* time of the last refill */
+  long requests, deferred;
+  host_url *queue, *queue_tail;   /* deferred URLs, oldest first */
+  long queued;
+} host_bucket;
+
+static int host_limits_enabled = 0;
+static double host_default_rate, host_default_burst;
+/* host -> host_bucket */
+static str_map host_buckets;
+static pthread_mutex_t host_lock = PTHREAD_MUTEX_INITIALIZER;
+/* the URLs passed to hts_addurl(), until httrack took them; or 0 */
+static char **host_batch = 0;
+
+static void free_host_batch(void) {
+  int i;
+
+  if (!host_batch)
+    return;
+  for (i = 0; host_batch[i]; i++)
+    free(host_batch[i]);
+  free(host_batch);
+  host_batch = 0;
+}
+
+static void free_host_bucket(void *value) {
+  host_bucket *b = value;
+  host_url *u;
+
+  while ((u = b->queue)) {
+    b->queue = u->next;
+    free(u->url);
+    free(u);
+  }
+  free(b);
+}
+
+static void stop_host_limits(void) {
+  str_map_free(&host_buckets);
+  free_host_batch();
+  host_limits_enabled = 0;
+}
+
+/* return: 1 on success; 0 if the value is invalid (Python error set) */
+static int parse_host_limit(PyObject *host, PyObject *v,
+                            double *rate, double *burst) {
+  if (PyTuple_Check(v)) {
+    if (PyTuple_Size(v) == 2) {
+      *rate = PyFloat_AsDouble(PyTuple_GetItem(v, 0));
+      *burst = PyFloat_AsDouble(PyTuple_GetItem(v, 1));
+    }
+    else {
+      *rate = *burst = -1.0;
+      PyErr_SetString(PyExc_TypeError, "tuple (rate, burst) expected");
+    }
+  }
+  else {
+    *rate = PyFloat_AsDouble(v);
+    *burst = *rate;
+  }
+  if (PyErr_Occurred()) {
+    PyErr_Clear();
+    PyErr_Format(PyExc_TypeError, "invalid value in host_limits for %s",
+                 PyString_Check(host) ? PyString_AsString(host) : "?");
+    return 0;
+  }
+  if (*burst < 1.0)
+    *burst = 1.0;
+  return 1;
+}
+
+static host_bucket *new_host_bucket(char *host, double rate, double burst) {
+  host_bucket *b = calloc(1, sizeof(host_bucket));
+  if (!b)
+    return 0;
+  b->rate = rate;
+  b->burst = b->tokens = burst;
+  b->last = now_seconds();
+  if (!str_map_put(&host_buckets, host, b)) {
+    free(b);
+    return 0;
+  }
+  return b;
+}
+
+/* read the setting host_limits.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int start_host_limits(void) {
+  PyObject *limits, *items = 0, *item;
+  double rate, burst;
+  int i, n, ok = 0;
+
+  if (host_buckets.buckets)
+    stop_host_limits();
+  if (   !interp->pCallbackClass
+      || !PyObject_HasAttrString(interp->pCallbackClass, "host_limits"))
+    return 1;
+  limits = PyObject_GetAttrString(interp->pCallbackClass, "host_limits");
+  if (!limits)
+    return 0;
+  if (!PyMapping_Check(limits)) {
+    PyErr_SetString(PyExc_TypeError,
+                    "host_limits attribute must be a mapping object");
+    goto done;
+  }
+  if (!str_map_init(&host_buckets, free_host_bucket)) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  host_default_rate = 0.0;
+  host_default_burst = 1.0;
+  items = PyMapping_Items(limits);
+  if (!items)
+    goto done;
+  n = PyList_Size(items);
+  for (i = 0; i < n; i++) {
+    item = PyList_GetItem(items, i);
+    if (!parse_host_limit(PyTuple_GetItem(item, 0), PyTuple_GetItem(item, 1),
+                          &rate, &burst))
+      goto done;
+    if (!PyString_Check(PyTuple_GetItem(item, 0))) {
+      PyErr_SetString(PyExc_TypeError, "host names must be strings");
+      goto done;
+    }
+    if (!strcmp(PyString_AsString(PyTuple_GetItem(item, 0)), "__default__")) {
+      host_default_rate = rate;
+      host_default_burst = burst;
+    }
+    else if (!new_host_bucket(PyString_AsString(PyTuple_GetItem(item, 0)),
+                              rate, burst)) {
+      PyErr_NoMemory();
+      goto done;
+    }
+  }
+  host_limits_enabled = 1;
+  ok = 1;
+
+done:
+  Py_XDECREF(items);
+  Py_DECREF(limits);
+  if (!ok)
+    stop_host_limits();
+  return ok;
+}
+
+/* copy the host name from adr (without protocol and path) into host */
+static void host_of(char *adr, char *host, int size) {
+  char *cc = strstr(adr, "://");
+  int len;
+
+  if (cc)
+    adr = cc + 3;
+  len = strcspn(adr, "/");
+  if (len >= size)
+    len = size - 1;
+  memcpy(host, adr, len);
+  host[len] = 0;
+}
+
+/* return: the bucket of the host of adr, or 0 if no memory is
+           available. Called with host_lock held.
+*/
+static host_bucket *host_bucket_of(char *adr) {
+  host_bucket *b;
+  char host[256];
+
+  host_of(adr, host, sizeof(host));
+  b = str_map_get(&host_buckets, host);
+  if (!b)
+    b = new_host_bucket(host, host_default_rate, host_default_burst);
+  return b;
+}
+
+static void host_refill(host_bucket *b, double now) {
+  b->tokens += (now - b->last) * b->rate;
+  if (b->tokens > b->burst)
+    b->tokens = b->burst;
+  b->last = now;
+}
+
+/* count a request to the host of adr; called from send_header */
+static void host_limit_request(char *adr) {
+  host_bucket *b;
+
+  pthread_mutex_lock(&host_lock);
+  b = host_bucket_of(adr);
+  if (b)
+    b->requests++;
+  pthread_mutex_unlock(&host_lock);
+}
+
+/* take a token for a link accepted by check_link (res, or status if
+   res is -1), or defer the link if its host has no token.
+   return: the result of check_link; 0 if the link was deferred
+*/
+static int host_limit_link(char *adr, char *fil, int status, int res) {
+  host_bucket *b;
+  host_url *u;
+
+  if (res == 0 || (res == -1 && status == 1))
+    return res;
+  pthread_mutex_lock(&host_lock);
+  b = host_bucket_of(adr);
+  if (b && b->rate > 0.0) {
+    host_refill(b, now_seconds());
+    /* the queued URLs of the host get the next tokens */
+    if (!b->queue && b->tokens >= 1.0) {
+      b->tokens -= 1.0;
+    }
+    else if ((u = malloc(sizeof(host_url)))) {
+      if ((u->url = url_key(adr, fil))) {
+        u->next = 0;
+        if (b->queue_tail)
+          b->queue_tail->next = u;
+        else
+          b->queue = u;
+        b->queue_tail = u;
+        b->queued++;
+        b->deferred++;
+        res = 0;
+      }
+      else
+        free(u);
+    }
+  }
+  pthread_mutex_unlock(&host_lock);
+  return res;
+}
+
+/* give the deferred URLs whose host has a token again to httrack.
+   Called from the loop callback, without the GIL; link is the index of
+   the link httrack is working on, and links the number of links.
+*/
+static void host_limit_release(lien_back *back, int back_max,
+                               int link, int links) {
+  str_entry *e;
+  unsigned long i;
+  host_bucket *b;
+  host_url *u;
+  char **batch = 0, **tmp;
+  struct timespec ts;
+  double wait;
+  int n = 0, busy, k;
+
+  if (host_batch) {
+    /* httrack did not take the last batch yet */
+    if (hts_addurl(0))
+      return;
+    free_host_batch();
+  }
+  busy = link + 1 < links;
+  for (k = 0; !busy && k < back_max; k++)
+    busy = back[k].status > 0;
+  for (;;) {
+    wait = 0.0;
+    e = 0;
+    i = 0;
+    pthread_mutex_lock(&host_lock);
+    while ((e = str_map_next(&host_buckets, &i, e))) {
+      b = e->value;
+      if (!b->queue)
+        continue;
+      host_refill(b, now_seconds());
+      while (b->queue && b->tokens >= 1.0) {
+        tmp = realloc(batch, (n + 2) * sizeof(char *));
+        if (!tmp)
+          break;
+        batch = tmp;
+        u = b->queue;
+        b->queue = u->next;
+        if (!b->queue)
+          b->queue_tail = 0;
+        b->queued--;
+        b->tokens -= 1.0;
+        batch[n++] = u->url;
+        free(u);
+      }
+      if (b->queue && (wait <= 0.0 || (1.0 - b->tokens) / b->rate < wait))
+        wait = (1.0 - b->tokens) / b->rate;
+    }
+    pthread_mutex_unlock(&host_lock);
+    if (n || busy || wait <= 0.0)
+      break;
+    /* nothing else to transfer: waiting delays no other host */
+    ts.tv_sec = (time_t) wait;
+    ts.tv_nsec = (long) ((wait - ts.tv_sec) * 1e9);
+    while (nanosleep(&ts, &ts) && errno == EINTR)
+      ;
+  }
+  if (n) {
+    batch[n] = 0;
+    host_batch = batch;
+    hts_addurl(host_batch);
+  }
+}
+
+/* return: {host: {'rate', 'burst', 'tokens', 'requests', 'deferred',
+           'queued'}} for the current or last mirror, or None
+*/
+static PyObject *build_host_stats(void) {
+  PyObject *res, *d;
+  str_entry *e = 0;
+  unsigned long i = 0;
+  host_bucket *b;
+
+  if (!host_limits_enabled) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  res = PyDict_New();
+  if (!res)
+    return 0;
+  pthread_mutex_lock(&host_lock);
+  while ((e = str_map_next(&host_buckets, &i, e))) {
+    b = e->value;
+    d = Py_BuildValue("{s:d,s:d,s:d,s:l,s:l,s:l}",
+                      "rate", b->rate, "burst", b->burst,
+                      "tokens", b->tokens, "requests", b->requests,
+                      "deferred", b->deferred, "queued", b->queued);
+    if (!d || PyDict_SetItemString(res, e->key, d)) {
+      Py_XDECREF(d);
+      Py_DECREF(res);
+      res = 0;
+      break;
+    }
+    Py_DECREF(d);
+  }
+  pthread_mutex_unlock(&host_lock);
+  return res;
+}
+
+/* Adaptive concurrency control.
+
+   If the first handler has an attribute concurrency_control (a
+   mapping; it may be empty), the options maxsoc, maxconn and timeout
+   are adjusted while the mirror runs. The controller measures the
+   time between send_header and transfer_status of each URL, counts
+   the failed transfers (negative status codes and 5xx), and reads the
+   resident set size of the process. Every interval seconds, in the
+   loop callback, it decides (AIMD):
+
+   - if the error rate is above max_error_rate, or the mean latency
+     above target_latency, or the RSS above max_rss: halve maxsoc and
+     maxconn;
+   - else: increase maxsoc and maxconn by 1.
+
+   If transfers timed out, timeout is doubled; if the controller
+   increased the concurrency without timeouts, timeout is decreased by
+   one second. All values stay within the configured bounds. The
+   changes are written into the httrackp structure passed to the start
+   callback, like the changes of the start and change_options
+   callbacks.
+
+   Keys of concurrency_control (defaults in parentheses):
+     maxsoc (1, 8), maxconn (1.0, 10.0), timeout (10, 120): (min, max)
+     interval (2.0): seconds between two decisions
+     target_latency (5.0): seconds; 0 disables the latency check
+     max_error_rate (0.1)
+     max_rss (0): kB; 0 disables the RSS check
+     min_samples (4): fewer transfers in an interval: no decision,
+                      except for the RSS check
+     log (None): name of a file, where each decision is appended as
+                 a line of comma separated values
+   
+   The decisions are also available from httracklib.controller_log().
+*/
+
+#ifndef STATUSCODE_TIMEOUT
+#define STATUSCODE_TIMEOUT -2
+#endif
+/* transfers started but not finished that we keep track of */
+#define CTL_STARTED_MAX 4096
+/* decisions kept for controller_log() */
+#define CTL_SAMPLES_MAX 100000
+
+typedef struct {
+  double time;
+  int maxsoc, timeout;
+  float maxconn;
+  long transfers, errors, timeouts;
+  double latency;       /* mean, seconds */
+  long rss;             /* kB */
+  char action;          /* '+', '-' or '=' */
+} ctl_sample;
+
+static int ctl_enabled = 0;
+static httrackp *ctl_opt = 0;
+static int ctl_maxsoc_min, ctl_maxsoc_max, ctl_timeout_min, ctl_timeout_max;
+static double ctl_maxconn_min, ctl_maxconn_max;
+static double ctl_interval, ctl_target_latency, ctl_max_error_rate;
+static long ctl_max_rss, ctl_min_samples;
+static FILE *ctl_log = 0;
+/* measurements of the current interval */
+static double ctl_window_start, ctl_latency_sum;
+static long ctl_transfers, ctl_errors, ctl_timeouts, ctl_latencies;
+/* adr+fil -> start time (double) */
+static str_map ctl_started;
+static ctl_sample *ctl_samples = 0;
+static int ctl_nsamples = 0, ctl_samples_size = 0;
+
+/* get the number d[key], if it exists.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int mapping_double(PyObject *d, char *key, double *v) {
+  PyObject *o;
+  double tmp;
+
+  if (!PyMapping_HasKeyString(d, key))
+    return 1;
+  o = PyMapping_GetItemString(d, key);
+  if (!o)
+    return 0;
+  tmp = PyFloat_AsDouble(o);
+  Py_DECREF(o);
+  if (tmp == -1.0 && PyErr_Occurred()) {
+    PyErr_Format(PyExc_TypeError, "invalid value for %s", key);
+    return 0;
+  }
+  *v = tmp;
+  return 1;
+}
+
+/* get the tuple d[key] == (min, max), if it exists.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int mapping_bounds(PyObject *d, char *key, double *lo, double *hi) {
+  PyObject *o;
+  int ok;
+
+  if (!PyMapping_HasKeyString(d, key))
+    return 1;
+  o = PyMapping_GetItemString(d, key);
+  if (!o)
+    return 0;
+  ok = PyTuple_Check(o) && PyArg_ParseTuple(o, "dd", lo, hi) && *lo <= *hi;
+  Py_DECREF(o);
+  if (!ok) {
+    PyErr_Clear();
+    PyErr_Format(PyExc_TypeError, "%s must be a tuple (min, max)", key);
+  }
+  return ok;
+}
+
+static void stop_controller(void) {
+  str_map_free(&ctl_started);
+  if (ctl_log) {
+    fclose(ctl_log);
+    ctl_log = 0;
+  }
+  ctl_opt = 0;
+}
+
+/* read the setting concurrency_control.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int start_controller(void) {
+  PyObject *d, *log = 0;
+  double maxsoc_min = 1, maxsoc_max = 8, timeout_min = 10, timeout_max = 120;
+  double max_rss = 0, min_samples = 4;
+  int ok = 0;
+
+  ctl_enabled = 0;
+  ctl_nsamples = 0;
+  if (   !interp->pCallbackClass
+      || !PyObject_HasAttrString(interp->pCallbackClass,
+                                 "concurrency_control"))
+    return 1;
+  d = PyObject_GetAttrString(interp->pCallbackClass, "concurrency_control");
+  if (!d)
+    return 0;
+  if (!PyMapping_Check(d)) {
+    PyErr_SetString(PyExc_TypeError,
+                    "concurrency_control attribute must be a mapping object");
+    goto done;
+  }
+  ctl_maxconn_min = 1.0;
+  ctl_maxconn_max = 10.0;
+  ctl_interval = 2.0;
+  ctl_target_latency = 5.0;
+  ctl_max_error_rate = 0.1;
+  if (   !mapping_bounds(d, "maxsoc", &maxsoc_min, &maxsoc_max)
+      || !mapping_bounds(d, "maxconn", &ctl_maxconn_min, &ctl_maxconn_max)
+      || !mapping_bounds(d, "timeout", &timeout_min, &timeout_max)
+      || !mapping_double(d, "interval", &ctl_interval)
+      || !mapping_double(d, "target_latency", &ctl_target_latency)
+      || !mapping_double(d, "max_error_rate", &ctl_max_error_rate)
+      || !mapping_double(d, "max_rss", &max_rss)
+      || !mapping_double(d, "min_samples", &min_samples))
+    goto done;
+  ctl_maxsoc_min = maxsoc_min < 1 ? 1 : (int) maxsoc_min;
+  ctl_maxsoc_max = maxsoc_max < ctl_maxsoc_min ? ctl_maxsoc_min
+                                               : (int) maxsoc_max;
+  ctl_timeout_min = (int) timeout_min;
+  ctl_timeout_max = (int) timeout_max;
+  ctl_max_rss = (long) max_rss;
+  ctl_min_samples = (long) min_samples;
+
+  if (PyMapping_HasKeyString(d, "log")) {
+    log = PyMapping_GetItemString(d, "log");
+    if (!log)
+      goto done;
+    if (log != Py_None) {
+      if (!PyString_Check(log)) {
+        PyErr_SetString(PyExc_TypeError, "log must be a file name");
+        goto done;
+      }
+      ctl_log = fopen(PyString_AsString(log), "a");
+      if (!ctl_log) {
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, PyString_AsString(log));
+        goto done;
+      }
+    }
+  }
+  if (!str_map_init(&ctl_started, free)) {
+    PyErr_NoMemory();
+    goto done;
+  }
+  ctl_enabled = 1;
+  ok = 1;
+
+done:
+  Py_XDECREF(log);
+  Py_DECREF(d);
+  if (!ok)
+    stop_controller();
+  return ok;
+}
+
+/* apply the configured bounds to the options */
+static void controller_clamp(httrackp *opt) {
+  if (opt->maxsoc < ctl_maxsoc_min) opt->maxsoc = ctl_maxsoc_min;
+  if (opt->maxsoc > ctl_maxsoc_max) opt->maxsoc = ctl_maxsoc_max;
+  if (opt->maxconn < ctl_maxconn_min) opt->maxconn = ctl_maxconn_min;
+  if (opt->maxconn > ctl_maxconn_max) opt->maxconn = ctl_maxconn_max;
+  if (opt->timeout < ctl_timeout_min) opt->timeout = ctl_timeout_min;
+  if (opt->timeout > ctl_timeout_max) opt->timeout = ctl_timeout_max;
+}
+
+/* the start callback was executed: from now on, opt is controlled */
+static void controller_attach(httrackp *opt) {
+  if (!ctl_enabled)
+    return;
+  ctl_opt = opt;
+  controller_clamp(opt);
+  ctl_window_start = now_seconds();
+  ctl_latency_sum = 0.0;
+  ctl_transfers = ctl_errors = ctl_timeouts = ctl_latencies = 0;
+}
+
+/* return: the resident set size of this process in kB, or 0 */
+static long read_rss(void) {
+  FILE *f = fopen("/proc/self/statm", "r");
+  long size, resident = 0;
+
+  if (!f)
+    return 0;
+  if (fscanf(f, "%ld %ld", &size, &resident) != 2)
+    resident = 0;
+  fclose(f);
+  return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void controller_send_header(char *adr, char *fil) {
+  double *start;
+  char *key;
+
+  if (!ctl_opt)
+    return;
+  key = url_key(adr, fil);
+  start = malloc(sizeof(double));
+  if (!key || !start) {
+    free(key);
+    free(start);
+    return;
+  }
+  /* transfer_status removes the entries; drop the oldest one, if many
+     transfers never finished
+  */
+  if (ctl_started.count >= CTL_STARTED_MAX)
+    str_map_drop_oldest(&ctl_started);
+  *start = now_seconds();
+  if (!str_map_put(&ctl_started, key, start))
+    free(start);
+  free(key);
+}
+
+static void controller_transfer_status(lien_back *back) {
+  double *start;
+  char *key;
+
+  if (!ctl_opt || !back)
+    return;
+  ctl_transfers++;
+  if (back->r.statuscode < 0 || back->r.statuscode >= 500)
+    ctl_errors++;
+  if (back->r.statuscode == STATUSCODE_TIMEOUT)
+    ctl_timeouts++;
+  key = url_key(back->url_adr, back->url_fil);
+  if (!key)
+    return;
+  start = str_map_take(&ctl_started, key);
+  free(key);
+  if (start) {
+    ctl_latency_sum += now_seconds() - *start;
+    ctl_latencies++;
+    free(start);
+  }
+}
+
+static void controller_decide(double now) {
+  ctl_sample *s;
+  double latency = ctl_latencies ? ctl_latency_sum / ctl_latencies : 0.0;
+  long rss = read_rss();
+  int rss_high = ctl_max_rss > 0 && rss > ctl_max_rss;
+  char action = '=';
+
+  if (rss_high || ctl_transfers >= ctl_min_samples) {
+    if (   rss_high
+        || (double) ctl_errors / ctl_transfers > ctl_max_error_rate
+        || (ctl_target_latency > 0.0 && latency > ctl_target_latency)) {
+      action = '-';
+      ctl_opt->maxsoc /= 2;
+      ctl_opt->maxconn /= 2;
+    }
+    else {
+      action = '+';
+      ctl_opt->maxsoc++;
+      ctl_opt->maxconn += 1.0;
+    }
+    if (ctl_timeouts)
+      ctl_opt->timeout *= 2;
+    else if (action == '+')
+      ctl_opt->timeout--;
+    controller_clamp(ctl_opt);
+  }
+  else {
+    ctl_window_start = now;
+  }
+
+  if (ctl_nsamples == ctl_samples_size && ctl_nsamples < CTL_SAMPLES_MAX) {
+    s = realloc(ctl_samples, (ctl_samples_size + 256) * sizeof(ctl_sample));
+    if (s) {
+      ctl_samples = s;
+      ctl_samples_size += 256;
+    }
+  }
+  if (ctl_nsamples < ctl_samples_size) {
+    s = &ctl_samples[ctl_nsamples++];
+    s->time = now;
+    s->maxsoc = ctl_opt->maxsoc;
+    s->maxconn = ctl_opt->maxconn;
+    s->timeout = ctl_opt->timeout;
+    s->transfers = ctl_transfers;
+    s->errors = ctl_errors;
+    s->timeouts = ctl_timeouts;
+    s->latency = latency;
+    s->rss = rss;
+    s->action = action;
+  }
+  if (ctl_log) {
+    fprintf(ctl_log, "%.3f,%c,%d,%.2f,%d,%ld,%ld,%ld,%.4f,%ld\n",
+            now, action, ctl_opt->maxsoc, ctl_opt->maxconn, ctl_opt->timeout,
+            ctl_transfers, ctl_errors, ctl_timeouts, latency, rss);
+    fflush(ctl_log);
+  }
+  if (action == '=')
+    return;
+  ctl_window_start = now;
+  ctl_latency_sum = 0.0;
+  ctl_transfers = ctl_errors = ctl_timeouts = ctl_latencies = 0;
+}
+
+static void controller_loop(void) {
+  double now;
+
+  if (!ctl_opt)
+    return;
+  now = now_seconds();
+  if (now - ctl_window_start >= ctl_interval)
+    controller_decide(now);
+}
+
+/* return: [{'time', 'action', 'maxsoc', 'maxconn', 'timeout',
+            'transfers', 'errors', 'timeouts', 'latency', 'rss'}] for
+           the current or last mirror, or None
+*/
+static PyObject *build_controller_log(void) {
+  PyObject *res, *d;
+  ctl_sample *s;
+  int i;
+
+  if (!ctl_enabled) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  res = PyList_New(0);
+  if (!res)
+    return 0;
+  for (i = 0; i < ctl_nsamples; i++) {
+    s = &ctl_samples[i];
+    d = Py_BuildValue("{s:d,s:c,s:i,s:d,s:i,s:l,s:l,s:l,s:d,s:l}",
+                      "time", s->time, "action", s->action,
+                      "maxsoc", s->maxsoc, "maxconn", (double) s->maxconn,
+                      "timeout", s->timeout, "transfers", s->transfers,
+                      "errors", s->errors, "timeouts", s->timeouts,
+                      "latency", s->latency, "rss", s->rss);
+    if (!d || PyList_Append(res, d)) {
+      Py_XDECREF(d);
+      Py_DECREF(res);
+      return 0;
+    }
+    Py_DECREF(d);
+  }
+  return res;
+}
+
+/* Decision cache.
+
+   If the setting decision_cache (attribute of the first handler, or
+   environment variable HTTRACK_PY_DECISION_CACHE) is greater than 0,
+   the results of check_link, link_detected and link_detected2 are
+   stored in a table of that many entries, and the Python methods are
+   not called again for the same arguments. The key is made of the
+   callback, the normalized URL (lower case protocol and host, without
+   "#fragment"), the tag (link_detected2) and the status (check_link).
+   If the table is full, the least recently used entry is removed.
+   Results of calls that raised an exception are not stored.
+
+   Only use the cache, if the methods always return the same value for
+   the same arguments, or call httracklib.decision_cache_invalidate(),
+   when the answer changes.
+
+   The table is protected by the GIL.
+*/
+
+typedef struct dc_entry {
+  struct dc_entry *prev, *next; /* LRU list; the head is the newest */
+  int result;
+  int url_off;                  /* position of the URL in key */
+  char key[1];
+} dc_entry;
+
+static long dc_capacity = 0;
+static long dc_hits, dc_misses, dc_evictions, dc_invalidations;
+/* key -> dc_entry; the entries are owned by dc_first/dc_last */
+static str_map dc_map;
+static dc_entry *dc_first = 0, *dc_last = 0;
+
+static void dc_unlink(dc_entry *e) {
+  if (e->prev) e->prev->next = e->next; else dc_first = e->next;
+  if (e->next) e->next->prev = e->prev; else dc_last = e->prev;
+  e->prev = e->next = 0;
+}
+
+static void dc_push(dc_entry *e) {
+  e->prev = 0;
+  e->next = dc_first;
+  if (dc_first) dc_first->prev = e; else dc_last = e;
+  dc_first = e;
+}
+
+static void dc_remove(dc_entry *e) {
+  dc_unlink(e);
+  str_map_take(&dc_map, e->key);
+  free(e);
+}
+
+static void dc_clear(void) {
+  while (dc_first)
+    dc_remove(dc_first);
+}
+
+static void stop_decision_cache(void) {
+  dc_clear();
+  str_map_free(&dc_map);
+  dc_capacity = 0;
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_decision_cache(void) {
+  if (dc_map.buckets)
+    stop_decision_cache();
+  dc_hits = dc_misses = dc_evictions = dc_invalidations = 0;
+  dc_capacity = get_setting_long("decision_cache",
+                                 "HTTRACK_PY_DECISION_CACHE", 0);
+  if (dc_capacity <= 0) {
+    dc_capacity = 0;
+    return 1;
+  }
+  if (!str_map_init(&dc_map, 0)) {
+    dc_capacity = 0;
+    PyErr_NoMemory();
+    return 0;
+  }
+  return 1;
+}
+
+/* return: the normalized URL (to be freed by the caller), or 0 if no
+           memory is available
+*/
+static char *normalize_url(char *url) {
+  char *res, *cc, *host;
+  int len = strcspn(url, "#");
+
+  res = malloc(len + 1);
+  if (!res)
+    return 0;
+  memcpy(res, url, len);
+  res[len] = 0;
+  cc = strstr(res, "://");
+  if (cc) {
+    /* protocol and host are not case sensitive; the path may be. A
+       URL without "://" may be a relative path, and is not changed
+    */
+    host = cc + 3;
+    for (cc = res; *cc && cc < host + strcspn(host, "/"); cc++) {
+      if (*cc >= 'A' && *cc <= 'Z')
+        *cc += 'a' - 'A';
+    }
+  }
+  return res;
+}
+
+/* build the key of a decision: kind is the callback ('c', 'l', 't') */
+static dc_entry *dc_new(char kind, char *url, char *tag, int status) {
+  dc_entry *e;
+  char prefix[64], *nurl;
+  int plen;
+
+  nurl = normalize_url(url);
+  if (!nurl)
+    return 0;
+  plen = snprintf(prefix, sizeof(prefix), "%c%d\t", kind, status);
+  e = malloc(sizeof(dc_entry) + plen + strlen(tag) + 1 + strlen(nurl));
+  if (e) {
+    e->prev = e->next = 0;
+    sprintf(e->key, "%s%s\t%s", prefix, tag, nurl);
+    e->url_off = plen + strlen(tag) + 1;
+  }
+  free(nurl);
+  return e;
+}
+
+/* look up a decision. If it is not known, *pe is the new entry to be
+   passed to dc_store(), or 0.
+   return: 1 if the decision was found (stored in *result), else 0
+*/
+static int dc_lookup(char kind, char *url, char *tag, int status,
+                     int *result, dc_entry **pe) {
+  dc_entry *e, *found;
+
+  *pe = 0;
+  e = dc_new(kind, url, tag, status);
+  if (!e)
+    return 0;
+  found = str_map_get(&dc_map, e->key);
+  if (found) {
+    free(e);
+    dc_hits++;
+    dc_unlink(found);
+    dc_push(found);
+    *result = found->result;
+    return 1;
+  }
+  dc_misses++;
+  *pe = e;
+  return 0;
+}
+
+/* store the decision for the entry returned by dc_lookup() */
+static void dc_store(dc_entry *e, int result) {
+  e->result = result;
+  if (!str_map_put(&dc_map, e->key, e)) {
+    free(e);
+    return;
+  }
+  dc_push(e);
+  while (dc_map.count > dc_capacity && dc_last) {
+    dc_remove(dc_last);
+    dc_evictions++;
+  }
+}
+
+static PyObject *build_decision_cache_stats(void) {
+  if (!dc_map.buckets) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  return Py_BuildValue("{s:l,s:l,s:l,s:l,s:l,s:l}",
+                       "hits", dc_hits, "misses", dc_misses,
+                       "evictions", dc_evictions,
+                       "invalidations", dc_invalidations,
+                       "size", (long) dc_map.count,
+                       "capacity", dc_capacity);
+}
+
+/* remove the decisions for the URL url, or for all URLs of the host
+   host, or all decisions, if both are 0.
+   return: the number of removed entries
+*/
+static long dc_invalidate(char *url, char *host) {
+  dc_entry *e, *next;
+  char *nurl = 0, h[256];
+  long n = 0;
+
+  if (url && !(nurl = normalize_url(url)))
+    return 0;
+  for (e = dc_first; e; e = next) {
+    next = e->next;
+    if (nurl && strcmp(e->key + e->url_off, nurl))
+      continue;
+    if (host) {
+      host_of(e->key + e->url_off, h, sizeof(h));
+      if (strcasecmp(h, host))
+        continue;
+    }
+    dc_remove(e);
+    n++;
+  }
+  free(nurl);
+  dc_invalidations += n;
+  return n;
+}
+
+/* Metrics exporter.
+
+   If the first handler has an attribute metrics_address, or if the
+   environment variable HTTRACK_PY_METRICS is set, a thread serves the
+   counters of the mirror in the Prometheus text format. An address
+   containing a '/' is the path of a Unix socket; otherwise it is
+   "[host:]port" of a TCP socket (default host: 127.0.0.1). Every
+   connection gets one HTTP response with the current values, so the
+   address can be scraped by Prometheus directly (TCP), or through
+   curl --unix-socket.
+
+   The values are maintained natively: the engine statistics from
+   loop, the status codes and sizes from transfer_status, and the
+   duration of each hts_py_* call (including the wait for the GIL).
+   The Python methods loop and transfer_status are not needed.
+*/
+
+#define MT_CODES 64
+#define MT_BUCKETS 6
+
+static double mt_bounds[MT_BUCKETS] = { 0.0001, 0.001, 0.01, 0.1, 1, 10 };
+
+typedef struct {
+  long count;
+  double sum;
+  long buckets[MT_BUCKETS];   /* not cumulative */
+} mt_histogram;
+
+static int metrics_enabled = 0, mt_stop;
+static int mt_fd = -1;
+static char *mt_unix_path = 0;
+static pthread_t mt_thread;
+/* protects the values */
+static pthread_mutex_t mt_lock = PTHREAD_MUTEX_INITIALIZER;
+static hts_stat_struct mt_stats;
+static int mt_have_stats, mt_links, mt_links_done;
+static struct { int code; long count; } mt_codes[MT_CODES];
+static int mt_ncodes;
+static long mt_codes_other;
+static LLint mt_transfer_bytes;
+static mt_histogram mt_latency[CB_COUNT];
+/* the hts_py_* call running in this thread */
+static THREAD_LOCAL int mt_cb = -1;
+static THREAD_LOCAL double mt_start;
+
+typedef struct {
+  char *data;
+  size_t len, size;
+} mt_text;
+
+static void mt_printf(mt_text *t, const char *fmt, ...) {
+  va_list ap;
+  size_t size;
+  char *tmp;
+  int n;
+
+  for (;;) {
+    if (t->data) {
+      va_start(ap, fmt);
+      n = vsnprintf(t->data + t->len, t->size - t->len, fmt, ap);
+      va_end(ap);
+      if (n < 0)
+        return;
+      if (t->len + n < t->size) {
+        t->len += n;
+        return;
+      }
+    }
+    size = t->size ? 2 * t->size : 4096;
+    tmp = realloc(t->data, size);
+    if (!tmp)
+      return;
+    t->data = tmp;
+    t->size = size;
+  }
+}
+
+static void mt_metric(mt_text *t, char *name, char *type, char *help,
+                      LLint value) {
+  mt_printf(t, "# HELP %s %s\n# TYPE %s %s\n%s %lli\n",
+            name, help, name, type, name, value);
+}
+
+/* return: the metrics in the Prometheus text format (malloc'ed), or 0
+   if no memory is available
+*/
+static char *metrics_text(void) {
+  mt_text t = { 0, 0, 0 };
+  mt_histogram *h;
+  long cumulative;
+  int cb, i;
+
+  pthread_mutex_lock(&mt_lock);
+  if (mt_have_stats) {
+    mt_metric(&t, "httrack_received_bytes_total", "counter",
+              "Bytes received by the engine.", mt_stats.HTS_TOTAL_RECV);
+    mt_metric(&t, "httrack_written_bytes_total", "counter",
+              "Bytes written to disk.", mt_stats.stat_bytes);
+    mt_metric(&t, "httrack_files_total", "counter",
+              "Files written.", mt_stats.stat_files);
+    mt_metric(&t, "httrack_updated_files_total", "counter",
+              "Files updated.", mt_stats.stat_updated_files);
+    mt_metric(&t, "httrack_requests_total", "counter",
+              "Requests sent.", mt_stats.stat_nrequests);
+    mt_metric(&t, "httrack_errors_total", "counter",
+              "Errors reported by the engine.", mt_stats.stat_errors);
+    mt_metric(&t, "httrack_warnings_total", "counter",
+              "Warnings reported by the engine.", mt_stats.stat_warnings);
+    mt_metric(&t, "httrack_sockets", "gauge",
+              "Open sockets.", mt_stats.stat_nsocket);
+    mt_metric(&t, "httrack_links", "gauge",
+              "Links known to the engine.", mt_links);
+    mt_metric(&t, "httrack_links_processed", "gauge",
+              "Links processed by the engine.", mt_links_done);
+  }
+  mt_metric(&t, "httrack_transfer_bytes_total", "counter",
+            "Size of the finished transfers.", mt_transfer_bytes);
+  mt_printf(&t, "# HELP httrack_transfers_total Finished transfers by "
+                "status code.\n# TYPE httrack_transfers_total counter\n");
+  for (i = 0; i < mt_ncodes; i++)
+    mt_printf(&t, "httrack_transfers_total{code=\"%i\"} %li\n",
+              mt_codes[i].code, mt_codes[i].count);
+  if (mt_codes_other)
+    mt_printf(&t, "httrack_transfers_total{code=\"other\"} %li\n",
+              mt_codes_other);
+  mt_printf(&t, "# HELP httrack_py_callback_seconds Duration of the "
+                "callbacks.\n# TYPE httrack_py_callback_seconds "
+                "histogram\n");
+  for (cb = 0; cb < CB_COUNT; cb++) {
+    h = &mt_latency[cb];
+    if (!h->count)
+      continue;
+    for (i = 0, cumulative = 0; i < MT_BUCKETS; i++) {
+      cumulative += h->buckets[i];
+      mt_printf(&t, "httrack_py_callback_seconds_bucket"
+                    "{callback=\"%s\",le=\"%g\"} %li\n",
+                cb_names[cb], mt_bounds[i], cumulative);
+    }
+    mt_printf(&t, "httrack_py_callback_seconds_bucket"
+                  "{callback=\"%s\",le=\"+Inf\"} %li\n"
+                  "httrack_py_callback_seconds_sum{callback=\"%s\"} %g\n"
+                  "httrack_py_callback_seconds_count{callback=\"%s\"} "
+                  "%li\n",
+              cb_names[cb], h->count, cb_names[cb], h->sum,
+              cb_names[cb], h->count);
+  }
+  pthread_mutex_unlock(&mt_lock);
+  return t.data;
+}
+
+/* read the request line from fd into buf.
+   return: 1 on success; 0 on an error, a timeout or an overlong line
+*/
+static int metrics_read_request(int fd, char *buf, int size) {
+  struct pollfd pfd;
+  int len = 0, n;
+
+  pfd.fd = fd;
+  pfd.events = POLLIN;
+  while (len < size - 1) {
+    if (poll(&pfd, 1, 1000) <= 0)
+      return 0;
+    n = read(fd, buf + len, size - 1 - len);
+    if (n < 0 && errno == EINTR)
+      continue;
+    if (n <= 0)
+      return 0;
+    len += n;
+    buf[len] = 0;
+    if (strchr(buf, '\n'))
+      return 1;
+  }
+  return 0;
+}
+
+/* answer one request on fd: GET /metrics gets the metrics, other
+   requests an error
+*/
+static void metrics_serve(int fd) {
+  char request[4096], head[256], *text = 0, *status, *target;
+  size_t len;
+  int n;
+
+  status = "400 Bad Request";
+  if (metrics_read_request(fd, request, sizeof(request))) {
+    /* method SP target [SP version] */
+    request[strcspn(request, "\r\n")] = 0;
+    target = strchr(request, ' ');
+    if (target) {
+      *target++ = 0;
+      target[strcspn(target, " ?")] = 0;
+      if (strcmp(request, "GET"))
+        status = "405 Method Not Allowed";
+      else if (strcmp(target, "/metrics"))
+        status = "404 Not Found";
+      else
+        status = "200 OK";
+    }
+  }
+  if (*status == '2')
+    text = metrics_text();
+  len = text ? strlen(text) : 0;
+  n = snprintf(head, sizeof(head),
+               "HTTP/1.0 %s\r\n"
+               "Content-Type: text/plain; version=0.0.4\r\n"
+               "Content-Length: %lu\r\n\r\n", status, (unsigned long) len);
+  if (   !write_all(fd, head, n)
+      || (len && !write_all(fd, text, len)))
+    fprintf(stderr, "httrack-py: can't send the metrics: %s\n",
+            strerror(errno));
+  free(text);
+}
+
+static void *metrics_main(void *arg) {
+  struct pollfd pfd;
+  int fd;
+
+  pfd.fd = mt_fd;
+  pfd.events = POLLIN;
+  while (!mt_stop) {
+    if (poll(&pfd, 1, 200) <= 0)
+      continue;
+    fd = accept(mt_fd, 0, 0);
+    if (fd < 0)
+      continue;
+    metrics_serve(fd);
+    close(fd);
+  }
+  return 0;
+}
+
+/* return: the listening socket for address, or -1 (Python error set) */
+static int metrics_listen(char *address) {
+  struct sockaddr_un un;
+  struct addrinfo hints, *ai = 0;
+  char *host = "127.0.0.1", *port = address, *sep;
+  int fd, on = 1, err;
+
+  if (strchr(address, '/')) {
+    if (strlen(address) >= sizeof(un.sun_path)) {
+      PyErr_Format(PyExc_ValueError, "metrics socket path too long: %s",
+                   address);
+      return -1;
+    }
+    memset(&un, 0, sizeof(un));
+    un.sun_family = AF_UNIX;
+    strcpy(un.sun_path, address);
+    unlink(address);
+    fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (   fd < 0 || bind(fd, (struct sockaddr *) &un, sizeof(un))
+        || listen(fd, 16)) {
+      PyErr_SetFromErrnoWithFilename(PyExc_OSError, address);
+      if (fd >= 0)
+        close(fd);
+      return -1;
+    }
+    mt_unix_path = strdup(address);
+    return fd;
+  }
+
+  sep = strrchr(address, ':');
+  if (sep) {
+    *sep = 0;
+    host = address;
+    port = sep + 1;
+  }
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = AI_PASSIVE;
+  err = getaddrinfo(*host ? host : 0, port, &hints, &ai);
+  if (err) {
+    PyErr_Format(PyExc_ValueError, "invalid metrics address %s:%s: %s",
+                 host, port, gai_strerror(err));
+    return -1;
+  }
+  fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+  if (fd >= 0)
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+  if (   fd < 0 || bind(fd, ai->ai_addr, ai->ai_addrlen)
+      || listen(fd, 16)) {
+    PyErr_SetFromErrno(PyExc_OSError);
+    if (fd >= 0)
+      close(fd);
+    fd = -1;
+  }
+  freeaddrinfo(ai);
+  return fd;
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_metrics(void) {
+  char *address;
+
+  address = get_setting_string("metrics_address", "HTTRACK_PY_METRICS");
+  if (!address)
+    return 1;
+  pthread_mutex_lock(&mt_lock);
+  memset(&mt_stats, 0, sizeof(mt_stats));
+  mt_have_stats = mt_links = mt_links_done = 0;
+  mt_ncodes = 0;
+  mt_codes_other = 0;
+  mt_transfer_bytes = 0;
+  memset(mt_latency, 0, sizeof(mt_latency));
+  pthread_mutex_unlock(&mt_lock);
+  mt_fd = metrics_listen(address);
+  free(address);
+  if (mt_fd < 0)
+    return 0;
+  mt_stop = 0;
+  if (pthread_create(&mt_thread, 0, metrics_main, 0)) {
+    close(mt_fd);
+    mt_fd = -1;
+    PyErr_SetString(PyExc_RuntimeError, "can't start the metrics thread");
+    return 0;
+  }
+  metrics_enabled = 1;
+  return 1;
+}
+
+static void stop_metrics(void) {
+  if (!metrics_enabled)
+    return;
+  metrics_enabled = 0;
+  mt_stop = 1;
+  /* the thread does not need the GIL */
+  pthread_join(mt_thread, 0);
+  close(mt_fd);
+  mt_fd = -1;
+  if (mt_unix_path) {
+    unlink(mt_unix_path);
+    free(mt_unix_path);
+    mt_unix_path = 0;
+  }
+}
+
+static void metrics_loop(int lien_tot, int lien_ntot,
+                         hts_stat_struct *stats) {
+  pthread_mutex_lock(&mt_lock);
+  if (stats) {
+    mt_stats = *stats;
+    mt_have_stats = 1;
+  }
+  mt_links = lien_tot;
+  mt_links_done = lien_ntot;
+  pthread_mutex_unlock(&mt_lock);
+}
+
+static void metrics_transfer_status(lien_back *back) {
+  int i;
+
+  pthread_mutex_lock(&mt_lock);
+  for (i = 0; i < mt_ncodes && mt_codes[i].code != back->r.statuscode; i++)
+    ;
+  if (i < mt_ncodes) {
+    mt_codes[i].count++;
+  }
+  else if (i < MT_CODES) {
+    mt_codes[i].code = back->r.statuscode;
+    mt_codes[i].count = 1;
+    mt_ncodes++;
+  }
+  else {
+    mt_codes_other++;
+  }
+  if (back->r.size > 0)
+    mt_transfer_bytes += back->r.size;
+  pthread_mutex_unlock(&mt_lock);
+}
+
+/* an hts_py_* call for the callback cb starts in this thread; called
+   before the GIL is acquired
+*/
+static void metrics_enter(int cb) {
+  if (!metrics_enabled)
+    return;
+  mt_cb = cb;
+  mt_start = now_seconds();
+}
+
+/* the hts_py_* call of this thread ends */
+static void metrics_leave(void) {
+  mt_histogram *h;
+  double seconds;
+  int i;
+
+  if (mt_cb < 0)
+    return;
+  seconds = now_seconds() - mt_start;
+  h = &mt_latency[mt_cb];
+  for (i = 0; i < MT_BUCKETS && seconds > mt_bounds[i]; i++)
+    ;
+  pthread_mutex_lock(&mt_lock);
+  h->count++;
+  h->sum += seconds;
+  if (i < MT_BUCKETS)
+    h->buckets[i]++;
+  pthread_mutex_unlock(&mt_lock);
+  mt_cb = -1;
+}
+
+/* return: the current metrics as a string */
+static PyObject *build_metrics_text(void) {
+  PyObject *res;
+  char *text = metrics_text();
+
+  if (!text)
+    return PyErr_NoMemory();
+  res = PyString_FromString(text);
+  free(text);
+  return res;
+}
+
+/* Background writer.
+
+   A bg_writer collects records in blocks in memory; full blocks are
+   queued and written by a thread of their own, which also encodes
+   them (write_block), so the callbacks don't wait for the
+   compression and the disk. A record is never split between two
+   blocks. If more than BG_MAX_QUEUED blocks are waiting, the
+   producer waits for the writer.
+*/
+
+#define BG_MAX_QUEUED 64
+
+typedef struct bg_block {
+  struct bg_block *next;
+  size_t len;
+  char data[1];
+} bg_block;
+
+typedef struct bg_writer {
+  int fd;
+  char *path;
+  /* encode and write one block; called by the writer thread, which
+     counts the bytes written with bg_count_out().
+     return: 1 on success, 0 on a write error (errno set)
+  */
+  int (*write_block)(struct bg_writer *w, char *data, size_t len);
+  pthread_t thread;
+  pthread_mutex_t lock;
+  pthread_cond_t cond;
+  bg_block *head, *tail;          /* queue of full blocks */
+  int queued, stop, running;
+  bg_block *current;              /* the block being filled */
+  size_t block_size;
+  long blocks;
+  LLint bytes_in, bytes_out;      /* protected by lock */
+} bg_writer;
+
+/* add n to the bytes written; called by the writer thread */
+static void bg_count_out(bg_writer *w, size_t n) {
+  pthread_mutex_lock(&w->lock);
+  w->bytes_out += n;
+  pthread_mutex_unlock(&w->lock);
+}
+
+static bg_block *bg_new_block(size_t size) {
+  bg_block *b = malloc(sizeof(bg_block) + size);
+  if (b) {
+    b->next = 0;
+    b->len = 0;
+  }
+  return b;
+}
+
+static void *bg_main(void *arg) {
+  bg_writer *w = arg;
+  bg_block *b;
+
+  pthread_mutex_lock(&w->lock);
+  for (;;) {
+    while (!w->head && !w->stop)
+      pthread_cond_wait(&w->cond, &w->lock);
+    b = w->head;
+    if (!b)
+      break;
+    w->head = b->next;
+    if (!w->head)
+      w->tail = 0;
+    w->queued--;
+    pthread_cond_broadcast(&w->cond);
+    pthread_mutex_unlock(&w->lock);
+    if (w->fd >= 0 && !w->write_block(w, b->data, b->len)) {
+      fprintf(stderr, "httrack-py: can't write %s: %s\n",
+              w->path, strerror(errno));
+      close(w->fd);
+      w->fd = -1;
+    }
+    free(b);
+    pthread_mutex_lock(&w->lock);
+  }
+  pthread_mutex_unlock(&w->lock);
+  return 0;
+}
+
+/* create the file path, write header into it, and start the writer
+   thread.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int bg_writer_open(bg_writer *w, char *path, size_t block_size,
+                          int (*write_block)(bg_writer *, char *, size_t),
+                          char *header, size_t header_len) {
+  memset(w, 0, sizeof(bg_writer));
+  w->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  if (w->fd < 0 || !write_all(w->fd, header, header_len)) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    if (w->fd >= 0)
+      close(w->fd);
+    return 0;
+  }
+  w->path = strdup(path);
+  w->write_block = write_block;
+  w->block_size = block_size;
+  w->bytes_out = header_len;
+  pthread_mutex_init(&w->lock, 0);
+  pthread_cond_init(&w->cond, 0);
+  if (!w->path || pthread_create(&w->thread, 0, bg_main, w)) {
+    PyErr_SetString(PyExc_RuntimeError, "can't start the writer thread");
+    close(w->fd);
+    free(w->path);
+    return 0;
+  }
+  w->running = 1;
+  return 1;
+}
+
+/* queue the current block. Called with w->lock held */
+static void bg_queue_current(bg_writer *w) {
+  bg_block *b = w->current;
+
+  if (!b || !b->len)
+    return;
+  while (w->queued >= BG_MAX_QUEUED)
+    pthread_cond_wait(&w->cond, &w->lock);
+  if (w->tail)
+    w->tail->next = b;
+  else
+    w->head = b;
+  w->tail = b;
+  w->queued++;
+  w->blocks++;
+  w->current = 0;
+  pthread_cond_broadcast(&w->cond);
+}
+
+/* append the record made of the n parts data[i], len[i] */
+static void bg_writer_append(bg_writer *w, int n, const void **data,
+                             size_t *len) {
+  size_t total = 0, size;
+  bg_block *b;
+  int i;
+
+  if (!w->running)
+    return;
+  for (i = 0; i < n; i++)
+    total += len[i];
+  pthread_mutex_lock(&w->lock);
+  b = w->current;
+  if (b && b->len + total > w->block_size)
+    bg_queue_current(w);
+  if (!w->current) {
+    size = total > w->block_size ? total : w->block_size;
+    w->current = bg_new_block(size);
+    if (!w->current) {
+      pthread_mutex_unlock(&w->lock);
+      return;
+    }
+  }
+  b = w->current;
+  for (i = 0; i < n; i++) {
+    memcpy(b->data + b->len, data[i], len[i]);
+    b->len += len[i];
+  }
+  w->bytes_in += total;
+  pthread_mutex_unlock(&w->lock);
+}
+
+/* write all records, stop the writer thread and close the file */
+static void bg_writer_close(bg_writer *w) {
+  if (!w->running)
+    return;
+  pthread_mutex_lock(&w->lock);
+  bg_queue_current(w);
+  w->stop = 1;
+  pthread_cond_broadcast(&w->cond);
+  pthread_mutex_unlock(&w->lock);
+  pthread_join(w->thread, 0);
+  if (w->fd >= 0)
+    close(w->fd);
+  free(w->current);
+  free(w->path);
+  w->current = 0;
+  w->path = 0;
+  w->running = 0;
+  pthread_mutex_destroy(&w->lock);
+  pthread_cond_destroy(&w->cond);
+}
+
+/* Event log.
+
+   If the first handler has an attribute event_log, or if the
+   environment variable HTTRACK_PY_EVENT_LOG is set, the glue records
+   the check_link decisions, the finished transfers and the names of
+   the saved files into this file, without calling Python. The file
+   starts with the magic "HTSEVLG1"; then follow zlib compressed blocks
+   of event_log_block_size (HTTRACK_PY_EVENT_LOG_BLOCK; default: 256 KB)
+   bytes, each with the header
+
+     char magic[4] = "HEVB"; uint32 compressed_len, raw_len;
+
+   A block contains records of the form (native byte order)
+
+     uint32 len;      length of the record, including this field
+     uint8 type;      EV_* constant
+     uint8 nstrings;
+     uint16 reserved;
+     double time;
+     int64 a, b;      check_link: status, result
+                      transfer:   statuscode, size
+                      save_name:  0, 0
+     then nstrings times: uint32 len; char data[len]
+                      check_link: url
+                      transfer:   url, content type
+                      save_name:  url, file name
+
+   httracktools.EventLogReader reads the file.
+*/
+
+#define EV_MAGIC "HTSEVLG1"
+#define EV_BLOCK_MAGIC "HEVB"
+
+enum { EV_CHECK_LINK = 1, EV_TRANSFER, EV_SAVE_NAME };
+
+typedef struct {
+  uint32_t len;
+  uint8_t type;
+  uint8_t nstrings;
+  uint16_t reserved;
+  double time;
+  int64_t a, b;
+} ev_header;
+
+static int evlog_enabled = 0;
+static bg_writer evlog;
+
+static int evlog_write_block(bg_writer *w, char *data, size_t len) {
+  uLongf clen = compressBound(len);
+  char *out = malloc(12 + clen);
+  uint32_t v;
+  int ok;
+
+  if (!out) {
+    errno = ENOMEM;
+    return 0;
+  }
+  if (compress2((Bytef *) out + 12, &clen, (Bytef *) data, len,
+                Z_DEFAULT_COMPRESSION) != Z_OK) {
+    free(out);
+    errno = EINVAL;
+    return 0;
+  }
+  memcpy(out, EV_BLOCK_MAGIC, 4);
+  v = clen;
+  memcpy(out + 4, &v, 4);
+  v = len;
+  memcpy(out + 8, &v, 4);
+  ok = write_all(w->fd, out, 12 + clen);
+  bg_count_out(w, 12 + clen);
+  free(out);
+  return ok;
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_event_log(void) {
+  char *path;
+  long block_size;
+  int ok;
+
+  path = get_setting_string("event_log", "HTTRACK_PY_EVENT_LOG");
+  if (!path)
+    return 1;
+  block_size = get_setting_long("event_log_block_size",
+                                "HTTRACK_PY_EVENT_LOG_BLOCK", 256 * 1024);
+  if (block_size < 4096)
+    block_size = 4096;
+  ok = bg_writer_open(&evlog, path, block_size, evlog_write_block,
+                      EV_MAGIC, 8);
+  free(path);
+  evlog_enabled = ok;
+  return ok;
+}
+
+static void stop_event_log(void) {
+  if (!evlog_enabled)
+    return;
+  evlog_enabled = 0;
+  bg_writer_close(&evlog);
+}
+
+/* append a record with the URL adr+fil, and the string extra, if it
+   is not 0
+*/
+static void evlog_add(int type, LLint a, LLint b, char *adr, char *fil,
+                      char *extra) {
+  const void *data[5];
+  size_t len[5];
+  uint32_t slen[2];
+  ev_header h;
+  char *url;
+
+  url = url_key(adr, fil);
+  if (!url)
+    return;
+  slen[0] = strlen(url);
+  slen[1] = extra ? strlen(extra) : 0;
+  h.len = sizeof(h) + 4 + slen[0] + (extra ? 4 + slen[1] : 0);
+  h.type = type;
+  h.nstrings = extra ? 2 : 1;
+  h.reserved = 0;
+  h.time = now_seconds();
+  h.a = a;
+  h.b = b;
+  data[0] = &h;
+  len[0] = sizeof(h);
+  data[1] = &slen[0];
+  len[1] = 4;
+  data[2] = url;
+  len[2] = slen[0];
+  data[3] = &slen[1];
+  len[3] = 4;
+  data[4] = extra;
+  len[4] = slen[1];
+  bg_writer_append(&evlog, extra ? 5 : 3, data, len);
+  free(url);
+}
+
+static void evlog_check_link(char *adr, char *fil, int status, int res) {
+  evlog_add(EV_CHECK_LINK, status, res, adr, fil, 0);
+}
+
+static void evlog_transfer(lien_back *back) {
+  evlog_add(EV_TRANSFER, back->r.statuscode, back->r.size,
+            back->url_adr, back->url_fil, back->r.contenttype);
+}
+
+static void evlog_save_name(char *adr, char *fil, char *save) {
+  evlog_add(EV_SAVE_NAME, 0, 0, adr, fil, save);
+}
+
+/* return: None, if the event log was not used, else
+           {'blocks', 'bytes', 'compressed_bytes'}
+*/
+static PyObject *build_event_log_stats(void) {
+  PyObject *res;
+
+  if (!evlog.write_block) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  if (evlog.running)
+    pthread_mutex_lock(&evlog.lock);
+  res = Py_BuildValue("{s:l,s:L,s:L}", "blocks", evlog.blocks,
+                      "bytes", evlog.bytes_in,
+                      "compressed_bytes", evlog.bytes_out);
+  if (evlog.running)
+    pthread_mutex_unlock(&evlog.lock);
+  return res;
+}
+
+/* WARC output.
+
+   If the first handler has an attribute warc_path, or if the
+   environment variable HTTRACK_PY_WARC is set, the transfers are also
+   written into WARC files named <warc_path>-00000.warc.gz,
+   <warc_path>-00001.warc.gz, ... A new file is started when a file
+   gets larger than warc_max_size (HTTRACK_PY_WARC_MAX_SIZE; default:
+   1 GB). Each file starts with a warcinfo record.
+
+   For each URL, the glue keeps the request headers from send_header,
+   and the response headers from receive_header, until the body is
+   known: HTML pages are taken from preprocess_html (the text as
+   received, before httrack rewrites the links), other files from the
+   file written by httrack (save_name tells the file name, save_file
+   that it is complete). The request and response records are then
+   appended to a bg_writer, which compresses each record as a gzip
+   member of its own. Responses whose body never arrived (redirects,
+   errors, ...) are written without body when the mirror ends.
+
+   httrack decodes compressed and chunked transfers before saving them,
+   so the body of a response record is the decoded text: the headers
+   Transfer-Encoding, Content-Encoding and Content-Length are renamed
+   to X-Crawler-Transfer-Encoding, ..., and a Content-Length with the
+   size of the body is added.
+*/
+
+typedef struct {
+  char *request;        /* request headers, or 0 */
+  char *response;       /* response headers, or 0 */
+  char contenttype[64];
+} warc_pending;
+
+static int warc_enabled = 0;
+static bg_writer warc_writer;
+static char *warc_prefix = 0;
+static LLint warc_max_size, warc_file_size;
+static int warc_index;
+static long warc_records;
+static uint64_t warc_id_state;
+/* protected by the GIL: url -> warc_pending; save name -> url */
+static str_map warc_urls = { 0 }, warc_saved = { 0 };
+
+static void warc_free_pending(void *value) {
+  warc_pending *p = value;
+  free(p->request);
+  free(p->response);
+  free(p);
+}
+
+/* return: a new record ID "<urn:uuid:...>" in buf */
+static void warc_record_id(char *buf, int size) {
+  uint64_t a, b;
+
+  /* splitmix64 over a counter seeded once from the time and the pid */
+  a = (warc_id_state += 0x9E3779B97F4A7C15ULL);
+  a = (a ^ (a >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  a = (a ^ (a >> 27)) * 0x94D049BB133111EBULL;
+  a ^= a >> 31;
+  b = (warc_id_state += 0x9E3779B97F4A7C15ULL);
+  b = (b ^ (b >> 30)) * 0xBF58476D1CE4E5B9ULL;
+  b = (b ^ (b >> 27)) * 0x94D049BB133111EBULL;
+  b ^= b >> 31;
+  /* version 4, variant 1 */
+  snprintf(buf, size, "<urn:uuid:%08x-%04x-4%03x-%04x-%012llx>",
+           (unsigned) (a >> 32), (unsigned) (a >> 16) & 0xffff,
+           (unsigned) a & 0xfff, (unsigned) ((b >> 48) & 0x3fff) | 0x8000,
+           (unsigned long long) b & 0xffffffffffffULL);
+}
+
+static void warc_date(char *buf, int size) {
+  time_t t = time(0);
+  struct tm tm;
+  gmtime_r(&t, &tm);
+  strftime(buf, size, "%Y-%m-%dT%H:%M:%SZ", &tm);
+}
+
+/* compress data as one gzip member.
+   return: the member (malloc'ed), or 0 if no memory is available
+*/
+static char *warc_gzip(char *data, size_t len, size_t *outlen) {
+  z_stream z;
+  char *out;
+  size_t size = compressBound(len) + 64;
+
+  out = malloc(size);
+  if (!out)
+    return 0;
+  memset(&z, 0, sizeof(z));
+  if (deflateInit2(&z, Z_DEFAULT_COMPRESSION, Z_DEFLATED, 15 + 16, 8,
+                   Z_DEFAULT_STRATEGY) != Z_OK) {
+    free(out);
+    return 0;
+  }
+  z.next_in = (Bytef *) data;
+  z.avail_in = len;
+  z.next_out = (Bytef *) out;
+  z.avail_out = size;
+  if (deflate(&z, Z_FINISH) != Z_STREAM_END) {
+    deflateEnd(&z);
+    free(out);
+    return 0;
+  }
+  *outlen = z.total_out;
+  deflateEnd(&z);
+  return out;
+}
+
+/* return: the gzipped warcinfo record for the file name (malloc'ed),
+           or 0
+*/
+static char *warc_info(char *name, size_t *outlen) {
+  char id[64], date[32], fields[256], record[1024];
+  int n;
+
+  warc_record_id(id, sizeof(id));
+  warc_date(date, sizeof(date));
+  n = snprintf(fields, sizeof(fields),
+               "software: httrack-py\r\nformat: WARC File Format 1.0\r\n");
+  n = snprintf(record, sizeof(record),
+               "WARC/1.0\r\nWARC-Type: warcinfo\r\nWARC-Record-ID: %s\r\n"
+               "WARC-Date: %s\r\nWARC-Filename: %s\r\n"
+               "Content-Type: application/warc-fields\r\n"
+               "Content-Length: %i\r\n\r\n%s\r\n\r\n",
+               id, date, name, n, fields);
+  return warc_gzip(record, n, outlen);
+}
+
+static char *warc_file_name(int index) {
+  char *name = malloc(strlen(warc_prefix) + 32);
+  if (name)
+    sprintf(name, "%s-%05i.warc.gz", warc_prefix, index);
+  return name;
+}
+
+/* start the next file. Called by the writer thread.
+   return: 1 on success, 0 on an error (errno set)
+*/
+static int warc_rotate(bg_writer *w) {
+  char *name, *info, *base;
+  size_t len;
+  int ok;
+
+  name = warc_file_name(++warc_index);
+  if (!name)
+    return 0;
+  close(w->fd);
+  w->fd = open(name, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  base = strrchr(name, '/');
+  info = warc_info(base ? base + 1 : name, &len);
+  ok = w->fd >= 0 && info && write_all(w->fd, info, len);
+  warc_file_size = len;
+  free(w->path);
+  w->path = name;
+  free(info);
+  return ok;
+}
+
+/* a write_block function: write one record as a gzip member */
+static int warc_write_block(bg_writer *w, char *data, size_t len) {
+  char *gz;
+  size_t gzlen;
+  int ok;
+
+  if (warc_file_size >= warc_max_size && !warc_rotate(w))
+    return 0;
+  gz = warc_gzip(data, len, &gzlen);
+  if (!gz) {
+    errno = ENOMEM;
+    return 0;
+  }
+  ok = write_all(w->fd, gz, gzlen);
+  warc_file_size += gzlen;
+  bg_count_out(w, gzlen);
+  free(gz);
+  return ok;
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_warc(void) {
+  char *name, *info, *base;
+  size_t len;
+  int ok;
+
+  free(warc_prefix);
+  warc_prefix = get_setting_string("warc_path", "HTTRACK_PY_WARC");
+  if (!warc_prefix)
+    return 1;
+  warc_max_size = get_setting_long("warc_max_size",
+                                   "HTTRACK_PY_WARC_MAX_SIZE",
+                                   1024L * 1024 * 1024);
+  if (!warc_id_state)
+    warc_id_state = (uint64_t) (now_seconds() * 1e6) ^ getpid();
+  warc_index = 0;
+  warc_records = 0;
+  name = warc_file_name(0);
+  base = name ? strrchr(name, '/') : 0;
+  info = name ? warc_info(base ? base + 1 : name, &len) : 0;
+  if (   !info || !str_map_init(&warc_urls, warc_free_pending)
+      || !str_map_init(&warc_saved, free)) {
+    free(name);
+    free(info);
+    PyErr_NoMemory();
+    return 0;
+  }
+  warc_file_size = len;
+  /* one record per block */
+  ok = bg_writer_open(&warc_writer, name, 1, warc_write_block, info, len);
+  free(name);
+  free(info);
+  warc_enabled = ok;
+  return ok;
+}
+
+/* return: the pending entry for adr+fil; it is created, if create is
+   true
+*/
+static warc_pending *warc_get(char *adr, char *fil, int create) {
+  warc_pending *p;
+  char *url = url_key(adr, fil);
+
+  if (!url)
+    return 0;
+  p = str_map_get(&warc_urls, url);
+  if (!p && create) {
+    p = calloc(1, sizeof(warc_pending));
+    if (p && !str_map_put(&warc_urls, url, p)) {
+      free(p);
+      p = 0;
+    }
+  }
+  free(url);
+  return p;
+}
+
+/* append a record of the type (request or response) for url */
+static void warc_record(char *type, char *url, char *concurrent,
+                        char *id, char *headers, char *payload_type,
+                        char *body, size_t body_len) {
+  char head[4096], date[32], extra[512];
+  const void *data[5];
+  size_t len[5], hlen;
+  int n;
+
+  /* the headers end with an empty line */
+  hlen = strlen(headers);
+  while (hlen && (headers[hlen - 1] == '\r' || headers[hlen - 1] == '\n'))
+    hlen--;
+  warc_date(date, sizeof(date));
+  n = 0;
+  extra[0] = 0;
+  if (concurrent)
+    n += snprintf(extra + n, sizeof(extra) - n,
+                  "WARC-Concurrent-To: %s\r\n", concurrent);
+  if (payload_type && *payload_type)
+    n += snprintf(extra + n, sizeof(extra) - n,
+                  "WARC-Identified-Payload-Type: %s\r\n", payload_type);
+  n = snprintf(head, sizeof(head),
+               "WARC/1.0\r\nWARC-Type: %s\r\nWARC-Record-ID: %s\r\n"
+               "WARC-Date: %s\r\nWARC-Target-URI: %s%s\r\n%s"
+               "Content-Type: application/http; msgtype=%s\r\n"
+               "Content-Length: %lu\r\n\r\n",
+               type, id, date, url_scheme(url), url,
+               extra, type, (unsigned long) (hlen + 4 + body_len));
+  if (n >= (int) sizeof(head))
+    return;
+  data[0] = head;
+  len[0] = n;
+  data[1] = headers;
+  len[1] = hlen;
+  data[2] = "\r\n\r\n";
+  len[2] = 4;
+  data[3] = body;
+  len[3] = body_len;
+  data[4] = "\r\n\r\n";
+  len[4] = 4;
+  bg_writer_append(&warc_writer, 5, data, len);
+  warc_records++;
+}
+
+/* return: the response headers (malloc'ed), with the headers which
+   describe the transfer renamed, and the Content-Length of the decoded
+   body, or 0 */
+static char *warc_response_headers(char *headers, size_t body_len) {
+  static const char *renamed[] = { "Transfer-Encoding:",
+                                   "Content-Encoding:",
+                                   "Content-Length:", 0 };
+  mt_text t = { 0, 0, 0 };
+  char *line, *end;
+  int len, i;
+
+  for (line = headers; *line; line = end) {
+    end = strchr(line, '\n');
+    end = end ? end + 1 : line + strlen(line);
+    len = (int) (end - line);
+    while (len && (line[len - 1] == '\r' || line[len - 1] == '\n'))
+      len--;
+    if (!len)
+      break;
+    for (i = 0; renamed[i]; i++)
+      if (!strncasecmp(line, renamed[i], strlen(renamed[i])))
+        break;
+    /* the status line is never renamed */
+    mt_printf(&t, "%s%.*s\r\n", line != headers && renamed[i]
+              ? "X-Crawler-" : "", len, line);
+  }
+  mt_printf(&t, "Content-Length: %lu\r\n", (unsigned long) body_len);
+  return t.data;
+}
+
+/* write the records of url, and forget the pending entry */
+static void warc_emit(char *url, warc_pending *p, char *body,
+                      size_t body_len) {
+  char response_id[64], request_id[64];
+  char *headers;
+
+  if (!p->response)
+    return;
+  headers = warc_response_headers(p->response, body_len);
+  if (!headers)
+    return;
+  warc_record_id(response_id, sizeof(response_id));
+  warc_record("response", url, 0, response_id, headers,
+              p->contenttype, body, body_len);
+  free(headers);
+  if (p->request) {
+    warc_record_id(request_id, sizeof(request_id));
+    warc_record("request", url, response_id, request_id, p->request,
+                0, 0, 0);
+  }
+}
+
+static void warc_send_header(char *buf, char *adr, char *fil) {
+  warc_pending *p = warc_get(adr, fil, 1);
+
+  if (!p)
+    return;
+  free(p->request);
+  p->request = strdup(buf);
+}
+
+static void warc_receive_header(char *buf, char *adr, char *fil,
+                                htsblk *incoming) {
+  warc_pending *p = warc_get(adr, fil, 1);
+
+  if (!p)
+    return;
+  free(p->response);
+  p->response = strdup(buf);
+  if (incoming) {
+    snprintf(p->contenttype, sizeof(p->contenttype), "%s",
+             incoming->contenttype);
+  }
+}
+
+/* the body of an HTML page */
+static void warc_html(char *html, int len, char *adr, char *fil) {
+  warc_pending *p;
+  char *url = url_key(adr, fil);
+
+  if (!url)
+    return;
+  p = str_map_take(&warc_urls, url);
+  if (p) {
+    warc_emit(url, p, html, len);
+    warc_free_pending(p);
+  }
+  free(url);
+}
+
+static void warc_save_name(char *adr, char *fil, char *save) {
+  char *url;
+
+  if (!*save)
+    return;
+  url = url_key(adr, fil);
+  if (url && !str_map_put(&warc_saved, save, url))
+    free(url);
+}
+
+/* the file save is complete; its content is the body of the response */
+static void warc_save_file(char *save) {
+  warc_pending *p;
+  struct stat st;
+  char *url, *body = 0;
+  int fd;
+
+  url = str_map_take(&warc_saved, save);
+  if (!url)
+    return;
+  p = str_map_take(&warc_urls, url);
+  if (p) {
+    fd = open(save, O_RDONLY);
+    if (   fd >= 0 && !fstat(fd, &st)
+        && (body = malloc(st.st_size + 1))
+        && read_all(fd, body, st.st_size)) {
+      warc_emit(url, p, body, st.st_size);
+    }
+    else {
+      fprintf(stderr, "httrack-py: can't read %s for the WARC file\n",
+              save);
+    }
+    if (fd >= 0)
+      close(fd);
+    free(body);
+    warc_free_pending(p);
+  }
+  free(url);
+}
+
+/* write the responses without body, and close the file */
+static void stop_warc(void) {
+  unsigned long bucket = 0;
+  str_entry *e = 0;
+
+  if (!warc_enabled)
+    return;
+  warc_enabled = 0;
+  while ((e = str_map_next(&warc_urls, &bucket, e)))
+    warc_emit(e->key, e->value, 0, 0);
+  str_map_free(&warc_urls);
+  str_map_free(&warc_saved);
+  bg_writer_close(&warc_writer);
+}
+
+/* return: None, if no WARC file was written, else
+           {'records', 'files', 'bytes'}
+*/
+static PyObject *build_warc_stats(void) {
+  PyObject *res;
+
+  if (!warc_writer.write_block) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  if (warc_writer.running)
+    pthread_mutex_lock(&warc_writer.lock);
+  res = Py_BuildValue("{s:l,s:i,s:L}", "records", warc_records,
+                      "files", warc_index + 1,
+                      "bytes", warc_writer.bytes_out);
+  if (warc_writer.running)
+    pthread_mutex_unlock(&warc_writer.lock);
+  return res;
+}
+
+/* Pack files.
+
+   If the first handler has an attribute pack_path, or if the
+   environment variable HTTRACK_PY_PACK is set, every file saved by
+   httrack is appended to the pack files <pack_path>-00000.pack,
+   <pack_path>-00001.pack, ... when save_file reports it complete. If
+   pack_remove_files (HTTRACK_PY_PACK_REMOVE_FILES) is greater than 0,
+   the file is then removed from the file system; httrack needs the
+   files to update the mirror, so they are kept by default. A new pack
+   is started when a pack exceeds pack_max_size (HTTRACK_PY_PACK_MAX_SIZE;
+   default: 1 GB). If the packs exist, they are continued; a file
+   saved again replaces the older entry.
+
+   pack_compression (HTTRACK_PY_PACK_COMPRESSION) is "none" (default),
+   "zlib", or "zstd" (only if compiled with HTS_PY_ZSTD).
+
+   An entry of a pack is (native byte order)
+
+     char magic[4] = "HPK1"; uint16 path_len; uint8 compression;
+     uint8 reserved; uint64 raw_len, stored_len;
+     char path[path_len]; char data[stored_len];
+
+   The path is relative to the mirror directory (path_html), if the
+   file is saved below it. The index <pack_path>.idx is a memory
+   mapped hash table:
+
+     char magic[8] = "HTSPKIX1"; uint64 nslots, count;
+     uint32 npacks, reserved;
+     nslots times: uint64 hash; uint32 pack, reserved; uint64 offset;
+
+   hash is the 64 bit FNV-1a hash of the path (0: empty slot; a hash
+   value of 0 is stored as 1), with linear probing. Two paths with the
+   same hash get slots of their own: a slot with the hash is only
+   replaced, if its entry has the same path. offset is the position of
+   the entry in the pack. httracktools.PackReader reads the packs.
+*/
+
+#define PACK_MAGIC "HPK1"
+#define PACK_INDEX_MAGIC "HTSPKIX1"
+#define PACK_INITIAL_SLOTS 65536
+
+enum { PACK_NONE, PACK_ZLIB, PACK_ZSTD };
+
+typedef struct {
+  char magic[4];
+  uint16_t path_len;
+  uint8_t compression;
+  uint8_t reserved;
+  uint64_t raw_len, stored_len;
+} pack_entry;
+
+typedef struct {
+  char magic[8];
+  uint64_t nslots, count;
+  uint32_t npacks, reserved;
+} pack_index_header;
+
+typedef struct {
+  uint64_t hash;
+  uint32_t pack, reserved;
+  uint64_t offset;
+} pack_slot;
+
+static int pack_enabled = 0, pack_remove, pack_compression;
+static char *pack_prefix = 0;
+static char pack_root[1024];
+static LLint pack_max_size;
+static int pack_fd = -1, pack_index_fd = -1;
+static LLint pack_size;
+static pack_index_header *pack_index = 0;
+static long pack_files;
+static LLint pack_bytes, pack_stored;
+static int pack_npacks;
+
+static uint64_t pack_hash(const char *s) {
+  /* FNV-1a, 64 bit */
+  uint64_t h = 14695981039346656037ULL;
+  while (*s) {
+    h = (h ^ (unsigned char) *s++) * 1099511628211ULL;
+  }
+  return h ? h : 1;
+}
+
+static char *pack_name(int index) {
+  char *name = malloc(strlen(pack_prefix) + 32);
+  if (name)
+    sprintf(name, "%s-%05i.pack", pack_prefix, index);
+  return name;
+}
+
+static size_t pack_index_size(uint64_t nslots) {
+  return sizeof(pack_index_header) + nslots * sizeof(pack_slot);
+}
+
+static pack_slot *pack_slots(pack_index_header *h) {
+  return (pack_slot *) (h + 1);
+}
+
+/* map the index file fd with nslots slots.
+   return: the mapping, or 0 (errno set)
+*/
+static pack_index_header *pack_map_index(int fd, uint64_t nslots) {
+  void *p = mmap(0, pack_index_size(nslots), PROT_READ | PROT_WRITE,
+                 MAP_SHARED, fd, 0);
+  return p == MAP_FAILED ? 0 : p;
+}
+
+/* create an empty index with nslots slots in path.
+   return: the file descriptor, or -1 (errno set)
+*/
+static int pack_create_index(char *path, uint64_t nslots, uint32_t npacks) {
+  pack_index_header h;
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0644);
+  if (fd < 0)
+    return -1;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, PACK_INDEX_MAGIC, 8);
+  h.nslots = nslots;
+  h.npacks = npacks;
+  if (   !write_all(fd, &h, sizeof(h))
+      || ftruncate(fd, pack_index_size(nslots))) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+/* return: 1, if the entry at offset in the pack number is the file
+           path, or if it can't be read; else 0
+*/
+static int pack_entry_is(uint32_t pack, uint64_t offset, const char *path) {
+  pack_entry e;
+  char *name = pack_name(pack), *buf;
+  size_t len = strlen(path);
+  int fd, res = 1;
+
+  fd = name ? open(name, O_RDONLY) : -1;
+  free(name);
+  if (fd < 0)
+    return 1;
+  if (pread(fd, &e, sizeof(e), offset) == sizeof(e)) {
+    if (e.path_len != len) {
+      res = 0;
+    }
+    else if ((buf = malloc(len + 1))) {
+      if (pread(fd, buf, len, offset + sizeof(e)) == (ssize_t) len)
+        res = !memcmp(buf, path, len);
+      free(buf);
+    }
+  }
+  close(fd);
+  return res;
+}
+
+/* add the entry of path to the index. If replace is set, a slot with
+   the entry of the same path is reused.
+*/
+static void pack_insert(pack_index_header *h, uint64_t hash, char *path,
+                        uint32_t pack, uint64_t offset, int replace) {
+  pack_slot *slots = pack_slots(h);
+  uint64_t i = hash & (h->nslots - 1);
+
+  while (   slots[i].hash
+         && !(   replace && slots[i].hash == hash
+              && pack_entry_is(slots[i].pack, slots[i].offset, path)))
+    i = (i + 1) & (h->nslots - 1);
+  if (!slots[i].hash)
+    h->count++;
+  slots[i].hash = hash;
+  slots[i].pack = pack;
+  slots[i].offset = offset;
+}
+
+/* double the size of the index.
+   return: 1 on success, 0 on an error (errno set)
+*/
+static int pack_grow_index(void) {
+  pack_index_header *h;
+  pack_slot *slots = pack_slots(pack_index);
+  char *path, *tmp;
+  uint64_t i, nslots = pack_index->nslots * 2;
+  int fd, ok = 0;
+
+  path = malloc(strlen(pack_prefix) + 16);
+  tmp = malloc(strlen(pack_prefix) + 16);
+  if (!path || !tmp) {
+    free(path);
+    free(tmp);
+    errno = ENOMEM;
+    return 0;
+  }
+  sprintf(path, "%s.idx", pack_prefix);
+  sprintf(tmp, "%s.idx.tmp", pack_prefix);
+  fd = pack_create_index(tmp, nslots, pack_index->npacks);
+  h = fd >= 0 ? pack_map_index(fd, nslots) : 0;
+  if (h) {
+    for (i = 0; i < pack_index->nslots; i++) {
+      if (slots[i].hash)
+        pack_insert(h, slots[i].hash, 0, slots[i].pack, slots[i].offset, 0);
+    }
+    if (!rename(tmp, path)) {
+      munmap(pack_index, pack_index_size(pack_index->nslots));
+      close(pack_index_fd);
+      pack_index = h;
+      pack_index_fd = fd;
+      ok = 1;
+    }
+  }
+  if (!ok) {
+    if (h)
+      munmap(h, pack_index_size(nslots));
+    if (fd >= 0)
+      close(fd);
+    unlink(tmp);
+  }
+  free(path);
+  free(tmp);
+  return ok;
+}
+
+/* open the pack number index for appending.
+   return: 1 on success, 0 on an error (errno set)
+*/
+static int pack_open(uint32_t index) {
+  struct stat st;
+  char *name = pack_name(index);
+
+  if (!name) {
+    errno = ENOMEM;
+    return 0;
+  }
+  if (pack_fd >= 0)
+    close(pack_fd);
+  pack_fd = open(name, O_WRONLY | O_CREAT | O_APPEND, 0644);
+  free(name);
+  if (pack_fd < 0 || fstat(pack_fd, &st))
+    return 0;
+  pack_size = st.st_size;
+  return 1;
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_pack(void) {
+  char *path, *compression;
+  struct stat st;
+  uint64_t nslots;
+
+  free(pack_prefix);
+  pack_prefix = get_setting_string("pack_path", "HTTRACK_PY_PACK");
+  if (!pack_prefix)
+    return 1;
+  pack_remove = get_setting_long("pack_remove_files",
+                                 "HTTRACK_PY_PACK_REMOVE_FILES", 0) > 0;
+  pack_max_size = get_setting_long("pack_max_size",
+                                   "HTTRACK_PY_PACK_MAX_SIZE",
+                                   1024L * 1024 * 1024);
+  compression = get_setting_string("pack_compression",
+                                   "HTTRACK_PY_PACK_COMPRESSION");
+  pack_compression = PACK_NONE;
+  if (compression && !strcmp(compression, "zlib")) {
+    pack_compression = PACK_ZLIB;
+  }
+#ifdef HTS_PY_ZSTD
+  else if (compression && !strcmp(compression, "zstd")) {
+    pack_compression = PACK_ZSTD;
+  }
+#endif
+  else if (compression && strcmp(compression, "none")) {
+    PyErr_Format(PyExc_ValueError, "unsupported pack_compression: %s",
+                 compression);
+    free(compression);
+    return 0;
+  }
+  free(compression);
+  pack_root[0] = 0;
+  pack_files = 0;
+  pack_bytes = pack_stored = 0;
+
+  path = malloc(strlen(pack_prefix) + 16);
+  if (!path) {
+    PyErr_NoMemory();
+    return 0;
+  }
+  sprintf(path, "%s.idx", pack_prefix);
+  /* continue an existing index */
+  pack_index_fd = open(path, O_RDWR);
+  if (   pack_index_fd >= 0 && !fstat(pack_index_fd, &st)
+      && st.st_size >= (off_t) sizeof(pack_index_header)) {
+    pack_index = mmap(0, sizeof(pack_index_header), PROT_READ,
+                      MAP_SHARED, pack_index_fd, 0);
+    if (pack_index == MAP_FAILED) {
+      pack_index = 0;
+    }
+    else {
+      nslots = pack_index->nslots;
+      if (   memcmp(pack_index->magic, PACK_INDEX_MAGIC, 8)
+          || st.st_size != (off_t) pack_index_size(nslots)) {
+        nslots = 0;
+      }
+      munmap(pack_index, sizeof(pack_index_header));
+      pack_index = nslots ? pack_map_index(pack_index_fd, nslots) : 0;
+    }
+    if (!pack_index) {
+      PyErr_Format(PyExc_IOError, "invalid pack index %s", path);
+      close(pack_index_fd);
+      pack_index_fd = -1;
+      free(path);
+      return 0;
+    }
+  }
+  else {
+    if (pack_index_fd >= 0)
+      close(pack_index_fd);
+    pack_index_fd = pack_create_index(path, PACK_INITIAL_SLOTS, 1);
+    pack_index = pack_index_fd >= 0 ?
+                 pack_map_index(pack_index_fd, PACK_INITIAL_SLOTS) : 0;
+  }
+  if (!pack_index || !pack_open(pack_index->npacks - 1)) {
+    PyErr_SetFromErrnoWithFilename(PyExc_IOError, path);
+    if (pack_index)
+      munmap(pack_index, pack_index_size(pack_index->nslots));
+    pack_index = 0;
+    if (pack_index_fd >= 0)
+      close(pack_index_fd);
+    pack_index_fd = -1;
+    free(path);
+    return 0;
+  }
+  free(path);
+  pack_enabled = 1;
+  return 1;
+}
+
+/* remember the mirror directory; called by hts_py_start */
+static void pack_attach(httrackp *opt) {
+  if (!pack_enabled)
+    return;
+  strncpy(pack_root, opt->path_html, sizeof(pack_root) - 1);
+  pack_root[sizeof(pack_root) - 1] = 0;
+}
+
+static void stop_pack(void) {
+  if (!pack_enabled)
+    return;
+  pack_enabled = 0;
+  pack_npacks = pack_index->npacks;
+  msync(pack_index, pack_index_size(pack_index->nslots), MS_SYNC);
+  munmap(pack_index, pack_index_size(pack_index->nslots));
+  pack_index = 0;
+  close(pack_index_fd);
+  pack_index_fd = -1;
+  close(pack_fd);
+  pack_fd = -1;
+}
+
+static void pack_error(char *save) {
+  fprintf(stderr, "httrack-py: can't pack %s: %s\n", save, strerror(errno));
+}
+
+/* the file save is complete: append it to the pack, and remove it,
+   if pack_remove is set. Called with the GIL held, which protects the pack.
+*/
+static void pack_save_file(char *save) {
+  pack_entry e;
+  struct stat st;
+  char *path = save, *data = 0, *out = 0, *stored;
+  size_t root_len = strlen(pack_root);
+  int fd, ok;
+
+  fd = open(save, O_RDONLY);
+  if (fd < 0 || fstat(fd, &st) || !(data = malloc(st.st_size + 1))
+      || !read_all(fd, data, st.st_size)) {
+    pack_error(save);
+    if (fd >= 0)
+      close(fd);
+    free(data);
+    return;
+  }
+  close(fd);
+
+  memcpy(e.magic, PACK_MAGIC, 4);
+  e.compression = pack_compression;
+  e.reserved = 0;
+  e.raw_len = st.st_size;
+  e.stored_len = st.st_size;
+  stored = data;
+  if (pack_compression == PACK_ZLIB) {
+    uLongf len = compressBound(st.st_size);
+    out = malloc(len);
+    if (out && compress2((Bytef *) out, &len, (Bytef *) data, st.st_size,
+                         Z_DEFAULT_COMPRESSION) == Z_OK) {
+      e.stored_len = len;
+      stored = out;
+    }
+    else {
+      e.compression = PACK_NONE;
+    }
+  }
+#ifdef HTS_PY_ZSTD
+  else if (pack_compression == PACK_ZSTD) {
+    size_t len = ZSTD_compressBound(st.st_size);
+    out = malloc(len);
+    if (out)
+      len = ZSTD_compress(out, len, data, st.st_size, 3);
+    if (out && !ZSTD_isError(len)) {
+      e.stored_len = len;
+      stored = out;
+    }
+    else {
+      e.compression = PACK_NONE;
+    }
+  }
+#endif
+
+  if (root_len && !strncmp(save, pack_root, root_len)) {
+    path = save + root_len;
+    while (*path == '/')
+      path++;
+  }
+  e.path_len = strlen(path);
+
+  if (pack_size >= pack_max_size) {
+    pack_index->npacks++;
+    if (!pack_open(pack_index->npacks - 1)) {
+      pack_error(save);
+      free(data);
+      free(out);
+      return;
+    }
+  }
+  ok =    write_all(pack_fd, &e, sizeof(e))
+       && write_all(pack_fd, path, e.path_len)
+       && write_all(pack_fd, stored, e.stored_len);
+  if (ok) {
+    if (pack_index->count * 2 >= pack_index->nslots && !pack_grow_index())
+      pack_error(save);
+    pack_insert(pack_index, pack_hash(path), path, pack_index->npacks - 1,
+                pack_size, 1);
+    pack_size += sizeof(e) + e.path_len + e.stored_len;
+    pack_files++;
+    pack_bytes += e.raw_len;
+    pack_stored += e.stored_len;
+    if (pack_remove)
+      unlink(save);
+  }
+  else {
+    pack_error(save);
+    /* the entry may be written partly */
+    if (!fstat(pack_fd, &st))
+      pack_size = st.st_size;
+  }
+  free(data);
+  free(out);
+}
+
+/* return: None, if no pack was written, else
+           {'files', 'bytes', 'stored_bytes', 'packs'}
+*/
+static PyObject *build_pack_stats(void) {
+  if (!pack_prefix) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  return Py_BuildValue("{s:l,s:L,s:L,s:i}", "files", pack_files,
+                       "bytes", pack_bytes, "stored_bytes", pack_stored,
+                       "packs",
+                       pack_enabled ? (int) pack_index->npacks : pack_npacks);
+}
+
+/* Near-duplicate detection.
+
+   If the first handler has an attribute near_duplicates (or the
+   environment variable HTTRACK_PY_NEAR_DUPLICATES is set), set to
+   "flag" or "refuse", a SimHash fingerprint of each HTML page is
+   computed in C when httrack calls check_html, and compared with the
+   fingerprints of the last near_duplicate_window (default: 65536)
+   pages. A page whose fingerprint differs in at most
+   near_duplicate_distance (0 to 7, default: 3) of its 64 bits from
+   that of another URL is a near-duplicate. With "refuse", check_html
+   refuses it without calling Python, so httrack does not parse its
+   links; with "flag", it is only counted, and page.near_duplicate
+   (see "Page objects") is the URL of the similar page.
+   Near-duplicates are not added to the index, so it keeps the first
+   page of each group.
+
+   The fingerprint is built from the shingles of three words of the
+   text, without tags, script and style; pages with less than three
+   words are not checked. The index is split into distance + 1 bands
+   of the 64 bits: two fingerprints within the distance agree in at
+   least one band, so only the fingerprints in the same bucket of one
+   of the bands are compared. The ring of recent fingerprints and the
+   bucket lists are protected by sh_lock.
+*/
+
+#define SH_MAX_BANDS 8
+#define SH_BUCKET_BITS 16
+
+typedef struct {
+  uint64_t fp;
+  char *url;            /* 0: the slot is free */
+  int32_t next[SH_MAX_BANDS], prev[SH_MAX_BANDS];
+} sh_entry;
+
+static int sh_mode = 0;     /* 0: off, 1: flag, 2: refuse */
+static int sh_used = 0;     /* near_duplicates was set; see the stats */
+static int sh_distance, sh_nbands, sh_window, sh_pos;
+static int sh_shift[SH_MAX_BANDS];
+static uint64_t sh_mask[SH_MAX_BANDS];
+static sh_entry *sh_ring = 0;
+static int32_t *sh_heads = 0;
+static pthread_mutex_t sh_lock = PTHREAD_MUTEX_INITIALIZER;
+static long sh_pages, sh_duplicates;
+
+/* result for the page being checked by this thread; see new_page() */
+static THREAD_LOCAL int sh_have_fp = 0;
+static THREAD_LOCAL uint64_t sh_fp;
+static THREAD_LOCAL char *sh_dup_url = 0;
+
+static uint64_t sh_mix(uint64_t h) {
+  /* finalizer of splitmix64 */
+  h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+  return h ^ (h >> 31);
+}
+
+/* return: the SimHash of the words of the HTML text; *nshingles is
+           set to the number of shingles
+*/
+static uint64_t simhash(char *html, int len, int *nshingles) {
+  char *s = html, *end = html + len, *close;
+  uint64_t w[3] = { 0, 0, 0 }, h;
+  int v[64], i, n, nwords = 0;
+  unsigned char c;
+
+  memset(v, 0, sizeof(v));
+  *nshingles = 0;
+  while (s < end) {
+    c = *s;
+    if (c == '<') {
+      /* skip the tag, and the content of script and style */
+      close = 0;
+      if (end - s > 7 && !strncasecmp(s, "<script", 7))
+        close = "</script";
+      else if (end - s > 6 && !strncasecmp(s, "<style", 6))
+        close = "</style";
+      n = close ? strlen(close) : 0;
+      for (s++; close && s < end; s++) {
+        if (*s == '<' && end - s >= n && !strncasecmp(s, close, n))
+          break;
+      }
+      for (; s < end && *s != '>'; s++) ;
+      s++;
+      continue;
+    }
+    if (c == '&') {
+      for (s++; s < end && (*s == '#' || isalnum((unsigned char)*s)); s++) ;
+      s++;
+      continue;
+    }
+    if (!isalnum(c) && c < 0x80) {
+      s++;
+      continue;
+    }
+    /* a word: FNV-1a of its bytes in lower case */
+    h = 14695981039346656037ULL;
+    for (; s < end && (isalnum((unsigned char)*s) || (unsigned char)*s >= 0x80);
+         s++) {
+      h = (h ^ tolower((unsigned char)*s)) * 1099511628211ULL;
+    }
+    w[0] = w[1];
+    w[1] = w[2];
+    w[2] = h;
+    if (++nwords < 3)
+      continue;
+    h = sh_mix(w[0] ^ sh_mix(w[1] ^ sh_mix(w[2])));
+    for (i = 0; i < 64; i++) {
+      v[i] += (h >> i) & 1 ? 1 : -1;
+    }
+    (*nshingles)++;
+  }
+  for (h = 0, i = 0; i < 64; i++) {
+    if (v[i] > 0)
+      h |= 1ULL << i;
+  }
+  return h;
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_near_duplicates(void) {
+  char *mode;
+  int b, bits;
+
+  mode = get_setting_string("near_duplicates", "HTTRACK_PY_NEAR_DUPLICATES");
+  if (!mode)
+    return 1;
+  sh_mode = !strcmp(mode, "flag") ? 1 : !strcmp(mode, "refuse") ? 2 : 0;
+  free(mode);
+  if (!sh_mode) {
+    PyErr_SetString(PyExc_ValueError,
+                    "near_duplicates must be 'flag' or 'refuse'");
+    return 0;
+  }
+  sh_distance = get_setting_long("near_duplicate_distance",
+                                 "HTTRACK_PY_NEAR_DUPLICATE_DISTANCE", 3);
+  if (sh_distance < 0)
+    sh_distance = 0;
+  if (sh_distance > SH_MAX_BANDS - 1)
+    sh_distance = SH_MAX_BANDS - 1;
+  sh_window = get_setting_long("near_duplicate_window",
+                               "HTTRACK_PY_NEAR_DUPLICATE_WINDOW", 65536);
+  if (sh_window < 16)
+    sh_window = 16;
+  sh_nbands = sh_distance + 1;
+  for (b = 0, bits = 0; b < sh_nbands; b++) {
+    sh_shift[b] = bits;
+    bits += 64 / sh_nbands + (b < 64 % sh_nbands);
+    sh_mask[b] = bits - sh_shift[b] == 64
+                   ? ~0ULL : ((1ULL << (bits - sh_shift[b])) - 1);
+  }
+  sh_ring = calloc(sh_window, sizeof(sh_entry));
+  sh_heads = malloc(sh_nbands * ((size_t)1 << SH_BUCKET_BITS)
+                    * sizeof(int32_t));
+  if (!sh_ring || !sh_heads) {
+    free(sh_ring);
+    free(sh_heads);
+    sh_ring = 0;
+    sh_heads = 0;
+    sh_mode = 0;
+    PyErr_NoMemory();
+    return 0;
+  }
+  memset(sh_heads, 0xff, sh_nbands * ((size_t)1 << SH_BUCKET_BITS)
+                         * sizeof(int32_t));
+  sh_pos = 0;
+  sh_pages = sh_duplicates = 0;
+  sh_used = sh_mode;
+  return 1;
+}
+
+static void stop_near_duplicates(void) {
+  int i;
+  if (!sh_ring)
+    return;
+  for (i = 0; i < sh_window; i++) {
+    free(sh_ring[i].url);
+  }
+  free(sh_ring);
+  free(sh_heads);
+  sh_ring = 0;
+  sh_heads = 0;
+  sh_mode = 0;
+}
+
+static int32_t *sh_bucket(int b, uint64_t fp) {
+  uint64_t v = (fp >> sh_shift[b]) & sh_mask[b];
+  return &sh_heads[(b << SH_BUCKET_BITS)
+                   + ((v * 0x9e3779b97f4a7c15ULL) >> (64 - SH_BUCKET_BITS))];
+}
+
+/* remove the ring slot i from the bucket lists, or add it.
+   Called with sh_lock held
+*/
+static void sh_unlink(int i) {
+  sh_entry *e = &sh_ring[i];
+  int b;
+  for (b = 0; b < sh_nbands; b++) {
+    if (e->prev[b] >= 0)
+      sh_ring[e->prev[b]].next[b] = e->next[b];
+    else
+      *sh_bucket(b, e->fp) = e->next[b];
+    if (e->next[b] >= 0)
+      sh_ring[e->next[b]].prev[b] = e->prev[b];
+  }
+  free(e->url);
+  e->url = 0;
+}
+
+static void sh_link(int i, uint64_t fp, char *url) {
+  sh_entry *e = &sh_ring[i];
+  int32_t *head;
+  int b;
+  e->fp = fp;
+  e->url = url;
+  for (b = 0; b < sh_nbands; b++) {
+    head = sh_bucket(b, fp);
+    e->prev[b] = -1;
+    e->next[b] = *head;
+    if (*head >= 0)
+      sh_ring[*head].prev[b] = i;
+    *head = i;
+  }
+}
+
+/* check a page in check_html; called without the GIL.
+   return: 0 if the page is refused, else 1
+*/
+static int near_duplicate_check(char *html, int len, char *adr, char *fil) {
+  char *url, *dup = 0;
+  uint64_t fp;
+  int b, i, n, found = 0;
+
+  free(sh_dup_url);
+  sh_dup_url = 0;
+  fp = simhash(html, len, &n);
+  sh_have_fp = 1;
+  sh_fp = fp;
+  if (n < 1)
+    return 1;
+  url = malloc(strlen(adr) + strlen(fil) + 8);
+  if (!url)
+    return 1;
+  sprintf(url, "%s%s%s", url_scheme(adr), adr, fil);
+
+  pthread_mutex_lock(&sh_lock);
+  sh_pages++;
+  for (b = 0; !found && b < sh_nbands; b++) {
+    for (i = *sh_bucket(b, fp); i >= 0; i = sh_ring[i].next[b]) {
+      if (   __builtin_popcountll(sh_ring[i].fp ^ fp) <= sh_distance
+          && strcmp(sh_ring[i].url, url)) {
+        found = 1;
+        dup = strdup(sh_ring[i].url);
+        break;
+      }
+    }
+  }
+  if (found) {
+    sh_duplicates++;
+    free(url);
+  }
+  else {
+    if (sh_ring[sh_pos].url)
+      sh_unlink(sh_pos);
+    sh_link(sh_pos, fp, url);
+    sh_pos = (sh_pos + 1) % sh_window;
+  }
+  pthread_mutex_unlock(&sh_lock);
+  sh_dup_url = dup;
+  return !found || sh_mode != 2;
+}
+
+/* return: None, if near_duplicates was not used, else
+           {'pages', 'near_duplicates', 'refused'}
+*/
+static PyObject *build_near_duplicate_stats(void) {
+  PyObject *res;
+  if (!sh_used) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  pthread_mutex_lock(&sh_lock);
+  res = Py_BuildValue("{s:l,s:l,s:l}", "pages", sh_pages,
+                      "near_duplicates", sh_duplicates,
+                      "refused", sh_used == 2 ? sh_duplicates : 0);
+  pthread_mutex_unlock(&sh_lock);
+  return res;
+}
+
+/* Page objects and process_page.
+
+   If a handler has a method process_page, it is called once for each
+   HTML page, in check_html, with a httracklib.Page object:
+
+      instance.process_page(page)
+
+   The page has the attributes url_adresse, url_fichier, content_type,
+   charset, html (the text), headers (a dictionary of the response
+   headers with lower case names) and text (html decoded to unicode,
+   see page_get_text). headers and text are built when they are first
+   used, so methods using only html don't pay for them. The method can
+
+   - reject the page: return a false value other than None. The other
+     stages, and the check_html methods, are not called.
+   - change the text for preprocessing: assign a string to page.html,
+     or a unicode object to page.text.
+     The new text replaces the page before the preprocess_html methods
+     are called.
+   - edit the text after postprocessing: page.replace(old, new) replaces
+     all occurences of old by new in the text that httrack passes to
+     postprocess_html, after the links are rewritten. The edits are
+     applied in C; the text is not copied to Python again.
+
+   So the text is copied to Python once, instead of once for each of
+   check_html, preprocess_html and postprocess_html. The stages of
+   process_page share the page object; filters are supported.
+
+   The pages with edits are kept by URL until postprocess_html, the
+   headers of HTML pages from receive_header until check_html. Both
+   tables are protected by the GIL. process_page always runs in this
+   process, also if worker processes are used.
+*/
+
+/* pages or headers waiting for the next callback */
+#define PAGE_PENDING_MAX 1024
+
+typedef struct {
+  PyObject_HEAD
+  PyObject *adr, *fil;
+  PyObject *html;
+  int html_changed;     /* html was assigned */
+  PyObject *edits;      /* list of (old, new) tuples, or 0 */
+  char *raw_headers;    /* response headers as received, or 0 */
+  PyObject *headers;    /* dictionary built from raw_headers, or 0 */
+  PyObject *text;       /* unicode object decoded from html, or 0 */
+  char content_type[64];
+  char charset[64];
+  char encoding[64];    /* charset used for text; see page_get_text */
+  int have_simhash;
+  uint64_t simhash;
+  char *near_duplicate; /* URL of the similar page, or 0 */
+} page_object;
+
+/* response headers of a page until check_html */
+typedef struct {
+  char content_type[64];
+  char charset[64];
+  char headers[1];
+} page_headers_entry;
+
+static str_map page_headers = { 0 };
+/* adr+fil -> page_object */
+static str_map page_pending = { 0 };
+
+static void page_dealloc(page_object *self) {
+  Py_XDECREF(self->adr);
+  Py_XDECREF(self->fil);
+  Py_XDECREF(self->html);
+  Py_XDECREF(self->edits);
+  Py_XDECREF(self->headers);
+  Py_XDECREF(self->text);
+  free(self->raw_headers);
+  free(self->near_duplicate);
+  PyObject_Del(self);
+}
+
+static PyObject *page_get_url_adresse(page_object *self, void *closure) {
+  Py_INCREF(self->adr);
+  return self->adr;
+}
+
+static PyObject *page_get_url_fichier(page_object *self, void *closure) {
+  Py_INCREF(self->fil);
+  return self->fil;
+}
+
+static PyObject *page_get_content_type(page_object *self, void *closure) {
+  return PyString_FromString(self->content_type);
+}
+
+static PyObject *page_get_charset(page_object *self, void *closure) {
+  return PyString_FromString(self->charset);
+}
+
+static PyObject *page_get_html(page_object *self, void *closure) {
+  Py_INCREF(self->html);
+  return self->html;
+}
+
+static int page_set_html(page_object *self, PyObject *v, void *closure) {
+  if (!v || !PyString_Check(v)) {
+    PyErr_SetString(PyExc_TypeError, "html must be a string");
+    return -1;
+  }
+  Py_INCREF(v);
+  Py_DECREF(self->html);
+  self->html = v;
+  self->html_changed = 1;
+  Py_XDECREF(self->text);
+  self->text = 0;
+  return 0;
+}
+
+/* copy the charset name at s (up to the first character not allowed
+   in a name) in lower case into buf
+*/
+static void page_copy_charset(char *buf, int size, char *s, char *end) {
+  int i = 0;
+  for (; s < end && (*s == '"' || *s == '\'' || *s == ' '); s++) ;
+  for (; s < end && i < size - 1 && (isalnum((unsigned char)*s)
+                                     || strchr("-_.:", *s)); s++) {
+    buf[i++] = tolower((unsigned char)*s);
+  }
+  buf[i] = 0;
+}
+
+/* the charset of the page: the charset of the htsblk, or else the
+   first "charset=" in the first 1024 bytes of the text (meta tags)
+*/
+static void page_find_charset(page_object *self, char *buf, int size) {
+  char *s = PyString_AS_STRING(self->html), *end;
+  int len = PyString_GET_SIZE(self->html);
+
+  if (self->charset[0]) {
+    page_copy_charset(buf, size, self->charset,
+                      self->charset + strlen(self->charset));
+    return;
+  }
+  buf[0] = 0;
+  end = s + (len < 1024 ? len : 1024);
+  for (; s + 8 <= end; s++) {
+    if ((*s == 'c' || *s == 'C') && !strncasecmp(s, "charset=", 8)) {
+      page_copy_charset(buf, size, s + 8, end);
+      return;
+    }
+  }
+}
+
+/* page.text: the text decoded with the charset of the page, computed
+   when it is first used. UTF-8, Latin-1 and ASCII are decoded by the
+   functions of the Python C API; other charsets by their codec.
+   Invalid bytes are replaced. If the charset is unknown, the text is
+   decoded as UTF-8, or as Latin-1, if it is not valid UTF-8.
+*/
+static PyObject *page_get_text(page_object *self, void *closure) {
+  char *s = PyString_AS_STRING(self->html), *cs = self->encoding;
+  int len = PyString_GET_SIZE(self->html);
+
+  if (self->text) {
+    Py_INCREF(self->text);
+    return self->text;
+  }
+  page_find_charset(self, cs, sizeof(self->encoding));
+  if (!*cs) {
+    self->text = PyUnicode_DecodeUTF8(s, len, "strict");
+    strcpy(cs, "utf-8");
+    if (!self->text && PyErr_ExceptionMatches(PyExc_UnicodeDecodeError)) {
+      PyErr_Clear();
+      self->text = PyUnicode_DecodeLatin1(s, len, "strict");
+      strcpy(cs, "iso-8859-1");
+    }
+  }
+  else if (!strcmp(cs, "utf-8") || !strcmp(cs, "utf8")) {
+    self->text = PyUnicode_DecodeUTF8(s, len, "replace");
+  }
+  else if (   !strcmp(cs, "iso-8859-1") || !strcmp(cs, "latin-1")
+           || !strcmp(cs, "latin1") || !strcmp(cs, "iso8859-1")) {
+    self->text = PyUnicode_DecodeLatin1(s, len, "strict");
+  }
+  else if (!strcmp(cs, "us-ascii") || !strcmp(cs, "ascii")) {
+    self->text = PyUnicode_DecodeASCII(s, len, "replace");
+  }
+  else {
+    self->text = PyUnicode_Decode(s, len, cs, "replace");
+    if (!self->text && PyErr_ExceptionMatches(PyExc_LookupError)) {
+      /* xxx unknown charset names are frequent in the wild */
+      PyErr_Clear();
+      self->text = PyUnicode_DecodeUTF8(s, len, "replace");
+      strcpy(cs, "utf-8");
+    }
+  }
+  Py_XINCREF(self->text);
+  return self->text;
+}
+
+/* assigning page.text encodes it with the charset used for decoding */
+static int page_set_text(page_object *self, PyObject *v, void *closure) {
+  PyObject *html;
+
+  if (!v || !PyUnicode_Check(v)) {
+    PyErr_SetString(PyExc_TypeError, "text must be a unicode object");
+    return -1;
+  }
+  if (!self->text)
+    page_find_charset(self, self->encoding, sizeof(self->encoding));
+  html = PyUnicode_AsEncodedString(v, self->encoding[0] ? self->encoding
+                                                        : "utf-8",
+                                   "xmlcharrefreplace");
+  if (!html && PyErr_ExceptionMatches(PyExc_LookupError)) {
+    PyErr_Clear();
+    strcpy(self->encoding, "utf-8");
+    html = PyUnicode_AsUTF8String(v);
+  }
+  if (!html)
+    return -1;
+  if (page_set_html(self, html, 0)) {
+    Py_DECREF(html);
+    return -1;
+  }
+  Py_DECREF(html);
+  Py_INCREF(v);
+  self->text = v;
+  return 0;
+}
+
+static PyObject *page_get_encoding(page_object *self, void *closure) {
+  if (!self->text)
+    page_find_charset(self, self->encoding, sizeof(self->encoding));
+  return PyString_FromString(self->encoding);
+}
+
+/* parse the "Name: value" lines of the raw headers; the status line
+   is skipped. Repeated headers are joined with ", ".
+*/
+static PyObject *page_get_headers(page_object *self, void *closure) {
+  PyObject *d, *k, *v, *old, *joined;
+  char *line, *end, *colon, *cc;
+  int ok = 1;
+
+  if (self->headers) {
+    Py_INCREF(self->headers);
+    return self->headers;
+  }
+  d = PyDict_New();
+  if (!d)
+    return 0;
+  for (line = self->raw_headers; ok && line && *line; line = end) {
+    end = strchr(line, '\n');
+    end = end ? end + 1 : line + strlen(line);
+    colon = memchr(line, ':', end - line);
+    if (!colon || colon == line)
+      continue;
+    k = PyString_FromStringAndSize(0, colon - line);
+    if (!k) {
+      ok = 0;
+      break;
+    }
+    for (cc = PyString_AS_STRING(k); line < colon; line++) {
+      *cc++ = tolower((unsigned char)*line);
+    }
+    for (line = colon + 1; line < end && (*line == ' ' || *line == '\t');
+         line++) ;
+    for (cc = end; cc > line && (cc[-1] == '\n' || cc[-1] == '\r'
+                                 || cc[-1] == ' '); cc--) ;
+    v = PyString_FromStringAndSize(line, cc - line);
+    old = v ? PyDict_GetItem(d, k) : 0;
+    if (old) {
+      joined = PyString_FromFormat("%s, %s", PyString_AsString(old),
+                                   PyString_AsString(v));
+      Py_DECREF(v);
+      v = joined;
+    }
+    ok = v && !PyDict_SetItem(d, k, v);
+    Py_DECREF(k);
+    Py_XDECREF(v);
+  }
+  if (!ok) {
+    Py_DECREF(d);
+    return 0;
+  }
+  self->headers = d;
+  Py_INCREF(d);
+  return d;
+}
+
+static PyObject *page_get_simhash(page_object *self, void *closure) {
+  int n;
+  if (!self->have_simhash) {
+    self->simhash = simhash(PyString_AS_STRING(self->html),
+                            PyString_GET_SIZE(self->html), &n);
+    self->have_simhash = 1;
+  }
+  return PyLong_FromUnsignedLongLong(self->simhash);
+}
+
+static PyObject *page_get_near_duplicate(page_object *self, void *closure) {
+  if (!self->near_duplicate) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  return PyString_FromString(self->near_duplicate);
+}
+
+static PyObject *page_replace(page_object *self, PyObject *args) {
+  PyObject *edit;
+  char *old, *new;
+  int old_len, new_len;
+
+  if (!PyArg_ParseTuple(args, "s#s#", &old, &old_len, &new, &new_len))
+    return 0;
+  if (!old_len) {
+    PyErr_SetString(PyExc_ValueError, "replace: empty search string");
+    return 0;
+  }
+  if (!self->edits && !(self->edits = PyList_New(0)))
+    return 0;
+  edit = Py_BuildValue("(s#s#)", old, old_len, new, new_len);
+  if (!edit || PyList_Append(self->edits, edit)) {
+    Py_XDECREF(edit);
+    return 0;
+  }
+  Py_DECREF(edit);
+  Py_INCREF(Py_None);
+  return Py_None;
+}
+
+static PyGetSetDef page_getset[] = {
+  {"url_adresse", (getter)page_get_url_adresse, 0, "host of the URL", 0},
+  {"url_fichier", (getter)page_get_url_fichier, 0, "path of the URL", 0},
+  {"content_type", (getter)page_get_content_type, 0,
+   "MIME type from the response headers, or \"\"", 0},
+  {"charset", (getter)page_get_charset, 0,
+   "charset from the response headers, or \"\"", 0},
+  {"html", (getter)page_get_html, (setter)page_set_html,
+   "the HTML text; assign a string to change it for preprocess_html", 0},
+  {"headers", (getter)page_get_headers, 0,
+   "dictionary of the response headers (lower case names)", 0},
+  {"text", (getter)page_get_text, (setter)page_set_text,
+   "the HTML text decoded with the charset of the page (unicode)", 0},
+  {"encoding", (getter)page_get_encoding, 0,
+   "the charset used for text, or \"\", if it is not known", 0},
+  {"simhash", (getter)page_get_simhash, 0,
+   "64 bit SimHash fingerprint of the text of the page", 0},
+  {"near_duplicate", (getter)page_get_near_duplicate, 0,
+   "URL of a similar page (see near_duplicates), or None", 0},
+  {0}
+};
+
+static PyMethodDef page_methods[] = {
+  {"replace", (PyCFunction)page_replace, METH_VARARGS,
+   "usage: page.replace(old, new)\n"
+   "replace all occurences of old in the text passed to postprocess_html"},
+  {0}
+};
+
+static PyTypeObject page_type = {
+  PyObject_HEAD_INIT(0)
+  0,                          /* ob_size */
+  "httracklib.Page",          /* tp_name */
+  sizeof(page_object),        /* tp_basicsize */
+  0,                          /* tp_itemsize */
+  (destructor)page_dealloc,   /* tp_dealloc */
+  0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+  Py_TPFLAGS_DEFAULT,         /* tp_flags */
+  "HTML page passed to process_page", /* tp_doc */
+  0, 0, 0, 0, 0, 0,
+  page_methods,               /* tp_methods */
+  0,                          /* tp_members */
+  page_getset,                /* tp_getset */
+};
+
+static void page_free_pending(void *value) {
+  Py_DECREF((PyObject*) value);
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_pages(void) {
+  if (!interp->pipelines[CB_PROCESS_PAGE].nstages)
+    return 1;
+  if (   !str_map_init(&page_headers, free)
+      || !str_map_init(&page_pending, page_free_pending)) {
+    PyErr_NoMemory();
+    return 0;
+  }
+  return 1;
+}
+
+/* called with the GIL held */
+static void stop_pages(void) {
+  str_map_free(&page_headers);
+  str_map_free(&page_pending);
+}
+
+/* remember the headers of a HTML page until check_html */
+static void page_receive_header(char *buf, char *adr, char *fil,
+                                htsblk *incoming) {
+  page_headers_entry *e;
+  char *headers, *key;
+  int len;
+
+  if (!page_headers.buckets || !strstr(incoming->contenttype, "html"))
+    return;
+  headers = incoming->headers ? incoming->headers : buf;
+  len = strlen(headers);
+  key = url_key(adr, fil);
+  e = malloc(sizeof(page_headers_entry) + len);
+  if (!key || !e) {
+    free(key);
+    free(e);
+    return;
+  }
+  /* as in feed_receive_header, pages that never reach check_html are
+     dropped, when they are the oldest entry of a full table
+  */
+  if (page_headers.count >= PAGE_PENDING_MAX)
+    str_map_drop_oldest(&page_headers);
+  snprintf(e->content_type, sizeof(e->content_type), "%s",
+           incoming->contenttype);
+  snprintf(e->charset, sizeof(e->charset), "%s", incoming->charset);
+  memcpy(e->headers, headers, len + 1);
+  if (!str_map_put(&page_headers, key, e))
+    free(e);
+  free(key);
+}
+
+static page_object *new_page(char *html, int len, char *adr, char *fil) {
+  page_headers_entry *e;
+  page_object *page;
+  char *key;
+
+  page = PyObject_New(page_object, &page_type);
+  if (!page)
+    return 0;
+  page->adr = PyString_FromString(adr);
+  page->fil = PyString_FromString(fil);
+  page->html = PyString_FromStringAndSize(html, len);
+  page->html_changed = 0;
+  page->edits = 0;
+  page->raw_headers = 0;
+  page->headers = 0;
+  page->text = 0;
+  page->content_type[0] = page->charset[0] = page->encoding[0] = 0;
+  /* the result of near_duplicate_check for this page, if any */
+  page->have_simhash = sh_have_fp;
+  page->simhash = sh_fp;
+  page->near_duplicate = sh_dup_url;
+  sh_have_fp = 0;
+  sh_dup_url = 0;
+  if (!page->adr || !page->fil || !page->html) {
+    Py_DECREF(page);
+    return 0;
+  }
+  key = url_key(adr, fil);
+  e = key ? str_map_take(&page_headers, key) : 0;
+  free(key);
+  if (e) {
+    strcpy(page->content_type, e->content_type);
+    strcpy(page->charset, e->charset);
+    page->raw_headers = strdup(e->headers);
+    free(e);
+  }
+  return page;
+}
+
+/* run the process_page pipeline; called by check_html.
+   return: 0 if the page is rejected, else 1
+*/
+static int py_process_page(char *html, int len, char *adr, char *fil) {
+  cb_pipeline *p = &interp->pipelines[CB_PROCESS_PAGE];
+  page_object *page;
+  PyObject *pArgs, *pRes;
+  char *key;
+  int i, res = 1;
+  url_info u;
+
+  if (!p->nstages || !cb_active(CB_PROCESS_PAGE))
+    return 1;
+  u.adr = adr;
+  u.fil = fil;
+  u.content_type = 0;
+  u.size = len;
+  if (!pipeline_wanted(p, &u))
+    return 1;
+  page = new_page(html, len, adr, fil);
+  pArgs = page ? Py_BuildValue("(O)", page) : 0;
+  if (!pArgs) {
+    Py_XDECREF(page);
+    process_error_indirect("process_page");
+    return 1;
+  }
+  for (i = 0; res && i < p->nstages; i++) {
+    if (!stage_wanted(&p->stages[i], &u))
+      continue;
+    pRes = call_stage(&p->stages[i], pArgs);
+    if (pRes) {
+      res = pRes == Py_None || PyObject_IsTrue(pRes);
+      Py_DECREF(pRes);
+    }
+    else {
+      /* accept the page; see py_check_html */
+      process_error_indirect("process_page");
+    }
+  }
+  Py_DECREF(pArgs);
+
+  if (res && (page->html_changed || page->edits)) {
+    key = url_key(adr, fil);
+    if (page_pending.count >= PAGE_PENDING_MAX)
+      str_map_drop_oldest(&page_pending);
+    if (key && str_map_put(&page_pending, key, page))
+      page = 0;
+    free(key);
+  }
+  Py_XDECREF(page);
+  return res;
+}
+
+/* replace the text in the buffer of httrack by len bytes of s.
+   return: 1 on success; 0 if the buffer could not be enlarged
+*/
+static int page_set_buffer(char **html, int *len, char *s, int slen) {
+  char *tmp;
+  if (slen > *len) {
+    tmp = realloc(*html, slen + 1);
+    if (!tmp)
+      return 0;
+    *html = tmp;
+  }
+  memmove(*html, s, slen);
+  (*html)[slen] = 0;
+  *len = slen;
   return 1;
 }
 
-static int get_option_dict(httrackp* opt, PyObject* dict) {
-  getIntItem(dict, opt, wizard);
-  getIntItem(dict, opt, flush);
-  getIntItem(dict, opt, travel);
-  getIntItem(dict, opt, seeker);
-  getIntItem(dict, opt, depth);
-  getIntItem(dict, opt, extdepth);
-  getIntItem(dict, opt, urlmode);
-  getIntItem(dict, opt, debug);
-  getIntItem(dict, opt, getmode);
-  /* xxx FILE* are missing. Not sure, if and how to map these 
-     to Python types
-  */
-  getLLIntItem(dict, opt, maxsite);
-  getLLIntItem(dict, opt, maxfile_nonhtml);
-  getLLIntItem(dict, opt, maxfile_html);
-  getIntItem(dict, opt, maxsoc);
-  getLLIntItem(dict, opt, fragment);
-  getIntItem(dict, opt, nearlink);
-  getIntItem(dict, opt, makeindex);
-  getIntItem(dict, opt, kindex);
-  getIntItem(dict, opt, delete_old);
-  getIntItem(dict, opt, timeout);
-  getIntItem(dict, opt, rateout);
-  getIntItem(dict, opt, maxtime);
-  getIntItem(dict, opt, maxrate);
-  getFloatItem(dict, opt, maxconn);
-  getIntItem(dict, opt, waittime);
-  getIntItem(dict, opt, cache);
-  getIntItem(dict, opt, shell);
-  getIntItem(dict, opt, savename_83);
-  getStringItem(dict, opt, savename_userdef, 256);
-  getIntItem(dict, opt, mimehtml);
-  getIntItem(dict, opt, user_agent_send);
-  getStringItem(dict, opt, user_agent, 128);
-  getStringItem(dict, opt, referer, 256);
-  getStringItem(dict, opt, from, 256);
-  getStringItem(dict, opt, path_log, 1024);
-  getStringItem(dict, opt, path_html, 1024);
-  getStringItem(dict, opt, path_bin, 1024);
-  getIntItem(dict, opt, retry);
-  getIntItem(dict, opt, makestat);
-  getIntItem(dict, opt, maketrack);
-  getIntItem(dict, opt, parsejava);
-  getIntItem(dict, opt, hostcontrol);
-  getIntItem(dict, opt, errpage);
-  getIntItem(dict, opt, check_type);
-  getIntItem(dict, opt, all_in_cache);
-  getIntItem(dict, opt, robots);
-  getIntItem(dict, opt, external);
-  getIntItem(dict, opt, passprivacy);
-  getIntItem(dict, opt, includequery);
-  getIntItem(dict, opt, mirror_first_page);
-  getStringItem(dict, opt, sys_com, 2048);
-  getIntItem(dict, opt, sys_com_exec);
-  getIntItem(dict, opt, accept_cookie);
-  /* xxx  t_cookie is missing */
-  getIntItem(dict, opt, http10);
-  getIntItem(dict, opt, nokeepalive);
-  getIntItem(dict, opt, nocompression);
-  getIntItem(dict, opt, sizehack);
-  getIntItem(dict, opt, urlhack);
-  getIntItem(dict, opt, tolerant);
-  getIntItem(dict, opt, parseall);
-  getIntItem(dict, opt, parsedebug);
-  getIntItem(dict, opt, norecatch);
-  getIntItem(dict, opt, verbosedisplay);
-  getStringItem(dict, opt, footer, 256);
-  getIntItem(dict, opt, maxcache);
-  getIntItem(dict, opt, ftp_proxy);
-  getStringItem(dict, opt, filelist, 1024);
-  getStringItem(dict, opt, urllist, 1024);
-  /* xxx htsfilters, hash, robotsptr missing 
-  */
-  getStringItem(dict, opt, lang_iso, 64);
-  getStringItem(dict, opt, mimedefs, 2048);
-  getIntItem(dict, opt, maxlink);
-  getIntItem(dict, opt, maxfilter);
-  /* xxx hrmm. No size defined for char* exec
-     getStringItem(dict, opt, exec);
-  */
-  getIntItem(dict, opt, quiet);
-  getIntItem(dict, opt, keyboard);
-  getIntItem(dict, opt, is_update);
-  getIntItem(dict, opt, dir_topindex);
-  /* xxx htsoptstate stats missing */
+/* apply page.html before the preprocess_html stages */
+static void page_preprocess(char **html, int *len, char *adr, char *fil) {
+  page_object *page;
+  char *key;
+
+  if (!page_pending.count || !(key = url_key(adr, fil)))
+    return;
+  page = str_map_get(&page_pending, key);
+  if (page && page->html_changed) {
+    if (!page_set_buffer(html, len, PyString_AS_STRING(page->html),
+                         PyString_GET_SIZE(page->html)))
+      fprintf(stderr, "httrack-py: can't realloc buffer for HTML text\n");
+    if (!page->edits) {
+      str_map_take(&page_pending, key);
+      Py_DECREF(page);
+    }
+  }
+  free(key);
+}
+
+static char *find_bytes(char *s, int len, char *sub, int sublen) {
+  char *end = s + len - sublen;
+  for (; s <= end; s++) {
+    s = memchr(s, *sub, end - s + 1);
+    if (!s)
+      return 0;
+    if (!memcmp(s, sub, sublen))
+      return s;
+  }
+  return 0;
+}
+
+/* apply the edits of page.replace() after postprocessing */
+static void page_postprocess(char **html, int *len, char *adr, char *fil) {
+  page_object *page;
+  PyObject *edit;
+  char *key, *old, *new, *s, *found, *out, *o;
+  int i, n, old_len, new_len, out_len;
+
+  if (!page_pending.count || !(key = url_key(adr, fil)))
+    return;
+  page = str_map_take(&page_pending, key);
+  free(key);
+  if (!page)
+    return;
+  for (i = 0; page->edits && i < PyList_GET_SIZE(page->edits); i++) {
+    edit = PyList_GET_ITEM(page->edits, i);
+    old = PyString_AS_STRING(PyTuple_GET_ITEM(edit, 0));
+    old_len = PyString_GET_SIZE(PyTuple_GET_ITEM(edit, 0));
+    new = PyString_AS_STRING(PyTuple_GET_ITEM(edit, 1));
+    new_len = PyString_GET_SIZE(PyTuple_GET_ITEM(edit, 1));
+    n = 0;
+    for (s = *html; (found = find_bytes(s, *len - (s - *html), old, old_len));
+         s = found + old_len) {
+      n++;
+    }
+    if (!n)
+      continue;
+    out_len = *len + n * (new_len - old_len);
+    out = malloc(out_len + 1);
+    if (!out) {
+      fprintf(stderr, "httrack-py: can't allocate buffer for HTML text\n");
+      break;
+    }
+    for (s = *html, o = out;
+         (found = find_bytes(s, *len - (s - *html), old, old_len));
+         s = found + old_len) {
+      memcpy(o, s, found - s);
+      o += found - s;
+      memcpy(o, new, new_len);
+      o += new_len;
+    }
+    memcpy(o, s, *len - (s - *html));
+    out[out_len] = 0;
+    free(*html);
+    *html = out;
+    *len = out_len;
+  }
+  Py_DECREF(page);
+}
+
+/* Recording of the callbacks.
+
+   If the first handler has an attribute record_path, or if the
+   environment variable HTTRACK_PY_RECORD is set, each call of a
+   handler method is recorded into this file: the callback, the index
+   of the handler, the time of the call, the time spent in the method,
+   the arguments and the result, both in the format of the marshal
+   module. For process_page, the Page object is recorded as the tuple
+   (html, url_adresse, url_fichier, content_type, charset, headers),
+   where headers are the raw response headers, taken before the
+   method is called, so changes of page.html are not recorded as its
+   input. Calls whose arguments or result can't be marshalled are
+   counted and reported when the mirror ends. The stages of a
+   pipeline are recorded separately, each with the arguments it got,
+   so the recording of preprocess_html contains the text returned by
+   each stage.
+
+   The file starts with the magic "HTSREC01", followed by compressed
+   blocks in the format of the event log (record_block_size or
+   HTTRACK_PY_RECORD_BLOCK; default: 1 MB). A record is
+
+     uint32 len;      length of the record, including this field
+     uint8 cb;        index in cb_names
+     uint8 handler;
+     uint16 flags;    REC_ERROR: the method raised an exception,
+                      the result is the name of its class
+                      REC_REPR: the result could not be marshalled,
+                      it is repr() of the result
+     double start, seconds;
+     uint32 args_len;
+     uint32 reserved;
+     then the marshalled arguments (args_len bytes) and result
+
+   httracktools.replay() calls the methods of a handler with the
+   recorded arguments, and compares the results. The methods run by
+   worker processes are not recorded.
+*/
+
+#define REC_MAGIC "HTSREC01"
+
+enum { REC_ERROR = 1, REC_REPR = 2 };
+
+typedef struct {
+  uint32_t len;
+  uint8_t cb;
+  uint8_t handler;
+  uint16_t flags;
+  double start, seconds;
+  uint32_t args_len;
+  uint32_t reserved;
+} rec_header;
+
+static int rec_enabled = 0;
+static bg_writer rec;
+/* calls whose arguments or result could not be marshalled; protected
+   by the GIL
+*/
+static long rec_dropped = 0;
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_record(void) {
+  char *path;
+  long block_size;
+  int ok;
+
+  path = get_setting_string("record_path", "HTTRACK_PY_RECORD");
+  if (!path)
+    return 1;
+  block_size = get_setting_long("record_block_size",
+                                "HTTRACK_PY_RECORD_BLOCK", 1024 * 1024);
+  if (block_size < 4096)
+    block_size = 4096;
+  ok = bg_writer_open(&rec, path, block_size, evlog_write_block,
+                      REC_MAGIC, 8);
+  free(path);
+  rec_enabled = ok;
+  rec_dropped = 0;
+  return ok;
+}
+
+static void stop_record(void) {
+  if (!rec_enabled)
+    return;
+  rec_enabled = 0;
+  bg_writer_close(&rec);
+  if (rec_dropped)
+    fprintf(stderr, "httrack-py: %li calls not recorded (arguments or "
+                    "result can't be marshalled)\n", rec_dropped);
+}
+
+/* return: new reference to the marshalled arguments of a call */
+static PyObject *record_args(PyObject *args) {
+  page_object *page;
+  PyObject *obj;
+
+  if (!args) {
+    obj = PyTuple_New(0);
+    args = obj ? PyMarshal_WriteObjectToString(obj, Py_MARSHAL_VERSION) : 0;
+    Py_XDECREF(obj);
+    return args;
+  }
+  if (   PyTuple_GET_SIZE(args) == 1
+      && PyObject_TypeCheck(PyTuple_GET_ITEM(args, 0), &page_type)) {
+    page = (page_object*) PyTuple_GET_ITEM(args, 0);
+    obj = Py_BuildValue("((OOOsss))", page->html, page->adr, page->fil,
+                        page->content_type, page->charset,
+                        page->raw_headers ? page->raw_headers : "");
+    args = obj ? PyMarshal_WriteObjectToString(obj, Py_MARSHAL_VERSION) : 0;
+    Py_XDECREF(obj);
+    return args;
+  }
+  return PyMarshal_WriteObjectToString(args, Py_MARSHAL_VERSION);
+}
+
+/* called by call_stage before the method is called, with the GIL held.
+   return: new reference to the marshalled arguments, or 0, if the
+           calls are not recorded, or if the arguments can't be
+           marshalled
+*/
+static PyObject *record_begin(PyObject *args) {
+  PyObject *pArgs;
+
+  if (!rec_enabled)
+    return 0;
+  pArgs = record_args(args);
+  if (!pArgs) {
+    PyErr_Clear();
+    rec_dropped++;
+  }
+  return pArgs;
+}
+
+/* record a call of a stage; pArgs is the result of record_begin, and
+   is released. pRes is 0, if the method raised an exception. Called
+   by call_stage, with the GIL held.
+*/
+static void record_stage(cb_stage *stage, PyObject *pArgs, PyObject *pRes,
+                         double start, double end) {
+  PyObject *type = 0, *value = 0, *tb = 0, *pData = 0, *obj;
+  char *name;
+  const void *data[3];
+  size_t len[3];
+  rec_header h;
+
+  h.flags = 0;
+  if (!pRes) {
+    PyErr_Fetch(&type, &value, &tb);
+    h.flags = REC_ERROR;
+    name = type && PyExceptionClass_Check(type)
+             ? PyExceptionClass_Name(type) : "?";
+    /* without the module, as __name__ */
+    obj = PyString_FromString(strrchr(name, '.') ? strrchr(name, '.') + 1
+                                                 : name);
+    pData = obj ? PyMarshal_WriteObjectToString(obj, Py_MARSHAL_VERSION) : 0;
+    Py_XDECREF(obj);
+  }
+  else {
+    pData = PyMarshal_WriteObjectToString(pRes, Py_MARSHAL_VERSION);
+    if (!pData) {
+      PyErr_Clear();
+      h.flags = REC_REPR;
+      obj = PyObject_Repr(pRes);
+      pData = obj ? PyMarshal_WriteObjectToString(obj, Py_MARSHAL_VERSION)
+                  : 0;
+      Py_XDECREF(obj);
+    }
+  }
+  if (pData) {
+    h.cb = stage->cb;
+    h.handler = stage->index;
+    h.start = start;
+    h.seconds = end - start;
+    h.args_len = PyString_GET_SIZE(pArgs);
+    h.reserved = 0;
+    h.len = sizeof(h) + h.args_len + PyString_GET_SIZE(pData);
+    data[0] = &h;
+    len[0] = sizeof(h);
+    data[1] = PyString_AS_STRING(pArgs);
+    len[1] = h.args_len;
+    data[2] = PyString_AS_STRING(pData);
+    len[2] = PyString_GET_SIZE(pData);
+    bg_writer_append(&rec, 3, data, len);
+  }
+  else {
+    PyErr_Clear();
+    rec_dropped++;
+  }
+  Py_DECREF(pArgs);
+  Py_XDECREF(pData);
+  if (!pRes)
+    PyErr_Restore(type, value, tb);
+}
+
+/* Tag scanner.
+
+   httracklib.scan_tags(html [, names]) tokenizes the tags of a HTML
+   text (a string, or a Page object) in C and returns an array('i') of
+   records of SCAN_RECORD integers:
+
+     tag:        [kind, start, end, name_start, name_end, nattrs]
+                 kind is SCAN_OPEN, SCAN_CLOSE or SCAN_EMPTY ("<br/>");
+                 start is the offset of '<', end the offset after '>'.
+                 The nattrs following records are its attributes.
+     attribute:  [SCAN_ATTR, name_start, name_end, value_start,
+                  value_end, quote]
+                 value_start and value_end are -1 for an attribute
+                 without value; quote is the quote character or 0.
+
+   All offsets are byte offsets into the text; values are not decoded
+   (entities). Comments, <!...> and <?...> are skipped, and the
+   contents of script and style elements are not scanned. If names (a
+   sequence of tag names) is given, only these tags are returned,
+   compared without regard to case.
+
+   The searches for '<', for the closing quote of attribute values
+   and for the end of comments and script elements compare 16 bytes
+   at a time with SSE2, if it is available. The attribute names are
+   short, and are scanned with a table.
+*/
+
+#define SCAN_RECORD 6
+enum { SCAN_OPEN = 1, SCAN_CLOSE, SCAN_EMPTY, SCAN_ATTR };
+
+/* the records are returned as array('i'), which holds C ints */
+#if INT_MAX != 2147483647
+#error "scan_tags needs a C int of 32 bits"
+#endif
+
+typedef struct {
+  int32_t *v;
+  int n, size;          /* in integers */
+} scan_vec;
+
+/* characters ending an attribute name or an unquoted value */
+static char scan_stop[256];
+
+/* return: the first position in [s, end) holding c1 or c2, or end */
+static char *scan_find2(char *s, char *end, char c1, char c2) {
+#ifdef __SSE2__
+  __m128i v1 = _mm_set1_epi8(c1), v2 = _mm_set1_epi8(c2), b;
+  int mask;
+  for (; end - s >= 16; s += 16) {
+    b = _mm_loadu_si128((__m128i*) s);
+    mask = _mm_movemask_epi8(_mm_or_si128(_mm_cmpeq_epi8(b, v1),
+                                          _mm_cmpeq_epi8(b, v2)));
+    if (mask)
+      return s + __builtin_ctz(mask);
+  }
+#endif
+  for (; s < end && *s != c1 && *s != c2; s++) ;
+  return s;
+}
+
+/* return: the position of the string t (length tlen, lower case) in
+           [s, end), compared without regard to case, or end
+*/
+static char *scan_find_nocase(char *s, char *end, char *t, int tlen) {
+  for (;; s++) {
+    s = scan_find2(s, end, t[0], toupper((unsigned char)t[0]));
+    if (end - s < tlen)
+      return end;
+    if (!strncasecmp(s, t, tlen))
+      return s;
+  }
+}
+
+static int scan_add(scan_vec *out, int32_t a, int32_t b, int32_t c,
+                    int32_t d, int32_t e, int32_t f) {
+  int32_t *tmp;
+  if (out->n + SCAN_RECORD > out->size) {
+    tmp = realloc(out->v, (out->size * 2 + 64 * SCAN_RECORD)
+                          * sizeof(int32_t));
+    if (!tmp)
+      return 0;
+    out->v = tmp;
+    out->size = out->size * 2 + 64 * SCAN_RECORD;
+  }
+  tmp = out->v + out->n;
+  tmp[0] = a; tmp[1] = b; tmp[2] = c; tmp[3] = d; tmp[4] = e; tmp[5] = f;
+  out->n += SCAN_RECORD;
+  return 1;
+}
+
+static int scan_wanted(char **names, char *name, int len) {
+  if (!names)
+    return 1;
+  for (; *names; names++) {
+    if (strlen(*names) == len && !strncasecmp(*names, name, len))
+      return 1;
+  }
+  return 0;
+}
+
+/* tokenize the tags of html into out; see above.
+   return: 1 on success; 0 if no memory is available
+*/
+static int scan_html(char *html, int len, char **names, scan_vec *out) {
+  char *s = html, *end = html + len, *tag, *name, *name_end, *an, *an_end;
+  char *vs, *ve, quote;
+  int kind, rec, wanted, raw;
+
+  if (!scan_stop[' ']) {
+    scan_stop[' '] = scan_stop['\t'] = scan_stop['\n'] = scan_stop['\r'] =
+      scan_stop['\f'] = scan_stop['='] = scan_stop['>'] = scan_stop['/'] = 1;
+  }
+  out->n = 0;
+  while ((s = scan_find2(s, end, '<', '<')) < end) {
+    tag = s++;
+    if (s < end && (*s == '!' || *s == '?')) {
+      if (end - s >= 3 && s[0] == '!' && s[1] == '-' && s[2] == '-') {
+        s = scan_find_nocase(s + 3, end, "-->", 3);
+        s = s < end ? s + 3 : end;
+      }
+      else {
+        s = scan_find2(s, end, '>', '>');
+      }
+      continue;
+    }
+    kind = SCAN_OPEN;
+    if (s < end && *s == '/') {
+      kind = SCAN_CLOSE;
+      s++;
+    }
+    if (s >= end || !isalpha((unsigned char)*s))
+      continue;
+    for (name = s; s < end && !scan_stop[(unsigned char)*s]; s++) ;
+    name_end = s;
+    wanted = scan_wanted(names, name, name_end - name);
+    rec = out->n;
+    if (wanted && !scan_add(out, kind, tag - html, 0, name - html,
+                            name_end - html, 0))
+      return 0;
+
+    /* attributes */
+    while (s < end && *s != '>') {
+      if (scan_stop[(unsigned char)*s]) {
+        if (*s == '/' && s + 1 < end && s[1] == '>')
+          kind = kind == SCAN_OPEN ? SCAN_EMPTY : kind;
+        s++;
+        continue;
+      }
+      for (an = s; s < end && !scan_stop[(unsigned char)*s]; s++) ;
+      an_end = s;
+      for (; s < end && isspace((unsigned char)*s); s++) ;
+      vs = ve = 0;
+      quote = 0;
+      if (s < end && *s == '=') {
+        for (s++; s < end && isspace((unsigned char)*s); s++) ;
+        if (s < end && (*s == '"' || *s == '\'')) {
+          quote = *s++;
+          vs = s;
+          s = ve = scan_find2(s, end, quote, quote);
+          if (s < end)
+            s++;
+        }
+        else {
+          for (vs = s; s < end && *s != '>' && !isspace((unsigned char)*s);
+               s++) ;
+          ve = s;
+        }
+      }
+      if (wanted && kind != SCAN_CLOSE) {
+        if (!scan_add(out, SCAN_ATTR, an - html, an_end - html,
+                      vs ? vs - html : -1, ve ? ve - html : -1, quote))
+          return 0;
+        out->v[rec + 5]++;
+      }
+    }
+    if (s >= end) {
+      /* unterminated tag */
+      out->n = wanted ? rec : out->n;
+      break;
+    }
+    s++;
+    if (wanted) {
+      out->v[rec] = kind;
+      out->v[rec + 2] = s - html;
+    }
+
+    /* the contents of script and style are no HTML */
+    raw = name_end - name;
+    if (   kind == SCAN_OPEN
+        && (   (raw == 6 && !strncasecmp(name, "script", 6))
+            || (raw == 5 && !strncasecmp(name, "style", 5)))) {
+      s = scan_find_nocase(s, end, raw == 6 ? "</script" : "</style",
+                           raw + 2);
+    }
+  }
   return 1;
 }
-static int process_options(httrackp* opt, char* method) {
-  PyObject *meth, *args, *dict, *pres;
-  int res = 0;
 
-  if (stop_on_next_callback)
+static PyObject *build_scan_tags(char *html, int len, char **names) {
+  PyObject *array_module, *res;
+  scan_vec out = { 0, 0, 0 };
+
+  if (!scan_html(html, len, names, &out)) {
+    free(out.v);
+    return PyErr_NoMemory();
+  }
+  array_module = PyImport_ImportModule("array");
+  if (!array_module) {
+    free(out.v);
+    return 0;
+  }
+  res = PyObject_CallMethod(array_module, "array", "ss#", "i",
+                            out.v ? (char*) out.v : "",
+                            out.n * sizeof(int32_t));
+  Py_DECREF(array_module);
+  free(out.v);
+  return res;
+}
+
+/* Structured data extraction.
+
+   If the first handler has an attribute extract_rules, a mapping from
+   field names to rules, each HTML page is searched for the fields in
+   C when httrack calls check_html, without entering Python. The pages
+   with at least one match are written as JSON lines into the file
+   extract_path (or HTTRACK_PY_EXTRACT) by a background writer:
+
+     {"url": "http://example.com/", "title": "Example", "price": null}
+
+   A rule is a simple selector: a tag name or '*' (which may be left
+   out), followed by any of .class, #id, [attr], [attr=value] and
+   [attr~=word], and optionally by @attr. With @attr, the value of the attribute is extracted, else
+   the text of the element (tags removed, entities decoded, white space
+   collapsed; the contents of script and style elements are taken as
+   they are). The first matching element gives the value of the field;
+   if the rule is given as a list with one string, the values of all
+   matching elements are extracted as a JSON array. Example:
+
+     extract_rules = {
+       'title': 'title',
+       'canonical': 'link[rel=canonical]@href',
+       'prices': ['span[itemprop=price]@content'],
+       'jsonld': ['script[type=application/ld+json]'],
+     }
+
+   Elements are not nested in selectors; there are no descendant
+   combinators. The values are written as UTF-8; bytes which are no
+   valid UTF-8 are written as Latin-1 characters.
+*/
+
+typedef struct {
+  char *name;           /* attribute name, lower case */
+  char *value;          /* 0: the attribute must exist */
+  int word;             /* 1: value is one of the words of the attribute */
+} ex_cond;
+
+typedef struct {
+  char *field;
+  char *tag;            /* 0: any tag */
+  ex_cond *conds;
+  int nconds;
+  char *attr;           /* @attr, or 0 for the text */
+  int all;              /* extract all matches as a list */
+} ex_rule;
+
+static int ex_enabled = 0;
+static ex_rule *ex_rules = 0;
+static int ex_nrules = 0;
+static bg_writer ex_writer;
+static pthread_mutex_t ex_lock = PTHREAD_MUTEX_INITIALIZER;
+static long ex_pages, ex_records, ex_matches;
+
+static void free_ex_rules(void) {
+  int i, j;
+  for (i = 0; i < ex_nrules; i++) {
+    free(ex_rules[i].field);
+    free(ex_rules[i].tag);
+    free(ex_rules[i].attr);
+    for (j = 0; j < ex_rules[i].nconds; j++) {
+      free(ex_rules[i].conds[j].name);
+      free(ex_rules[i].conds[j].value);
+    }
+    free(ex_rules[i].conds);
+  }
+  free(ex_rules);
+  ex_rules = 0;
+  ex_nrules = 0;
+}
+
+/* copy the name at *s (letters, digits, '-', '_', ':', '.' unless
+   dot is 0) in lower case, and advance *s
+*/
+static char *ex_name(char **s, int dot) {
+  char *start = *s, *res;
+  int i;
+  while (   isalnum((unsigned char)**s) || **s == '-' || **s == '_'
+         || **s == ':' || (dot && **s == '.'))
+    (*s)++;
+  if (*s == start)
+    return 0;
+  res = malloc(*s - start + 1);
+  if (res) {
+    for (i = 0; start + i < *s; i++) {
+      res[i] = tolower((unsigned char)start[i]);
+    }
+    res[i] = 0;
+  }
+  return res;
+}
+
+static ex_cond *ex_add_cond(ex_rule *r) {
+  ex_cond *tmp = realloc(r->conds, (r->nconds + 1) * sizeof(ex_cond));
+  if (!tmp)
+    return 0;
+  r->conds = tmp;
+  tmp += r->nconds++;
+  memset(tmp, 0, sizeof(ex_cond));
+  return tmp;
+}
+
+/* parse the selector s into r.
+   return: 1 on success; 0 if s is invalid, or no memory is available
+*/
+static int ex_parse_rule(ex_rule *r, char *s) {
+  ex_cond *c;
+  char *end, quote;
+
+  for (; *s == ' '; s++) ;
+  if (*s == '*')
+    s++;
+  else if (*s != '.' && *s != '#' && *s != '[' && !(r->tag = ex_name(&s, 0)))
     return 0;
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, method)) {
-    meth = PyObject_GetAttrString(pCallbackClass, method);
-    if (meth) {
-      dict = PyDict_New();
-      if (!dict) {
-        Py_DECREF(meth);
-        return process_error_direct(method);
-      }
-      if (   !set_option_dict(opt, dict) 
-          || !(args = PyTuple_New(1))) {
-        Py_DECREF(meth);
-        Py_DECREF(dict);
-        return process_error_direct(method);
-      }
-      PyTuple_SetItem(args, 0, dict);
-      pres = PyObject_CallObject(meth, args);
-      if (pres) {
-        res = PyObject_IsTrue(pres);
-        if (res) {
-          get_option_dict(opt, dict);
-        }
-        Py_DECREF(pres);
+  while (*s && *s != '@' && *s != ' ') {
+    if (!(c = ex_add_cond(r)))
+      return 0;
+    if (*s == '.' || *s == '#') {
+      c->name = strdup(*s == '.' ? "class" : "id");
+      c->word = *s++ == '.';
+      end = s;
+      while (*end && !strchr(".#[@ ", *end))
+        end++;
+      c->value = end > s ? strndup(s, end - s) : 0;
+      s = end;
+      if (!c->name || !c->value)
+        return 0;
+    }
+    else if (*s == '[') {
+      s++;
+      if (!(c->name = ex_name(&s, 1)))
+        return 0;
+      if (*s == '~' && s[1] == '=') {
+        c->word = 1;
+        s++;
       }
-      else {
-        return process_error_direct(method);
+      if (*s == '=') {
+        s++;
+        quote = *s == '"' || *s == '\'' ? *s++ : ']';
+        end = strchr(s, quote);
+        if (!end || !(c->value = strndup(s, end - s)))
+          return 0;
+        s = end + (quote != ']');
       }
-      Py_DECREF(dict);
-      Py_DECREF(args);
-      Py_DECREF(meth);
+      if (*s++ != ']')
+        return 0;
+    }
+    else {
+      return 0;
     }
   }
-  else
-    res = 1;
-  return res;
+  if (*s == '@') {
+    s++;
+    if (!(r->attr = ex_name(&s, 1)))
+      return 0;
+  }
+  for (; *s == ' '; s++) ;
+  return !*s;
 }
 
+/* read extract_rules from the first handler.
+   return: 1 on success; 0 if an error occured (Python error set)
+*/
+static int ex_load_rules(PyObject *d) {
+  PyObject *items, *key, *v, *rule;
+  ex_rule *r;
+  int i, n;
 
-EXTERNAL_FUNCTION int hts_py_start(httrackp* opt) {
-  /* call the method 'start' of the Python class; pass (almost) all
-     option values in a dictionary
-  */
-  
-  /* "delayed error signal" from plugin_init set?
-  */
-  int res = 1;
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_start %li\n", pthread_self());
-#endif
-#ifdef PLUGIN
-  if (abort_in_start_callback) return 0;
-  res = initialize(0);
-#endif
-  res = res && process_options(opt, "start");
-  return res;
+  items = PyMapping_Items(d);
+  if (!items)
+    return 0;
+  n = PyList_Size(items);
+  ex_rules = calloc(n ? n : 1, sizeof(ex_rule));
+  if (!ex_rules) {
+    Py_DECREF(items);
+    PyErr_NoMemory();
+    return 0;
+  }
+  for (i = 0; i < n; i++) {
+    key = PyTuple_GetItem(PyList_GetItem(items, i), 0);
+    v = rule = PyTuple_GetItem(PyList_GetItem(items, i), 1);
+    r = &ex_rules[ex_nrules++];
+    if (   (PyList_Check(v) || PyTuple_Check(v))
+        && PySequence_Size(v) == 1) {
+      r->all = 1;
+      rule = PySequence_Fast_GET_ITEM(v, 0);
+    }
+    if (!PyString_Check(key) || !PyString_Check(rule)) {
+      PyErr_SetString(PyExc_TypeError,
+                      "extract_rules must map strings to selectors");
+      break;
+    }
+    r->field = strdup(PyString_AsString(key));
+    if (!r->field || !ex_parse_rule(r, PyString_AsString(rule))) {
+      PyErr_Format(PyExc_ValueError, "invalid extraction rule for %s: %s",
+                   PyString_AsString(key), PyString_AsString(rule));
+      break;
+    }
+  }
+  Py_DECREF(items);
+  return !PyErr_Occurred();
 }
 
-static void cleanup() {
-  if (pAnswerQuery2) { Py_DECREF(pAnswerQuery2); }
-  if (pAnswerQuery3) { Py_DECREF(pAnswerQuery3); }
-  
-  /* explicitly delete the callback class instance in order to
-    allow a possible class destructor to be executed 
-  */
-  if (pCallbackClass) {
-    Py_DECREF(pCallbackClass);
+static int ex_write_block(bg_writer *w, char *data, size_t len) {
+  bg_count_out(w, len);
+  return write_all(w->fd, data, len);
+}
+
+/* return: 1 on success; 0 if an error occured (Python error set) */
+static int start_extract(void) {
+  PyObject *d;
+  char *path;
+  int ok;
+
+  if (   !interp->pCallbackClass
+      || !PyObject_HasAttrString(interp->pCallbackClass, "extract_rules"))
+    return 1;
+  d = PyObject_GetAttrString(interp->pCallbackClass, "extract_rules");
+  if (!d)
+    return 0;
+  if (d == Py_None) {
+    Py_DECREF(d);
+    return 1;
+  }
+  if (!PyMapping_Check(d)) {
+    Py_DECREF(d);
+    PyErr_SetString(PyExc_TypeError,
+                    "extract_rules attribute must be a mapping object");
+    return 0;
+  }
+  ok = ex_load_rules(d);
+  Py_DECREF(d);
+  path = ok ? get_setting_string("extract_path", "HTTRACK_PY_EXTRACT") : 0;
+  if (ok && !path) {
+    PyErr_SetString(PyExc_ValueError, "extract_rules needs extract_path");
+    ok = 0;
+  }
+  if (ok)
+    ok = bg_writer_open(&ex_writer, path, 64 * 1024, ex_write_block, "", 0);
+  free(path);
+  if (!ok) {
+    free_ex_rules();
+    return 0;
   }
+  ex_pages = ex_records = ex_matches = 0;
+  ex_enabled = 1;
+  return 1;
+}
 
-  pCallbackClass = 0;
+static void stop_extract(void) {
+  if (!ex_enabled)
+    return;
+  ex_enabled = 0;
+  bg_writer_close(&ex_writer);
+  free_ex_rules();
 }
 
-EXTERNAL_FUNCTION int hts_py_end(void) {
-  PyObject *meth, *pRes;
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_end %li\n", pthread_self());
-#endif
-  if (stop_on_next_callback)
+/* return: the length of the valid UTF-8 sequence at s, or 0 */
+static int utf8_len(unsigned char *s, unsigned char *end) {
+  int n, i;
+  if (*s < 0x80)
+    return 1;
+  n = *s >= 0xf0 && *s < 0xf5 ? 4 : *s >= 0xe0 ? 3 : *s >= 0xc2 ? 2 : 0;
+  if (!n || end - s < n || (n == 4 && *s >= 0xf8))
     return 0;
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "end")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "end");
-    if (meth) {
-      pRes =  PyObject_CallObject(meth, 0);
-      if (!pRes) {
-        /* this is the last of all callbacks, and we can't return
-           anything, so let's just see, what the user wants to do
-        */
-        process_error_direct("end");
+  for (i = 1; i < n; i++) {
+    if ((s[i] & 0xc0) != 0x80)
+      return 0;
+  }
+  return n;
+}
+
+/* append s as a JSON string */
+static void ex_json_string(mt_text *t, char *s, int len) {
+  char *end = s + len, *run;
+  int n;
+
+  mt_printf(t, "\"");
+  while (s < end) {
+    for (run = s; s < end && (unsigned char)*s >= 0x20 && *s != '"'
+                  && *s != '\\' && (unsigned char)*s < 0x80; s++) ;
+    if (s > run)
+      mt_printf(t, "%.*s", (int)(s - run), run);
+    if (s >= end)
+      break;
+    n = utf8_len((unsigned char*) s, (unsigned char*) end);
+    if (n > 1) {
+      mt_printf(t, "%.*s", n, s);
+      s += n;
+    }
+    else if (*s == '"' || *s == '\\') {
+      mt_printf(t, "\\%c", *s++);
+    }
+    else {
+      mt_printf(t, "\\u%04x", (unsigned char)*s++);
+    }
+  }
+  mt_printf(t, "\"");
+}
+
+/* append the UTF-8 encoding of the code point c */
+static void ex_utf8(mt_text *t, unsigned long c) {
+  if (c < 0x80)
+    mt_printf(t, "%c", (int)c);
+  else if (c < 0x800)
+    mt_printf(t, "%c%c", (int)(0xc0 | c >> 6), (int)(0x80 | (c & 0x3f)));
+  else if (c < 0x10000)
+    mt_printf(t, "%c%c%c", (int)(0xe0 | c >> 12),
+              (int)(0x80 | (c >> 6 & 0x3f)), (int)(0x80 | (c & 0x3f)));
+  else
+    mt_printf(t, "%c%c%c%c", (int)(0xf0 | c >> 18),
+              (int)(0x80 | (c >> 12 & 0x3f)), (int)(0x80 | (c >> 6 & 0x3f)),
+              (int)(0x80 | (c & 0x3f)));
+}
+
+/* append [s, end) to t with the common entities decoded; if text is
+   set, tags are removed and white space is collapsed
+*/
+static void ex_decode(mt_text *t, char *s, char *end, int text) {
+  static struct { char *name; int c; } entities[] = {
+    {"amp;", '&'}, {"lt;", '<'}, {"gt;", '>'}, {"quot;", '"'},
+    {"apos;", '\''}, {"nbsp;", 0xa0}, {0, 0}
+  };
+  char *cc;
+  unsigned long c;
+  int i, space = 0;
+
+  for (; s < end && text && isspace((unsigned char)*s); s++) ;
+  while (s < end) {
+    if (text && *s == '<') {
+      cc = scan_find2(s, end, '>', '>');
+      s = cc < end ? cc + 1 : end;
+      space = 1;
+      continue;
+    }
+    if (text && isspace((unsigned char)*s)) {
+      s++;
+      space = 1;
+      continue;
+    }
+    if (space && t->len && t->data[t->len - 1] != ' ') {
+      mt_printf(t, " ");
+    }
+    space = 0;
+    if (*s == '&') {
+      if (s + 2 < end && s[1] == '#') {
+        c = s[2] == 'x' || s[2] == 'X' ? strtoul(s + 3, &cc, 16)
+                                       : strtoul(s + 2, &cc, 10);
+        if (cc < end && *cc == ';' && cc > s + 2 && c && c < 0x110000) {
+          ex_utf8(t, c);
+          s = cc + 1;
+          continue;
+        }
       }
-      else {
-        Py_DECREF(pRes);
+      for (i = 0; entities[i].name; i++) {
+        if (   end - s > strlen(entities[i].name)
+            && !strncmp(s + 1, entities[i].name, strlen(entities[i].name)))
+          break;
+      }
+      if (entities[i].name) {
+        ex_utf8(t, entities[i].c);
+        s += 1 + strlen(entities[i].name);
+        continue;
       }
-      Py_DECREF(meth);
     }
+    for (cc = s + 1; cc < end && *cc != '&' && *cc != '<'
+                     && !isspace((unsigned char)*cc); cc++) ;
+    mt_printf(t, "%.*s", (int)(cc - s), s);
+    s = cc;
   }
-  
-#ifdef PLUGIN
-  cleanup();
-  Py_Finalize();
-#endif
-  return 1;
 }
 
-EXTERNAL_FUNCTION int hts_py_change_options(httrackp* opt) {
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_change_options %li\n", pthread_self());
-#endif
-  return process_options(opt, "change_options");
+/* return: the record of the attribute name of the tag at rec, or 0 */
+static int32_t *ex_attr(char *html, int32_t *rec, char *name) {
+  int i, len = strlen(name);
+  int32_t *a;
+  for (i = 0; i < rec[5]; i++) {
+    a = rec + (i + 1) * SCAN_RECORD;
+    if (a[2] - a[1] == len && !strncasecmp(html + a[1], name, len))
+      return a;
+  }
+  return 0;
 }
 
+static int ex_match(ex_rule *r, char *html, int32_t *rec) {
+  int32_t *a;
+  char *v, *end, *word;
+  int i, len;
 
-static PyObject* process_html(char* html, int len, 
-                                   char* url_adresse, char* url_fichier,
-                                   char *method) {
-  /* allow to change the HTML text
-     Python method:
-        instance.check_html(html, url_adresse, url_fichier)
-        
-        If a string is returned, the value is copied into *html (up to len
-        bytes); if less bytes are copied, the remaining space up to len
-        is filled with 0x20. the return value of this function will be 1.
-        
-        If some other Python object is returned, its "boolean value" will
-        be returned by this function
-        
-        Python error handling is done in the caller
-  */
-  PyObject *meth, *pHtml, *pURL_adresse, *pURL_fichier, *pArgs, *pRes;
-  
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, method)) {
-    meth = PyObject_GetAttrString(pCallbackClass, method);
-    if (meth) {
-      pHtml = PyString_FromStringAndSize(html, len);
-      if (!pHtml) {
-        Py_DECREF(meth);
+  if (   r->tag && (   rec[4] - rec[3] != strlen(r->tag)
+                    || strncasecmp(html + rec[3], r->tag, strlen(r->tag))))
+    return 0;
+  for (i = 0; i < r->nconds; i++) {
+    a = ex_attr(html, rec, r->conds[i].name);
+    if (!a)
+      return 0;
+    if (!r->conds[i].value)
+      continue;
+    v = a[3] >= 0 ? html + a[3] : "";
+    end = a[3] >= 0 ? html + a[4] : v;
+    len = strlen(r->conds[i].value);
+    if (!r->conds[i].word) {
+      if (end - v != len || strncmp(v, r->conds[i].value, len))
         return 0;
-      }
-      
-      pURL_adresse = PyString_FromString(url_adresse);
-      if (!pURL_adresse) {
-        Py_DECREF(meth);
-        Py_DECREF(pHtml);
+      continue;
+    }
+    for (;;) {
+      for (; v < end && isspace((unsigned char)*v); v++) ;
+      for (word = v; v < end && !isspace((unsigned char)*v); v++) ;
+      if (v == word)
         return 0;
+      if (v - word == len && !strncmp(word, r->conds[i].value, len))
+        break;
+    }
+  }
+  return 1;
+}
+
+/* append the value of rule r for the tag at rec (with index i in the
+   records v[0..n)) to out as a JSON string.
+   return: 1 if a value was found
+*/
+static int ex_value(ex_rule *r, char *html, int32_t *v, int n, int i,
+                    mt_text *out, mt_text *tmp) {
+  int32_t *rec = v + i, *a;
+  char *start, *end, *next, *same;
+  int j, depth = 0, raw;
+
+  tmp->len = 0;
+  if (r->attr) {
+    a = ex_attr(html, rec, r->attr);
+    if (!a || a[3] < 0)
+      return 0;
+    ex_decode(tmp, html + a[3], html + a[4], 0);
+  }
+  else {
+    if (rec[0] == SCAN_EMPTY)
+      return 0;
+    start = html + rec[2];
+    end = next = same = 0;
+    /* the text ends at the matching end tag. Without one (<p>, <li>),
+       it ends at the next tag of the same name, or else at the next tag
+    */
+    for (j = i + SCAN_RECORD * (rec[5] + 1); j < n;
+         j += SCAN_RECORD * (v[j + 5] + 1)) {
+      if (   v[j + 4] - v[j + 3] != rec[4] - rec[3]
+          || strncasecmp(html + v[j + 3], html + rec[3], rec[4] - rec[3])) {
+        if (!next)
+          next = html + v[j + 1];
+        continue;
       }
-      
-      pURL_fichier = PyString_FromString(url_fichier);
-      if (!pURL_fichier) {
-        Py_DECREF(meth);
-        Py_DECREF(pHtml);
-        Py_DECREF(pURL_adresse);
-        return 0;
+      if (v[j] == SCAN_OPEN) {
+        if (!same)
+          same = html + v[j + 1];
+        depth++;
       }
-      
-      pArgs = PyTuple_New(3);
-      if (!pArgs) {
-        Py_DECREF(meth);
-        Py_DECREF(pHtml);
-        Py_DECREF(pURL_adresse);
-        Py_DECREF(pURL_fichier);
-        return 0;
+      else if (v[j] == SCAN_CLOSE && !depth--) {
+        end = html + v[j + 1];
+        break;
       }
-      
-      PyTuple_SetItem(pArgs, 0, pHtml);
-      PyTuple_SetItem(pArgs, 1, pURL_adresse);
-      PyTuple_SetItem(pArgs, 2, pURL_fichier);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(meth);
-      Py_DECREF(pArgs);
-      return pRes;
+    }
+    if (!end)
+      end = same ? same : next ? next : start;
+    raw = rec[4] - rec[3] == 6 ? !strncasecmp(html + rec[3], "script", 6)
+        : rec[4] - rec[3] == 5 ? !strncasecmp(html + rec[3], "style", 5)
+        : 0;
+    if (raw) {
+      for (; start < end && isspace((unsigned char)*start); start++) ;
+      for (; end > start && isspace((unsigned char)end[-1]); end--) ;
+      mt_printf(tmp, "%.*s", (int)(end - start), start);
+    }
+    else {
+      ex_decode(tmp, start, end, 1);
+      while (tmp->len && tmp->data[tmp->len - 1] == ' ')
+        tmp->len--;
     }
   }
-  /* no callback class or no appropriate method defined: continue */
-  pRes = PyInt_FromLong(1);
-  return pRes;
+  ex_json_string(out, tmp->data ? tmp->data : "", tmp->len);
+  return 1;
 }
 
-EXTERNAL_FUNCTION int hts_py_check_html(char* html, int len, 
-                                        char* url_adresse, char* url_fichier) {
-  PyObject * pRes;
-  int res;
+/* extract the fields of a page, and write them; called without the
+   GIL
+*/
+static void extract_page(char *html, int len, char *adr, char *fil) {
+  scan_vec v = { 0, 0, 0 };
+  mt_text out = { 0, 0, 0 }, tmp = { 0, 0, 0 };
+  const void *data[1];
+  size_t dlen[1];
+  int i, r, found, matches = 0;
+
+  if (!scan_html(html, len, 0, &v)) {
+    free(v.v);
+    return;
+  }
+  mt_printf(&out, "{\"url\": ");
+  mt_printf(&tmp, "%s%s%s", url_scheme(adr), adr, fil);
+  ex_json_string(&out, tmp.data, tmp.len);
+  for (r = 0; r < ex_nrules; r++) {
+    mt_printf(&out, ", ");
+    ex_json_string(&out, ex_rules[r].field, strlen(ex_rules[r].field));
+    mt_printf(&out, ex_rules[r].all ? ": [" : ": ");
+    found = 0;
+    for (i = 0; i < v.n; i += SCAN_RECORD * (v.v[i + 5] + 1)) {
+      if (   v.v[i] == SCAN_CLOSE || !ex_match(&ex_rules[r], html, v.v + i))
+        continue;
+      if (found && ex_rules[r].all)
+        mt_printf(&out, ", ");
+      if (ex_value(&ex_rules[r], html, v.v, v.n, i, &out, &tmp)) {
+        found++;
+        if (!ex_rules[r].all)
+          break;
+      }
+      else if (found && ex_rules[r].all) {
+        out.len -= 2;
+      }
+    }
+    matches += found;
+    if (ex_rules[r].all)
+      mt_printf(&out, "]");
+    else if (!found)
+      mt_printf(&out, "null");
+  }
+  mt_printf(&out, "}\n");
+  if (matches && out.data) {
+    data[0] = out.data;
+    dlen[0] = out.len;
+    bg_writer_append(&ex_writer, 1, data, dlen);
+  }
+  pthread_mutex_lock(&ex_lock);
+  ex_pages++;
+  ex_records += matches > 0;
+  ex_matches += matches;
+  pthread_mutex_unlock(&ex_lock);
+  free(v.v);
+  free(out.data);
+  free(tmp.data);
+}
+
+/* return: None, if no extraction was done, else
+           {'pages', 'records', 'matches', 'bytes'}
+*/
+static PyObject *build_extract_stats(void) {
+  PyObject *res;
+
+  if (!ex_writer.write_block) {
+    Py_INCREF(Py_None);
+    return Py_None;
+  }
+  pthread_mutex_lock(&ex_lock);
+  res = Py_BuildValue("{s:l,s:l,s:l,s:L}", "pages", ex_pages,
+                      "records", ex_records, "matches", ex_matches,
+                      "bytes", ex_writer.bytes_in);
+  pthread_mutex_unlock(&ex_lock);
+  return res;
+}
+
+static int py_check_html(char* html, int len,
+                         char* url_adresse, char* url_fichier) {
+  /* Python method:
+        instance.check_html(html, url_adresse, url_fichier)
+
+     The Python "boolean value" of the result is returned. The first
+     stage returning a false value refuses the page; the remaining
+     stages are not called.
+  */
+  cb_pipeline *p = &interp->pipelines[CB_CHECK_HTML];
+  PyObject *pArgs, *pRes;
+  int i, res = 1;
+  url_info u;
 #ifdef DEBUG
   fprintf(stderr, "hts_py_check_html %li\n", pthread_self());
 #endif
-  
-  pRes = process_html(html, len, url_adresse, url_fichier, "check_html");
-  if (pRes) {
-    res = PyObject_IsTrue(pRes);
-    Py_DECREF(pRes);
-    return res;
+  if (!cb_active(CB_CHECK_HTML))
+    return 1;
+  u.adr = url_adresse;
+  u.fil = url_fichier;
+  u.content_type = 0;
+  u.size = len;
+  if (!pipeline_wanted(p, &u))
+    return 1;
+  if (nworkers) {
+    res = worker_call(CB_CHECK_HTML, &html, &len, url_adresse, url_fichier);
+    if (res != WORKER_FAILED)
+      return res;
+    res = 1;
   }
-  else {
+
+  pArgs = Py_BuildValue("(s#ss)", html, len, url_adresse, url_fichier);
+  if (!pArgs) {
     process_error_indirect("check_html");
-    /* return value options 
-       0 -> page will not be processed by httrack. If this happens e.g.
-            in the start page, not a single file will be saved, and this
-            might not be intended.
-       1 -> page be processed.
-       
-       Returning 1 seems to be the better option: If the user wants to
-       abort the mirror, s/he can set the desired value in error_policy
-       of the Python error handler, and the mirror will be aborted soon
-    */
     return 1;
   }
+  for (i = 0; res && i < p->nstages; i++) {
+    if (!stage_wanted(&p->stages[i], &u))
+      continue;
+    pRes = call_stage(&p->stages[i], pArgs);
+    if (pRes) {
+      res = PyObject_IsTrue(pRes);
+      Py_DECREF(pRes);
+    }
+    else {
+      process_error_indirect("check_html");
+      /* return value options
+         0 -> page will not be processed by httrack. If this happens e.g.
+              in the start page, not a single file will be saved, and this
+              might not be intended.
+         1 -> page be processed.
+
+         Returning 1 seems to be the better option: If the user wants to
+         abort the mirror, s/he can set the desired value in error_policy
+         of the Python error handler, and the mirror will be aborted soon
+      */
+      res = 1;
+    }
+  }
+  Py_DECREF(pArgs);
+  return res;
 }
 
-static int can_change_html(char** html, int* len, 
-                                        char* url_adresse, char* url_fichier,
-                                        char *method) {
-  PyObject * pRes;
-  
-  pRes = process_html(*html, *len, url_adresse, url_fichier, method);
-  if (pRes) {
+static int can_change_html(char** html, int* len,
+                           char* url_adresse, char* url_fichier,
+                           int cb) {
+  /* allow to change the HTML text
+     Python method:
+        instance.preprocess_html(html, url_adresse, url_fichier)
+
+     If a string is returned, it replaces the HTML text. The stages
+     are chained: each stage gets the text returned by the previous
+     one. For other return values, the text is passed unchanged to
+     the next stage. The buffer *html is updated once, after the
+     last stage.
+  */
+  cb_pipeline *p = &interp->pipelines[cb];
+  PyObject *pHtml, *pArgs, *pRes;
+  int i, plen;
+  url_info u;
+
+  if (!cb_active(cb))
+    return 1;
+  /* the filters see the text as passed to the first stage */
+  u.adr = url_adresse;
+  u.fil = url_fichier;
+  u.content_type = 0;
+  u.size = *len;
+  if (!pipeline_wanted(p, &u))
+    return 1;
+  if (nworkers) {
+    i = worker_call(cb, html, len, url_adresse, url_fichier);
+    if (i != WORKER_FAILED)
+      return i;
+  }
+
+  pHtml = PyString_FromStringAndSize(*html, *len);
+  if (!pHtml) {
+    process_error_indirect(cb_names[cb]);
+    return 1;
+  }
+  for (i = 0; i < p->nstages; i++) {
+    if (!stage_wanted(&p->stages[i], &u))
+      continue;
+    pArgs = Py_BuildValue("(Oss)", pHtml, url_adresse, url_fichier);
+    if (!pArgs) {
+      process_error_indirect(cb_names[cb]);
+      break;
+    }
+    pRes = call_stage(&p->stages[i], pArgs);
+    Py_DECREF(pArgs);
+    if (!pRes) {
+      process_error_indirect(cb_names[cb]);
+      continue;
+    }
     if (PyString_Check(pRes)) {
-      int plen = PyString_Size(pRes);
-      if (plen > *len) {
-        *html = realloc(*html, plen+1);
-        if (!(*html)) {
-          PyErr_SetString(httrackError, "can't realloc buffer for HTML text\n");
-          process_error_indirect(method);
-          return 0;
-        }
-      }
-      
-      memcpy(*html, PyString_AsString(pRes), plen);
-      html[plen] = 0;
-      *len = plen;
+      Py_DECREF(pHtml);
+      pHtml = pRes;
+    }
+    else {
+      Py_DECREF(pRes);
     }
-    Py_DECREF(pRes);
   }
-  else {
-    process_error_indirect(method);
+
+  plen = PyString_Size(pHtml);
+  if (plen != *len || memcmp(*html, PyString_AsString(pHtml), plen)) {
+    if (plen > *len) {
+      char *tmp = realloc(*html, plen+1);
+      if (!tmp) {
+        Py_DECREF(pHtml);
+        PyErr_SetString(interp->httrackError,
+                        "can't realloc buffer for HTML text\n");
+        process_error_indirect(cb_names[cb]);
+        return 0;
+      }
+      *html = tmp;
+    }
+    memcpy(*html, PyString_AsString(pHtml), plen);
+    (*html)[plen] = 0;
+    *len = plen;
   }
+  Py_DECREF(pHtml);
   return 1;
 }
 
-EXTERNAL_FUNCTION int hts_py_preprocess_html(char** html, int* len, 
-                                        char* url_adresse, char* url_fichier) {
+static int py_preprocess_html(char** html, int* len,
+                         char* url_adresse, char* url_fichier) {
 #ifdef DEBUG
   fprintf(stderr, "hts_py_preprocess_html %li\n", pthread_self());
 #endif
-  return can_change_html(html, len, url_adresse, url_fichier, "preprocess_html");
+  return can_change_html(html, len, url_adresse, url_fichier,
+                         CB_PREPROCESS_HTML);
 }
 
-EXTERNAL_FUNCTION int hts_py_postprocess_html(char** html, int* len, 
-                                        char* url_adresse, char* url_fichier) {
+static int py_postprocess_html(char** html, int* len,
+                         char* url_adresse, char* url_fichier) {
 #ifdef DEBUG
   fprintf(stderr, "hts_py_postprocess_html %li\n", pthread_self());
 #endif
-  return can_change_html(html, len, url_adresse, url_fichier, "postprocess_html");
+  int res = can_change_html(html, len, url_adresse, url_fichier,
+                            CB_POSTPROCESS_HTML);
+  if (feed)
+    feed_publish(*html, *len, url_adresse, url_fichier);
+  return res;
 }
 
 
@@ -1181,67 +8952,60 @@ EXTERNAL_FUNCTION char* hts_py_query(char *question) {
    PyString_AsString of a "static" Python string, which should be
    returned by the Python method. We laeve the final "cleanup" to
    py_Finalize()
+
+   The first stage returning a string provides the answer.
 */
 
-static char* query(char *question, char *method, char *default_answer,
+static char* query(char *question, int cb, char *default_answer,
                    PyObject **pAnswer) {
-  PyObject *pQuestion, *meth, *pArgs, *pRes;
-  
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, method)) {
-    meth = PyObject_GetAttrString(pCallbackClass, method);
-    if (meth) {
-      pQuestion = PyString_FromString(question);
-      if (!pQuestion) {
-        process_error_indirect(method);
-        return default_answer;
-      }
-      pArgs = PyTuple_New(1);
-      if (!pArgs) {
-        Py_DECREF(pQuestion);
-        process_error_indirect(method);
-        return default_answer;
-      }
-      
-      PyTuple_SetItem(pArgs, 0, pQuestion);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
+  cb_pipeline *p = &interp->pipelines[cb];
+  PyObject *pArgs, *pRes;
+  int i;
+
+  if (!cb_active(cb))
+    return default_answer;
+
+  pArgs = Py_BuildValue("(s)", question);
+  if (!pArgs) {
+    process_error_indirect(cb_names[cb]);
+    return default_answer;
+  }
+  for (i = 0; i < p->nstages; i++) {
+    pRes = call_stage(&p->stages[i], pArgs);
+    if (!pRes) {
+      process_error_indirect(cb_names[cb]);
+      continue;
+    }
+    if (PyString_Check(pRes)) {
       Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        process_error_indirect(method);
-        return default_answer;
-      }
-      if (PyString_Check(pRes)) {
-        if (*pAnswer) {
-          Py_DECREF(*pAnswer);
-        }
-        *pAnswer = pRes;
-        return PyString_AsString(pRes);
-      }
-      else {
-        Py_DECREF(pRes);
-        return default_answer;
+      if (*pAnswer) {
+        Py_DECREF(*pAnswer);
       }
+      *pAnswer = pRes;
+      return PyString_AsString(pRes);
     }
+    Py_DECREF(pRes);
   }
+  Py_DECREF(pArgs);
   return default_answer;
 }
 
 static char *default_answer_query2 = "y";
-EXTERNAL_FUNCTION char* hts_py_query2(char *question) {
+static char* py_query2(char *question) {
 #ifdef DEBUG
   fprintf(stderr, "hts_py_query2 %li\n", pthread_self());
 #endif
-  return query(question, "query2", default_answer_query2, &pAnswerQuery2);
+  return query(question, CB_QUERY2, default_answer_query2,
+               &interp->pAnswerQuery2);
 }
 
 static char *default_answer_query3 = "*";
-EXTERNAL_FUNCTION char* hts_py_query3(char *question) {
+static char* py_query3(char *question) {
 #ifdef DEBUG
   fprintf(stderr, "hts_py_query3 %li\n", pthread_self());
 #endif
-  return query(question, "query3", default_answer_query3, &pAnswerQuery3);
+  return query(question, CB_QUERY3, default_answer_query3,
+               &interp->pAnswerQuery3);
 }
 
 
@@ -1338,166 +9102,119 @@ static PyObject *setup_lien_back(PyObject *dict, lien_back* back) {
   return dict;
 }
 
-EXTERNAL_FUNCTION int hts_py_loop(lien_back* back, int back_max,
-                                  int back_index, 
-                                  int lien_tot, int lien_ntot,
-                                  int stat_time, 
-                                  hts_stat_struct* stats) {
-  PyObject *pLienback, *pBackMax, *pBackIndex, *pLienTot, *pLienNtot,
-          *pStatTime, *meth, *pArgs=0, *pRes;
-  int res;
-  if (stop_on_next_callback)
-    return 0;
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_loop %li\n", pthread_self());
-#endif
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "loop")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "loop");
-    if (meth) {
-      pBackMax = PyInt_FromLong(back_max);
-      if (!pBackMax) {
-        Py_DECREF(meth);
-        return process_error_direct("loop");
-      }
-      pBackIndex = PyInt_FromLong(back_index);
-      if (!pBackIndex) {
-        Py_DECREF(meth);
-        Py_DECREF(pBackMax);
-        return process_error_direct("loop");
-      }
-      pLienTot = PyInt_FromLong(lien_tot);
-      if (!pLienTot) {
-        Py_DECREF(meth);
-        Py_DECREF(pBackMax);
-        Py_DECREF(pBackIndex);
-        return process_error_direct("loop");
-      }
-      pLienNtot = PyInt_FromLong(lien_ntot);
-      if (!pLienNtot) {
-        Py_DECREF(meth);
-        Py_DECREF(pBackMax);
-        Py_DECREF(pBackIndex);
-        Py_DECREF(pLienTot);
-        return process_error_direct("loop");
-      }
-      pStatTime = PyInt_FromLong(stat_time);
-      if (!pStatTime) {
-        Py_DECREF(meth);
-        Py_DECREF(pBackMax);
-        Py_DECREF(pBackIndex);
-        Py_DECREF(pLienTot);
-        Py_DECREF(pLienNtot);
-        return process_error_direct("loop");
-      }
-      
-      pLienback = PyDict_New();
-      if (!pLienback) {
-        Py_DECREF(meth);
-        Py_DECREF(pBackMax);
-        Py_DECREF(pBackIndex);
-        Py_DECREF(pLienTot);
-        Py_DECREF(pLienNtot);
-        Py_DECREF(pStatTime);
-        return process_error_direct("loop");
-      }
-      
-      if (!setup_lien_back(pLienback, back) || !(pArgs = PyTuple_New(6))) {
-        Py_DECREF(pBackMax);
-        Py_DECREF(pBackIndex);
-        Py_DECREF(pLienTot);
-        Py_DECREF(pLienNtot);
-        Py_DECREF(pStatTime);
-        Py_DECREF(pLienback);
-        return process_error_direct("loop");
-      }
+/* run the stages of the callbacks which may abort the mirror (loop,
+   send_header, receive_header): the first stage returning a false
+   value stops the mirror; the remaining stages are not called.
+*/
+static int run_direct(int cb, PyObject *pArgs) {
+  cb_pipeline *p = &interp->pipelines[cb];
+  PyObject *pRes;
+  int i, res = 1;
 
-      PyTuple_SetItem(pArgs, 0, pLienback);
-      PyTuple_SetItem(pArgs, 1, pBackMax);
-      PyTuple_SetItem(pArgs, 2, pBackIndex);
-      PyTuple_SetItem(pArgs, 3, pLienTot);
-      PyTuple_SetItem(pArgs, 4, pLienNtot);
-      PyTuple_SetItem(pArgs, 5, pStatTime);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        return process_error_direct("loop");
-      }
+  for (i = 0; res && i < p->nstages; i++) {
+    pRes = call_stage(&p->stages[i], pArgs);
+    if (!pRes) {
+      res = process_error_direct(cb_names[cb]);
+    }
+    else {
       res = PyObject_IsTrue(pRes);
       Py_DECREF(pRes);
-      return res;
     }
   }
-  return 1;
+  return res;
 }
 
-EXTERNAL_FUNCTION int hts_py_checklink(char *address, char* fil, int status) {
-  PyObject *pAddress, *pFil, *pStatus, *meth, *pArgs, *pRes;
+static int py_loop(lien_back* back, int back_max,
+                   int back_index,
+                   int lien_tot, int lien_ntot,
+                   int stat_time,
+                   hts_stat_struct* stats) {
+  PyObject *pLienback, *pArgs;
   int res;
- 
+  if (stop_on_next_callback)
+    return 0;
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_loop %li\n", pthread_self());
+#endif
+  if (ctl_opt)
+    controller_loop();
+  if (metrics_enabled)
+    metrics_loop(lien_tot, lien_ntot, stats);
+  if (!cb_active(CB_LOOP))
+    return 1;
+
+  pLienback = PyDict_New();
+  if (!pLienback) {
+    return process_error_direct("loop");
+  }
+  if (!setup_lien_back(pLienback, back)) {
+    Py_DECREF(pLienback);
+    return process_error_direct("loop");
+  }
+  pArgs = Py_BuildValue("(Niiiii)", pLienback, back_max, back_index,
+                        lien_tot, lien_ntot, stat_time);
+  if (!pArgs) {
+    return process_error_direct("loop");
+  }
+
+  res = run_direct(CB_LOOP, pArgs);
+  Py_DECREF(pArgs);
+  return res;
+}
+
+static int py_checklink(char *address, char* fil, int status) {
+  /* the first stage refusing the link (return value 0) wins; the
+     remaining stages are not called. Otherwise, the link is accepted,
+     if at least one stage accepted it (return value 1), else the
+     decision is left to httrack (-1)
+  */
+  cb_pipeline *p = &interp->pipelines[CB_CHECK_LINK];
+  PyObject *pArgs, *pRes;
+  dc_entry *dc = 0;
+  char *url;
+  int i, r, res = -1, failed = 0;
+
  #ifdef DEBUG
   fprintf(stderr, "hts_py_checklink %li\n", pthread_self());
 #endif
- 
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "check_link")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "check_link");
-    if (meth) {
-      pAddress = PyString_FromString(address);
-      if (!pAddress) {
-        process_error_indirect("check_link");
-        Py_DECREF(meth);
-        return -1;
-      }
-      pFil = PyString_FromString(fil);
-      if (!pFil) {
-        process_error_indirect("check_link");
-        Py_DECREF(meth);
-        Py_DECREF(pAddress);
-        return -1;
-      }
-      pStatus = PyInt_FromLong(status);
-      if (!pStatus) {
-        process_error_indirect("check_link");
-        Py_DECREF(meth);
-        Py_DECREF(pAddress);
-        Py_DECREF(pFil);
-        return -1;
-      }
-      pArgs = PyTuple_New(3);
-      if (!pArgs) {
-        process_error_indirect("check_link");
-        Py_DECREF(meth);
-        Py_DECREF(pAddress);
-        Py_DECREF(pFil);
-        Py_DECREF(pStatus);
-        return -1;
-      }
-      
-      PyTuple_SetItem(pArgs, 0, pAddress);
-      PyTuple_SetItem(pArgs, 1, pFil);
-      PyTuple_SetItem(pArgs, 2, pStatus);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        process_error_indirect("check_link");
-        return -1;
-      }
-      if (PyInt_Check(pRes)) {
-        res = PyInt_AsLong(pRes);
-      }
-      else {
-        res = -1;
-      }
-      Py_DECREF(pRes);
+  if (!cb_active(CB_CHECK_LINK))
+    return -1;
+  if (dc_capacity && (url = url_key(address, fil))) {
+    r = dc_lookup('c', url, "", status, &res, &dc);
+    free(url);
+    if (r)
       return res;
+  }
+
+  pArgs = Py_BuildValue("(ssi)", address, fil, status);
+  if (!pArgs) {
+    free(dc);
+    process_error_indirect("check_link");
+    return -1;
+  }
+  for (i = 0; i < p->nstages; i++) {
+    pRes = call_stage(&p->stages[i], pArgs);
+    if (!pRes) {
+      process_error_indirect("check_link");
+      failed = 1;
+      continue;
+    }
+    r = PyInt_Check(pRes) ? PyInt_AsLong(pRes) : -1;
+    Py_DECREF(pRes);
+    if (r == 0) {
+      res = 0;
+      break;
+    }
+    if (r == 1) {
+      res = 1;
     }
   }
-  return -1;
+  Py_DECREF(pArgs);
+  if (dc && !failed)
+    dc_store(dc, res);
+  else
+    free(dc);
+  return res;
 }
 
 #if 0
@@ -1518,226 +9235,519 @@ static void default_pause(char* lockfile) {
   while (fexist(lockfile)) {
     sleep(1);
   }
-}                        
+}
+
+/* run all stages of a callback whose return value is ignored */
+static int run_all(int cb, PyObject *pArgs, url_info *u) {
+  cb_pipeline *p = &interp->pipelines[cb];
+  PyObject *pRes;
+  int i, ok = 1;
+
+  for (i = 0; i < p->nstages; i++) {
+    if (u && !stage_wanted(&p->stages[i], u))
+      continue;
+    pRes = call_stage(&p->stages[i], pArgs);
+    if (!pRes) {
+      process_error_indirect(cb_names[cb]);
+      ok = 0;
+    }
+    else {
+      Py_DECREF(pRes);
+    }
+  }
+  return ok;
+}
+
+static void py_pause(char *lockfile) {
+  PyObject *pArgs;
+  int ok;
 
-EXTERNAL_FUNCTION void hts_py_pause(char *lockfile) {
-  PyObject *pLockfile, *meth, *pArgs, *pRes;
-  
 #ifdef DEBUG
   fprintf(stderr, "hts_py_pause %li\n", pthread_self());
 #endif
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "pause")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "pause");
-    if (meth) {
-      pLockfile = PyString_FromString(lockfile);
-      if (!pLockfile) {
-        process_error_indirect("pause");
-        default_pause(lockfile);
-        return;
-      }
-      pArgs = PyTuple_New(1);
-      if (!pArgs) {
-        process_error_indirect("pause");
-        Py_DECREF(pLockfile);
-        default_pause(lockfile);
-        return;
-      }
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        process_error_indirect("pause");
-        /* The Python error can have occured anywehre, and 
-           we should be really sure that the lockfile is gone,
-           so we'll call the internal test function.
-        */
-        default_pause(lockfile);
-        return;
-      }
-      
-      Py_DECREF(pRes);
-      return;
-    }
+  if (!cb_active(CB_PAUSE)) {
+    default_pause(lockfile);
+    return;
+  }
+  pArgs = Py_BuildValue("(s)", lockfile);
+  if (!pArgs) {
+    process_error_indirect("pause");
+    default_pause(lockfile);
+    return;
+  }
+  ok = run_all(CB_PAUSE, pArgs, 0);
+  Py_DECREF(pArgs);
+  if (!ok) {
+    /* The Python error can have occured anywehre, and
+       we should be really sure that the lockfile is gone,
+       so we'll call the internal test function.
+    */
+    default_pause(lockfile);
   }
-  
-  default_pause(lockfile);
 }
 
-EXTERNAL_FUNCTION void hts_py_save_file(char *file) {
-  PyObject *pFile, *meth, *pArgs, *pRes;
-  
+static void py_save_file(char *file) {
+  PyObject *pArgs;
+
 #ifdef DEBUG
   fprintf(stderr, "hts_py_save_file %li\n", pthread_self());
 #endif
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "save_file")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "save_file");
-    if (meth) {
-      pFile = PyString_FromString(file);
-      if (!pFile) {
-        process_error_indirect("save_file");
-        Py_DECREF(meth);
-        return;
-      }
+  if (!cb_active(CB_SAVE_FILE))
+    return;
+  pArgs = Py_BuildValue("(s)", file);
+  if (!pArgs) {
+    process_error_indirect("save_file");
+    return;
+  }
+  run_all(CB_SAVE_FILE, pArgs, 0);
+  Py_DECREF(pArgs);
+}
 
-      pArgs = PyTuple_New(1);
-      if (!pArgs) {
-        process_error_indirect("save_file");
-        Py_DECREF(meth);
-        Py_DECREF(pFile);
-        return;
-      }
-      
-      PyTuple_SetItem(pArgs, 0, pFile);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        process_error_indirect("save_file");
-        return;
+/* link_detected and link_detected2: the first stage returning a
+   false value refuses the link
+*/
+static int run_link_detected(int cb, PyObject *pArgs, int *failed) {
+  cb_pipeline *p = &interp->pipelines[cb];
+  PyObject *pRes;
+  int i, res = 1;
+
+  for (i = 0; res && i < p->nstages; i++) {
+    pRes = call_stage(&p->stages[i], pArgs);
+    if (!pRes) {
+      process_error_indirect(cb_names[cb]);
+      *failed = 1;
+      continue;
+    }
+    res = PyObject_IsTrue(pRes);
+    Py_DECREF(pRes);
+  }
+  return res;
+}
+
+static int py_link_detected(char *link) {
+  PyObject *pArgs;
+  dc_entry *dc = 0;
+  int res, failed = 0;
+
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_link_detected %li\n", pthread_self());
+#endif
+  if (!cb_active(CB_LINK_DETECTED))
+    return 1;
+  if (dc_capacity && dc_lookup('l', link, "", 0, &res, &dc))
+    return res;
+  pArgs = Py_BuildValue("(s)", link);
+  if (!pArgs) {
+    free(dc);
+    process_error_indirect("link_detected");
+    return 1;
+  }
+  res = run_link_detected(CB_LINK_DETECTED, pArgs, &failed);
+  Py_DECREF(pArgs);
+  if (dc && !failed)
+    dc_store(dc, res);
+  else
+    free(dc);
+  return res;
+}
+
+static int py_link_detected2(char *link, char* start_tag) {
+  PyObject *pArgs;
+  dc_entry *dc = 0;
+  int res, failed = 0;
+
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_link_detected2 %li\n", pthread_self());
+#endif
+  if (!cb_active(CB_LINK_DETECTED2))
+    return 1;
+  if (dc_capacity && dc_lookup('t', link, start_tag, 0, &res, &dc))
+    return res;
+  pArgs = Py_BuildValue("(ss)", link, start_tag);
+  if (!pArgs) {
+    free(dc);
+    process_error_indirect("link_detected2");
+    return 1;
+  }
+  res = run_link_detected(CB_LINK_DETECTED2, pArgs, &failed);
+  Py_DECREF(pArgs);
+  if (dc && !failed)
+    dc_store(dc, res);
+  else
+    free(dc);
+  return res;
+}
+
+static int py_transfer_status(lien_back *back) {
+  PyObject *pLienback, *pArgs;
+  url_info u;
+
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_transfer_status %li\n", pthread_self());
+#endif
+  if (ctl_opt)
+    controller_transfer_status(back);
+#ifdef HTS_PY_SQLITE
+  if (validator_db && back)
+    validator_transfer_status(back);
+#endif
+  if (metrics_enabled && back)
+    metrics_transfer_status(back);
+  if (evlog_enabled && back)
+    evlog_transfer(back);
+  if (trace_enabled && back)
+    trace_transfer(TR_TRANSFER_END, back->url_adr, back->url_fil,
+                   back->r.statuscode);
+  if (!cb_active(CB_TRANSFER_STATUS))
+    return 1;
+  u.adr = back ? back->url_adr : 0;
+  u.fil = back ? back->url_fil : 0;
+  u.content_type = back ? back->r.contenttype : 0;
+  u.size = back ? back->r.size : -1;
+  if (!pipeline_wanted(&interp->pipelines[CB_TRANSFER_STATUS], &u))
+    return 1;
+
+  pLienback = PyDict_New();
+  if (!pLienback) {
+    process_error_indirect("transfer_status");
+    return 1;
+  }
+  if (!setup_lien_back(pLienback, back)) {
+    process_error_indirect("transfer_status");
+    Py_DECREF(pLienback);
+    return 1;
+  }
+  pArgs = Py_BuildValue("(N)", pLienback);
+  if (!pArgs) {
+    process_error_indirect("transfer_status");
+    return 1;
+  }
+  run_all(CB_TRANSFER_STATUS, pArgs, &u);
+  Py_DECREF(pArgs);
+  return 1;
+}
+
+static int py_save_name(char *adr_complete,
+                        char *fil_complete,
+                        char *referer_adr,
+                        char *referer_fil,
+                        char *save) {
+  /* the stages are chained: if a stage returns a string, it is
+     copied into save, and the next stage gets the new value
+  */
+  cb_pipeline *p = &interp->pipelines[CB_SAVE_NAME];
+  PyObject *pArgs, *pRes;
+  int i, size;
+
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_save_name %li\n", pthread_self());
+#endif
+  if (!cb_active(CB_SAVE_NAME))
+    return 1;
+  for (i = 0; i < p->nstages; i++) {
+    pArgs = Py_BuildValue("(sssss)", adr_complete, fil_complete,
+                          referer_adr, referer_fil, save);
+    if (!pArgs) {
+      process_error_indirect("save_name");
+      return 1;
+    }
+    pRes = call_stage(&p->stages[i], pArgs);
+    Py_DECREF(pArgs);
+
+    if (!pRes) {
+      process_error_indirect("save_name");
+      continue;
+    }
+
+    if (PyString_Check(pRes)) {
+      size = PyString_Size(pRes);
+      size = size < 1023 ? size : 1023;
+      if (size) {
+        memcpy(save, PyString_AsString(pRes), size);
+        save[size] = 0;
       }
-      Py_DECREF(pRes);
     }
+    Py_DECREF(pRes);
+  }
+  return 1;
+}
+
+static int process_header(char *buf,
+                          char *adr,
+                          char *fil,
+                          char *referer_adr,
+                          char *referer_fil,
+                          htsblk *incoming,
+                          int cb) {
+  PyObject *pHtsblk, *pArgs;
+  int res;
+  if (stop_on_next_callback)
+    return 0;
+  if (!cb_active(cb))
+    return 1;
+
+  pHtsblk = PyDict_New();
+  if (!pHtsblk) {
+    return process_error_direct(cb_names[cb]);
+  }
+  if (!setup_htsblk(pHtsblk, incoming)) {
+    Py_DECREF(pHtsblk);
+    return process_error_direct(cb_names[cb]);
+  }
+  pArgs = Py_BuildValue("(sssssN)", buf, adr, fil, referer_adr, referer_fil,
+                        pHtsblk);
+  if (!pArgs) {
+    return process_error_direct(cb_names[cb]);
+  }
+
+  res = run_direct(cb, pArgs);
+  Py_DECREF(pArgs);
+  return res;
+}
+
+static int py_send_header(char *buf,
+                          char *adr,
+                          char *fil,
+                          char *referer_adr,
+                          char *referer_fil,
+                          htsblk *incoming) {
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_send_header %li\n", pthread_self());
+#endif
+  if (host_limits_enabled)
+    host_limit_request(adr);
+  if (trace_enabled)
+    trace_transfer(TR_TRANSFER_BEGIN, adr, fil, 0);
+  if (ctl_opt)
+    controller_send_header(adr, fil);
+#ifdef HTS_PY_SQLITE
+  if (validator_db)
+    validator_send_header(buf, adr, fil);
+#endif
+  return process_header(buf, adr, fil, referer_adr, referer_fil,
+                        incoming, CB_SEND_HEADER);
+}
+
+static int py_receive_header(char *buf,
+                          char *adr,
+                          char *fil,
+                          char *referer_adr,
+                          char *referer_fil,
+                          htsblk *incoming) {
+#ifdef DEBUG
+  fprintf(stderr, "hts_py_send_header %li\n", pthread_self());
+#endif
+#ifdef HTS_PY_SQLITE
+  if (validator_db)
+    validator_receive_header(incoming);
+#endif
+  if (feed)
+    feed_receive_header(buf, adr, fil, incoming);
+  page_receive_header(buf, adr, fil, incoming);
+  return process_header(buf, adr, fil, referer_adr, referer_fil,
+                        incoming, CB_RECEIVE_HEADER);
+}
+
+
+/* the functions called by httrack. They only acquire the GIL and
+   call the py_* functions above.
+*/
+
+EXTERNAL_FUNCTION int hts_py_change_options(httrackp* opt) {
+  PyGILState_STATE gil = enter_python(CB_CHANGE_OPTIONS);
+  int res = py_change_options(opt);
+  leave_python(gil);
+  return res;
+}
+
+EXTERNAL_FUNCTION int hts_py_check_html(char* html, int len,
+                                        char* url_adresse, char* url_fichier) {
+  PyGILState_STATE gil;
+  int res;
+  if (ex_enabled)
+    extract_page(html, len, url_adresse, url_fichier);
+  if (sh_mode && !near_duplicate_check(html, len, url_adresse, url_fichier))
+    return 0;
+  RUN_NATIVE(res, CB_CHECK_HTML, hts_py_check_html_fn,
+             (html, len, url_adresse, url_fichier, native->data));
+  if (res != HTS_PY_CONTINUE)
+    return res;
+  if (!html_wanted(CB_CHECK_HTML, url_adresse, url_fichier, len))
+    return 1;
+  gil = enter_python(CB_CHECK_HTML);
+  watch_url(url_adresse, url_fichier);
+  res = py_process_page(html, len, url_adresse, url_fichier);
+  if (res)
+    res = py_check_html(html, len, url_adresse, url_fichier);
+  leave_python(gil);
+  return res;
+}
+
+EXTERNAL_FUNCTION int hts_py_preprocess_html(char** html, int* len,
+                                        char* url_adresse, char* url_fichier) {
+  PyGILState_STATE gil;
+  int res = HTS_PY_CONTINUE, late = warc_enabled || page_pending.buckets;
+  /* the filters of the Python stages apply, also if late */
+  int wanted = html_wanted(CB_PREPROCESS_HTML, url_adresse, url_fichier,
+                           *len);
+  if (!late) {
+    RUN_NATIVE(res, CB_PREPROCESS_HTML, hts_py_preprocess_html_fn,
+               (html, len, url_adresse, url_fichier, native->data));
+    if (res != HTS_PY_CONTINUE)
+      return res;
+    if (!wanted)
+      return 1;
+  }
+  gil = enter_python(CB_PREPROCESS_HTML);
+  watch_url(url_adresse, url_fichier);
+  if (warc_enabled)
+    warc_html(*html, *len, url_adresse, url_fichier);
+  page_preprocess(html, len, url_adresse, url_fichier);
+  if (late) {
+    RUN_NATIVE(res, CB_PREPROCESS_HTML, hts_py_preprocess_html_fn,
+               (html, len, url_adresse, url_fichier, native->data));
+  }
+  if (res == HTS_PY_CONTINUE)
+    res = wanted ? py_preprocess_html(html, len, url_adresse, url_fichier)
+                 : 1;
+  leave_python(gil);
+  return res;
+}
+
+EXTERNAL_FUNCTION int hts_py_postprocess_html(char** html, int* len,
+                                        char* url_adresse, char* url_fichier) {
+  PyGILState_STATE gil;
+  int res = HTS_PY_CONTINUE, late = feed || page_pending.buckets;
+  int wanted = html_wanted(CB_POSTPROCESS_HTML, url_adresse, url_fichier,
+                           *len);
+  if (!late) {
+    RUN_NATIVE(res, CB_POSTPROCESS_HTML, hts_py_postprocess_html_fn,
+               (html, len, url_adresse, url_fichier, native->data));
+    if (res != HTS_PY_CONTINUE)
+      return res;
+    if (!wanted)
+      return 1;
+  }
+  gil = enter_python(CB_POSTPROCESS_HTML);
+  watch_url(url_adresse, url_fichier);
+  page_postprocess(html, len, url_adresse, url_fichier);
+  if (late) {
+    RUN_NATIVE(res, CB_POSTPROCESS_HTML, hts_py_postprocess_html_fn,
+               (html, len, url_adresse, url_fichier, native->data));
   }
-  return;
+  if (res == HTS_PY_CONTINUE && wanted) {
+    res = py_postprocess_html(html, len, url_adresse, url_fichier);
+  }
+  else {
+    if (res == HTS_PY_CONTINUE)
+      res = 1;
+    if (feed)
+      feed_publish(*html, *len, url_adresse, url_fichier);
+  }
+  leave_python(gil);
+  return res;
+}
+
+EXTERNAL_FUNCTION char* hts_py_query2(char *question) {
+  PyGILState_STATE gil = enter_python(CB_QUERY2);
+  char *res = py_query2(question);
+  leave_python(gil);
+  return res;
+}
+
+EXTERNAL_FUNCTION char* hts_py_query3(char *question) {
+  PyGILState_STATE gil = enter_python(CB_QUERY3);
+  char *res = py_query3(question);
+  leave_python(gil);
+  return res;
+}
+
+EXTERNAL_FUNCTION int hts_py_loop(lien_back* back, int back_max,
+                                  int back_index,
+                                  int lien_tot, int lien_ntot,
+                                  int stat_time,
+                                  hts_stat_struct* stats) {
+  PyGILState_STATE gil;
+  int res;
+  if (host_limits_enabled)
+    host_limit_release(back, back_max, lien_tot, lien_ntot);
+  gil = enter_python(CB_LOOP);
+  res = py_loop(back, back_max, back_index, lien_tot, lien_ntot,
+                stat_time, stats);
+  leave_python(gil);
+  return res;
+}
+
+EXTERNAL_FUNCTION int hts_py_checklink(char *address, char* fil, int status) {
+  PyGILState_STATE gil;
+  int res;
+  RUN_NATIVE(res, CB_CHECK_LINK, hts_py_check_link_fn,
+             (address, fil, status, native->data));
+  if (res == HTS_PY_CONTINUE) {
+    gil = enter_python(CB_CHECK_LINK);
+    watch_url(address, fil);
+    res = py_checklink(address, fil, status);
+    leave_python(gil);
+  }
+  if (host_limits_enabled)
+    res = host_limit_link(address, fil, status, res);
+  if (evlog_enabled)
+    evlog_check_link(address, fil, status, res);
+  return res;
+}
+
+EXTERNAL_FUNCTION void hts_py_pause(char *lockfile) {
+  PyGILState_STATE gil = enter_python(CB_PAUSE);
+  py_pause(lockfile);
+  leave_python(gil);
+}
+
+EXTERNAL_FUNCTION void hts_py_save_file(char *file) {
+  PyGILState_STATE gil = enter_python(CB_SAVE_FILE);
+  py_save_file(file);
+  /* the WARC writer reads the file before it is packed and removed */
+  if (warc_enabled)
+    warc_save_file(file);
+  if (pack_enabled)
+    pack_save_file(file);
+  leave_python(gil);
 }
 
 EXTERNAL_FUNCTION int hts_py_link_detected(char *link) {
-  PyObject *pLink, *meth, *pArgs, *pRes;
+  PyGILState_STATE gil;
   int res;
-  
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_link_detected %li\n", pthread_self());
-#endif
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "link_detected")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "link_detected");
-    if (meth) {
-      pLink = PyString_FromString(link);
-      if (!pLink) {
-        process_error_indirect("link_detected");
-        Py_DECREF(meth);
-        return 1;
-      }
-
-      pArgs = PyTuple_New(1);
-      if (!pArgs) {
-        process_error_indirect("link_detected");
-        Py_DECREF(meth);
-        Py_DECREF(pLink);
-        return 1;
-      }
-      
-      PyTuple_SetItem(pArgs, 0, pLink);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        process_error_indirect("link_detected");
-        return 1;
-      }
-      
-      res = PyObject_IsTrue(pRes);
-      Py_DECREF(pRes);
-      return res;
-    }
-  }
-  return 1;
+  RUN_NATIVE(res, CB_LINK_DETECTED, hts_py_link_detected_fn,
+             (link, native->data));
+  if (res != HTS_PY_CONTINUE)
+    return res;
+  gil = enter_python(CB_LINK_DETECTED);
+  watch_url(link, "");
+  res = py_link_detected(link);
+  leave_python(gil);
+  return res;
 }
 
 EXTERNAL_FUNCTION int hts_py_link_detected2(char *link, char* start_tag) {
-  PyObject *pLink, *pStartTag, *meth, *pArgs, *pRes;
+  PyGILState_STATE gil;
   int res;
-  
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_link_detected2 %li\n", pthread_self());
-#endif
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "link_detected2")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "link_detected2");
-    if (meth) {
-      pLink = PyString_FromString(link);
-      if (!pLink) {
-        process_error_indirect("link_detected2");
-        Py_DECREF(meth);
-        return 1;
-      }
-
-      pStartTag = PyString_FromString(start_tag);
-      if (!pStartTag) {
-        process_error_indirect("link_detected2");
-        Py_DECREF(meth);
-        Py_DECREF(pLink);
-        return 1;
-      }
-
-      pArgs = PyTuple_New(2);
-      if (!pArgs) {
-        process_error_indirect("link_detected2");
-        Py_DECREF(meth);
-        Py_DECREF(pLink);
-        Py_DECREF(pStartTag);
-        return 1;
-      }
-      
-      PyTuple_SetItem(pArgs, 0, pLink);
-      PyTuple_SetItem(pArgs, 1, pStartTag);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        process_error_indirect("link_detected2");
-        return 1;
-      }
-      
-      res = PyObject_IsTrue(pRes);
-      Py_DECREF(pRes);
-      return res;
-    }
-  }
-  return 1;
+  RUN_NATIVE(res, CB_LINK_DETECTED2, hts_py_link_detected2_fn,
+             (link, start_tag, native->data));
+  if (res != HTS_PY_CONTINUE)
+    return res;
+  gil = enter_python(CB_LINK_DETECTED2);
+  watch_url(link, "");
+  res = py_link_detected2(link, start_tag);
+  leave_python(gil);
+  return res;
 }
 
 EXTERNAL_FUNCTION int hts_py_transfer_status(lien_back *back) {
-  PyObject *pLienback, *meth, *pArgs=0, *pRes;
-  
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_transfer_status %li\n", pthread_self());
-#endif
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "transfer_status")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "transfer_status");
-    if (meth) {
-      pLienback = PyDict_New();
-      if (!pLienback) {
-        process_error_indirect("transfer_status");
-        Py_DECREF(meth);
-        return 1;
-      }
-      
-      if (!setup_lien_back(pLienback, back) || !(pArgs = PyTuple_New(1))) {
-        process_error_indirect("transfer_status");
-        Py_DECREF(meth);
-        Py_DECREF(pLienback);
-        return 1;
-      }
-      
-      PyTuple_SetItem(pArgs, 0, pLienback);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        process_error_indirect("transfer_status");
-      }
-    }
-  }
-  return 1;
+  PyGILState_STATE gil = enter_python(CB_TRANSFER_STATUS);
+  int res;
+  watch_url(back->url_adr, back->url_fil);
+  res = py_transfer_status(back);
+  leave_python(gil);
+  return res;
 }
 
 EXTERNAL_FUNCTION int hts_py_save_name(char *adr_complete,
@@ -1745,204 +9755,17 @@ EXTERNAL_FUNCTION int hts_py_save_name(char *adr_complete,
                                        char *referer_adr,
                                        char *referer_fil,
                                        char *save) {
-  PyObject *pAddress, *pFil, *pRefererAdr, *pRefererFil, *pSave, 
-           *meth, *pArgs, *pRes;
-  
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_save_name %li\n", pthread_self());
-#endif
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, "save_name")) {
-    meth = PyObject_GetAttrString(pCallbackClass, "save_name");
-    if (meth) {
-      pAddress = PyString_FromString(adr_complete);
-      if (!pAddress) {
-        process_error_indirect("save_name");
-        Py_DECREF(meth);
-        return 1;
-      }
-      pFil = PyString_FromString(fil_complete);
-      if (!pFil) {
-        process_error_indirect("save_name");
-        Py_DECREF(meth);
-        Py_DECREF(pAddress);
-        return 1;
-      }
-      pRefererAdr = PyString_FromString(referer_adr);
-      if (!pRefererAdr) {
-        process_error_indirect("save_name");
-        Py_DECREF(meth);
-        Py_DECREF(pAddress);
-        Py_DECREF(pFil);
-        return 1;
-      }
-      pRefererFil = PyString_FromString(referer_fil);
-      if (!pRefererFil) {
-        process_error_indirect("save_name");
-        Py_DECREF(meth);
-        Py_DECREF(pAddress);
-        Py_DECREF(pFil);
-        Py_DECREF(pRefererAdr);
-        return 1;
-      }
-      pSave = PyString_FromString(save);
-      if (!pSave) {
-        process_error_indirect("save_name");
-        Py_DECREF(meth);
-        Py_DECREF(pAddress);
-        Py_DECREF(pFil);
-        Py_DECREF(pRefererAdr);
-        Py_DECREF(pRefererFil);
-        return 1;
-      }
-
-      pArgs = PyTuple_New(5);
-      if (!pArgs) {
-        process_error_indirect("save_name");
-        Py_DECREF(meth);
-        Py_DECREF(pAddress);
-        Py_DECREF(pFil);
-        Py_DECREF(pRefererAdr);
-        Py_DECREF(pRefererFil);
-        Py_DECREF(pSave);
-        return 1;
-      }
-      
-      PyTuple_SetItem(pArgs, 0, pAddress);
-      PyTuple_SetItem(pArgs, 1, pFil);
-      PyTuple_SetItem(pArgs, 2, pRefererAdr);
-      PyTuple_SetItem(pArgs, 3, pRefererFil);
-      PyTuple_SetItem(pArgs, 4, pSave);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        process_error_indirect("save_name");
-        return 1;
-      }
-      
-      if (PyString_Check(pRes)) {
-        int size = PyString_Size(pRes);
-        size = size < 1023 ? size : 1023;
-        if (size) {
-          memcpy(save, PyString_AsString(pRes), size);
-          save[size] = 0;
-        }
-      }
-      
-      Py_DECREF(pRes);
-      return 1;
-    }
-  }
-  return 1;
-}
-
-static int process_header(char *buf,
-                          char *adr,
-                          char *fil,
-                          char *referer_adr,
-                          char *referer_fil,
-                          htsblk *incoming,
-                          char *function) {
-  PyObject *pBuf, *pAdr, *pFil, *pRefererAdr, *pRefererFil, *pHtsblk,
-           *meth, *pArgs, *pRes;
+  PyGILState_STATE gil = enter_python(CB_SAVE_NAME);
   int res;
-  if (stop_on_next_callback)
-    return 0;
-  
-  if (pCallbackClass && PyObject_HasAttrString(pCallbackClass, function)) {
-    meth = PyObject_GetAttrString(pCallbackClass, function);
-    if (meth) {
-      pBuf = PyString_FromString(buf);
-      if (!pBuf) {
-        Py_DECREF(meth);
-        return process_error_direct(function);
-      }
-      pAdr = PyString_FromString(adr);
-      if (!pAdr) {
-        Py_DECREF(meth);
-        Py_DECREF(pBuf);
-        return process_error_direct(function);
-      }
-      pFil = PyString_FromString(fil);
-      if (!pFil) {
-        Py_DECREF(meth);
-        Py_DECREF(pBuf);
-        Py_DECREF(pAdr);
-        return process_error_direct(function);
-      }
-      pRefererAdr = PyString_FromString(referer_adr);
-      if (!pRefererAdr) {
-        Py_DECREF(meth);
-        Py_DECREF(pBuf);
-        Py_DECREF(pAdr);
-        Py_DECREF(pFil);
-        return process_error_direct(function);
-      }
-      pRefererFil = PyString_FromString(referer_fil);
-      if (!pRefererAdr) {
-        Py_DECREF(meth);
-        Py_DECREF(pBuf);
-        Py_DECREF(pAdr);
-        Py_DECREF(pFil);
-        Py_DECREF(pRefererAdr);
-        return process_error_direct(function);
-      }
-
-      pHtsblk = PyDict_New();
-      if (!pHtsblk) {
-        Py_DECREF(meth);
-        Py_DECREF(pBuf);
-        Py_DECREF(pAdr);
-        Py_DECREF(pFil);
-        Py_DECREF(pRefererAdr);
-        Py_DECREF(pRefererFil);
-        return process_error_direct(function);
-      }
-      if (!setup_htsblk(pHtsblk, incoming)) {
-        Py_DECREF(meth);
-        Py_DECREF(pBuf);
-        Py_DECREF(pAdr);
-        Py_DECREF(pFil);
-        Py_DECREF(pRefererAdr);
-        Py_DECREF(pRefererFil);
-        Py_DECREF(pHtsblk);
-        return process_error_direct(function);
-      }
-      pArgs = PyTuple_New(6);
-      if (!pRefererAdr) {
-        Py_DECREF(meth);
-        Py_DECREF(pBuf);
-        Py_DECREF(pAdr);
-        Py_DECREF(pFil);
-        Py_DECREF(pRefererAdr);
-        Py_DECREF(pRefererFil);
-        Py_DECREF(pHtsblk);
-        return process_error_direct(function);
-      }
-      
-      PyTuple_SetItem(pArgs, 0, pBuf);
-      PyTuple_SetItem(pArgs, 1, pAdr);
-      PyTuple_SetItem(pArgs, 2, pFil);
-      PyTuple_SetItem(pArgs, 3, pRefererAdr);
-      PyTuple_SetItem(pArgs, 4, pRefererFil);
-      PyTuple_SetItem(pArgs, 5, pHtsblk);
-      
-      pRes = PyObject_CallObject(meth, pArgs);
-      Py_DECREF(pArgs);
-      Py_DECREF(meth);
-      
-      if (!pRes) {
-        return process_error_direct(function);
-      }
-      
-      res = PyObject_IsTrue(pRes);
-      Py_DECREF(pRes);
-      return res;
-    }
-  }
-  return 1;
+  watch_url(adr_complete, fil_complete);
+  res = py_save_name(adr_complete, fil_complete, referer_adr,
+                     referer_fil, save);
+  if (evlog_enabled)
+    evlog_save_name(adr_complete, fil_complete, save);
+  if (warc_enabled)
+    warc_save_name(adr_complete, fil_complete, save);
+  leave_python(gil);
+  return res;
 }
 
 EXTERNAL_FUNCTION int hts_py_send_header(char *buf,
@@ -1951,11 +9774,15 @@ EXTERNAL_FUNCTION int hts_py_send_header(char *buf,
                                          char *referer_adr,
                                          char *referer_fil,
                                          htsblk *incoming) {
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_send_header %li\n", pthread_self());
-#endif
-  return process_header(buf, adr, fil, referer_adr, referer_fil, 
-                        incoming, "send_header");
+  PyGILState_STATE gil = enter_python(CB_SEND_HEADER);
+  int res;
+  watch_url(adr, fil);
+  res = py_send_header(buf, adr, fil, referer_adr, referer_fil,
+                       incoming);
+  if (warc_enabled)
+    warc_send_header(buf, adr, fil);
+  leave_python(gil);
+  return res;
 }
 
 EXTERNAL_FUNCTION int hts_py_receive_header(char *buf,
@@ -1964,11 +9791,15 @@ EXTERNAL_FUNCTION int hts_py_receive_header(char *buf,
                                          char *referer_adr,
                                          char *referer_fil,
                                          htsblk *incoming) {
-#ifdef DEBUG
-  fprintf(stderr, "hts_py_send_header %li\n", pthread_self());
-#endif
-  return process_header(buf, adr, fil, referer_adr, referer_fil, 
-                        incoming, "receive_header");
+  PyGILState_STATE gil = enter_python(CB_RECEIVE_HEADER);
+  int res;
+  watch_url(adr, fil);
+  if (warc_enabled)
+    warc_receive_header(buf, adr, fil, incoming);
+  res = py_receive_header(buf, adr, fil, referer_adr, referer_fil,
+                          incoming);
+  leave_python(gil);
+  return res;
 }
 
 #ifndef PLUGIN
@@ -2026,9 +9857,19 @@ EXTERNAL_FUNCTION int hts_py_receive_header(char *buf,
     }
     
     hts_init();
-    initialize(cbObj);
+    if (!initialize(cbObj)) {
+      PyObject *pType, *pValue, *pTraceback;
+      free(hts_main_args);
+      PyErr_Fetch(&pType, &pValue, &pTraceback);
+      cleanup();
+      PyErr_Restore(pType, pValue, pTraceback);
+      return 0;
+    }
     
+    /* the callbacks acquire the GIL, when they need it */
+    Py_BEGIN_ALLOW_THREADS
     i = hts_main(argc, hts_main_args);
+    Py_END_ALLOW_THREADS
     cleanup();
 
     if (i) {
@@ -2057,8 +9898,194 @@ EXTERNAL_FUNCTION int hts_py_receive_header(char *buf,
     
     return result;
   }
-  
-  static PyMethodDef httrackMethods[] = {
+#endif
+
+/* Python functions available in both the plugin and the extension
+   module. In the plugin, they are provided by the built-in module
+   httracklib, which is created during plugin initialization, so the
+   callback module can simply import it.
+*/
+
+static PyObject* hts_py_stage_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  if (!interp->pHandlers && pLastStageStats) {
+    /* the mirror is finished */
+    Py_INCREF(pLastStageStats);
+    return pLastStageStats;
+  }
+  return build_stage_stats();
+}
+
+static PyObject* hts_py_feed_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_feed_stats();
+}
+
+static PyObject* hts_py_validator_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_validator_stats();
+}
+
+static PyObject* hts_py_host_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_host_stats();
+}
+
+static PyObject* hts_py_controller_log(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_controller_log();
+}
+
+static PyObject* hts_py_decision_cache_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_decision_cache_stats();
+}
+
+static PyObject* hts_py_decision_cache_invalidate(PyObject *self,
+                                                 PyObject *args,
+                                                 PyObject *kwargs) {
+  static char *kwlist[] = {"url", "host", 0};
+  char *url = 0, *host = 0;
+
+  if (!PyArg_ParseTupleAndKeywords(args, kwargs, "|zz", kwlist, &url, &host))
+    return 0;
+  return PyInt_FromLong(dc_invalidate(url, host));
+}
+
+static PyObject* hts_py_error_summary(PyObject *self, PyObject *args) {
+  PyObject *errors, *breakers;
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  errors = build_error_summary();
+  if (!errors)
+    return 0;
+  breakers = build_breaker_stats();
+  if (!breakers) {
+    Py_DECREF(errors);
+    return 0;
+  }
+  return Py_BuildValue("{s:N,s:N}", "errors", errors, "breakers", breakers);
+}
+
+static PyObject* hts_py_overruns(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_overruns();
+}
+
+static PyObject* hts_py_metrics_text(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_metrics_text();
+}
+
+static PyObject* hts_py_event_log_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_event_log_stats();
+}
+
+static PyObject* hts_py_warc_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_warc_stats();
+}
+
+static PyObject* hts_py_pack_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_pack_stats();
+}
+
+static PyObject* hts_py_extract_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_extract_stats();
+}
+
+static PyObject* hts_py_audit_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_audit_stats();
+}
+
+static PyObject* hts_py_near_duplicate_stats(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_near_duplicate_stats();
+}
+
+static PyObject* hts_py_simhash(PyObject *self, PyObject *args) {
+  PyObject *obj;
+  const char *html;
+  Py_ssize_t len;
+  int n;
+
+  if (!PyArg_ParseTuple(args, "O", &obj))
+    return 0;
+  if (PyObject_TypeCheck(obj, &page_type))
+    return page_get_simhash((page_object*) obj, 0);
+  if (PyObject_AsCharBuffer(obj, &html, &len))
+    return 0;
+  return PyLong_FromUnsignedLongLong(simhash((char*) html, len, &n));
+}
+
+static PyObject* hts_py_scan_tags(PyObject *self, PyObject *args) {
+  PyObject *obj, *pNames = 0, *seq = 0, *res = 0;
+  const char *html;
+  char **names = 0;
+  Py_ssize_t len;
+  int i, n;
+
+  if (!PyArg_ParseTuple(args, "O|O", &obj, &pNames))
+    return 0;
+  if (PyObject_TypeCheck(obj, &page_type))
+    obj = ((page_object*) obj)->html;
+  if (PyObject_AsCharBuffer(obj, &html, &len))
+    return 0;
+  if (pNames && pNames != Py_None) {
+    seq = PySequence_Fast(pNames, "names must be a sequence of strings");
+    if (!seq)
+      return 0;
+    n = PySequence_Fast_GET_SIZE(seq);
+    names = calloc(n + 1, sizeof(char*));
+    if (!names) {
+      Py_DECREF(seq);
+      return PyErr_NoMemory();
+    }
+    for (i = 0; i < n; i++) {
+      names[i] = PyString_Check(PySequence_Fast_GET_ITEM(seq, i))
+                   ? PyString_AS_STRING(PySequence_Fast_GET_ITEM(seq, i))
+                   : 0;
+      if (!names[i]) {
+        PyErr_SetString(PyExc_TypeError,
+                        "names must be a sequence of strings");
+        goto done;
+      }
+    }
+  }
+  res = build_scan_tags((char*) html, len, names);
+
+done:
+  free(names);
+  Py_XDECREF(seq);
+  return res;
+}
+
+static PyObject* hts_py_profile_samples(PyObject *self, PyObject *args) {
+  if (!PyArg_ParseTuple(args, ""))
+    return 0;
+  return build_profile_samples();
+}
+
+static PyMethodDef httrackMethods[] = {
+#ifndef PLUGIN
     {"httrack", hts_py_hts_main, METH_VARARGS, 
      "calls the hts_main function\n"
      "usage: httrack(callback_instance, arguments)\n\n"
@@ -2069,31 +10096,208 @@ EXTERNAL_FUNCTION int hts_py_receive_header(char *buf,
      "callback_instance must be an intance of class defining at least\n"
      "one of the callbacks start, end, pause, query2, query3,change_options,\n"
      "check_html, preprocess_html, postprocess_html, loop, check_link,\n"
-     "save_file, link_detected, save_name, send_header, receive_header\n\n"
+     "save_file, link_detected, save_name, send_header, receive_header,\n"
+     "or a list of such instances\n\n"
      "arguments must be a sequence of strings, where the strings are valid\n"
      "arguments for hts_main, i.e., they must be httrack command line\n"
      "parameters or URLs\n"
     },
+#endif
+    {"stage_stats", hts_py_stage_stats, METH_VARARGS,
+     "return the number of calls and the time spent in each callback\n"
+     "method\n"
+     "usage: stage_stats()\n\n"
+     "return value: {callback_name: [(handler_index, calls, seconds), ...]}\n"
+     "After the end of a mirror, the statistics of that mirror are\n"
+     "returned.\n"
+    },
+    {"feed_stats", hts_py_feed_stats, METH_VARARGS,
+     "return the statistics of the page feed\n"
+     "usage: feed_stats()\n\n"
+     "return value: None, if no feed is active, else a dictionary\n"
+     "{'size', 'records', 'bytes', 'too_large', 'subscribers'}, where\n"
+     "subscribers is a list of dictionaries\n"
+     "{'pid', 'lag_records', 'lag_bytes', 'drops'}\n"
+    },
+    {"validator_stats", hts_py_validator_stats, METH_VARARGS,
+     "return the statistics of the validator cache\n"
+     "usage: validator_stats()\n\n"
+     "return value: None, if no validator cache is used, else a\n"
+     "dictionary {'hits', 'misses', 'not_modified', 'stored',\n"
+     "'dropped'}\n"
+     "After the end of a mirror, the statistics of that mirror are\n"
+     "returned.\n"
+    },
+    {"host_stats", hts_py_host_stats, METH_VARARGS,
+     "return the state of the per-host rate limits\n"
+     "usage: host_stats()\n\n"
+     "return value: None, if the first handler has no attribute\n"
+     "host_limits, else a dictionary {host: {'rate', 'burst', 'tokens',\n"
+     "'requests', 'deferred', 'queued'}}\n"
+     "After the end of a mirror, the statistics of that mirror are\n"
+     "returned.\n"
+    },
+    {"controller_log", hts_py_controller_log, METH_VARARGS,
+     "return the decisions of the concurrency controller\n"
+     "usage: controller_log()\n\n"
+     "return value: None, if the first handler has no attribute\n"
+     "concurrency_control, else a list of dictionaries {'time',\n"
+     "'action', 'maxsoc', 'maxconn', 'timeout', 'transfers', 'errors',\n"
+     "'timeouts', 'latency', 'rss'}; action is '+' (more concurrency),\n"
+     "'-' (less concurrency) or '=' (not enough transfers)\n"
+    },
+    {"error_summary", hts_py_error_summary, METH_VARARGS,
+     "return the exceptions raised by the callback methods\n"
+     "usage: error_summary()\n\n"
+     "return value: {'errors': [...], 'breakers': {...}}\n"
+     "errors contains a dictionary {'callback', 'type', 'count',\n"
+     "'suppressed', 'first', 'last', 'message'} for each callback and\n"
+     "exception type; breakers contains {'state', 'trips', 'skipped'}\n"
+     "for each callback whose circuit breaker was opened\n"
+    },
+    {"decision_cache_stats", hts_py_decision_cache_stats, METH_VARARGS,
+     "return the statistics of the decision cache\n"
+     "usage: decision_cache_stats()\n\n"
+     "return value: None, if the cache is not used, else a dictionary\n"
+     "{'hits', 'misses', 'evictions', 'invalidations', 'size',\n"
+     "'capacity'}\n"
+    },
+    {"decision_cache_invalidate",
+     (PyCFunction) hts_py_decision_cache_invalidate,
+     METH_VARARGS | METH_KEYWORDS,
+     "remove decisions from the decision cache\n"
+     "usage: decision_cache_invalidate(url=None, host=None)\n\n"
+     "removes the decisions for the URL url, or for all URLs of the\n"
+     "host host, or all decisions, if neither is given\n\n"
+     "return value: the number of removed decisions\n"
+    },
+    {"overruns", hts_py_overruns, METH_VARARGS,
+     "return the callback methods that exceeded their time budget\n"
+     "usage: overruns()\n\n"
+     "return value: a list of dictionaries {'callback', 'url',\n"
+     "'seconds', 'interrupted'}\n"
+    },
+    {"profile_samples", hts_py_profile_samples, METH_VARARGS,
+     "return the samples of the profiler\n"
+     "usage: profile_samples()\n\n"
+     "return value: None, if the profiler was not used, else a\n"
+     "dictionary {collapsed_stack: count}\n"
+    },
+    {"metrics_text", hts_py_metrics_text, METH_VARARGS,
+     "return the metrics served at metrics_address\n"
+     "usage: metrics_text()\n\n"
+     "return value: a string in the Prometheus text format\n"
+    },
+    {"event_log_stats", hts_py_event_log_stats, METH_VARARGS,
+     "return the statistics of the event log\n"
+     "usage: event_log_stats()\n\n"
+     "return value: None, if the event log was not used, else a\n"
+     "dictionary {'blocks', 'bytes', 'compressed_bytes'}\n"
+    },
+    {"warc_stats", hts_py_warc_stats, METH_VARARGS,
+     "return the statistics of the WARC output\n"
+     "usage: warc_stats()\n\n"
+     "return value: None, if no WARC file was written, else a\n"
+     "dictionary {'records', 'files', 'bytes'}\n"
+    },
+    {"pack_stats", hts_py_pack_stats, METH_VARARGS,
+     "return the statistics of the pack files\n"
+     "usage: pack_stats()\n\n"
+     "return value: None, if no pack was written, else a dictionary\n"
+     "{'files', 'bytes', 'stored_bytes', 'packs'}\n"
+    },
+    {"extract_stats", hts_py_extract_stats, METH_VARARGS,
+     "return the statistics of the structured data extraction\n"
+     "usage: extract_stats()\n\n"
+     "return value: None, if extract_rules was not used, else a\n"
+     "dictionary {'pages', 'records', 'matches', 'bytes'}\n"
+    },
+    {"scan_tags", hts_py_scan_tags, METH_VARARGS,
+     "tokenize the tags of a HTML text in C\n"
+     "usage: scan_tags(html [, names])\n"
+     "   html:  a string, or a Page object\n"
+     "   names: only return the tags with these names\n\n"
+     "return value: array('i') of records of SCAN_RECORD integers:\n"
+     "[kind, start, end, name_start, name_end, nattrs] for tags (kind\n"
+     "SCAN_OPEN, SCAN_CLOSE or SCAN_EMPTY), followed by nattrs records\n"
+     "[SCAN_ATTR, name_start, name_end, value_start, value_end, quote]\n"
+    },
+    {"simhash", hts_py_simhash, METH_VARARGS,
+     "compute the SimHash fingerprint used by near_duplicates\n"
+     "usage: simhash(html)\n"
+     "   html:  a string, or a Page object\n\n"
+     "return value: the fingerprint (64 bit long integer). The number\n"
+     "of different bits of two fingerprints measures the difference\n"
+     "of the texts\n"
+    },
+    {"audit_stats", hts_py_audit_stats, METH_VARARGS,
+     "return the result of the memory audit (see audit_interval)\n"
+     "usage: audit_stats()\n\n"
+     "return value: None, if audit_interval was not used, else a\n"
+     "dictionary callback name -> {'calls', 'audited', 'objects', 'rss'}\n"
+     "where objects and rss are the growth summed over the audited calls\n"
+    },
+    {"near_duplicate_stats", hts_py_near_duplicate_stats, METH_VARARGS,
+     "return the statistics of the near-duplicate detection\n"
+     "usage: near_duplicate_stats()\n\n"
+     "return value: None, if near_duplicates was not used, else a\n"
+     "dictionary {'pages', 'near_duplicates', 'refused'}\n"
+    },
     {NULL, NULL, 0, NULL}
-  };
-  
-  PyMODINIT_FUNC inithttracklib() {
-    PyObject *m, *d, *v;
-    m = Py_InitModule("httracklib", httrackMethods);
-    d = PyModule_GetDict(m);
+};
 
-    v = PyInt_FromLong(IMMEDIATE_STOP);
-    PyDict_SetItemString(d, "IMMEDIATE_STOP", v);
-    Py_DECREF(v);
-    
-    v = PyInt_FromLong(REGULAR_STOP);
-    PyDict_SetItemString(d, "REGULAR_STOP", v);
-    Py_DECREF(v);
-    
-    v = PyInt_FromLong(IGNORE_EXCEPTION);
-    PyDict_SetItemString(d, "IGNORE_EXCEPTION", v);
-    Py_DECREF(v);
-    
+static PyObject *create_lib_module(void) {
+  PyObject *m, *d, *v;
+  m = Py_InitModule("httracklib", httrackMethods);
+  if (!m)
+    return 0;
+  d = PyModule_GetDict(m);
+
+  v = PyInt_FromLong(IMMEDIATE_STOP);
+  PyDict_SetItemString(d, "IMMEDIATE_STOP", v);
+  Py_DECREF(v);
+
+  v = PyInt_FromLong(REGULAR_STOP);
+  PyDict_SetItemString(d, "REGULAR_STOP", v);
+  Py_DECREF(v);
+
+  v = PyInt_FromLong(IGNORE_EXCEPTION);
+  PyDict_SetItemString(d, "IGNORE_EXCEPTION", v);
+  Py_DECREF(v);
+
+  /* raised by the watchdog; see start_watchdog() */
+  interp->pTimeoutError = PyErr_NewException("httracklib.CallbackTimeout",
+                                             PyExc_RuntimeError, 0);
+  if (!interp->pTimeoutError)
+    return 0;
+  PyDict_SetItemString(d, "CallbackTimeout", interp->pTimeoutError);
+
+  v = PyInt_FromLong(SCAN_RECORD);
+  PyDict_SetItemString(d, "SCAN_RECORD", v);
+  Py_DECREF(v);
+  v = PyInt_FromLong(SCAN_OPEN);
+  PyDict_SetItemString(d, "SCAN_OPEN", v);
+  Py_DECREF(v);
+  v = PyInt_FromLong(SCAN_CLOSE);
+  PyDict_SetItemString(d, "SCAN_CLOSE", v);
+  Py_DECREF(v);
+  v = PyInt_FromLong(SCAN_EMPTY);
+  PyDict_SetItemString(d, "SCAN_EMPTY", v);
+  Py_DECREF(v);
+  v = PyInt_FromLong(SCAN_ATTR);
+  PyDict_SetItemString(d, "SCAN_ATTR", v);
+  Py_DECREF(v);
+
+  if (PyType_Ready(&page_type) < 0)
+    return 0;
+  PyDict_SetItemString(d, "Page", (PyObject*) &page_type);
+  return m;
+}
+
+#ifndef PLUGIN
+  PyMODINIT_FUNC inithttracklib() {
+    PyEval_InitThreads();
+    create_lib_module();
     if (PyErr_Occurred())
       Py_FatalError("can't initialize module httracklib");
 
@@ -0,0 +1,68 @@
+/*
+    httrack-py.h: native callbacks for the httrack-py glue layer.
+
+    This program is free software; you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation; either version 2 of the License, or
+    (at your option) any later version.
+
+    This program is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with this program; if not, write to the Free Software
+    Foundation, Inc., 59 Temple Place, Suite 330, Boston, MA 02111-1307, USA.
+
+    A callback handler may provide a C function instead of, or in front
+    of, a Python method: the attribute check_link (or check_link_native,
+    if the handler also has a Python method check_link) is a PyCapsule
+    with the name HTS_PY_CAPSULE_NAME("check_link") and a pointer to a
+    function of the type hts_py_check_link_fn. The context of the
+    capsule (PyCapsule_SetContext) is passed as the last argument.
+    Example:
+
+      static int my_check_link(char *adr, char *fil, int status,
+                               void *data) {
+        if (strstr(fil, "/private/"))
+          return 0;
+        return HTS_PY_CONTINUE;
+      }
+
+      capsule = PyCapsule_New((void *) my_check_link,
+                              HTS_PY_CAPSULE_NAME("check_link"), 0);
+
+    The functions are called without the GIL, possibly by several
+    httrack threads at the same time; they must not use the Python API.
+    A function returns the result of the callback, or HTS_PY_CONTINUE to
+    pass the call on to the next native function, and finally to the
+    Python methods. The arguments and results are those of the hts_py_*
+    functions, plus data.
+*/
+
+#ifndef HTTRACK_PY_H
+#define HTTRACK_PY_H
+
+/* result of a native callback: let the next stage decide */
+#define HTS_PY_CONTINUE (-1000)
+
+#define HTS_PY_CAPSULE_NAME(callback) ("httrack_py." callback)
+
+typedef int (*hts_py_check_html_fn)(char *html, int len,
+                                    char *url_adresse, char *url_fichier,
+                                    void *data);
+/* *html is allocated with malloc; it may be replaced with realloc */
+typedef int (*hts_py_preprocess_html_fn)(char **html, int *len,
+                                         char *url_adresse,
+                                         char *url_fichier, void *data);
+typedef int (*hts_py_postprocess_html_fn)(char **html, int *len,
+                                          char *url_adresse,
+                                          char *url_fichier, void *data);
+typedef int (*hts_py_check_link_fn)(char *adr, char *fil, int status,
+                                    void *data);
+typedef int (*hts_py_link_detected_fn)(char *link, void *data);
+typedef int (*hts_py_link_detected2_fn)(char *link, char *start_tag,
+                                        void *data);
+
+#endif
@@ -1,27 +1,477 @@
 #!/usr/bin/python
-""" simple test and example for the usage of the httrack Python extension
+""" tests and example for the usage of the httrack Python extension
+
+    Without arguments, the tests below mirror a small site, served by
+    a HTTP server in a thread, into temporary directories. With
+    arguments, the script works like the httrack command line program:
+
+      python test_extension.py http://www.example.com/
 """
 
-import sys, os
-# the next line is only required for tests. Normally, the httrack 
-# extension module should be installed in the Python site-packages directory 
+import sys, os, shutil, tempfile, threading, unittest
+import BaseHTTPServer
+# the next line is only required for tests. Normally, the httrack
+# extension module should be installed in the Python site-packages directory
 # which is in the default search path
 sys.path.append(".")
+sys.path.append("..")
 
 # httracklib defines the Python function httrack, which start
 # the httrack engine
 import httracklib
+import httracktools
+
+TEXT = " ".join(["word%i" % i for i in range(300)])
+OTHER_TEXT = " ".join(["alpha%i" % i for i in range(300)])
+
+# index links a.html twice, so that httrack checks the link again;
+# a.html and b.html differ in one word
+PAGES = {
+    "/index.html": '<html><head><title>index</title></head><body>'
+                   '<a href="a.html">a</a> <a href="b.html">b</a> '
+                   '<a href="c.html">c</a> <a href="a.html">a again</a>'
+                   '</body></html>',
+    "/a.html": '<html><body><p>%s</p><a href="c.html">c</a>'
+               '</body></html>' % TEXT,
+    "/b.html": '<html><body><div class="x">%s</div><a href="c.html">c</a>'
+               '</body></html>' % TEXT.replace("word150", "other"),
+    "/c.html": '<html><body><p>%s</p><a href="index.html">index</a>'
+               '<a href="a.html">a</a></body></html>' % OTHER_TEXT,
+    }
+
+
+class PageServer(BaseHTTPServer.BaseHTTPRequestHandler):
+
+    def do_GET(self):
+        body = PAGES.get(self.path.split("?")[0])
+        if body is None:
+            self.send_error(404)
+            return
+        self.send_response(200)
+        self.send_header("Content-Type", "text/html; charset=utf-8")
+        self.send_header("Content-Length", str(len(body)))
+        self.end_headers()
+        self.wfile.write(body)
+
+    def log_message(self, *args):
+        pass
+
+
+server = None
+
+def start_server():
+    global server
+    if server is None:
+        server = BaseHTTPServer.HTTPServer(("127.0.0.1", 0), PageServer)
+        t = threading.Thread(target=server.serve_forever)
+        t.setDaemon(1)
+        t.start()
+    return "http://127.0.0.1:%i/" % server.server_address[1]
+
+
+def bits(fp):
+    return bin(fp).count("1")
+
+
+def full_url(adr, fil):
+    """ the URL as httracklib reports it, e.g. in page.near_duplicate """
+    if "://" in adr:
+        return adr + fil
+    return "http://" + adr + fil
+
+
+class MirrorTest(unittest.TestCase):
+    """ base class: mirror() runs httrack on the test site in a
+        temporary directory
+    """
+
+    def setUp(self):
+        self.url = start_server()
+        self.cwd = os.getcwd()
+        self.dir = tempfile.mkdtemp(prefix="httrack-test")
+        os.chdir(self.dir)
+
+    def tearDown(self):
+        os.chdir(self.cwd)
+        shutil.rmtree(self.dir, True)
+
+    def mirror(self, handlers):
+        res = httracklib.httrack(handlers, ["httrack", self.url + "index.html",
+                                            "-O", self.dir, "-q", "-r5"])
+        self.assertEqual(res, (0, None))
+
+
+class Recorder:
+    """ records the calls of its methods in self.calls """
+
+    def __init__(self):
+        self.calls = []
+
+
+class PipelineTest(MirrorTest):
+
+    def test_check_link_short_circuit(self):
+        class Refuse(Recorder):
+            # refuses every second link
+            def check_link(self, adr, fil, status):
+                self.calls.append((adr, fil, status))
+                return len(self.calls) % 2 and -1 or 0
+        class Accept(Recorder):
+            def check_link(self, adr, fil, status):
+                self.calls.append((adr, fil, status))
+                return 1
+        first, second = Refuse(), Accept()
+        self.mirror([first, second])
+        self.assert_(len(first.calls) > 1)
+        self.assertEqual(second.calls, first.calls[::2])
+        stats = httracklib.stage_stats()["check_link"]
+        self.assertEqual([s[1] for s in stats],
+                         [len(first.calls), len(second.calls)])
+
+    def test_check_html_short_circuit(self):
+        class Refuse(Recorder):
+            def check_html(self, html, adr, fil):
+                self.calls.append(adr + fil)
+                return len(self.calls) % 2
+        class Check(Recorder):
+            def check_html(self, html, adr, fil):
+                self.calls.append(adr + fil)
+                return 1
+        first, second = Refuse(), Check()
+        self.mirror([first, second])
+        self.assert_(len(first.calls) > 1)
+        self.assertEqual(second.calls, first.calls[::2])
+
+    def test_chained_text(self):
+        class Append(Recorder):
+            def __init__(self, mark):
+                Recorder.__init__(self)
+                self.mark = mark
+            def postprocess_html(self, html, adr, fil):
+                self.calls.append(html)
+                return html + self.mark
+        class Ignore(Recorder):
+            # None leaves the text unchanged
+            def postprocess_html(self, html, adr, fil):
+                self.calls.append(html)
+        first, second = Append("<!--A-->"), Append("<!--B-->")
+        third = Ignore()
+        self.mirror([first, Ignore(), second, third])
+        self.assert_(first.calls)
+        self.assertEqual(len(third.calls), len(first.calls))
+        for before, after in zip(first.calls, third.calls):
+            self.assertEqual(after, before + "<!--A--><!--B-->")
+
+
+class DecisionCacheTest(MirrorTest):
+
+    class Handler(Recorder):
+        decision_cache = 100
+        def check_link(self, adr, fil, status):
+            self.calls.append((adr, fil, status))
+            return 1
+
+    def test_hits(self):
+        handler = self.Handler()
+        self.mirror(handler)
+        stats = httracklib.decision_cache_stats()
+        # each decision is asked once from Python
+        self.assertEqual(len(handler.calls), len(dict.fromkeys(handler.calls)))
+        self.assertEqual(stats["misses"], len(handler.calls))
+        self.assert_(stats["hits"] > 0)
+        self.assertEqual(stats["size"], len(handler.calls))
+        self.assertEqual(stats["capacity"], 100)
+        self.assertEqual(stats["evictions"], 0)
+
+    def test_invalidate(self):
+        handler = self.Handler()
+        self.mirror(handler)
+        size = httracklib.decision_cache_stats()["size"]
+        adr, fil, status = handler.calls[0]
+        n = len([c for c in handler.calls if c[:2] == (adr, fil)])
+        self.assertEqual(httracklib.decision_cache_invalidate(url=adr + fil), n)
+        self.assertEqual(httracklib.decision_cache_invalidate(url=adr + fil), 0)
+        host = adr.split("://")[-1].split("/")[0]
+        m = len([c for c in handler.calls
+                 if c[0].split("://")[-1].split("/")[0] == host]) - n
+        self.assertEqual(httracklib.decision_cache_invalidate(
+                host=host.upper()), m)
+        rest = size - n - m
+        self.assertEqual(httracklib.decision_cache_invalidate(), rest)
+        stats = httracklib.decision_cache_stats()
+        self.assertEqual(stats["size"], 0)
+        self.assertEqual(stats["invalidations"], size)
+
+
+class ScanTagsTest(unittest.TestCase):
+
+    def test_offsets(self):
+        h = ('<p>x<!-- <a href="no"> --><a href="" title=\'\' alt= '
+             'disabled>t</a><br/><script>"<a>"</script><img src=y.png>')
+        r = list(httracklib.scan_tags(h))
+        self.assertEqual(len(r) % httracklib.SCAN_RECORD, 0)
+        a = h.index('<a href=""')
+        href, title = h.index("href", a), h.index("title")
+        alt, disabled = h.index("alt"), h.index("disabled")
+        img = h.index("<img")
+        src = h.index("src")
+        expect = [
+            httracklib.SCAN_OPEN, 0, 3, 1, 2, 0,
+            # alt= takes the next word as its value, like a browser
+            httracklib.SCAN_OPEN, a, h.index(">t") + 1, a + 1, a + 2, 3,
+            httracklib.SCAN_ATTR, href, href + 4, href + 6, href + 6, ord('"'),
+            httracklib.SCAN_ATTR, title, title + 5, title + 7, title + 7,
+            ord("'"),
+            httracklib.SCAN_ATTR, alt, alt + 3, disabled, disabled + 8, 0,
+            httracklib.SCAN_CLOSE, h.index("</a>"), h.index("</a>") + 4,
+            h.index("</a>") + 2, h.index("</a>") + 3, 0,
+            httracklib.SCAN_EMPTY, h.index("<br/>"), h.index("<br/>") + 5,
+            h.index("<br/>") + 1, h.index("<br/>") + 3, 0,
+            httracklib.SCAN_OPEN, h.index("<script>"), h.index("<script>") + 8,
+            h.index("<script>") + 1, h.index("<script>") + 7, 0,
+            httracklib.SCAN_CLOSE, h.index("</script>"),
+            h.index("</script>") + 9, h.index("</script>") + 2,
+            h.index("</script>") + 8, 0,
+            httracklib.SCAN_OPEN, img, len(h), img + 1, img + 4, 1,
+            httracklib.SCAN_ATTR, src, src + 3, src + 4, len(h) - 1, 0]
+        self.assertEqual(r, expect)
+
+    def test_empty_values(self):
+        for h, value in [('<img alt="">', 10), ("<img alt=''/>", 10),
+                         ("<img alt=>", 9)]:
+            r = list(httracklib.scan_tags(h))
+            self.assertEqual(r[httracklib.SCAN_RECORD:][3:5], [value, value])
+            tag = list(httracktools.iter_tags(h))[0]
+            self.assertEqual(tag.attrs, {"alt": ""})
+        r = list(httracklib.scan_tags("<input checked>"))
+        self.assertEqual(r[httracklib.SCAN_RECORD:][3:5], [-1, -1])
+
+    def test_names(self):
+        h = PAGES["/index.html"]
+        tags = [t for t in httracktools.iter_tags(h, ["A", "title"])
+                if t.kind == httracklib.SCAN_OPEN]
+        self.assertEqual([t.name for t in tags], ["title"] + ["a"] * 4)
+        self.assertEqual([t.attrs.get("href") for t in tags],
+                         [None, "a.html", "b.html", "c.html", "a.html"])
+        self.assertEqual(list(httracklib.scan_tags("")), [])
+        self.assertRaises(TypeError, httracklib.scan_tags, h, [1])
+
+
+class SimHashTest(MirrorTest):
+
+    def test_fingerprint(self):
+        a = httracklib.simhash(PAGES["/a.html"])
+        self.assert_(a)
+        # markup, script and style are not part of the text
+        self.assertEqual(httracklib.simhash(
+                '<script>var x;</script><p>%s</p><style>p{}</style>'
+                % TEXT), httracklib.simhash(TEXT))
+        self.assert_(bits(a ^ httracklib.simhash(PAGES["/b.html"])) <= 3)
+        self.assert_(bits(a ^ httracklib.simhash(PAGES["/c.html"])) > 7)
+        # less than three words are not fingerprinted
+        self.assertEqual(httracklib.simhash("<p>one two</p>"), 0)
+
+    def test_flag(self):
+        class Pages(Recorder):
+            near_duplicates = "flag"
+            near_duplicate_distance = 3
+            def process_page(self, page):
+                self.calls.append((full_url(page.url_adresse,
+                                            page.url_fichier),
+                                   page.simhash, page.near_duplicate))
+        handler = Pages()
+        self.mirror(handler)
+        index = {}
+        flagged = 0
+        for url, fp, dup in handler.calls:
+            near = [u for u, f in index.items()
+                    if u != url and bits(fp ^ f) <= 3]
+            if dup is not None:
+                flagged += 1
+                self.assert_(dup in near, (url, dup))
+            elif fp:
+                self.assertEqual(near, [], url)
+                index[url] = fp
+        self.assert_(flagged)
+        stats = httracklib.near_duplicate_stats()
+        self.assertEqual(stats["pages"], len(handler.calls))
+        self.assertEqual(stats["near_duplicates"], flagged)
+        self.assertEqual(stats["refused"], 0)
+
+    def test_refuse(self):
+        class Pages(Recorder):
+            near_duplicates = "refuse"
+            near_duplicate_distance = 3
+            def check_html(self, html, adr, fil):
+                self.calls.append(adr + fil)
+                return 1
+        handler = Pages()
+        self.mirror(handler)
+        stats = httracklib.near_duplicate_stats()
+        self.assert_(stats["refused"] > 0)
+        self.assertEqual(stats["refused"], stats["near_duplicates"])
+        self.assertEqual(len(handler.calls), stats["pages"] - stats["refused"])
+
+
+class RoundTripTest(MirrorTest):
+
+    def test_feed(self):
+        class Feed(Recorder):
+            feed_size = 1 << 20
+            def __init__(self, path):
+                Recorder.__init__(self)
+                self.feed_path = path
+                self.records = []
+            def start(self, opt):
+                self.reader = httracktools.FeedReader(self.feed_path)
+                return 1
+            def postprocess_html(self, html, adr, fil):
+                html += "<!-- feed -->"
+                self.calls.append((adr + fil, html))
+                return html
+            def end(self):
+                for rec in self.reader.poll():
+                    self.records.append((rec.url, rec.status, str(rec.headers),
+                                         str(rec.body), rec.valid()))
+                self.reader.close()
+                self.stats = httracklib.feed_stats()
+                return 1
+        handler = Feed(os.path.join(self.dir, "feed"))
+        self.mirror(handler)
+        self.assertEqual([r[0] for r in handler.records],
+                         [c[0] for c in handler.calls])
+        self.assertEqual([r[3] for r in handler.records],
+                         [c[1] for c in handler.calls])
+        for url, status, headers, body, valid in handler.records:
+            self.assertEqual(status, 200)
+            self.assert_(valid)
+        self.assertEqual(handler.stats["records"], len(handler.calls))
+
+    def test_event_log(self):
+        class Log(Recorder):
+            event_log_block_size = 4096
+            def __init__(self, path):
+                Recorder.__init__(self)
+                self.event_log = path
+                self.saved = []
+            def check_link(self, adr, fil, status):
+                self.calls.append((adr + fil, status, len(self.calls) % 2))
+                return self.calls[-1][2]
+            def save_name(self, adr, fil, referer_adr, referer_fil, save):
+                self.saved.append((adr + fil, save))
+            def postprocess_html(self, html, adr, fil):
+                self.calls.append((adr + fil, None, None))
+        handler = Log(os.path.join(self.dir, "crawl.evl"))
+        self.mirror(handler)
+        events = list(httracktools.EventLogReader(handler.event_log))
+        self.assertEqual([(e.url, e.status, e.result) for e in events
+                          if e.type == httracktools.EV_CHECK_LINK],
+                         [c for c in handler.calls if c[1] is not None])
+        self.assertEqual([(e.url, e.filename) for e in events
+                          if e.type == httracktools.EV_SAVE_NAME],
+                         handler.saved)
+        transfers = dict([(e.url, e) for e in events
+                          if e.type == httracktools.EV_TRANSFER])
+        for url, status, result in handler.calls:
+            if status is None:
+                self.assertEqual(transfers[url].statuscode, 200)
+                self.assertEqual(transfers[url].contenttype, "text/html")
+        stats = httracklib.event_log_stats()
+        self.assert_(stats["blocks"] > 0)
+        self.assertEqual(stats["compressed_bytes"],
+                         os.path.getsize(handler.event_log))
+
+    def test_pack(self):
+        class Pack(Recorder):
+            pack_compression = "zlib"
+            def __init__(self, path):
+                Recorder.__init__(self)
+                self.pack_path = path
+            def save_file(self, filename):
+                self.calls.append(filename)
+        handler = Pack(os.path.join(self.dir, "pk"))
+        self.mirror(handler)
+        self.assert_(handler.calls)
+        reader = httracktools.PackReader(handler.pack_path)
+        files = {}
+        for filename in handler.calls:
+            path = os.path.relpath(os.path.abspath(filename), self.dir)
+            files[path] = open(filename, "rb").read()
+        self.assertEqual(sorted(reader.paths()), sorted(files))
+        for path, data in files.items():
+            self.assertEqual(reader.get(path), data)
+        self.assertRaises(KeyError, reader.get, "no/such/file")
+        target = os.path.join(self.dir, "extracted")
+        self.assertEqual(reader.extract(target), len(files))
+        for path, data in files.items():
+            self.assertEqual(open(os.path.join(target, path), "rb").read(),
+                             data)
+        reader.close()
+        stats = httracklib.pack_stats()
+        self.assertEqual(stats["files"], len(handler.calls))
+
+
+class ReplayTest(MirrorTest):
+
+    class Handler(Recorder):
+        def check_html(self, html, adr, fil):
+            self.calls.append(("check_html", adr + fil))
+            return len(self.calls) % 2
+        def preprocess_html(self, html, adr, fil):
+            self.calls.append(("preprocess_html", adr + fil))
+            return html.replace("</body>", "<!-- replayed --></body>")
+        def check_link(self, adr, fil, status):
+            self.calls.append(("check_link", adr + fil))
+            return 1
+
+    def record(self):
+        handler = self.Handler()
+        handler.record_path = os.path.join(self.dir, "crawl.rec")
+        self.mirror(handler)
+        return handler
+
+    def test_recording(self):
+        handler = self.record()
+        calls = list(httracktools.RecordingReader(handler.record_path))
+        self.assertEqual([(c.callback, c.url()) for c in calls], handler.calls)
 
-# I am lazy: let's use the same callback class as in the plugin example
-import httrack
+    def test_replay(self):
+        handler = self.record()
+        report = httracktools.replay(handler.record_path, self.Handler())
+        self.assertEqual(report.ndiffs, 0)
+        for name in ("check_html", "preprocess_html", "check_link"):
+            self.assertEqual(report.stats[name][0],
+                             len([c for c in handler.calls if c[0] == name]))
 
-# don't check for errors -- simply bail out if the directory exists
-# This is only intended for tests...
-os.mkdir("httrack-test")
-os.chdir("httrack-test")
-callback = httrack.Htcb()
+    def test_diffs(self):
+        class Changed(self.Handler):
+            def check_html(self, html, adr, fil):
+                self.calls.append(("check_html", adr + fil))
+                return 1
+        handler = self.record()
+        report = httracktools.replay(handler.record_path, Changed())
+        refused = [c[1] for i, c in enumerate(handler.calls)
+                   if c[0] == "check_html" and (i + 1) % 2 == 0]
+        self.assert_(refused)
+        self.assertEqual(report.ndiffs, len(refused))
+        self.assertEqual([(d.callback, d.url, d.recorded, d.replayed)
+                          for d in report.diffs],
+                         [("check_html", url, False, True) for url in refused])
 
-# we simply specify the command line arguments as the second parameter
-# the httrack engine expects at least one parameter, the program name
-httracklib.httrack(callback, sys.argv)
 
+if __name__ == "__main__":
+    if len(sys.argv) > 1:
+        # I am lazy: let's use the same callback class as in the plugin
+        # example
+        import httrack
+        # don't check for errors -- simply bail out if the directory exists
+        # This is only intended for tests...
+        os.mkdir("httrack-test")
+        os.chdir("httrack-test")
+        callback = httrack.Htcb()
+        # we simply specify the command line arguments as the second
+        # parameter. The httrack engine expects at least one parameter,
+        # the program name
+        httracklib.httrack(callback, sys.argv)
+    else:
+        unittest.main()